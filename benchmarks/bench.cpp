@@ -0,0 +1,433 @@
+/*
+    benchmarks/bench.cpp -- Scheduler microbenchmarks for nanothread
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+
+    Usage: nanothread_bench [--json] [--quick] [--threads 1,2,4] [--filter name]
+
+    Every benchmark is repeated several times for each thread count, and the
+    results (one row per benchmark, parameter, and thread count) are written
+    to stdout as CSV or JSON. Times refer to one repetition divided by the
+    number of operations ('units') that it performs, e.g. tasks or elements.
+
+    Note that the thread count refers to the number of pool workers. The
+    submitting thread also participates in parallel loops, hence the OpenMP
+    baseline (only available when compiled with OpenMP) uses one more thread.
+*/
+
+#include <nanothread/nanothread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_OPENMP)
+#  include <omp.h>
+#endif
+
+namespace dr = drjit;
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string name, param;
+    uint32_t threads;
+    uint32_t reps;
+    double units;                     // Operations per repetition
+    double median_ns, min_ns, mean_ns; // Time per operation
+    double cas_retries, sleeps;        // Per repetition
+};
+
+struct Options {
+    std::vector<uint32_t> threads;
+    std::string filter;
+    uint32_t reps = 20;
+    bool json = false;
+};
+
+static double elapsed_ns(Clock::time_point start, Clock::time_point end) {
+    return (double) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count();
+}
+
+static void empty_task(uint32_t, void *) { }
+
+/// Repeatedly run 'func', which performs 'units' operations
+template <typename Func>
+static Result measure(const char *name, const std::string &param, Pool *pool,
+                      uint32_t threads, uint32_t reps, double units,
+                      Func func) {
+    PoolStats before, after;
+    std::vector<double> times;
+
+    func(); // Warm-up
+
+    if (pool)
+        pool_stats(pool, &before);
+
+    for (uint32_t i = 0; i < reps; ++i) {
+        Clock::time_point start = Clock::now();
+        func();
+        times.push_back(elapsed_ns(start, Clock::now()) / units);
+    }
+
+    Result r;
+    r.name = name;
+    r.param = param;
+    r.threads = threads;
+    r.reps = reps;
+    r.units = units;
+
+    std::sort(times.begin(), times.end());
+    r.median_ns = times[times.size() / 2];
+    r.min_ns = times[0];
+    r.mean_ns = 0;
+    for (double t : times)
+        r.mean_ns += t / times.size();
+
+    r.cas_retries = r.sleeps = 0;
+    if (pool) {
+        pool_stats(pool, &after);
+        r.cas_retries = (double) ((after.push_retries + after.pop_retries +
+                                   after.alloc_retries) -
+                                  (before.push_retries + before.pop_retries +
+                                   before.alloc_retries)) / reps;
+        r.sleeps = (double) (after.sleeps - before.sleeps) / reps;
+    }
+
+    return r;
+}
+
+/// Latency of submitting an empty task and waiting for it
+static Result bench_submit_wait(Pool *pool, uint32_t threads, uint32_t reps) {
+    const uint32_t n = 1000;
+    return measure("submit_wait", "", pool, threads, reps, n, [&]() {
+        for (uint32_t i = 0; i < n; ++i) {
+            Task *task = task_submit_dep(pool, nullptr, 0, 1, empty_task,
+                                         nullptr, 0, nullptr, 1);
+            task_wait_and_release(task);
+        }
+    });
+}
+
+/// Throughput of a memory-bound parallel loop (fixed or automatic block size)
+static Result bench_parallel_for(Pool *pool, uint32_t threads, uint32_t reps,
+                                 uint32_t block_size) {
+    const uint32_t n = 1u << 22;
+    std::vector<float> data(n, 1.f);
+    float *ptr = data.data();
+
+    std::string param = block_size == dr::auto_block_size
+                            ? std::string("auto")
+                            : std::to_string(block_size);
+
+    return measure("parallel_for", param, pool, threads,
+                   reps, n, [&]() {
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, n, block_size),
+            [ptr](dr::blocked_range<uint32_t> range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    ptr[i] = ptr[i] * 0.999f + 1.f;
+            },
+            pool);
+    });
+}
+
+#if defined(_OPENMP)
+/// OpenMP version of the above, as a baseline
+static Result bench_parallel_for_omp(uint32_t threads, uint32_t reps,
+                                     uint32_t block_size) {
+    const int n = 1 << 22;
+    std::vector<float> data(n, 1.f);
+    float *ptr = data.data();
+
+    return measure("parallel_for_omp", std::to_string(block_size), nullptr,
+                   threads, reps, n, [&]() {
+        #pragma omp parallel for schedule(dynamic, block_size) num_threads(threads + 1)
+        for (int i = 0; i < n; ++i)
+            ptr[i] = ptr[i] * 0.999f + 1.f;
+    });
+}
+#endif
+
+/// Deep chain of dependent tasks
+static Result bench_chain(Pool *pool, uint32_t threads, uint32_t reps) {
+    const uint32_t n = 1000;
+    return measure("dep_chain", std::to_string(n), pool, threads, reps, n, [&]() {
+        Task *prev = nullptr;
+        for (uint32_t i = 0; i < n; ++i) {
+            Task *task = task_submit_dep(pool, &prev, 1, 1, empty_task,
+                                         nullptr, 0, nullptr, 1);
+            task_release(prev);
+            prev = task;
+        }
+        task_wait_and_release(prev);
+    });
+}
+
+/// One task fanning out to many children, which are joined by a single task
+static Result bench_fan(Pool *pool, uint32_t threads, uint32_t reps) {
+    const uint32_t n = 1000;
+    std::vector<Task *> children(n);
+
+    return measure("fan_out_in", std::to_string(n), pool, threads, reps, n + 2,
+                   [&]() {
+        Task *root = task_submit_dep(pool, nullptr, 0, 1, empty_task, nullptr,
+                                     0, nullptr, 1);
+        for (uint32_t i = 0; i < n; ++i)
+            children[i] = task_submit_dep(pool, &root, 1, 1, empty_task,
+                                          nullptr, 0, nullptr, 1);
+        Task *join = task_submit_dep(pool, children.data(), n, 1, empty_task,
+                                     nullptr, 0, nullptr, 1);
+        task_release(root);
+        for (uint32_t i = 0; i < n; ++i)
+            task_release(children[i]);
+        task_wait_and_release(join);
+    });
+}
+
+/// Same as the above, but all tasks are submitted as a single graph
+static Result bench_fan_graph(Pool *pool, uint32_t threads, uint32_t reps) {
+    const uint32_t n = 1000;
+    std::vector<Task *> children(n);
+
+    return measure("fan_out_in_graph", std::to_string(n), pool, threads, reps,
+                   n + 2, [&]() {
+        TaskGraph *graph = task_graph_begin(pool);
+        Task *root = task_graph_add(graph, nullptr, 0, 1, empty_task, nullptr,
+                                    nullptr, 0, nullptr, nullptr);
+        for (uint32_t i = 0; i < n; ++i)
+            children[i] = task_graph_add(graph, &root, 1, 1, empty_task,
+                                         nullptr, nullptr, 0, nullptr, nullptr);
+        task_wait_and_release(task_graph_commit(graph));
+    });
+}
+
+/// Same as the above, but the graph is recorded once and then replayed
+static Result bench_fan_replay(Pool *pool, uint32_t threads, uint32_t reps) {
+    const uint32_t n = 1000;
+    TaskGraph *graph = task_graph_begin(pool);
+    Task *root = task_graph_add(graph, nullptr, 0, 1, empty_task, nullptr,
+                                nullptr, 0, nullptr, nullptr);
+    for (uint32_t i = 0; i < n; ++i)
+        task_graph_add(graph, &root, 1, 1, empty_task, nullptr, nullptr, 0,
+                       nullptr, nullptr);
+
+    Result r = measure("fan_out_in_replay", std::to_string(n), pool, threads,
+                       reps, n + 2, [&]() {
+        task_wait_and_release(task_graph_launch(graph));
+    });
+
+    task_graph_destroy(graph);
+    return r;
+}
+
+/// Nested parallel loops with small inner loops
+static Result bench_nested(Pool *pool, uint32_t threads, uint32_t reps) {
+    const uint32_t outer = 256, inner = 4096;
+    std::vector<float> data(outer * inner, 1.f);
+    float *ptr = data.data();
+
+    return measure("nested_parallel_for", std::to_string(inner), pool, threads,
+                   reps, outer * inner, [&]() {
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, outer, 1),
+            [&](dr::blocked_range<uint32_t> range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    float *row = ptr + i * inner;
+                    dr::parallel_for(
+                        dr::blocked_range<uint32_t>(0, inner, 256),
+                        [row](dr::blocked_range<uint32_t> r) {
+                            for (uint32_t j = r.begin(); j != r.end(); ++j)
+                                row[j] = row[j] * 0.999f + 1.f;
+                        },
+                        pool);
+                }
+            },
+            pool);
+    });
+}
+
+/**
+ * Time from submitting a task until a worker starts running it, either when
+ * the workers are parked, or when they are still spinning
+ */
+static Result bench_wake(Pool *pool, uint32_t threads, uint32_t reps,
+                         bool parked) {
+    uint32_t budget = pool_spin_budget(pool);
+    pool_set_spin_budget(pool, parked ? 0 : 1000000);
+
+    struct Payload {
+        std::atomic<int64_t> *started;
+    };
+
+    std::atomic<int64_t> started(0);
+    std::vector<double> latency;
+
+    auto callback = [](uint32_t, void *ptr) {
+        ((Payload *) ptr)->started->store(
+            (int64_t) Clock::now().time_since_epoch().count());
+    };
+
+    Result r = measure("wake_latency", parked ? "parked" : "spinning", pool,
+                       threads, reps, 1, [&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(parked ? 5 : 0));
+        started.store(0);
+
+        Payload payload{ &started };
+        Clock::time_point submit = Clock::now();
+        Task *task = task_submit_dep(pool, nullptr, 0, 1, callback, &payload,
+                                     sizeof(Payload), nullptr, 1);
+
+        // Don't help, a worker should pick up the task
+        while (started.load() == 0)
+            std::this_thread::yield();
+
+        latency.push_back((double) (started.load() -
+                                    submit.time_since_epoch().count()));
+        task_wait_and_release(task);
+    });
+
+    pool_set_spin_budget(pool, budget);
+
+    // Report the submit-to-start latency instead of the loop time
+    latency.erase(latency.begin()); // Warm-up
+    std::sort(latency.begin(), latency.end());
+    double ns_per_tick = 1e9 * Clock::period::num / Clock::period::den;
+    r.median_ns = latency[latency.size() / 2] * ns_per_tick;
+    r.min_ns = latency[0] * ns_per_tick;
+    r.mean_ns = 0;
+    for (double l : latency)
+        r.mean_ns += l * ns_per_tick / latency.size();
+
+    return r;
+}
+
+static void print_csv(const std::vector<Result> &results) {
+    printf("benchmark,param,threads,reps,units,median_ns,min_ns,mean_ns,"
+           "units_per_s,cas_retries,sleeps\n");
+    for (const Result &r : results)
+        printf("%s,%s,%u,%u,%.0f,%.2f,%.2f,%.2f,%.4g,%.1f,%.1f\n",
+               r.name.c_str(), r.param.c_str(), r.threads, r.reps, r.units,
+               r.median_ns, r.min_ns, r.mean_ns, 1e9 / r.median_ns,
+               r.cas_retries, r.sleeps);
+}
+
+static void print_json(const std::vector<Result> &results) {
+    printf("{\n  \"cores\": %u,\n  \"benchmarks\": [", core_count());
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result &r = results[i];
+        printf("%s\n    {\"benchmark\": \"%s\", \"param\": \"%s\", "
+               "\"threads\": %u, \"reps\": %u, \"units\": %.0f, "
+               "\"median_ns\": %.2f, \"min_ns\": %.2f, \"mean_ns\": %.2f, "
+               "\"units_per_s\": %.4g, \"cas_retries\": %.1f, "
+               "\"sleeps\": %.1f}", i == 0 ? "" : ",", r.name.c_str(),
+               r.param.c_str(), r.threads, r.reps, r.units, r.median_ns,
+               r.min_ns, r.mean_ns, 1e9 / r.median_ns, r.cas_retries,
+               r.sleeps);
+    }
+    printf("\n  ]\n}\n");
+}
+
+static bool parse_args(int argc, char **argv, Options &opts) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0) {
+            opts.json = true;
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            opts.reps = 3;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            const char *s = argv[++i];
+            while (*s) {
+                char *end;
+                opts.threads.push_back((uint32_t) strtoul(s, &end, 10));
+                if (end == s)
+                    return false;
+                s = *end == ',' ? end + 1 : end;
+            }
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            opts.filter = argv[++i];
+        } else {
+            return false;
+        }
+    }
+
+    if (opts.threads.empty()) {
+        uint32_t cores = core_count();
+        for (uint32_t t = 1; t < cores; t *= 2)
+            opts.threads.push_back(t);
+        opts.threads.push_back(cores);
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+        fprintf(stderr, "Usage: %s [--json] [--quick] [--threads 1,2,4] "
+                        "[--filter name]\n", argv[0]);
+        return 1;
+    }
+
+    auto enabled = [&](const char *name) {
+        return opts.filter.empty() || strstr(name, opts.filter.c_str());
+    };
+
+    std::vector<Result> results;
+    uint32_t reps = opts.reps;
+
+    for (uint32_t threads : opts.threads) {
+        fprintf(stderr, "Running benchmarks with %u threads..\n", threads);
+        Pool *pool = pool_create(threads);
+
+        if (enabled("submit_wait"))
+            results.push_back(bench_submit_wait(pool, threads, reps));
+
+        for (uint32_t block_size : { 256u, 4096u, 65536u }) {
+            if (enabled("parallel_for"))
+                results.push_back(
+                    bench_parallel_for(pool, threads, reps, block_size));
+#if defined(_OPENMP)
+            if (enabled("parallel_for_omp"))
+                results.push_back(
+                    bench_parallel_for_omp(threads, reps, block_size));
+#endif
+        }
+
+        if (enabled("parallel_for"))
+            results.push_back(bench_parallel_for(pool, threads, reps,
+                                                 dr::auto_block_size));
+
+        if (enabled("dep_chain"))
+            results.push_back(bench_chain(pool, threads, reps));
+        if (enabled("fan_out_in"))
+            results.push_back(bench_fan(pool, threads, reps));
+        if (enabled("fan_out_in_graph"))
+            results.push_back(bench_fan_graph(pool, threads, reps));
+        if (enabled("fan_out_in_replay"))
+            results.push_back(bench_fan_replay(pool, threads, reps));
+        if (enabled("nested_parallel_for"))
+            results.push_back(bench_nested(pool, threads, reps));
+
+        if (threads > 0 && enabled("wake_latency")) {
+            results.push_back(bench_wake(pool, threads, reps, true));
+            results.push_back(bench_wake(pool, threads, reps, false));
+        }
+
+        pool_destroy(pool);
+    }
+
+    if (opts.json)
+        print_json(results);
+    else
+        print_csv(results);
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+    benchmarks/latency.cpp -- Dispatch latency of small task submissions
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+
+    Usage: nanothread_latency [--json] [--samples N] [--gap us] [--threads N]
+
+    Models a request handler that submits one task of size 1 at a time and
+    measures the time from the submission until the callback starts on a
+    worker. Submissions are separated by an idle gap, during which workers
+    outside of the latency mode may park. The submitting thread doesn't help
+    with the work, so that every sample refers to a dispatch to a worker.
+    The results (one row per mode) are written to stdout as CSV or JSON.
+*/
+
+#include <nanothread/nanothread.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string mode;
+    uint32_t threads, samples;
+    double p50_ns, p99_ns, p999_ns, max_ns;
+    double sleeps, handoffs; // Per sample
+};
+
+struct Options {
+    uint32_t threads = 1, samples = 100000, gap_us = 100;
+    bool json = false;
+};
+
+struct Sample {
+    Clock::time_point start;
+    std::atomic<bool> done;
+};
+
+static void record_start(uint32_t, void *payload) {
+    Sample *s = *(Sample **) payload;
+    s->start = Clock::now();
+    s->done.store(true, std::memory_order_release);
+}
+
+static Result measure(const char *mode, uint32_t hot_workers,
+                      const Options &opts) {
+    Pool *pool = pool_create(opts.threads);
+    pool_set_latency_mode(pool, hot_workers);
+
+    Sample sample;
+    Sample *ptr = &sample;
+    std::vector<double> times;
+    times.reserve(opts.samples);
+
+    PoolStats before, after;
+    pool_stats(pool, &before);
+
+    for (uint32_t i = 0; i < opts.samples; ++i) {
+        // Idle period between requests
+        Clock::time_point gap_end =
+            Clock::now() + std::chrono::microseconds(opts.gap_us);
+        while (Clock::now() < gap_end)
+            ;
+
+        sample.done.store(false, std::memory_order_relaxed);
+        Clock::time_point submit = Clock::now();
+        Task *task = task_submit_dep(pool, nullptr, 0, 1, record_start, &ptr,
+                                     sizeof(Sample *), nullptr, 1);
+        while (!sample.done.load(std::memory_order_acquire))
+            ;
+        times.push_back((double) std::chrono::duration_cast<
+            std::chrono::nanoseconds>(sample.start - submit).count());
+        task_wait_and_release(task);
+    }
+
+    pool_stats(pool, &after);
+    pool_destroy(pool);
+
+    std::sort(times.begin(), times.end());
+    auto percentile = [&](double p) {
+        size_t index = (size_t) (p * (times.size() - 1) + 0.5);
+        return times[index];
+    };
+
+    Result r;
+    r.mode = mode;
+    r.threads = opts.threads;
+    r.samples = opts.samples;
+    r.p50_ns = percentile(0.5);
+    r.p99_ns = percentile(0.99);
+    r.p999_ns = percentile(0.999);
+    r.max_ns = times.back();
+    r.sleeps = (double) (after.sleeps - before.sleeps) / opts.samples;
+    r.handoffs = (double) (after.handoffs - before.handoffs) / opts.samples;
+    return r;
+}
+
+static bool parse_args(int argc, char **argv, Options &opts) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--json") == 0)
+            opts.json = true;
+        else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+            opts.samples = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--gap") == 0 && i + 1 < argc)
+            opts.gap_us = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            opts.threads = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        else
+            return false;
+    }
+    return opts.samples > 0 && opts.threads > 0;
+}
+
+int main(int argc, char **argv) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+        fprintf(stderr, "Usage: %s [--json] [--samples N] [--gap us] "
+                        "[--threads N]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Result> results;
+    results.push_back(measure("default", 0, opts));
+    results.push_back(measure("latency", opts.threads, opts));
+
+    if (opts.json) {
+        printf("{\n  \"cores\": %u,\n  \"gap_us\": %u,\n  \"results\": [",
+               core_count(), opts.gap_us);
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            printf("%s\n    {\"mode\": \"%s\", \"threads\": %u, "
+                   "\"samples\": %u, \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+                   "\"p999_ns\": %.0f, \"max_ns\": %.0f, \"sleeps\": %.3f, "
+                   "\"handoffs\": %.3f}", i == 0 ? "" : ",", r.mode.c_str(),
+                   r.threads, r.samples, r.p50_ns, r.p99_ns, r.p999_ns,
+                   r.max_ns, r.sleeps, r.handoffs);
+        }
+        printf("\n  ]\n}\n");
+    } else {
+        printf("mode,threads,samples,p50_ns,p99_ns,p999_ns,max_ns,sleeps,"
+               "handoffs\n");
+        for (const Result &r : results)
+            printf("%s,%u,%u,%.0f,%.0f,%.0f,%.0f,%.3f,%.3f\n", r.mode.c_str(),
+                   r.threads, r.samples, r.p50_ns, r.p99_ns, r.p999_ns,
+                   r.max_ns, r.sleeps, r.handoffs);
+    }
+
+    return 0;
+}
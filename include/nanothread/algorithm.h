@@ -0,0 +1,425 @@
+/*
+    nanothread/algorithm.h -- Parallel reductions, scans, and sorting
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#pragma once
+
+#include <nanothread/nanothread.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace drjit {
+    namespace detail {
+        /// Size of a cache line, used to prevent false sharing
+        constexpr size_t cache_line_size = 64;
+
+        /**
+         * \brief Array of values that reside on separate cache lines
+         *
+         * Used for per-worker accumulators, which are frequently updated by
+         * different threads.
+         */
+        template <typename T> class padded_array {
+        public:
+            static constexpr size_t stride =
+                (sizeof(T) + cache_line_size - 1) / cache_line_size *
+                cache_line_size;
+
+            padded_array(size_t size, const T &value)
+                : m_storage(new unsigned char[size * stride + cache_line_size]),
+                  m_size(0) {
+                uintptr_t ptr = (uintptr_t) m_storage.get();
+                ptr = (ptr + cache_line_size - 1) / cache_line_size *
+                      cache_line_size;
+                m_data = (unsigned char *) ptr;
+
+                for (; m_size < size; ++m_size)
+                    new (m_data + m_size * stride) T(value);
+            }
+
+            padded_array(const padded_array &) = delete;
+            padded_array &operator=(const padded_array &) = delete;
+
+            ~padded_array() {
+                for (size_t i = 0; i < m_size; ++i)
+                    (*this)[i].~T();
+            }
+
+            T &operator[](size_t i) { return *(T *) (m_data + i * stride); }
+            size_t size() const { return m_size; }
+
+        private:
+            std::unique_ptr<unsigned char[]> m_storage;
+            unsigned char *m_data;
+            size_t m_size;
+        };
+
+        /// Accumulator of a worker thread, see \ref parallel_reduce()
+        template <typename T> struct reduce_slot {
+            std::atomic<bool> busy;
+            T value;
+
+            reduce_slot(const T &value) : busy(false), value(value) { }
+            reduce_slot(const reduce_slot &s) : busy(false), value(s.value) { }
+        };
+
+        /**
+         * \brief Find the split of a merge of <tt>[a, a + m)</tt> and <tt>[b,
+         * b + n)</tt> that places \c d elements before it
+         *
+         * Returns the number of elements taken from the first range. Ties
+         * are resolved in favor of the first range, matching \c std::merge().
+         */
+        template <typename It, typename Compare>
+        size_t merge_split(It a, size_t m, It b, size_t n, size_t d,
+                           Compare &comp) {
+            size_t lo = d > n ? d - n : 0,
+                   hi = d < m ? d : m;
+
+            while (lo < hi) {
+                size_t i = (lo + hi + 1) / 2;
+                if (comp(b[d - i], a[i - 1]))
+                    hi = i - 1;
+                else
+                    lo = i;
+            }
+
+            return lo;
+        }
+
+        /**
+         * \brief Merge pairs of adjacent sorted runs of length \c width from
+         * \c src into \c dst
+         *
+         * Each work unit produces \c grain elements of the output. The input
+         * ranges of all work units are located first (via \ref
+         * merge_split()), since the merges move elements out of \c src.
+         */
+        template <typename In, typename Out, typename Compare>
+        void merge_pass(In src, Out dst, size_t n, size_t width, size_t grain,
+                        Compare &comp, Pool *pool) {
+            size_t pieces = (n + grain - 1) / grain;
+
+            // Number of elements of the first run preceding each piece
+            std::vector<size_t> splits(pieces);
+
+            parallel_for(
+                blocked_range<size_t>(0, pieces, 16),
+                [&](blocked_range<size_t> r) {
+                    for (size_t piece : r) {
+                        size_t start = piece * grain,
+                               pair = start / (2 * width) * (2 * width),
+                               mid = std::min(n, pair + width),
+                               stop = std::min(n, pair + 2 * width);
+
+                        splits[piece] = merge_split(src + pair, mid - pair,
+                                                    src + mid, stop - mid,
+                                                    start - pair, comp);
+                    }
+                },
+                pool);
+
+            parallel_for(
+                blocked_range<size_t>(0, pieces),
+                [&](blocked_range<size_t> r) {
+                    for (size_t piece : r) {
+                        size_t start = piece * grain,
+                               pair = start / (2 * width) * (2 * width),
+                               mid = std::min(n, pair + width),
+                               stop = std::min(n, pair + 2 * width),
+                               end = std::min(stop, start + grain),
+                               d0 = start - pair, d1 = end - pair,
+                               i0 = splits[piece],
+                               i1 = end == stop ? mid - pair : splits[piece + 1];
+
+                        std::merge(
+                            std::make_move_iterator(src + pair + i0),
+                            std::make_move_iterator(src + pair + i1),
+                            std::make_move_iterator(src + mid + (d0 - i0)),
+                            std::make_move_iterator(src + mid + (d1 - i1)),
+                            dst + start, comp);
+                    }
+                },
+                pool);
+        }
+    }
+
+    /**
+     * \brief Reduce a range in parallel
+     *
+     * Splits \c range into blocks and invokes <tt>func(blocked_range<Int>)
+     * -> T</tt> on each of them. The partial results are combined using the
+     * associative operation <tt>reduce(T, T) -> T</tt>, whose neutral
+     * element is \c identity.
+     *
+     * By default, each worker thread first combines the results of the blocks
+     * that it processed into its own accumulator, which resides on a separate
+     * cache line. The order of combination therefore depends on scheduling,
+     * which is generally fine for integers but causes round-off differences
+     * for floating point values. Specify <tt>deterministic=true</tt> to
+     * combine the block results in the order of the blocks, which makes the
+     * result independent of the number of threads (given a fixed block size,
+     * i.e. not \ref auto_block_size, which depends on the pool size).
+     */
+    template <typename Int, typename T, typename Func, typename Reduce>
+    T parallel_reduce(const blocked_range<Int> &range_, const T &identity,
+                      Func &&func, Reduce &&reduce, bool deterministic = false,
+                      Pool *pool = nullptr) {
+        blocked_range<Int> range = range_.resolve(pool);
+        uint32_t blocks = range.blocks();
+        if (blocks == 0)
+            return identity;
+
+        struct Payload {
+            typename std::remove_reference<Func>::type *f;
+            typename std::remove_reference<Reduce>::type *r;
+            Int begin, end, block_size;
+            T *partials;
+            detail::padded_array<detail::reduce_slot<T>> *slots;
+
+            blocked_range<Int> block(uint32_t index) const {
+                Int b = begin + block_size * (Int) index,
+                    e = b + block_size;
+                return blocked_range<Int>(b, e > end ? end : e);
+            }
+        };
+
+        Payload payload{ &func, &reduce, *range.begin(), *range.end(),
+                         range.block_size(), nullptr, nullptr };
+
+        if (deterministic) {
+            std::vector<T> partials(blocks, identity);
+            payload.partials = partials.data();
+
+            auto callback = [](uint32_t index_begin, uint32_t index_end,
+                               void *payload) {
+                Payload *p = (Payload *) payload;
+                for (uint32_t index = index_begin; index != index_end; ++index)
+                    p->partials[index] = (*p->f)(p->block(index));
+            };
+
+            task_submit_range_and_wait(pool, blocks, callback, &payload);
+
+            T result = identity;
+            for (uint32_t i = 0; i < blocks; ++i)
+                result = reduce(result, partials[i]);
+            return result;
+        } else {
+            /* Threads of other pools and external threads may also help with
+               the work, hence their IDs might collide. The slots are therefore
+               protected by a (normally uncontended) flag. */
+            detail::padded_array<detail::reduce_slot<T>> slots(
+                pool_size(pool) + 1, detail::reduce_slot<T>(identity));
+            payload.slots = &slots;
+
+            auto callback = [](uint32_t index_begin, uint32_t index_end,
+                               void *payload) {
+                Payload *p = (Payload *) payload;
+
+                T value = (*p->f)(p->block(index_begin));
+                for (uint32_t index = index_begin + 1; index != index_end; ++index)
+                    value = (*p->r)(value, (*p->f)(p->block(index)));
+
+                detail::reduce_slot<T> &slot =
+                    (*p->slots)[pool_thread_id() % p->slots->size()];
+
+                while (slot.busy.exchange(true, std::memory_order_acquire))
+                    ;
+                slot.value = (*p->r)(slot.value, value);
+                slot.busy.store(false, std::memory_order_release);
+            };
+
+            task_submit_range_and_wait(pool, blocks, callback, &payload);
+
+            T result = identity;
+            for (size_t i = 0; i < slots.size(); ++i)
+                result = reduce(result, slots[i].value);
+            return result;
+        }
+    }
+
+    /**
+     * \brief Reduce the values <tt>transform(i) -> T</tt> for all \c i in \c
+     * range in parallel
+     *
+     * Convenience wrapper around \ref parallel_reduce().
+     */
+    template <typename Int, typename T, typename Transform, typename Reduce>
+    T parallel_transform_reduce(const blocked_range<Int> &range,
+                                const T &identity, Transform &&transform,
+                                Reduce &&reduce, bool deterministic = false,
+                                Pool *pool = nullptr) {
+        return parallel_reduce(
+            range, identity,
+            [&](blocked_range<Int> block) {
+                T value = identity;
+                for (Int i : block)
+                    value = reduce(value, transform(i));
+                return value;
+            },
+            reduce, deterministic, pool);
+    }
+
+    /**
+     * \brief Compute a prefix sum over a range in parallel
+     *
+     * The function <tt>func(blocked_range<Int> block, T prefix, bool final)
+     * -> T</tt> must return the combination (via the associative operation
+     * \c reduce) of \c prefix and the values of \c block. When \c final is
+     * \c true, \c prefix is the combination of all values preceding \c
+     * block, and \c func should additionally write out the prefix sums of
+     * the block.
+     *
+     * The scan uses two phases: the first computes the sum of every block
+     * (with <tt>final=false</tt>), the second produces the output of every
+     * block. The block size of \c range should be chosen so that a block
+     * fits into the cache, hence the second pass is served from the cache.
+     * The function returns the combination of all values.
+     *
+     * \code
+     * // Inclusive prefix sum of 'in'
+     * drjit::parallel_scan(
+     *     drjit::blocked_range<size_t>(0, size, 16384), 0.f,
+     *     [&](drjit::blocked_range<size_t> block, float sum, bool final) {
+     *         for (size_t i : block) {
+     *             sum += in[i];
+     *             if (final)
+     *                 out[i] = sum;
+     *         }
+     *         return sum;
+     *     },
+     *     std::plus<float>());
+     * \endcode
+     */
+    template <typename Int, typename T, typename Func, typename Reduce>
+    T parallel_scan(const blocked_range<Int> &range_, const T &identity,
+                    Func &&func, Reduce &&reduce, Pool *pool = nullptr) {
+        blocked_range<Int> range = range_.resolve(pool);
+        uint32_t blocks = range.blocks();
+        if (blocks == 0)
+            return identity;
+        else if (blocks == 1 || pool_size(pool) == 0)
+            return func(blocked_range<Int>(*range.begin(), *range.end()),
+                        identity, true);
+
+        Int begin = *range.begin(), end = *range.end(),
+            block_size = range.block_size();
+
+        auto block = [begin, end, block_size](uint32_t index) {
+            Int b = begin + block_size * (Int) index,
+                e = b + block_size;
+            return blocked_range<Int>(b, e > end ? end : e);
+        };
+
+        std::vector<T> sums(blocks, identity);
+
+        // Phase 1: reduce each block, except for the last one
+        parallel_for(
+            blocked_range<uint32_t>(0, blocks - 1),
+            [&](blocked_range<uint32_t> r) {
+                for (uint32_t i : r)
+                    sums[i] = func(block(i), identity, false);
+            },
+            pool);
+
+        // Exclusive prefix sum of the block sums
+        T prefix = identity;
+        for (uint32_t i = 0; i < blocks; ++i) {
+            T value = reduce(prefix, sums[i]);
+            sums[i] = prefix;
+            prefix = value;
+        }
+
+        // Phase 2: compute the output, starting from the block prefix
+        parallel_for(
+            blocked_range<uint32_t>(0, blocks),
+            [&](blocked_range<uint32_t> r) {
+                for (uint32_t i : r) {
+                    T value = func(block(i), sums[i], true);
+                    if (i == blocks - 1)
+                        prefix = value;
+                }
+            },
+            pool);
+
+        return prefix;
+    }
+
+    /**
+     * \brief Sort the range <tt>[begin, end)</tt> in parallel
+     *
+     * Uses a merge sort: blocks of the input are first sorted concurrently
+     * via \c std::sort(), and pairs of sorted runs are then merged in rounds.
+     * Each merge is split into independent pieces of similar size, hence all
+     * workers participate until the final round. Requires a temporary buffer
+     * with space for the elements (which must be move-constructible and
+     * default-constructible). The sort is not stable.
+     *
+     * \param grain
+     *     Number of elements that are processed by a work unit
+     */
+    template <typename It, typename Compare>
+    void parallel_sort(It begin, It end, Compare comp, Pool *pool = nullptr,
+                       size_t grain = 16384) {
+        using Value = typename std::iterator_traits<It>::value_type;
+
+        size_t n = (size_t) (end - begin);
+        if (grain == 0)
+            grain = 1;
+
+        if (n <= grain || pool_size(pool) == 0) {
+            std::sort(begin, end, comp);
+            return;
+        }
+
+        // Sort runs of 'grain' elements
+        size_t runs = (n + grain - 1) / grain;
+        parallel_for(
+            blocked_range<size_t>(0, runs),
+            [&](blocked_range<size_t> r) {
+                for (size_t i : r)
+                    std::sort(begin + i * grain,
+                              begin + std::min(n, (i + 1) * grain), comp);
+            },
+            pool);
+
+        std::vector<Value> buffer(n);
+        bool in_buffer = false;
+
+        for (size_t width = grain; width < n; width *= 2) {
+            if (in_buffer)
+                detail::merge_pass(buffer.begin(), begin, n, width, grain,
+                                   comp, pool);
+            else
+                detail::merge_pass(begin, buffer.begin(), n, width, grain,
+                                   comp, pool);
+            in_buffer = !in_buffer;
+        }
+
+        if (in_buffer)
+            parallel_for(
+                blocked_range<size_t>(0, n, grain),
+                [&](blocked_range<size_t> r) {
+                    std::move(buffer.begin() + *r.begin(),
+                              buffer.begin() + *r.end(), begin + *r.begin());
+                },
+                pool);
+    }
+
+    template <typename It>
+    void parallel_sort(It begin, It end, Pool *pool = nullptr,
+                       size_t grain = 16384) {
+        parallel_sort(begin, end,
+                      std::less<typename std::iterator_traits<It>::value_type>(),
+                      pool, grain);
+    }
+}
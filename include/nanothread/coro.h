@@ -0,0 +1,282 @@
+/*
+    nanothread/coro.h -- C++20 coroutine support for nanothread
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#pragma once
+
+#include <nanothread/nanothread.h>
+
+#if !defined(__cpp_impl_coroutine)
+#  error "nanothread/coro.h requires a compiler with C++20 coroutine support"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace drjit {
+    template <typename T = void> class coro_task;
+
+    namespace detail {
+        /**
+         * \brief Resume a suspended coroutine as a work unit of \c pool once
+         * \c parent (if specified) has completed
+         *
+         * The resumption is attached to the children of \c parent, hence
+         * no thread blocks in the meantime. It also takes place when \c
+         * parent failed, in which case the coroutine can observe the
+         * exception via \ref task_wait().
+         */
+        inline void resume_after(Pool *pool, std::coroutine_handle<> handle,
+                                 const Task *parent) {
+            void *address = handle.address();
+
+            auto callback = [](uint32_t /* unused */, void *payload) {
+                std::coroutine_handle<>::from_address(*(void **) payload).resume();
+            };
+
+            TaskAttr attr;
+            task_attr_init(&attr);
+            attr.flags = NANOTHREAD_TASK_ALWAYS_RUN;
+
+            task_release(task_submit_ex(pool, &parent, parent ? 1 : 0, 1,
+                                        callback, nullptr, &address,
+                                        sizeof(void *), nullptr, 1, &attr));
+        }
+
+        template <typename T> struct coro_result {
+            std::optional<T> value;
+
+            template <typename U> void return_value(U &&result) {
+                value.emplace(std::forward<U>(result));
+            }
+
+            T get() { return std::move(*value); }
+        };
+
+        template <> struct coro_result<void> {
+            void return_void() { }
+            void get() { }
+        };
+    }
+
+    /**
+     * \brief Awaitable wrapper around a task handle
+     *
+     * <tt>co_await drjit::awaitable(task, pool)</tt> suspends the calling
+     * coroutine until \c task has completed, and then resumes it as a work
+     * unit of \c pool. The wrapper takes ownership of the handle and releases
+     * it afterwards. When \c task failed, its exception is rethrown within
+     * the coroutine.
+     *
+     * Within a \ref coro_task coroutine, plain task handles (e.g. the return
+     * value of \ref parallel_for_async()) can also be awaited directly, as
+     * can futures returned by \ref do_async_future(), which produce their
+     * result.
+     */
+    class awaitable {
+    public:
+        explicit awaitable(Task *task, Pool *pool = nullptr)
+            : m_task(task), m_pool(pool) { }
+
+        awaitable(awaitable &&other) noexcept
+            : m_task(other.m_task), m_pool(other.m_pool) {
+            other.m_task = nullptr;
+        }
+
+        awaitable(const awaitable &) = delete;
+        awaitable &operator=(const awaitable &) = delete;
+
+        ~awaitable() { task_release(m_task); }
+
+        bool await_ready() const noexcept { return m_task == nullptr; }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            // The coroutine (and this instance) may be gone once this returns
+            detail::resume_after(m_pool, handle, m_task);
+        }
+
+        void await_resume() {
+            Task *task = m_task;
+            m_task = nullptr;
+
+            // Returns right away, but rethrows exceptions
+            task_wait_and_release(task);
+        }
+
+    private:
+        Task *m_task;
+        Pool *m_pool;
+    };
+
+    namespace detail {
+        /// Awaits a \ref future from a \ref coro_task, see await_transform()
+        template <typename T> struct future_awaiter {
+            future<T> value;
+            Pool *pool;
+
+            bool await_ready() const noexcept { return !value.valid(); }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                resume_after(pool, handle, value.task());
+            }
+
+            T await_resume() { return value.get(); }
+        };
+    }
+
+    /**
+     * \brief Coroutine whose execution is carried out by the work units of a
+     * thread pool
+     *
+     * The coroutine starts running asynchronously as a work unit of a pool
+     * (the default pool, or the one given as first argument of the coroutine
+     * function). Each time it awaits a task or another \ref coro_task, its
+     * resumption is scheduled as a new work unit that becomes ready once the
+     * awaited work has completed.
+     *
+     * The result can be obtained by awaiting the instance from another
+     * coroutine, or via \ref get(), which helps to execute work in the
+     * meantime (similar to \ref task_wait()). The handle returned by \ref
+     * task() can be used as a parent of ordinary tasks. Destroying a \ref
+     * coro_task waits for the coroutine to finish.
+     *
+     * \code
+     * drjit::coro_task<int> compute(Pool *pool) {
+     *     co_await drjit::parallel_for_async(
+     *         drjit::blocked_range<uint32_t>(0, 1000, 10),
+     *         [](drjit::blocked_range<uint32_t> range) { ... }, {}, pool);
+     *     co_return 42;
+     * }
+     *
+     * int value = compute(pool).get();
+     * \endcode
+     */
+    template <typename T> class coro_task {
+    public:
+        struct promise_type : detail::coro_result<T> {
+            Pool *pool = nullptr;
+            Task *done = nullptr;
+            std::exception_ptr exception;
+
+            promise_type() = default;
+
+            /// Coroutine functions can specify the pool as first argument
+            template <typename... Args>
+            promise_type(Pool *pool, Args &&...) : pool(pool) { }
+
+            coro_task get_return_object() {
+                done = task_create_event(pool);
+                return coro_task(
+                    std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            auto initial_suspend() noexcept {
+                struct awaiter {
+                    Pool *pool;
+                    bool await_ready() const noexcept { return false; }
+                    void await_suspend(std::coroutine_handle<> handle) {
+                        detail::resume_after(pool, handle, nullptr);
+                    }
+                    void await_resume() const noexcept { }
+                };
+
+                return awaiter{ pool };
+            }
+
+            auto final_suspend() noexcept {
+                struct awaiter {
+                    bool await_ready() const noexcept { return false; }
+                    void await_suspend(
+                        std::coroutine_handle<promise_type> handle) noexcept {
+                        // The coroutine may be destroyed once this returns
+                        task_signal(handle.promise().done);
+                    }
+                    void await_resume() const noexcept { }
+                };
+
+                return awaiter{};
+            }
+
+            void unhandled_exception() { exception = std::current_exception(); }
+
+            /// Task handles are awaited by scheduling a continuation
+            awaitable await_transform(Task *task) {
+                return awaitable(task, pool);
+            }
+
+            /// Futures are awaited similarly and produce the result
+            template <typename U>
+            detail::future_awaiter<U> await_transform(future<U> &&value) {
+                return detail::future_awaiter<U>{ std::move(value), pool };
+            }
+
+            template <typename Awaitable>
+            Awaitable &&await_transform(Awaitable &&value) {
+                return std::forward<Awaitable>(value);
+            }
+        };
+
+        coro_task(coro_task &&other) noexcept : m_handle(other.m_handle) {
+            other.m_handle = nullptr;
+        }
+
+        coro_task(const coro_task &) = delete;
+        coro_task &operator=(const coro_task &) = delete;
+
+        ~coro_task() {
+            if (m_handle) {
+                Task *done = m_handle.promise().done;
+                task_wait(done);
+                m_handle.destroy();
+                task_release(done);
+            }
+        }
+
+        /// Task that completes once the coroutine has finished
+        Task *task() const { return m_handle.promise().done; }
+
+        /// Wait for the coroutine to finish and return its result
+        T get() {
+            task_wait(m_handle.promise().done);
+            return result();
+        }
+
+        /// Await the coroutine from another coroutine
+        auto operator co_await() noexcept {
+            struct awaiter {
+                coro_task *self;
+
+                bool await_ready() const noexcept { return false; }
+
+                void await_suspend(std::coroutine_handle<> handle) {
+                    promise_type &p = self->m_handle.promise();
+                    detail::resume_after(p.pool, handle, p.done);
+                }
+
+                T await_resume() { return self->result(); }
+            };
+
+            return awaiter{ this };
+        }
+
+    private:
+        explicit coro_task(std::coroutine_handle<promise_type> handle)
+            : m_handle(handle) { }
+
+        T result() {
+            promise_type &p = m_handle.promise();
+            if (p.exception)
+                std::rethrow_exception(p.exception);
+            return p.get();
+        }
+
+        std::coroutine_handle<promise_type> m_handle;
+    };
+}
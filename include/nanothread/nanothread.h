@@ -17,7 +17,11 @@
     #include <stdbool.h>
 #endif
 
-#if defined(_MSC_VER)
+/* Static builds (NANOTHREAD_STATIC) don't export symbols, and they expose
+   some internal state so that fast paths can be inlined into the caller */
+#if defined(NANOTHREAD_STATIC)
+#  define NANOTHREAD_EXPORT
+#elif defined(_MSC_VER)
 #  if defined(NANOTHREAD_BUILD)
 #    define NANOTHREAD_EXPORT    __declspec(dllexport)
 #  else
@@ -27,6 +31,12 @@
 #  define NANOTHREAD_EXPORT      __attribute__ ((visibility("default")))
 #endif
 
+#if defined(_MSC_VER)
+#  define NANOTHREAD_TLS         __declspec(thread)
+#else
+#  define NANOTHREAD_TLS         __thread
+#endif
+
 #if defined(__cplusplus)
 #  define NANOTHREAD_DEF(x) = x
 #else
@@ -35,8 +45,203 @@
 
 #define NANOTHREAD_AUTO ((uint32_t) -1)
 
+/// Task priorities, see \ref TaskAttr::priority
+#define NANOTHREAD_PRIORITY_LOW    0
+#define NANOTHREAD_PRIORITY_NORMAL 1
+#define NANOTHREAD_PRIORITY_HIGH   2
+#define NANOTHREAD_PRIORITY_COUNT  3
+
+/// Flags of a task, see \ref TaskAttr
+#define NANOTHREAD_TASK_ALWAYS_RUN 1
+#define NANOTHREAD_TASK_KEEP_PAYLOAD 2
+
 typedef struct Pool Pool;
 typedef struct Task Task;
+typedef struct TaskGraph TaskGraph;
+typedef struct CancelToken CancelToken;
+
+/// Optional attributes of a task, see \ref task_submit_ex()
+typedef struct TaskAttr {
+    /**
+     * \brief Preferred NUMA node of the task
+     *
+     * Tasks are appended to the queue of this node, whose workers process
+     * them before turning to the queues of other nodes. The value is
+     * interpreted modulo \ref pool_node_count(). The default value \c
+     * NANOTHREAD_AUTO refers to the node of the submitting thread.
+     */
+    uint32_t node;
+
+    /**
+     * \brief Priority of the task
+     *
+     * Workers process tasks of higher priority (\c NANOTHREAD_PRIORITY_HIGH)
+     * before tasks of lower priority (\c NANOTHREAD_PRIORITY_NORMAL and \c
+     * NANOTHREAD_PRIORITY_LOW), see also \ref pool_set_priority_aging().
+     * Values larger than \c NANOTHREAD_PRIORITY_HIGH are clamped. The
+     * default is \c NANOTHREAD_PRIORITY_NORMAL. Priorities are not
+     * inherited by the children of a task.
+     */
+    uint32_t priority;
+
+    /**
+     * \brief Combination of task flags
+     *
+     * <ul>
+     *   <li>\c NANOTHREAD_TASK_ALWAYS_RUN: invoke the callback even when a
+     *   parent task failed with an exception. The exception is still
+     *   propagated to the task (and can be observed via \ref task_wait()).
+     *   </li>
+     *   <li>\c NANOTHREAD_TASK_KEEP_PAYLOAD: don't free the payload when the
+     *   task completes, but only once the last handle has been released. The
+     *   callback can then leave results in the payload, which the holder of
+     *   a handle retrieves via \ref task_payload().</li>
+     * </ul>
+     *
+     * The default value is zero.
+     */
+    uint32_t flags;
+
+    /**
+     * \brief Optional cancellation token (see \ref cancel_token_create())
+     *
+     * Cancelling the token via \ref cancel_token_cancel() has the same
+     * effect as calling \ref task_cancel() on every task submitted with it.
+     * Tasks with a token are never executed right away upon submission
+     * (even when they are small or \c always_async is 0), so that waiting
+     * for them raises \ref drjit::task_cancelled once the token has been
+     * cancelled. The task keeps the token alive as long as needed. The
+     * default value is \c NULL.
+     */
+    CancelToken *token;
+
+    /**
+     * \brief Thread that must execute the task
+     *
+     * The default value \c NANOTHREAD_AUTO lets any thread of the pool
+     * execute the task. Otherwise, the task is appended to the mailbox of the
+     * thread with the given ID (see \ref pool_attach_thread()), which
+     * processes all of its work units. Threads check their mailbox before
+     * any other queue, and targeted tasks are never executed right away upon
+     * submission, even when they are small.
+     */
+    uint32_t thread;
+
+    /**
+     * \brief Optional function that constructs the payload in place
+     *
+     * When specified, the task reserves \c payload_size bytes of storage
+     * (aligned to 16 bytes) within its record or the payload arena of the
+     * pool, and invokes <tt>payload_init(storage, payload)</tt> to construct
+     * the payload there, e.g. by moving a C++ object out of \c payload. The
+     * callback then receives the storage, and \c payload_deleter (if
+     * specified) is invoked on it to destroy the payload without freeing the
+     * memory. The caller retains ownership of \c payload, which only needs to
+     * remain valid during the submission. Tasks with this attribute are
+     * never executed right away upon submission, even when they are small or
+     * \c always_async is 0. The default value is \c NULL.
+     */
+    void (*payload_init)(void *storage, void *payload);
+
+    /**
+     * \brief Estimated execution time of the task in nanoseconds
+     *
+     * Used by the critical path mode (see \ref pool_set_critical_path()) to
+     * determine which ready tasks should run first. Only the relative values
+     * of different tasks matter. Resident graphs that were launched with
+     * profiling enabled instead use the measured time of the previous
+     * launch. The default value zero counts one nanosecond per work unit.
+     */
+    float cost;
+} TaskAttr;
+
+/// Scheduler statistics of a pool, see \ref pool_stats()
+typedef struct PoolStats {
+    /// Number of executed work units
+    uint64_t work_units;
+
+    /// Number of tasks that were pushed into the queue once ready
+    uint64_t tasks_pushed;
+
+    /**
+     * \brief Number of tasks whose work units have all completed
+     *
+     * The difference <tt>tasks_pushed - tasks_completed</tt> is the number
+     * of tasks that are queued or running.
+     */
+    uint64_t tasks_completed;
+
+    /// Number of times that a thread fetched a range of work units
+    uint64_t pops;
+
+    /// Number of ranges stolen from the deques of other workers
+    uint64_t steals;
+
+    /// Number of failed CAS operations (contention) in push, pop, and allocation
+    uint64_t push_retries, pop_retries, alloc_retries;
+
+    /// Number of unsuccessful attempts of idle threads to fetch work
+    uint64_t idle_spins;
+
+    /// Number of times that idle threads were put to sleep or woken up
+    uint64_t sleeps, wakeups;
+
+    /// Number of created and recycled task records
+    uint64_t tasks_created, tasks_recycled;
+
+    /// Number of small tasks that were executed immediately upon submission
+    uint64_t inline_tasks;
+
+    /// Number of nested submissions that workers executed inline
+    uint64_t inline_nested;
+
+    /// Number of work units that were skipped due to a cancellation
+    uint64_t units_cancelled;
+
+    /// Number of tasks handed directly to a hot worker (latency mode)
+    uint64_t handoffs;
+
+    /// Number of chunks allocated by the payload arena (see \ref task_submit_dep())
+    uint64_t payload_chunks;
+} PoolStats;
+
+/// Range of work units executed by a thread, see \ref pool_schedule_record()
+typedef struct ScheduleEntry {
+    /// Sequence number of the task (order of submission since the recording began)
+    uint32_t task;
+
+    /// \ref pool_thread_id() of the worker that ran the range (0: other threads)
+    uint32_t thread;
+
+    /// Range of work units <tt>[begin, end)</tt>
+    uint32_t begin, end;
+} ScheduleEntry;
+
+/// Duration of the last launch of a graph, see \ref task_graph_makespan()
+typedef struct MakespanReport {
+    /// Time from the start of the first task until the end of the last one
+    uint64_t achieved_ns;
+
+    /// Lower bound of the makespan, <tt>max(critical_path_ns, work_ns / threads)</tt>
+    uint64_t ideal_ns;
+
+    /// Length of the longest chain of dependent tasks
+    uint64_t critical_path_ns;
+
+    /// Sum of the durations of all tasks
+    uint64_t work_ns;
+} MakespanReport;
+
+/// Initialize a \ref TaskAttr instance with default values
+static inline void task_attr_init(TaskAttr *attr) {
+    attr->node = NANOTHREAD_AUTO;
+    attr->priority = NANOTHREAD_PRIORITY_NORMAL;
+    attr->flags = 0;
+    attr->token = 0;
+    attr->thread = NANOTHREAD_AUTO;
+    attr->payload_init = 0;
+    attr->cost = 0;
+}
 
 #if defined(__cplusplus)
 #define NANOTHREAD_THROW     noexcept(false)
@@ -62,6 +267,74 @@ extern NANOTHREAD_EXPORT Pool *
 pool_create(uint32_t size NANOTHREAD_DEF(NANOTHREAD_AUTO),
             int ftz NANOTHREAD_DEF(1));
 
+/**
+ * \brief Create a new thread pool that is aware of the system's NUMA topology
+ *
+ * Workers of this pool are pinned to specific CPU cores, which are evenly
+ * distributed over the available NUMA nodes. The pool maintains a separate
+ * task queue for each node, and task records are allocated on the node
+ * whose queue they are pushed to. Workers process tasks of their own node
+ * first and only turn to other nodes when their own node has run out of
+ * work. The \ref TaskAttr::node field can be used to direct tasks to a
+ * specific node.
+ *
+ * On systems without NUMA information, the pool has a single node.
+ *
+ * \param size
+ *     Specifies the desired number of threads. The default value of
+ *     \c NANOTHREAD_AUTO creates a worker per available core.
+ *
+ * \param ftz
+ *     Should denormalized floating point numbers be flushed to zero?
+ */
+extern NANOTHREAD_EXPORT Pool *
+pool_create_numa(uint32_t size NANOTHREAD_DEF(NANOTHREAD_AUTO),
+                 int ftz NANOTHREAD_DEF(1));
+
+/**
+ * \brief Create an arena, i.e., a pool without threads of its own
+ *
+ * The tasks of all arenas are executed by a single set of shared workers,
+ * one per available core (see \ref core_count()), which are launched along
+ * with the first arena and stop when the last one is destroyed. Each arena
+ * keeps its own queues, so that the tasks of different arenas (e.g. tenants)
+ * remain isolated, while idle arenas don't occupy any threads.
+ *
+ * Workers move to arenas that have work, at most \c max_concurrency at a
+ * time per arena. When several arenas compete for workers, each receives a
+ * share of the worker time proportional to its \c weight. Workers revisit
+ * this decision after a bounded amount of work.
+ *
+ * \ref pool_set_size() adjusts the maximum concurrency of an arena, and \ref
+ * pool_size() returns it. Threads waiting for tasks of an arena (e.g. via
+ * \ref task_wait()) help to process its work as usual.
+ *
+ * \param max_concurrency
+ *     Maximum number of shared workers that process the arena's tasks at the
+ *     same time. \c NANOTHREAD_AUTO (the default) refers to all of them.
+ *
+ * \param weight
+ *     Relative share of the worker time when arenas compete (default: 1).
+ *
+ * \param ftz
+ *     Should denormalized floating point numbers be flushed to zero while
+ *     workers process the arena's tasks?
+ */
+extern NANOTHREAD_EXPORT Pool *
+pool_create_arena(uint32_t max_concurrency NANOTHREAD_DEF(NANOTHREAD_AUTO),
+                  uint32_t weight NANOTHREAD_DEF(1),
+                  int ftz NANOTHREAD_DEF(1));
+
+/**
+ * \brief Return the number of NUMA nodes of the pool
+ *
+ * This is always 1 except for pools created by \ref pool_create_numa().
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ */
+extern NANOTHREAD_EXPORT uint32_t pool_node_count(Pool *pool NANOTHREAD_DEF(0));
+
 /**
  * \brief Destroy the thread pool and discard remaining unfinished work.
  *
@@ -73,12 +346,19 @@ pool_create(uint32_t size NANOTHREAD_DEF(NANOTHREAD_AUTO),
  */
 extern NANOTHREAD_EXPORT void pool_destroy(Pool *pool NANOTHREAD_DEF(0));
 
-/// Returns the number of available CPU cores.
+/**
+ * \brief Returns the number of available CPU cores.
+ *
+ * On Linux, this accounts for the CPU affinity mask of the calling thread.
+ */
 extern NANOTHREAD_EXPORT uint32_t core_count();
 
 /**
  * \brief Return the number of threads that are part of the pool
  *
+ * For arenas (\ref pool_create_arena()), this is the maximum number of shared
+ * workers that process its tasks at the same time.
+ *
  * \param pool
  *     The thread pool to query. \c nullptr refers to the default pool.
  */
@@ -87,11 +367,186 @@ extern NANOTHREAD_EXPORT uint32_t pool_size(Pool *pool NANOTHREAD_DEF(0));
 /**
  * \brief Resize the thread pool to the given number of threads
  *
+ * This function returns without waiting for threads to start or stop: removed
+ * workers exit once they finish their current work unit, and new workers are
+ * launched in the background. It is safe to call concurrently with the
+ * submission of work or other resize operations.
+ *
+ * Passing \c NANOTHREAD_AUTO enables an automatic mode, in which the pool
+ * periodically adapts its size to the number of available cores while it
+ * processes work. On Linux, this mode additionally clamps the size to the CPU
+ * quota of the cgroup (if any) and follows changes of the quota, e.g. when a
+ * container is resized. Passing any other size ends this mode.
+ *
+ * For arenas, this function sets the maximum concurrency, which is clamped to
+ * the number of shared workers.
+ *
  * \param pool
  *     The thread pool to resize. \c nullptr refers to the default pool.
  */
 extern NANOTHREAD_EXPORT void pool_set_size(Pool *pool, uint32_t size);
 
+/**
+ * \brief Enable/disable work stealing
+ *
+ * By default, all tasks are appended to a single queue that is shared by the
+ * workers of the pool. When work stealing is enabled, tasks that are submitted
+ * by a worker of the pool (e.g. by a nested parallel loop), and tasks that
+ * become ready when their parent completes on a worker, are instead placed on
+ * a deque owned by that worker. Idle workers first process work from their own
+ * deque, then try to steal work from other workers, and finally fall back to
+ * the shared queue. This reduces contention on the shared queue when
+ * executing fine-grained task graphs.
+ *
+ * \param pool
+ *     The thread pool to configure. \c nullptr refers to the default pool.
+ *
+ * \param value
+ *     A nonzero value indicates that work stealing should be enabled.
+ */
+extern NANOTHREAD_EXPORT void pool_set_work_stealing(Pool *pool, int value);
+
+/**
+ * \brief Check whether work stealing is enabled
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ */
+extern NANOTHREAD_EXPORT int pool_work_stealing(Pool *pool NANOTHREAD_DEF(0));
+
+/**
+ * \brief Set the maximum time that idle threads spin before parking
+ *
+ * Threads without work spin for an adaptive amount of time before they are
+ * put to sleep: the spinning time grows when threads are woken up shortly
+ * after parking, and it shrinks when they sleep for long periods. This
+ * function sets an upper bound on this spinning time. Lower values reduce the
+ * CPU usage of mostly idle pools, while higher values reduce the latency of
+ * bursty workloads. The default is 50000 microseconds, which can be changed
+ * when compiling the library via \c NANOTHREAD_SPIN_BUDGET.
+ *
+ * \param pool
+ *     The thread pool to configure. \c nullptr refers to the default pool.
+ *
+ * \param microseconds
+ *     The spin budget in microseconds. A value of zero parks idle threads
+ *     right away.
+ */
+extern NANOTHREAD_EXPORT void pool_set_spin_budget(Pool *pool,
+                                                   uint32_t microseconds);
+
+/**
+ * \brief Return the maximum time that idle threads spin before parking
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ */
+extern NANOTHREAD_EXPORT uint32_t pool_spin_budget(Pool *pool NANOTHREAD_DEF(0));
+
+/**
+ * \brief Enable/disable the latency mode
+ *
+ * In latency mode, the first \c hot_workers workers of the pool never park
+ * while they are idle. Instead, they keep spinning and accept tasks of size 1
+ * submitted by threads outside of the pool (e.g. via \ref drjit::do_async()
+ * from a request handler), which are handed over directly instead of passing
+ * through the queue and the wakeup mechanism. This minimizes the delay until
+ * such a task starts, at the cost of keeping \c hot_workers cores busy.
+ *
+ * \param pool
+ *     The thread pool to configure. \c nullptr refers to the default pool.
+ *
+ * \param hot_workers
+ *     The number of spinning workers. Zero (the default) disables the
+ *     latency mode.
+ */
+extern NANOTHREAD_EXPORT void pool_set_latency_mode(Pool *pool,
+                                                    uint32_t hot_workers);
+
+/**
+ * \brief Return the number of hot workers of the latency mode
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ */
+extern NANOTHREAD_EXPORT uint32_t pool_latency_mode(Pool *pool NANOTHREAD_DEF(0));
+
+/**
+ * \brief Enable/disable the critical path mode
+ *
+ * By default, the children of a task are pushed in the order in which they
+ * were registered once the task completes, and the tasks without parents of
+ * a graph in the order in which they were added. In critical path mode, they
+ * are instead ordered by their upward rank: the estimated time from the start
+ * of a task until its last descendant completes, based on \ref
+ * TaskAttr::cost. The pool then runs the longest remaining chain of dependent
+ * tasks first, which reduces the end-to-end latency of deep graphs.
+ *
+ * The mode combines well with work stealing (\ref pool_set_work_stealing()),
+ * which it leaves unchanged: a worker whose task completes then continues
+ * with the most critical child, while other workers steal the remaining
+ * ones. The ranks of resident graphs are computed once per launch. For other
+ * tasks, they are computed when a task becomes ready and only account for
+ * descendants that were submitted at this point.
+ *
+ * \param pool
+ *     The thread pool to configure. \c nullptr refers to the default pool.
+ *
+ * \param value
+ *     A nonzero value indicates that the critical path mode should be enabled.
+ */
+extern NANOTHREAD_EXPORT void pool_set_critical_path(Pool *pool, int value);
+
+/**
+ * \brief Check whether the critical path mode is enabled
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ */
+extern NANOTHREAD_EXPORT int pool_critical_path(Pool *pool NANOTHREAD_DEF(0));
+
+/**
+ * \brief Configure how often lower-priority tasks are preferred
+ *
+ * Threads normally take work from the highest non-empty priority level.
+ * To prevent starvation, every <tt>interval</tt>-th attempt of a thread to
+ * fetch work instead visits the priority levels from lowest to highest. The
+ * default interval is 32, and a value of zero disables this aging mechanism.
+ *
+ * \param pool
+ *     The thread pool to configure. \c nullptr refers to the default pool.
+ *
+ * \param interval
+ *     The desired interval
+ */
+extern NANOTHREAD_EXPORT void pool_set_priority_aging(Pool *pool,
+                                                      uint32_t interval);
+
+/**
+ * \brief Return the interval of the priority aging mechanism
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ */
+extern NANOTHREAD_EXPORT uint32_t
+pool_priority_aging(Pool *pool NANOTHREAD_DEF(0));
+
+/**
+ * \brief Query scheduler statistics of a pool
+ *
+ * The statistics are accumulated in per-thread counters from the moment
+ * the pool was created. This is cheap enough that it is always enabled.
+ * Values are gathered without stopping the workers. They are therefore only
+ * approximately consistent with each other while the pool is busy.
+ *
+ * \param pool
+ *     The thread pool to query. \c nullptr refers to the default pool.
+ *
+ * \param stats
+ *     Output argument receiving the statistics
+ */
+extern NANOTHREAD_EXPORT void pool_stats(Pool *pool, PoolStats *stats);
+
 /**
  * \brief Enable/disable time profiling
  *
@@ -105,6 +560,104 @@ extern NANOTHREAD_EXPORT void pool_set_profile(int value);
 /// Check whether time profiling is enabled (global setting)
 extern NANOTHREAD_EXPORT int pool_profile();
 
+/**
+ * \brief Enable/disable event tracing
+ *
+ * When tracing is enabled, every thread records the execution of work units
+ * (with task and work unit index range), steals from other workers' deques,
+ * time spent asleep, and wakeups of sleeping threads into a private ring
+ * buffer that holds the most recent 65536 events. The recorded events can be
+ * exported via \ref pool_trace_dump().
+ *
+ * \param value
+ *     A nonzero value indicates that tracing should be enabled.
+ */
+extern NANOTHREAD_EXPORT void pool_set_trace(int value);
+
+/// Check whether event tracing is enabled (global setting)
+extern NANOTHREAD_EXPORT int pool_trace();
+
+/**
+ * \brief Write the recorded events to a file in the Chrome trace format
+ *
+ * The resulting JSON file can be inspected using <tt>chrome://tracing</tt>
+ * or the Perfetto UI (https://ui.perfetto.dev). Each thread is shown as a
+ * separate track. Threads should be idle while this function runs, since the
+ * ring buffers are read without synchronization.
+ *
+ * \param filename
+ *     Path of the output file
+ *
+ * \return
+ *     A nonzero value upon success.
+ */
+extern NANOTHREAD_EXPORT int pool_trace_dump(const char *filename);
+
+/// Discard all recorded trace events
+extern NANOTHREAD_EXPORT void pool_trace_clear();
+
+/**
+ * \brief Record the scheduling decisions of a pool
+ *
+ * This discards any previous recording, and numbers the tasks submitted to
+ * the pool from now on in the order of submission. Every range of work units
+ * that a thread executes is then appended to a buffer of \c capacity
+ * entries, in the order in which the ranges started. The entries can be
+ * retrieved via \ref pool_schedule_entries() and replayed via \ref
+ * pool_schedule_replay(). Trace events (see \ref pool_set_trace()) of
+ * numbered tasks also report their sequence number.
+ *
+ * While recording or replaying, workers don't execute nested submissions
+ * inline (see \ref task_submit_dep()), since doing so depends on the timing.
+ * The pool should be idle when this function is called.
+ *
+ * \param capacity
+ *     Maximum number of entries. The value zero stops the recording and
+ *     keeps the recorded entries.
+ */
+extern NANOTHREAD_EXPORT void pool_schedule_record(Pool *pool, uint32_t capacity);
+
+/**
+ * \brief Copy up to \c count recorded entries of a pool to \c entries
+ *
+ * \return
+ *     The number of ranges executed since the recording began, which
+ *     exceeds the capacity of the buffer if some entries were dropped.
+ */
+extern NANOTHREAD_EXPORT uint32_t pool_schedule_entries(Pool *pool,
+                                                        ScheduleEntry *entries,
+                                                        uint32_t count);
+
+/**
+ * \brief Replay a recorded schedule
+ *
+ * This numbers subsequently submitted tasks in the same way as \ref
+ * pool_schedule_record(). Ranges of work units of tasks that appear in the
+ * schedule are then only executed by the recorded thread, and every thread
+ * executes its ranges in the recorded order (waiting for tasks that were
+ * not submitted yet). Threads other than the workers (e.g. ones that wait
+ * for a task) share the ranges of thread 0. Tasks whose work units don't
+ * match the schedule, and targeted tasks (see \ref TaskAttr::thread), are
+ * scheduled as usual. This reproduces the placement and per-thread order of
+ * the recorded run, while its timing can still differ.
+ *
+ * The program must submit the same tasks in the same order as during the
+ * recording, from one thread or in a deterministic order, and the pool must
+ * not be resized. Otherwise, threads may wait for work that never arrives.
+ * Any schedule that keeps the recorded order while moving ranges to other
+ * threads (e.g. randomly with a fixed seed) can be replayed as well.
+ *
+ * \param entries
+ *     Schedule, e.g. produced by \ref pool_schedule_entries(). The function
+ *     copies it.
+ *
+ * \param count
+ *     Number of entries. The value zero stops the replay.
+ */
+extern NANOTHREAD_EXPORT void pool_schedule_replay(Pool *pool,
+                                                   const ScheduleEntry *entries,
+                                                   uint32_t count);
+
 /**
  * \brief Return a unique number identifying the current worker thread
  *
@@ -113,9 +666,16 @@ extern NANOTHREAD_EXPORT int pool_profile();
  * pool's total thread count.
  *
  * The IDs of separate thread pools overlap. When the current thread is not a
- * thread pool worker, the function returns zero.
+ * thread pool worker, the function returns zero. Static builds inline this
+ * function, which then reads a thread-local variable of the library.
  */
+#if defined(NANOTHREAD_STATIC)
+extern NANOTHREAD_TLS uint32_t nanothread_thread_id_tls;
+
+static inline uint32_t pool_thread_id() { return nanothread_thread_id_tls; }
+#else
 extern NANOTHREAD_EXPORT uint32_t pool_thread_id();
+#endif
 
 /** \brief Process work available within the pool until a stopping criterion is
  * satisified.
@@ -131,6 +691,30 @@ extern NANOTHREAD_EXPORT uint32_t pool_thread_id();
 extern NANOTHREAD_EXPORT void
 pool_work_until(Pool *pool, bool (*stopping_criterion)(void *), void *payload);
 
+/**
+ * \brief Return an ID that tasks can use to target the calling thread (see
+ * \ref TaskAttr::thread)
+ *
+ * When called from a worker of \c pool, this function returns the worker's ID
+ * (i.e., \ref pool_thread_id()). Other threads are registered as <em>driver
+ * threads</em> of the pool, which receive their own mailbox. Tasks that
+ * target a driver thread only run while it executes work within the pool,
+ * e.g. via \ref pool_work_until() or \ref task_wait().
+ *
+ * A thread can be a driver thread of a single pool at a time. Calling the
+ * function again returns the same ID.
+ */
+extern NANOTHREAD_EXPORT uint32_t pool_attach_thread(Pool *pool NANOTHREAD_DEF(0));
+
+/**
+ * \brief Undo \ref pool_attach_thread() for a driver thread
+ *
+ * Tasks that are still waiting in the thread's mailbox are executed first.
+ * Tasks can no longer target the thread afterwards, and its ID may be reused
+ * for another driver thread. Has no effect when called from a worker.
+ */
+extern NANOTHREAD_EXPORT void pool_detach_thread(Pool *pool NANOTHREAD_DEF(0));
+
 /*
  * \brief Submit a new task to a thread pool
  *
@@ -168,6 +752,14 @@ pool_work_until(Pool *pool, bool (*stopping_criterion)(void *), void *payload);
  *    function call.</li>
  * </ol>
  *
+ * Copies of up to \c NANOTHREAD_PAYLOAD_STORAGE bytes (256 by default) are
+ * stored within the task record. Larger ones are carved out of 64 KiB chunks
+ * of a per-pool payload arena using a bump pointer, which avoids a heap
+ * allocation per task: each chunk is rewound as a whole once the tasks using
+ * it have completed. \ref task_submit_ex() can
+ * furthermore construct the payload in place (see \ref
+ * TaskAttr::payload_init).
+ *
  * The function returns a task handle that can be used to schedule other
  * dependent tasks, and to wait for task completion if desired. This handle
  * must eventually be released using \ref task_release() or \ref
@@ -183,6 +775,13 @@ pool_work_until(Pool *pool, bool (*stopping_criterion)(void *), void *payload);
  *   <li>The \c always_async parameter is set to 0</li>
  * </ol>
  *
+ * <b>Nested parallelism</b>: Larger tasks without parents that are submitted
+ * with <tt>always_async == 0</tt> from a worker of the same pool (e.g. by a
+ * nested \ref drjit::parallel_for()) are also executed by the calling
+ * thread. Parts of the remaining work are only handed over to the pool when
+ * other threads are idle. The function then returns \c nullptr once all
+ * work has completed.
+ *
  * \remark
  *     Barriers and similar dependency relations can be encoded by via
  *     artificial tasks using <tt>size == 0</tt> and <tt>func == nullptr<tt>
@@ -224,6 +823,8 @@ pool_work_until(Pool *pool, bool (*stopping_criterion)(void *), void *payload);
  *     even in cases where the task being scheduled has no parents, and
  *     when only encodes a small amount of work (\c size == 1). Otherwise
  *     it will be executed synchronously, and the function will return \c nullptr.
+ *     The same applies to larger tasks submitted from a worker of the pool
+ *     (see the remark on nested parallelism above).
  *
  * \return
  *     A task handle that must eventually be released via \ref task_release()
@@ -243,6 +844,261 @@ Task *task_submit_dep(Pool *pool,
                       void (*payload_deleter)(void *) NANOTHREAD_DEF(0),
                       int always_async NANOTHREAD_DEF(0));
 
+/*
+ * \brief Submit a new task with a range-based callback to a thread pool
+ *
+ * This function is analogous to \ref task_submit_dep(), except that the
+ * callback \c func processes a contiguous range of work units
+ * <tt>[begin, end)</tt> per invocation. Workers fetch several adjacent work
+ * units at once when many of them remain, and the number of calls of \c func
+ * is therefore generally much smaller than \c size. The ranges passed to the
+ * callback are disjoint and cover the interval <tt>[0, size)</tt>.
+ *
+ * Refer to \ref task_submit_dep() for a description of the other
+ * parameters.
+ */
+extern NANOTHREAD_EXPORT
+Task *task_submit_range_dep(Pool *pool,
+                            const Task * const *parent,
+                            uint32_t parent_count,
+                            uint32_t size NANOTHREAD_DEF(1),
+                            void (*func)(uint32_t, uint32_t, void *) NANOTHREAD_DEF(0),
+                            void *payload NANOTHREAD_DEF(0),
+                            uint32_t payload_size NANOTHREAD_DEF(0),
+                            void (*payload_deleter)(void *) NANOTHREAD_DEF(0),
+                            int always_async NANOTHREAD_DEF(0));
+
+/*
+ * \brief Submit a new task with additional attributes to a thread pool
+ *
+ * This function generalizes \ref task_submit_dep() and \ref
+ * task_submit_range_dep(). Exactly one of the callbacks \c func and \c
+ * func_range should be specified (or neither, in the case of a task that only
+ * encodes dependencies).
+ *
+ * \param attr
+ *     Optional task attributes (see \ref TaskAttr). When equal to \c nullptr,
+ *     default values are used.
+ *
+ * Refer to \ref task_submit_dep() for a description of the other
+ * parameters.
+ */
+extern NANOTHREAD_EXPORT
+Task *task_submit_ex(Pool *pool,
+                     const Task * const *parent,
+                     uint32_t parent_count,
+                     uint32_t size,
+                     void (*func)(uint32_t, void *),
+                     void (*func_range)(uint32_t, uint32_t, void *),
+                     void *payload,
+                     uint32_t payload_size,
+                     void (*payload_deleter)(void *),
+                     int always_async,
+                     const TaskAttr *attr);
+
+/*
+ * \brief Create a task that completes when \ref task_signal() is called
+ *
+ * The task has no callback and is never executed by the pool. Instead, it
+ * completes following a call to \ref task_signal(), at which point its
+ * children are scheduled and threads waiting for it via \ref task_wait()
+ * return. This can be used to represent the completion of external events
+ * (e.g. I/O or coroutines) within a graph of tasks.
+ *
+ * \return
+ *     A task handle that must eventually be released via \ref task_release()
+ *     or \ref task_wait_and_release().
+ */
+extern NANOTHREAD_EXPORT Task *task_create_event(Pool *pool NANOTHREAD_DEF(0));
+
+/// Complete a task created via \ref task_create_event() (exactly once)
+extern NANOTHREAD_EXPORT void task_signal(Task *task);
+
+/**
+ * \brief Cancel a task
+ *
+ * Work units of the task that haven't started yet are skipped: the next
+ * thread that encounters the task in the queue retires all of its remaining
+ * work units at once. Callbacks that are already running can periodically
+ * poll \ref task_is_cancelled() to return early.
+ *
+ * Once it has completed, a cancelled task reports an exception of type \c
+ * drjit::task_cancelled (via \ref task_wait()), unless it failed with another
+ * exception. Cancellations propagate to child tasks, whose work is skipped
+ * as well (apart from tasks with the \c NANOTHREAD_TASK_ALWAYS_RUN flag,
+ * which still run and observe the exception).
+ *
+ * Cancelling a task that has already completed has no effect. The function
+ * accepts \c NULL, in which case it does nothing.
+ */
+extern NANOTHREAD_EXPORT void task_cancel(Task *task);
+
+/**
+ * \brief Check whether cancellation of a task has been requested
+ *
+ * This is a cheap check that long-running callbacks can use to stop early.
+ * When \c task is \c NULL, the function refers to the task whose callback
+ * is running on the current thread (and returns zero outside of callbacks).
+ */
+extern NANOTHREAD_EXPORT int task_is_cancelled(const Task *task NANOTHREAD_DEF(0));
+
+/**
+ * \brief Create a cancellation token
+ *
+ * Tasks are associated with the token by specifying it via \ref
+ * TaskAttr::token when submitting them (or when adding them to a task
+ * graph), and \ref cancel_token_cancel() then cancels all of them.
+ */
+extern NANOTHREAD_EXPORT CancelToken *cancel_token_create();
+
+/// Release a cancellation token (tasks hold their own references)
+extern NANOTHREAD_EXPORT void cancel_token_destroy(CancelToken *token);
+
+/// Cancel all tasks associated with a token, including ones submitted later
+extern NANOTHREAD_EXPORT void cancel_token_cancel(CancelToken *token);
+
+/// Check whether \ref cancel_token_cancel() was called
+extern NANOTHREAD_EXPORT int cancel_token_is_cancelled(const CancelToken *token);
+
+/*
+ * \brief Return the payload pointer that is passed to the callback of \c task
+ *
+ * When the payload was copied (see \ref task_submit_dep()), this refers to
+ * the task's own copy. The pointer is only meaningful while the payload still
+ * exists, i.e. before the task has completed or, for tasks submitted with the
+ * \c NANOTHREAD_TASK_KEEP_PAYLOAD flag, until the handle is released.
+ */
+extern NANOTHREAD_EXPORT void *task_payload(Task *task);
+
+/*
+ * \brief Begin building a task graph
+ *
+ * Submitting a large graph of dependent tasks via separate calls to \ref
+ * task_submit_dep() is comparably costly: every call allocates a task
+ * record, registers dependencies using atomic operations, and potentially
+ * wakes up sleeping workers. A task graph instead collects tasks added via
+ * \ref task_graph_add() without making them visible to other threads, and
+ * \ref task_graph_commit() then submits all of them at once.
+ *
+ * \param pool
+ *     The thread pool that should execute the tasks of the graph. \c
+ *     nullptr refers to the default pool.
+ *
+ * \return
+ *     A graph handle that must eventually be passed to \ref
+ *     task_graph_commit().
+ */
+extern NANOTHREAD_EXPORT TaskGraph *task_graph_begin(Pool *pool NANOTHREAD_DEF(0));
+
+/*
+ * \brief Add a task to a graph that is being built
+ *
+ * This function is analogous to \ref task_submit_ex(), except that the task
+ * is only scheduled once \ref task_graph_commit() is called. Parents can be
+ * tasks that were previously added to the same graph, or tasks that were
+ * already submitted by other means (e.g. \ref task_submit_dep() or a
+ * committed graph).
+ *
+ * The returned handle belongs to the graph: it can be used as a parent of
+ * further tasks of the graph, but becomes invalid following \ref
+ * task_graph_commit() unless it was retained via \ref task_retain() (in
+ * which case it must eventually be released as usual). It cannot be used to
+ * wait for the task before the graph is committed.
+ *
+ * Refer to \ref task_submit_dep() for a description of the other
+ * parameters. Tasks added to a graph are never executed synchronously.
+ */
+extern NANOTHREAD_EXPORT
+Task *task_graph_add(TaskGraph *graph,
+                     const Task * const *parent,
+                     uint32_t parent_count,
+                     uint32_t size,
+                     void (*func)(uint32_t, void *),
+                     void (*func_range)(uint32_t, uint32_t, void *),
+                     void *payload,
+                     uint32_t payload_size,
+                     void (*payload_deleter)(void *),
+                     const TaskAttr *attr);
+
+/*
+ * \brief Submit all tasks of a graph
+ *
+ * Tasks without unfinished parents are appended to the queue using a single
+ * atomic operation per queue, and sleeping workers are only notified once.
+ * The graph handle is freed by this function.
+ *
+ * \return
+ *     A handle of a task that completes once all tasks of the graph have
+ *     finished executing. It must eventually be released via \ref
+ *     task_release() or \ref task_wait_and_release().
+ */
+extern NANOTHREAD_EXPORT Task *task_graph_commit(TaskGraph *graph);
+
+/*
+ * \brief Submit all tasks of a graph, and keep the graph for later launches
+ *
+ * This function is analogous to \ref task_graph_commit(), except that the
+ * graph can be launched again afterwards. Its task records, payloads, and
+ * dependency structure stay resident, so that subsequent launches only need
+ * to reset some counters and append the tasks without parents to the queue.
+ * Dependencies on tasks that don't belong to the graph only apply to the
+ * first launch, and no tasks can be added after it.
+ *
+ * A launched graph must eventually be freed via \ref task_graph_destroy().
+ *
+ * When the graph is launched again (or its payloads are changed, or it is
+ * destroyed), the caller waits for the previous launch to complete. Its
+ * handle must therefore have been released at this point, which also
+ * applies to handles of the graph's tasks that were retained via \ref
+ * task_retain().
+ *
+ * \return
+ *     A handle of a task that completes once all tasks of the graph have
+ *     finished executing. It must be released via \ref task_release() or
+ *     \ref task_wait_and_release() before the graph is launched again.
+ */
+extern NANOTHREAD_EXPORT Task *task_graph_launch(TaskGraph *graph);
+
+/*
+ * \brief Change the payload of a task of a graph between launches
+ *
+ * The \c payload, \c payload_size, and \c payload_deleter parameters have
+ * the same meaning as in \ref task_submit_dep(). A previously installed
+ * payload deleter is invoked on the old payload.
+ */
+extern NANOTHREAD_EXPORT
+void task_graph_set_payload(TaskGraph *graph, Task *task, void *payload,
+                            uint32_t payload_size NANOTHREAD_DEF(0),
+                            void (*payload_deleter)(void *) NANOTHREAD_DEF(0));
+
+/*
+ * \brief Free a graph and the resources of its tasks
+ *
+ * This waits for the last launch of the graph to complete. A graph that was
+ * never launched can also be freed, unless its tasks depend on tasks
+ * outside of it.
+ */
+extern NANOTHREAD_EXPORT void task_graph_destroy(TaskGraph *graph);
+
+/*
+ * \brief Compare the duration of the last launch of a graph with the ideal
+ *
+ * The durations of tasks (from the start of their first work unit until the
+ * end of their last one) are measured when profiling is enabled (see \ref
+ * pool_set_profile()), otherwise all values are zero. The ideal makespan
+ * refers to the pool's current number of threads, including the caller.
+ * Like \ref task_graph_launch(), this waits for the previous launch to
+ * complete, and its handle must therefore have been released.
+ *
+ * \param graph
+ *     A graph that was launched via \ref task_graph_launch()
+ *
+ * \param report
+ *     Output argument receiving the durations
+ */
+extern NANOTHREAD_EXPORT void task_graph_makespan(TaskGraph *graph,
+                                                  MakespanReport *report);
+
 /*
  * \brief Release a task handle so that it can eventually be reused
  *
@@ -304,6 +1160,15 @@ extern NANOTHREAD_EXPORT void task_wait_and_release(Task *task) NANOTHREAD_THROW
  */
 extern NANOTHREAD_EXPORT float task_time(Task *task) NANOTHREAD_THROW;
 
+/**
+ * \brief Return the time consumed by the task in nanoseconds
+ *
+ * Like \ref task_time(), but with full precision. Timestamps are recorded
+ * using the CPU's time stamp counter when it runs at a constant rate, which
+ * is cheap enough to leave profiling enabled permanently.
+ */
+extern NANOTHREAD_EXPORT uint64_t task_time_ns(Task *task) NANOTHREAD_THROW;
+
 /*
  * \brief Increase the reference count of a task
  *
@@ -318,6 +1183,19 @@ extern NANOTHREAD_EXPORT float task_time(Task *task) NANOTHREAD_THROW;
  */
 extern NANOTHREAD_EXPORT void task_retain(Task *task);
 
+#if defined(NANOTHREAD_STATIC)
+/**
+ * \brief Check whether a task of size 1 without parents can be executed
+ * right away, and count it in \ref PoolStats::inline_tasks if so
+ *
+ * This is the part of the fast path of \ref task_submit_dep() for small
+ * tasks that depends on the state of the pool (the result is zero while
+ * profiling is enabled). Static builds use it to execute such tasks in the
+ * inline wrappers below, and link-time optimization can inline it as well.
+ */
+extern NANOTHREAD_EXPORT int task_try_inline(Pool *pool);
+#endif
+
 /// Convenience wrapper around task_submit_dep(), but without dependencies
 static inline
 Task *task_submit(Pool *pool,
@@ -328,6 +1206,16 @@ Task *task_submit(Pool *pool,
                   void (*payload_deleter)(void *) NANOTHREAD_DEF(0),
                   int always_async NANOTHREAD_DEF(0)) {
 
+#if defined(NANOTHREAD_STATIC)
+    if (size <= 1 && !always_async && task_try_inline(pool)) {
+        if (size == 1 && func)
+            func(0, payload);
+        if (payload_deleter)
+            payload_deleter(payload);
+        return 0;
+    }
+#endif
+
     return task_submit_dep(pool, 0, 0, size, func, payload, payload_size,
                            payload_deleter, always_async);
 }
@@ -340,15 +1228,107 @@ void task_submit_and_wait(Pool *pool,
                           void *payload NANOTHREAD_DEF(0)) {
 
     Task *task = task_submit(pool, size, func, payload, 0, 0, 0);
-    task_wait_and_release(task);
+    if (task)
+        task_wait_and_release(task);
+}
+
+/// Convenience wrapper around task_submit_range_dep(), but fully synchronous
+static inline
+void task_submit_range_and_wait(Pool *pool,
+                                uint32_t size NANOTHREAD_DEF(1),
+                                void (*func)(uint32_t, uint32_t, void *) NANOTHREAD_DEF(0),
+                                void *payload NANOTHREAD_DEF(0)) {
+
+#if defined(NANOTHREAD_STATIC)
+    if (size <= 1 && task_try_inline(pool)) {
+        if (size == 1 && func)
+            func(0, 1, payload);
+        return;
+    }
+#endif
+
+    Task *task = task_submit_range_dep(pool, 0, 0, size, func, payload, 0, 0, 0);
+    if (task)
+        task_wait_and_release(task);
 }
 
 #if defined(__cplusplus)
 }
 
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <new>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+/**
+ * Automatically sized ranges (see \ref drjit::auto_block_size) are split into
+ * this many blocks per thread, which leaves enough room for load balancing
+ */
+#define NANOTHREAD_AUTO_BLOCKS 16
+
+/**
+ * When an estimate of the cost per element is available (see \ref
+ * drjit::auto_partitioner), automatically sized blocks take at least this many
+ * nanoseconds to amortize the scheduling overheads
+ */
+#define NANOTHREAD_AUTO_MIN_BLOCK_NS 20000
 
 namespace drjit {
+    /// Exception reported by cancelled tasks, see \ref task_cancel()
+    class NANOTHREAD_EXPORT task_cancelled : public std::exception {
+    public:
+        const char *what() const noexcept override;
+    };
+
+    /// RAII wrapper around \ref cancel_token_create()
+    class cancel_token {
+    public:
+        cancel_token() : m_token(cancel_token_create()) { }
+
+        cancel_token(cancel_token &&other) noexcept : m_token(other.m_token) {
+            other.m_token = nullptr;
+        }
+
+        cancel_token &operator=(cancel_token &&other) noexcept {
+            std::swap(m_token, other.m_token);
+            return *this;
+        }
+
+        cancel_token(const cancel_token &) = delete;
+        cancel_token &operator=(const cancel_token &) = delete;
+
+        ~cancel_token() {
+            if (m_token)
+                cancel_token_destroy(m_token);
+        }
+
+        /// Cancel all associated tasks
+        void cancel() { cancel_token_cancel(m_token); }
+
+        /// Was \ref cancel() called?
+        bool cancelled() const { return cancel_token_is_cancelled(m_token) != 0; }
+
+        /// Return the underlying token, e.g. to fill \ref TaskAttr::token
+        CancelToken *get() const { return m_token; }
+
+    private:
+        CancelToken *m_token;
+    };
+
+    /**
+     * \brief Block size that requests automatic selection
+     *
+     * The block size of a \ref blocked_range created with this value is
+     * chosen based on the range size and the number of threads of the pool
+     * processing it, and optionally based on the measured cost of prior
+     * loops (see \ref auto_partitioner).
+     */
+    constexpr uint32_t auto_block_size = 0;
+
     template <typename Int> struct blocked_range {
     public:
         blocked_range(Int begin, Int end, Int block_size = 1)
@@ -368,6 +1348,8 @@ namespace drjit {
         };
 
         uint32_t blocks() const {
+            if (m_block_size == 0)
+                return resolve(nullptr).blocks();
             return (uint32_t) ((m_end - m_begin + m_block_size - 1) / m_block_size);
         }
 
@@ -375,59 +1357,317 @@ namespace drjit {
         iterator end() const { return iterator(m_end); }
         Int block_size() const { return m_block_size; }
 
+        /**
+         * \brief Return a range with a concrete block size
+         *
+         * When the block size equals \ref auto_block_size, it is chosen so
+         * that each thread of \c pool receives about \c
+         * NANOTHREAD_AUTO_BLOCKS blocks. A nonzero \c cost (the estimated
+         * time per element in nanoseconds) additionally ensures that blocks
+         * take at least \c NANOTHREAD_AUTO_MIN_BLOCK_NS nanoseconds. Other
+         * ranges are returned unchanged.
+         */
+        blocked_range resolve(Pool *pool, double cost = 0) const {
+            if (m_block_size != 0)
+                return *this;
+
+            uint64_t size = m_end > m_begin ? (uint64_t) (m_end - m_begin) : 0,
+                     threads = pool_size(pool),
+                     block = size;
+
+            if (threads > 0) {
+                uint64_t count = (threads + 1) * NANOTHREAD_AUTO_BLOCKS;
+                block = (size + count - 1) / count;
+
+                if (cost > 0) {
+                    double min_block = NANOTHREAD_AUTO_MIN_BLOCK_NS / cost;
+                    if (min_block > (double) block)
+                        block = min_block < (double) size ? (uint64_t) min_block
+                                                          : size;
+                }
+            }
+
+            return blocked_range(m_begin, m_end, (Int) (block > 0 ? block : 1));
+        }
+
     private:
         Int m_begin;
         Int m_end;
         Int m_block_size;
     };
 
+    /**
+     * \brief Records the cost of loops with automatically sized blocks
+     *
+     * Passing the same instance (e.g. a \c static variable) to repeated
+     * invocations of \ref parallel_for() at a call site measures the average
+     * time per element, which is then used to select the block size of
+     * subsequent runs (see \ref blocked_range::resolve()). For example, this
+     * avoids splitting loops with very little work per element into blocks
+     * that are dominated by the scheduling overhead.
+     */
+    class auto_partitioner {
+    public:
+        auto_partitioner() : m_cost(0) { }
+
+        /// Estimated time per element in nanoseconds (zero if unknown)
+        double cost() const { return m_cost.load(std::memory_order_relaxed); }
+
+        /// Incorporate the measured time of a loop
+        void record(uint64_t ns, uint64_t elements) {
+            if (elements == 0)
+                return;
+
+            double cost = (double) ns / (double) elements,
+                   prev = m_cost.load(std::memory_order_relaxed);
+
+            // Exponential moving average of the measurements
+            m_cost.store(prev > 0 ? (prev + cost) * .5 : cost,
+                         std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<double> m_cost;
+    };
+
+    /**
+     * \brief Hands the blocks of repeated loops to the threads that
+     * processed them in the previous run
+     *
+     * Passing the same instance (e.g. a \c static variable) to repeated
+     * invocations of \ref parallel_for() over a range with the same number
+     * of blocks records which thread executed each block. In the next run,
+     * every thread first processes the blocks that it executed before, so
+     * that their data is likely still warm in its caches, and only then takes
+     * over remaining blocks of other threads. The first run distributes
+     * contiguous groups of blocks over the threads.
+     *
+     * An instance must not be used by several loops at the same time.
+     */
+    class affinity_partitioner {
+    public:
+        affinity_partitioner() : m_groups(0), m_hits(0) { }
+
+        /**
+         * \brief Number of blocks of the last loop that were executed by the
+         * same thread as in the run before
+         */
+        uint32_t hits() const { return m_hits.load(std::memory_order_relaxed); }
+
+        /// Assign \c blocks blocks to \c groups threads (IDs 0 to \c groups - 1)
+        void prepare(uint32_t blocks, uint32_t groups) {
+            if (m_owner.size() != blocks) {
+                m_owner.resize(blocks);
+                for (uint32_t i = 0; i < blocks; ++i)
+                    m_owner[i] = (uint32_t) ((uint64_t) i * groups / blocks);
+            }
+
+            if (m_groups != groups) {
+                m_cursor.reset(new Cursor[groups]);
+                m_groups = groups;
+            }
+
+            // Sort the blocks by their previous thread (counting sort)
+            for (uint32_t g = 0; g < groups; ++g)
+                m_cursor[g].end = 0;
+            for (uint32_t &owner : m_owner) {
+                owner %= groups;
+                m_cursor[owner].end++;
+            }
+
+            // Turn the counts into ranges of 'm_order', then insert the blocks
+            uint32_t offset = 0;
+            for (uint32_t g = 0; g < groups; ++g) {
+                uint32_t count = m_cursor[g].end;
+                m_cursor[g].next.store(offset, std::memory_order_relaxed);
+                m_cursor[g].end = offset;
+                offset += count;
+            }
+
+            m_order.resize(blocks);
+            for (uint32_t i = 0; i < blocks; ++i)
+                m_order[m_cursor[m_owner[i]].end++] = i;
+
+            m_hits.store(0, std::memory_order_relaxed);
+        }
+
+        /**
+         * \brief Claim a block for the thread with the given ID
+         *
+         * Returns a block of the thread, or of the next thread that has some
+         * left. Exactly \c blocks calls succeed following \ref prepare().
+         */
+        uint32_t claim(uint32_t thread) {
+            uint32_t g = thread < m_groups ? thread : 0;
+
+            for (uint32_t i = 0; i < m_groups; ++i) {
+                Cursor &c = m_cursor[g];
+                if (c.next.load(std::memory_order_relaxed) < c.end) {
+                    uint32_t k = c.next.fetch_add(1, std::memory_order_relaxed);
+                    if (k < c.end)
+                        return m_order[k];
+                }
+                g = g + 1 < m_groups ? g + 1 : 0;
+            }
+
+            return (uint32_t) -1;
+        }
+
+        /// Record that the thread with the given ID executed a block
+        void record(uint32_t block, uint32_t thread) {
+            uint32_t g = thread < m_groups ? thread : 0;
+            if (m_owner[block] == g)
+                m_hits.fetch_add(1, std::memory_order_relaxed);
+            m_owner[block] = g;
+        }
+
+    private:
+        /// Unclaimed blocks <tt>m_order[next..end)</tt> of a thread
+        struct Cursor {
+            std::atomic<uint32_t> next;
+            uint32_t end;
+            uint8_t padding[64 - 2 * sizeof(uint32_t)];
+        };
+
+        /// Thread that executed each block in the last run
+        std::vector<uint32_t> m_owner;
+
+        /// Block indices, grouped by their thread
+        std::vector<uint32_t> m_order;
+
+        std::unique_ptr<Cursor[]> m_cursor;
+        uint32_t m_groups;
+        std::atomic<uint32_t> m_hits;
+    };
+
     template <typename Int, typename Func>
-    void parallel_for(const blocked_range<Int> &range, Func &&func,
+    void parallel_for(const blocked_range<Int> &range_, Func &&func,
                       Pool *pool = nullptr) {
+        blocked_range<Int> range = range_.resolve(pool);
 
         struct Payload {
-            Func *f;
+            typename std::remove_reference<Func>::type *f;
             Int begin, end, block_size;
         };
 
         Payload payload{ &func, range.begin(), range.end(),
                          range.block_size() };
 
-        auto callback = [](uint32_t index, void *payload) {
+        auto callback = [](uint32_t index_begin, uint32_t index_end,
+                           void *payload) {
             Payload *p = (Payload *) payload;
-            Int begin = p->begin + p->block_size * (Int) index,
-                end = begin + p->block_size;
 
-            if (end > p->end)
-                end = p->end;
+            for (uint32_t index = index_begin; index != index_end; ++index) {
+                Int begin = p->begin + p->block_size * (Int) index,
+                    end = begin + p->block_size;
 
-            (*p->f)(blocked_range<Int>(begin, end));
+                if (end > p->end)
+                    end = p->end;
+
+                (*p->f)(blocked_range<Int>(begin, end));
+            }
         };
 
-        task_submit_and_wait(pool, range.blocks(), callback, &payload);
+        task_submit_range_and_wait(pool, range.blocks(), callback, &payload);
     }
 
+    /**
+     * \brief Variant of \ref parallel_for() that measures the cost of the
+     * loop body to choose automatic block sizes, see \ref auto_partitioner
+     */
     template <typename Int, typename Func>
-    Task *parallel_for_async(const blocked_range<Int> &range, Func &&func,
+    void parallel_for(const blocked_range<Int> &range, Func &&func,
+                      auto_partitioner &partitioner, Pool *pool = nullptr) {
+        using clock = std::chrono::steady_clock;
+        std::atomic<uint64_t> ns(0);
+
+        auto timed = [&](blocked_range<Int> block) {
+            clock::time_point start = clock::now();
+            func(block);
+            ns.fetch_add((uint64_t) std::chrono::duration_cast<
+                             std::chrono::nanoseconds>(clock::now() - start)
+                             .count(),
+                         std::memory_order_relaxed);
+        };
+
+        parallel_for(range.resolve(pool, partitioner.cost()), timed, pool);
+
+        Int begin = range.begin(), end = range.end();
+        partitioner.record(ns.load(), end > begin ? (uint64_t) (end - begin) : 0);
+    }
+
+    /**
+     * \brief Variant of \ref parallel_for() that hands each block to the
+     * thread that executed it in the previous run, see \ref
+     * affinity_partitioner
+     */
+    template <typename Int, typename Func>
+    void parallel_for(const blocked_range<Int> &range_, Func &&func,
+                      affinity_partitioner &partitioner, Pool *pool = nullptr) {
+        blocked_range<Int> range = range_.resolve(pool);
+        uint32_t blocks = range.blocks();
+
+        // Groups for the workers and the calling thread (ID 0)
+        partitioner.prepare(blocks, pool_size(pool) + 1);
+
+        struct Payload {
+            typename std::remove_reference<Func>::type *f;
+            affinity_partitioner *partitioner;
+            Int begin, end, block_size;
+        };
+
+        Payload payload{ &func, &partitioner, range.begin(), range.end(),
+                         range.block_size() };
+
+        auto callback = [](uint32_t index_begin, uint32_t index_end,
+                           void *payload) {
+            Payload *p = (Payload *) payload;
+            uint32_t thread = pool_thread_id();
+
+            // Work units only determine the number of blocks to process
+            for (uint32_t i = index_begin; i != index_end; ++i) {
+                uint32_t index = p->partitioner->claim(thread);
+
+                Int begin = p->begin + p->block_size * (Int) index,
+                    end = begin + p->block_size;
+
+                if (end > p->end)
+                    end = p->end;
+
+                (*p->f)(blocked_range<Int>(begin, end));
+                p->partitioner->record(index, thread);
+            }
+        };
+
+        task_submit_range_and_wait(pool, blocks, callback, &payload);
+    }
+
+    template <typename Int, typename Func>
+    Task *parallel_for_async(const blocked_range<Int> &range_, Func &&func,
                              const Task * const *parents,
                              size_t parent_count,
                              Pool *pool = nullptr) {
         using BaseFunc = typename std::decay<Func>::type;
+        blocked_range<Int> range = range_.resolve(pool);
 
         struct Payload {
             BaseFunc f;
             Int begin, end, block_size;
         };
 
-        auto callback = [](uint32_t index, void *payload) {
+        auto callback = [](uint32_t index_begin, uint32_t index_end,
+                           void *payload) {
             Payload *p = (Payload *) payload;
-            Int begin = p->begin + p->block_size * (Int) index,
-                end = begin + p->block_size;
 
-            if (end > p->end)
-                end = p->end;
+            for (uint32_t index = index_begin; index != index_end; ++index) {
+                Int begin = p->begin + p->block_size * (Int) index,
+                    end = begin + p->block_size;
+
+                if (end > p->end)
+                    end = p->end;
 
-            p->f(blocked_range<Int>(begin, end));
+                p->f(blocked_range<Int>(begin, end));
+            }
         };
 
         if (std::is_trivially_copyable<BaseFunc>::value &&
@@ -435,9 +1675,35 @@ namespace drjit {
             Payload payload{ std::forward<Func>(func), range.begin(),
                              range.end(), range.block_size() };
 
-            return task_submit_dep(pool, parents,
-                                   (uint32_t) parent_count, range.blocks(),
-                                   callback, &payload, sizeof(Payload), nullptr, 1);
+            return task_submit_range_dep(pool, parents,
+                                         (uint32_t) parent_count, range.blocks(),
+                                         callback, &payload, sizeof(Payload),
+                                         nullptr, 1);
+        } else if (alignof(Payload) <= 16) {
+            // Move the function directly into storage owned by the task
+            struct Source {
+                typename std::remove_reference<Func>::type *f;
+                Int begin, end, block_size;
+            };
+
+            Source source{ &func, range.begin(), range.end(),
+                           range.block_size() };
+
+            TaskAttr attr;
+            task_attr_init(&attr);
+            attr.payload_init = [](void *storage, void *ptr) {
+                Source *s = (Source *) ptr;
+                new (storage) Payload{ std::forward<Func>(*s->f), s->begin,
+                                       s->end, s->block_size };
+            };
+
+            auto deleter = [](void *payload) {
+                ((Payload *) payload)->~Payload();
+            };
+
+            return task_submit_ex(pool, parents, (uint32_t) parent_count,
+                                  range.blocks(), nullptr, callback, &source,
+                                  sizeof(Payload), deleter, 1, &attr);
         } else {
             Payload *payload = new Payload{ std::forward<Func>(func), range.begin(),
                                             range.end(), range.block_size() };
@@ -446,9 +1712,9 @@ namespace drjit {
                 delete (Payload *) payload;
             };
 
-            return task_submit_dep(pool, parents,
-                                   (uint32_t) parent_count, range.blocks(),
-                                   callback, payload, 0, deleter, 1);
+            return task_submit_range_dep(pool, parents,
+                                         (uint32_t) parent_count, range.blocks(),
+                                         callback, payload, 0, deleter, 1);
         }
     }
 
@@ -456,8 +1722,8 @@ namespace drjit {
     Task *parallel_for_async(const blocked_range<Int> &range, Func &&func,
                              std::initializer_list<const Task *> parents = { },
                              Pool *pool = nullptr) {
-        return parallel_for_async(range, func, parents.begin(), parents.size(),
-                                  pool);
+        return parallel_for_async(range, std::forward<Func>(func), parents.begin(),
+                                  parents.size(), pool);
     }
 
     template <typename Func>
@@ -475,11 +1741,27 @@ namespace drjit {
 
         if (std::is_trivially_copyable<BaseFunc>::value &&
             std::is_trivially_destructible<BaseFunc>::value) {
-            Payload payload {std::forward<Func>(func) };
+            Payload payload{ std::forward<Func>(func) };
 
             return task_submit_dep(pool, parents,
                                    (uint32_t) parent_count, 1, callback,
                                    &payload, sizeof(Payload), nullptr, 1);
+        } else if (alignof(Payload) <= 16) {
+            // Move the function directly into storage owned by the task
+            TaskAttr attr;
+            task_attr_init(&attr);
+            attr.payload_init = [](void *storage, void *func) {
+                new (storage) Payload{ std::forward<Func>(
+                    *(typename std::remove_reference<Func>::type *) func) };
+            };
+
+            auto deleter = [](void *payload) {
+                ((Payload *) payload)->~Payload();
+            };
+
+            return task_submit_ex(pool, parents, (uint32_t) parent_count, 1,
+                                  callback, nullptr, (void *) &func,
+                                  sizeof(Payload), deleter, 1, &attr);
         } else {
             Payload *payload = new Payload{ std::forward<Func>(func) };
 
@@ -494,7 +1776,309 @@ namespace drjit {
     template <typename Func>
     Task *do_async(Func &&func, std::initializer_list<const Task *> parents = {},
                    Pool *pool = nullptr) {
-        return do_async(func, parents.begin(), parents.size(), pool);
+        return do_async(std::forward<Func>(func), parents.begin(),
+                        parents.size(), pool);
+    }
+
+    template <typename T> class future;
+
+    namespace detail {
+        /// Storage for the result of an asynchronous function, see \ref future
+        template <typename T> struct future_storage {
+            /// Can the storage be discarded without destroying its contents?
+            static constexpr bool trivial = std::is_trivially_destructible<T>::value;
+
+            alignas(T) unsigned char value[sizeof(T)];
+            bool constructed;
+
+            future_storage() : constructed(false) { }
+
+            template <typename Func> void run(Func &func) {
+                new (value) T(func());
+                constructed = true;
+            }
+
+            T take() {
+                T result(std::move(*(T *) value));
+                destroy();
+                return result;
+            }
+
+            void destroy() {
+                if (constructed) {
+                    ((T *) value)->~T();
+                    constructed = false;
+                }
+            }
+
+            /// Pass the result to \c func, see \ref future::then()
+            template <typename Func>
+            auto apply(Func &func) -> decltype(func(std::declval<T>())) {
+                return func(take());
+            }
+        };
+
+        template <> struct future_storage<void> {
+            static constexpr bool trivial = true;
+
+            template <typename Func> void run(Func &func) { func(); }
+            void take() { }
+            void destroy() { }
+
+            template <typename Func>
+            auto apply(Func &func) -> decltype(func()) { return func(); }
+        };
+
+        template <typename Func> using async_result =
+            decltype(std::declval<typename std::decay<Func>::type &>()());
+
+        template <typename T, typename Func> using then_result =
+            decltype(std::declval<future_storage<T> &>().apply(
+                std::declval<typename std::decay<Func>::type &>()));
+
+        /// Releases a task handle when going out of scope
+        struct task_guard {
+            Task *task;
+            ~task_guard() { task_release(task); }
+        };
+
+        /// Callable that runs the continuation \c func of \c parent
+        template <typename T, typename Func> struct continuation {
+            Task *parent;
+            future_storage<T> *storage;
+            Func func;
+
+            then_result<T, Func> operator()() {
+                task_guard guard{ parent };
+
+                // Rethrow the failure of the parent (already propagated)
+                task_wait(parent);
+
+                return storage->apply(func);
+            }
+        };
+
+        template <typename Func>
+        future<async_result<Func>> submit_async(Func &&func,
+                                                const Task * const *parents,
+                                                size_t parent_count,
+                                                Pool *pool, uint32_t flags,
+                                                uint32_t thread) {
+            using BaseFunc = typename std::decay<Func>::type;
+            using Result = async_result<Func>;
+
+            struct Payload {
+                // The result is constructed here once the function has run
+                future_storage<Result> result;
+                BaseFunc f;
+
+                Payload(Func &&func) : f(std::forward<Func>(func)) { }
+            };
+
+            auto callback = [](uint32_t /* unused */, void *payload) {
+                Payload *p = (Payload *) payload;
+                p->result.run(p->f);
+            };
+
+            TaskAttr attr;
+            task_attr_init(&attr);
+            attr.flags = flags | NANOTHREAD_TASK_KEEP_PAYLOAD;
+            attr.thread = thread;
+
+            /* Results that must be destroyed need a deleter, which rules out
+               copying the payload into the task */
+            if (std::is_trivially_copyable<BaseFunc>::value &&
+                std::is_trivially_destructible<BaseFunc>::value &&
+                future_storage<Result>::trivial && alignof(Payload) <= 8) {
+                Payload payload(std::forward<Func>(func));
+
+                // Copied into the task record, the result lives there as well
+                Task *task = task_submit_ex(pool, parents, (uint32_t) parent_count,
+                                            1, callback, nullptr, &payload,
+                                            sizeof(Payload), nullptr, 1, &attr);
+
+                return future<Result>(
+                    task, &((Payload *) task_payload(task))->result);
+            } else if (alignof(Payload) <= 16) {
+                // Move the function directly into storage owned by the task
+                attr.payload_init = [](void *storage, void *func) {
+                    new (storage) Payload(std::forward<Func>(
+                        *(typename std::remove_reference<Func>::type *) func));
+                };
+
+                auto deleter = [](void *payload) {
+                    ((Payload *) payload)->result.destroy();
+                    ((Payload *) payload)->~Payload();
+                };
+
+                Task *task = task_submit_ex(pool, parents, (uint32_t) parent_count,
+                                            1, callback, nullptr, (void *) &func,
+                                            sizeof(Payload), deleter, 1, &attr);
+
+                return future<Result>(
+                    task, &((Payload *) task_payload(task))->result);
+            } else {
+                Payload *payload = new Payload(std::forward<Func>(func));
+
+                auto deleter = [](void *payload) {
+                    ((Payload *) payload)->result.destroy();
+                    delete (Payload *) payload;
+                };
+
+                Task *task = task_submit_ex(pool, parents, (uint32_t) parent_count,
+                                            1, callback, nullptr, payload, 0,
+                                            deleter, 1, &attr);
+
+                return future<Result>(task, &payload->result);
+            }
+        }
+    }
+
+    /**
+     * \brief Handle to the result of an asynchronous function
+     *
+     * Returned by \ref do_async_future(). The result is stored in place
+     * within the payload of the associated task when possible, and \ref get()
+     * retrieves it (by moving) once the task has completed. The function's
+     * exceptions are rethrown by \ref get().
+     *
+     * Futures are move-only and own a handle of their task. Destroying a
+     * future (or converting an rvalue future into a plain task handle, which
+     * must eventually be released via \ref task_release()) doesn't wait for
+     * the task: a result that was never retrieved is destroyed along with the
+     * payload when the task record is recycled, i.e., some time after the
+     * task has completed and its last handle was released.
+     */
+    template <typename T> class future {
+        template <typename Func> friend future<detail::async_result<Func>>
+        detail::submit_async(Func &&, const Task * const *, size_t, Pool *,
+                             uint32_t, uint32_t);
+
+    public:
+        future() : m_task(nullptr), m_storage(nullptr) { }
+
+        future(future &&other) noexcept
+            : m_task(other.m_task), m_storage(other.m_storage) {
+            other.m_task = nullptr;
+            other.m_storage = nullptr;
+        }
+
+        future &operator=(future &&other) noexcept {
+            if (this != &other) {
+                reset();
+                m_task = other.m_task;
+                m_storage = other.m_storage;
+                other.m_task = nullptr;
+                other.m_storage = nullptr;
+            }
+            return *this;
+        }
+
+        future(const future &) = delete;
+        future &operator=(const future &) = delete;
+
+        ~future() { reset(); }
+
+        /// Does the future refer to a task?
+        bool valid() const { return m_task != nullptr; }
+
+        /// Return the associated task handle (still owned by the future)
+        Task *task() const { return m_task; }
+
+        /// Wait for the task and rethrow its exception (if any)
+        void wait() const { task_wait(m_task); }
+
+        /**
+         * \brief Wait for the task and return its result
+         *
+         * Executes other work units in the meantime (see \ref task_wait()).
+         * The future is no longer valid afterwards.
+         */
+        T get() {
+            detail::task_guard guard{ m_task };
+            detail::future_storage<T> *storage = m_storage;
+            m_task = nullptr;
+            m_storage = nullptr;
+
+            task_wait(guard.task);
+            return storage->take();
+        }
+
+        /**
+         * \brief Schedule \c func to run once the result is available
+         *
+         * The continuation receives the result by value (or no argument for
+         * <tt>future<void></tt>), and its own result is accessible via the
+         * returned future. No thread blocks in the meantime, as the
+         * continuation is registered as a child of this future's task. When
+         * the task fails, \c func isn't invoked and the exception propagates
+         * to the returned future. This future is no longer valid afterwards.
+         *
+         * The continuation runs on the thread with ID \c thread if specified
+         * (see \ref pool_attach_thread()), and on any thread otherwise.
+         */
+        template <typename Func>
+        future<detail::then_result<T, Func>>
+        then(Func &&func, Pool *pool = nullptr,
+             uint32_t thread = NANOTHREAD_AUTO) {
+            using BaseFunc = typename std::decay<Func>::type;
+
+            const Task *parent = m_task;
+            detail::continuation<T, BaseFunc> cont{ m_task, m_storage,
+                                                    std::forward<Func>(func) };
+            m_task = nullptr;
+            m_storage = nullptr;
+
+            // Invoked on failure as well, to release the parent
+            return detail::submit_async(std::move(cont), &parent, 1, pool,
+                                        NANOTHREAD_TASK_ALWAYS_RUN, thread);
+        }
+
+        /// Convert into a plain task handle, discarding the result
+        operator Task *() && {
+            Task *task = m_task;
+            m_task = nullptr;
+            m_storage = nullptr;
+            return task;
+        }
+
+    private:
+        future(Task *task, detail::future_storage<T> *storage)
+            : m_task(task), m_storage(storage) { }
+
+        void reset() {
+            task_release(m_task);
+            m_task = nullptr;
+            m_storage = nullptr;
+        }
+
+        Task *m_task;
+        detail::future_storage<T> *m_storage;
+    };
+
+    /**
+     * \brief Run \c func asynchronously and return a future of its result
+     *
+     * Like \ref do_async(), but the result of \c func (of type \c T) is
+     * stored within the payload of the task, and can be retrieved via the
+     * returned \ref future. Continuations are scheduled via \ref
+     * future::then().
+     */
+    template <typename Func>
+    future<detail::async_result<Func>>
+    do_async_future(Func &&func, const Task * const *parents,
+                    size_t parent_count, Pool *pool = nullptr) {
+        return detail::submit_async(std::forward<Func>(func), parents,
+                                    parent_count, pool, 0, NANOTHREAD_AUTO);
+    }
+
+    template <typename Func>
+    future<detail::async_result<Func>>
+    do_async_future(Func &&func,
+                    std::initializer_list<const Task *> parents = {},
+                    Pool *pool = nullptr) {
+        return do_async_future(std::forward<Func>(func), parents.begin(),
+                               parents.size(), pool);
     }
 }
 #endif
@@ -0,0 +1,387 @@
+/*
+    nanothread/pipeline.h -- Streaming pipelines with a bounded number of
+    items in flight
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#pragma once
+
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace drjit {
+    /// Execution mode of a pipeline stage, see \ref pipeline::stage()
+    enum class stage_mode {
+        /// Several items may be processed concurrently, in any order
+        parallel,
+
+        /// One item at a time, in the order produced by the input stage
+        serial_in_order,
+
+        /// One item at a time, in any order
+        serial_out_of_order
+    };
+
+    /**
+     * \brief Pipeline of stages that process a stream of items
+     *
+     * An input stage produces items one at a time, which then traverse the
+     * remaining stages in the order that they were added. Stages are either
+     * parallel or serial (see \ref stage_mode), and subsequent items can
+     * occupy different stages at the same time.
+     *
+     * At most \c max_tokens items are in flight at once. Each is stored in one
+     * of \c max_tokens instances of \c T that the pipeline allocates once and
+     * reuses for later items, hence the memory usage doesn't depend on the
+     * length of the stream. A stage function receives the item by reference
+     * and modifies it in place.
+     *
+     * After finishing a stage, a thread directly continues with the next
+     * stage of the same item. Tasks are only submitted to hand an item over
+     * to another thread: this happens when a serial stage becomes available
+     * for an item that was waiting for it, and to continue reading the input
+     * while the current thread processes the item that was just read.
+     *
+     * \code
+     * struct Frame { std::string path; Image image; };
+     *
+     * drjit::pipeline<Frame> p(16, pool);
+     * p.input([&](Frame &f) { return next_path(f.path); })
+     *  .stage(drjit::stage_mode::parallel,
+     *         [](Frame &f) { f.image = decode(f.path); })
+     *  .stage(drjit::stage_mode::serial_in_order,
+     *         [&](Frame &f) { write(f.image); });
+     * p.run();
+     * \endcode
+     */
+    template <typename T> class pipeline {
+    public:
+        explicit pipeline(uint32_t max_tokens, Pool *pool = nullptr)
+            : m_max_tokens(max_tokens > 0 ? max_tokens : 1), m_pool(pool) { }
+
+        pipeline(const pipeline &) = delete;
+        pipeline &operator=(const pipeline &) = delete;
+
+        /**
+         * \brief Specify the input stage
+         *
+         * The function <tt>bool(T &item)</tt> is invoked serially. It should
+         * fill in the next item and return \c true, or return \c false when
+         * the stream has ended.
+         */
+        template <typename Func> pipeline &input(Func &&func) {
+            m_input = std::forward<Func>(func);
+            return *this;
+        }
+
+        /// Append a stage <tt>void(T &item)</tt>
+        template <typename Func>
+        pipeline &stage(stage_mode mode, Func &&func) {
+            m_stages.emplace_back(new Stage(mode, std::forward<Func>(func),
+                                            m_max_tokens));
+            return *this;
+        }
+
+        /**
+         * \brief Process the stream and wait until all items have traversed
+         * the pipeline
+         *
+         * The calling thread helps with the work in the meantime. When a stage
+         * throws an exception, the input stage isn't invoked anymore, items
+         * that are in flight skip the remaining stages, and the exception is
+         * rethrown here.
+         */
+        void run() {
+            if (!m_input) {
+                fprintf(stderr, "nanothread: pipeline::run(): the input "
+                                "stage was not specified!\n");
+                abort();
+            }
+
+            if (!m_tokens)
+                m_tokens.reset(new Token[m_max_tokens]);
+
+            m_free.clear();
+            for (uint32_t i = 0; i < m_max_tokens; ++i)
+                m_free.push_back(&m_tokens[i]);
+
+            for (std::unique_ptr<Stage> &s : m_stages)
+                s->next = 0;
+
+            m_seq = 0;
+            m_input_busy = true;
+            m_finished = m_failed = false;
+            m_exception = nullptr;
+            m_done = task_create_event(m_pool);
+
+            Token *token = m_free.back();
+            m_free.pop_back();
+            resume(token, read_index, false);
+
+            task_wait_and_release(m_done);
+
+            if (m_exception)
+                std::rethrow_exception(m_exception);
+        }
+
+    private:
+        struct Token {
+            T value;
+            uint64_t seq = 0;
+        };
+
+        struct Stage {
+            stage_mode mode;
+            std::function<void(T &)> func;
+
+            std::mutex mutex;
+            bool busy = false;
+
+            /// Sequence number of the next item (serial_in_order)
+            uint64_t next = 0;
+
+            /**
+             * Items waiting to enter the stage. Serial in-order stages index
+             * them by sequence number modulo \c max_tokens.
+             */
+            std::vector<Token *> waiting;
+
+            template <typename Func>
+            Stage(stage_mode mode, Func &&func, uint32_t max_tokens)
+                : mode(mode), func(std::forward<Func>(func)) {
+                if (mode == stage_mode::serial_in_order)
+                    waiting.resize(max_tokens, nullptr);
+                else if (mode == stage_mode::serial_out_of_order)
+                    waiting.reserve(max_tokens);
+            }
+        };
+
+        /// Index passed to \ref resume() to invoke the input stage
+        static constexpr size_t read_index = (size_t) -1;
+
+        /// Continue the processing of an item on another thread
+        void submit(Token *token, size_t index, bool entered) {
+            struct Payload {
+                pipeline *p;
+                Token *token;
+                size_t index;
+                bool entered;
+            };
+
+            Payload payload{ this, token, index, entered };
+
+            auto callback = [](uint32_t, void *ptr) {
+                Payload *p = (Payload *) ptr;
+                p->p->resume(p->token, p->index, p->entered);
+            };
+
+            task_release(task_submit_dep(m_pool, nullptr, 0, 1, callback,
+                                         &payload, sizeof(Payload), nullptr,
+                                         1));
+        }
+
+        void fail() {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (!m_exception)
+                m_exception = std::current_exception();
+            m_failed = true;
+        }
+
+        /**
+         * \brief Process items using \c token, starting at the given stage
+         *
+         * Once an item has traversed all stages, the token is used to read
+         * the next one if the input stage is idle. Otherwise, it is returned
+         * to the free list.
+         */
+        void resume(Token *token, size_t index, bool entered) {
+            while (true) {
+                if (index == read_index) {
+                    if (!read(token))
+                        return;
+                    index = 0;
+                }
+
+                if (!process(token, index, entered))
+                    return;
+
+                Task *done = nullptr;
+                bool read_next = false;
+                {
+                    std::lock_guard<std::mutex> guard(m_mutex);
+                    if (m_finished || m_input_busy) {
+                        done = release(token);
+                    } else {
+                        m_input_busy = true;
+                        read_next = true;
+                    }
+                }
+
+                if (!read_next) {
+                    if (done)
+                        task_signal(done);
+                    return;
+                }
+
+                index = read_index;
+                entered = false;
+            }
+        }
+
+        /// Invoke the input stage, returns \c false when the stream ended
+        bool read(Token *token) {
+            bool more = false;
+            if (!m_failed) {
+                try {
+                    more = m_input(token->value);
+                } catch (...) {
+                    fail();
+                }
+            }
+
+            Token *next = nullptr;
+            Task *done = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(m_mutex);
+                if (more) {
+                    token->seq = m_seq++;
+                    if (!m_free.empty()) {
+                        next = m_free.back();
+                        m_free.pop_back();
+                    } else {
+                        m_input_busy = false;
+                    }
+                } else {
+                    m_finished = true;
+                    m_input_busy = false;
+                    done = release(token);
+                }
+            }
+
+            if (!more) {
+                if (done)
+                    task_signal(done);
+                return false;
+            }
+
+            // Process the item here, and keep reading on another thread
+            if (next)
+                submit(next, read_index, false);
+
+            return true;
+        }
+
+        /**
+         * \brief Let the item of \c token traverse the stages starting at
+         * \c index. Returns \c false if it was parked at a serial stage.
+         */
+        bool process(Token *token, size_t index, bool entered) {
+            for (; index < m_stages.size(); ++index) {
+                Stage &s = *m_stages[index];
+                bool serial = s.mode != stage_mode::parallel;
+
+                if (serial && !entered && !enter(s, token))
+                    return false;
+
+                entered = false;
+
+                if (!m_failed) {
+                    try {
+                        s.func(token->value);
+                    } catch (...) {
+                        fail();
+                    }
+                }
+
+                if (serial)
+                    leave(s, index);
+            }
+
+            return true;
+        }
+
+        /// Try to enter a serial stage, or park the item until it is its turn
+        bool enter(Stage &s, Token *token) {
+            std::lock_guard<std::mutex> guard(s.mutex);
+            if (s.mode == stage_mode::serial_in_order) {
+                if (!s.busy && token->seq == s.next) {
+                    s.busy = true;
+                    return true;
+                }
+                s.waiting[token->seq % m_max_tokens] = token;
+            } else {
+                if (!s.busy) {
+                    s.busy = true;
+                    return true;
+                }
+                s.waiting.push_back(token);
+            }
+            return false;
+        }
+
+        /// Leave a serial stage and hand it over to a parked item
+        void leave(Stage &s, size_t index) {
+            Token *next = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(s.mutex);
+                if (s.mode == stage_mode::serial_in_order) {
+                    s.next++;
+                    Token *&slot = s.waiting[s.next % m_max_tokens];
+                    if (slot && slot->seq == s.next) {
+                        next = slot;
+                        slot = nullptr;
+                    }
+                } else if (!s.waiting.empty()) {
+                    next = s.waiting.back();
+                    s.waiting.pop_back();
+                }
+
+                // The stage remains occupied by the handed-over item
+                s.busy = next != nullptr;
+            }
+
+            if (next)
+                submit(next, index, true);
+        }
+
+        /**
+         * \brief Return a token to the free list (\c m_mutex must be held)
+         *
+         * Once the stream ended and all tokens are free, this function returns
+         * the event that \ref run() waits for. The caller must signal it after
+         * releasing the lock, and must not access the pipeline afterwards.
+         */
+        Task *release(Token *token) {
+            m_free.push_back(token);
+            if (m_finished && !m_input_busy && m_free.size() == m_max_tokens)
+                return m_done;
+            return nullptr;
+        }
+
+        uint32_t m_max_tokens;
+        Pool *m_pool;
+        std::function<bool(T &)> m_input;
+        std::vector<std::unique_ptr<Stage>> m_stages;
+        std::unique_ptr<Token[]> m_tokens;
+
+        /// Protects the fields below
+        std::mutex m_mutex;
+        std::vector<Token *> m_free;
+        uint64_t m_seq = 0;
+        bool m_input_busy = false, m_finished = false;
+        std::atomic<bool> m_failed{false};
+        std::exception_ptr m_exception;
+        Task *m_done = nullptr;
+    };
+}
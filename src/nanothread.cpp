@@ -9,12 +9,19 @@
 
 #include <nanothread/nanothread.h>
 #include "queue.h"
+#include "trace.h"
+#include "timer.h"
 #include <thread>
 #include <memory>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <type_traits>
+#include <unordered_map>
 
 #if defined(__linux__)
 #  include <unistd.h>
+#  include <pthread.h>
 #elif defined(_WIN32)
 #  include <windows.h>
 #  include <processthreadsapi.h>
@@ -27,34 +34,118 @@
 #endif
 
 struct Worker;
+struct ArenaGroup;
 
-/// TLS variable storing an ID of each thread
+/// TLS variable storing an ID of each thread (read by the header in static builds)
+#if defined(NANOTHREAD_STATIC)
+    NANOTHREAD_TLS uint32_t nanothread_thread_id_tls = 0;
+#else
+    static NANOTHREAD_TLS uint32_t nanothread_thread_id_tls = 0;
+#endif
+
+/// TLS variable storing the task whose callback is running on each thread
 #if defined(_MSC_VER)
-    static __declspec(thread) uint32_t thread_id_tls = 0;
+    static __declspec(thread) Task *current_task_tls = nullptr;
 #else
-    static __thread uint32_t thread_id_tls = 0;
+    static __thread Task *current_task_tls = nullptr;
 #endif
 
+/// Number of task records that each worker of a NUMA-aware pool creates
+#define NANOTHREAD_NUMA_RESERVE 32
+
+/// Number of ranges that a shared worker processes before choosing an arena again
+#define NANOTHREAD_ARENA_QUANTUM 64
+
+/// Number of failed attempts to find work before a shared worker leaves an arena
+#define NANOTHREAD_ARENA_POLLS 64
+
+/// Virtual time that an arena of weight 1 is charged per processed range
+#define NANOTHREAD_ARENA_STRIDE 1024
+
+/// Minimum interval between core count updates of auto-sized pools (in milliseconds)
+#define NANOTHREAD_AUTO_SIZE_INTERVAL 1000
+
+/// Number of worker loop iterations between checks of the above interval
+#define NANOTHREAD_AUTO_SIZE_POLL 256
+
 /// Data structure describing a pool of workers
 struct Pool {
+    Pool(uint32_t node_count = 1) : queue(node_count) { }
+
     /// Queue of scheduled tasks
     TaskQueue queue;
 
-    /// List of currently running worker threads
+    /// Serializes resize operations, see pool_resize()
+    std::mutex resize_mutex;
+
+    /// Protects 'workers', 'retired', and 'spawning'
+    std::mutex workers_mutex;
+
+    /// Workers 1..size, which may not have been launched yet
     std::vector<std::unique_ptr<Worker>> workers;
 
+    /// Removed workers that finish their current work unit before exiting
+    std::vector<std::unique_ptr<Worker>> retired;
+
+    /// Is a newly launched worker about to launch the next one?
+    bool spawning = false;
+
+    /// Number of workers requested via pool_set_size()
+    std::atomic<uint32_t> size { 0 };
+
+    /// Should the pool follow the core count? (protected by 'resize_mutex')
+    std::atomic<bool> auto_size { false };
+
     /// Number of idle workers that have gone to sleep
     std::atomic<uint32_t> asleep;
 
     /// Should denormalized floating point numbers be flushed to zero?
     bool ftz = true;
+
+    /// CPUs that workers are pinned to (round robin, empty: don't pin)
+    std::vector<uint32_t> worker_cpus;
+
+    /// NUMA node of each entry of 'worker_cpus'
+    std::vector<uint32_t> worker_nodes;
+
+    // ---------- Fields below are used by arenas, see pool_create_arena() ----------
+
+    /// Shared workers processing the tasks of the arena (nullptr: ordinary pool)
+    ArenaGroup *group = nullptr;
+
+    /// Maximum number of shared workers that process the arena's tasks
+    std::atomic<uint32_t> arena_limit { 0 };
+
+    /// Relative share of the worker time (protected by ArenaGroup::mutex)
+    uint32_t arena_weight = 1;
+
+    /// Number of shared workers currently in the arena (protected by ArenaGroup::mutex)
+    uint32_t arena_active = 0;
+
+    /// Virtual time of the fair share scheduler (protected by ArenaGroup::mutex)
+    uint64_t arena_pass = 0;
+};
+
+/// Life cycle of a worker, see pool_resize()
+enum WorkerState : uint32_t {
+    /// Processing tasks
+    WorkerRunning,
+
+    /// Asked to exit, can still be reactivated by a later resize
+    WorkerRetiring,
+
+    /// Draining its deque and mailbox before exiting
+    WorkerExiting,
+
+    /// Done, joining the thread won't block
+    WorkerExited
 };
 
 struct Worker {
     Pool *pool;
     std::thread thread;
     uint32_t id;
-    bool stop;
+    std::atomic<uint32_t> state;
     bool ftz;
 
     Worker(Pool *pool, uint32_t id, bool ftz);
@@ -63,15 +154,170 @@ struct Worker {
 };
 
 
+/**
+ * \brief Set of workers shared by all arenas
+ *
+ * Workers pick the arena with the smallest virtual time ('arena_pass') among
+ * those that have work and haven't reached their concurrency limit (stride
+ * scheduling). Processing work advances the virtual time of an arena
+ * inversely proportional to its weight.
+ */
+struct ArenaGroup {
+    /// Protects the fields below and the arena fields of the member pools
+    std::mutex mutex;
+
+    /// Signaled when work is pushed to an arena and upon shutdown
+    std::condition_variable work_cv;
+
+    /// Signaled when a worker leaves an arena
+    std::condition_variable leave_cv;
+
+    /// Arenas that workers can choose from
+    std::vector<Pool *> arenas;
+
+    /// Worker threads
+    std::vector<std::thread> threads;
+
+    /// Number of workers waiting on 'work_cv' (also read without the mutex)
+    std::atomic<uint32_t> sleepers { 0 };
+
+    /// Incremented to wake the workers waiting on 'work_cv'
+    uint64_t epoch = 0;
+
+    /// Virtual time of the arena that was chosen last
+    uint64_t vtime = 0;
+
+    /// Should the workers exit?
+    bool stop = false;
+};
+
 static Pool *pool_default_inst = nullptr;
 static std::mutex pool_default_lock;
 static uint32_t cached_core_count = 0;
 
-uint32_t core_count() {
-    // assumes atomic word size memory access
-    if (cached_core_count)
-        return cached_core_count;
+/// Workers shared by all arenas (protected by 'arena_lock')
+static ArenaGroup *arena_group = nullptr;
+static std::mutex arena_lock;
+
+static void arena_worker(ArenaGroup *group, uint32_t id);
+static void arena_notify(void *payload, uint32_t count);
+static void arena_remove(Pool *pool);
+static void pool_resize(Pool *pool, uint32_t size);
+static void pool_join(Pool *pool);
+
+#if defined(__linux__)
+/// Determine the CPUs that the calling thread is allowed to run on
+static bool available_cpus(std::vector<uint32_t> &cpus) {
+    uint32_t ncores_logical = std::thread::hardware_concurrency();
+    size_t size = 0;
+    cpu_set_t *cpuset = nullptr;
+    int retval = 0;
+
+    /* The kernel may expect a larger cpu_set_t than would
+       be warranted by the physical core count. Keep querying
+       with increasingly larger buffers if the
+       pthread_getaffinity_np operation fails */
+    for (uint32_t i = 0; i < 10; ++i) {
+        size = CPU_ALLOC_SIZE(ncores_logical);
+        cpuset = CPU_ALLOC(ncores_logical);
+        if (!cpuset) {
+            fprintf(stderr, "nanothread: core_count(): Could not allocate cpu_set_t.\n");
+            return false;
+        }
+        CPU_ZERO_S(size, cpuset);
+
+        retval = pthread_getaffinity_np(pthread_self(), size, cpuset);
+        if (retval == 0)
+            break;
+        CPU_FREE(cpuset);
+        ncores_logical *= 2;
+    }
+
+    if (retval) {
+        fprintf(stderr, "nanothread: core_count(): Could not read thread affinity map.\n");
+        return false;
+    }
+
+    cpus.clear();
+    for (uint32_t i = 0; i < ncores_logical; ++i) {
+        if (CPU_ISSET_S(i, size, cpuset))
+            cpus.push_back(i);
+    }
+    CPU_FREE(cpuset);
+    return true;
+}
+
+/// Parse a list of CPUs/nodes in sysfs format (e.g. "0-3,8-11")
+static void parse_cpu_list(const char *str, std::vector<uint32_t> &result) {
+    while (*str) {
+        char *end = nullptr;
+        unsigned long first = strtoul(str, &end, 10), last = first;
+        if (end == str)
+            break;
+        str = end;
+        if (*str == '-') {
+            last = strtoul(str + 1, &end, 10);
+            str = end;
+        }
+        for (unsigned long i = first; i <= last; ++i)
+            result.push_back((uint32_t) i);
+        if (*str != ',')
+            break;
+        str++;
+    }
+}
+
+/// Read a CPU/node list from a sysfs file
+static bool read_cpu_list(const char *path, std::vector<uint32_t> &result) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    char buf[4096];
+    bool success = fgets(buf, sizeof(buf), f) != nullptr;
+    fclose(f);
+    if (success)
+        parse_cpu_list(buf, result);
+    return success;
+}
+#endif
+
+#if defined(__linux__)
+/// Limit the core count to the CPU quota of the cgroup (v2 or v1), if any
+static uint32_t cgroup_quota(uint32_t ncores) {
+    double quota = -1, period = 0;
+    FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (f) {
+        char buf[32];
+        if (fscanf(f, "%31s %lf", buf, &period) == 2 && strcmp(buf, "max") != 0)
+            quota = atof(buf);
+        fclose(f);
+    } else {
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+        if (f) {
+            if (fscanf(f, "%lf", &quota) != 1)
+                quota = -1;
+            fclose(f);
+        }
+        f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+        if (f) {
+            if (fscanf(f, "%lf", &period) != 1)
+                period = 0;
+            fclose(f);
+        }
+    }
+
+    if (quota <= 0 || period <= 0)
+        return ncores;
+
+    uint32_t limit = (uint32_t) ((quota + period - 1) / period);
+    if (limit < 1)
+        limit = 1;
+    return limit < ncores ? limit : ncores;
+}
+#endif
 
+/// Determine the number of cores that the calling thread may run on
+static uint32_t available_core_count() {
     // Determine the number of present cores
     uint32_t ncores = std::thread::hardware_concurrency();
 
@@ -81,293 +327,1562 @@ uint32_t core_count() {
         /* Some of the cores may not be available to the user
            (e.g. on certain cluster nodes) -- determine the number
            of actual available cores here. */
-        uint32_t ncores_logical = ncores;
-        size_t size = 0;
-        cpu_set_t *cpuset = nullptr;
-        int retval = 0;
-
-        /* The kernel may expect a larger cpu_set_t than would
-           be warranted by the physical core count. Keep querying
-           with increasingly larger buffers if the
-           pthread_getaffinity_np operation fails */
-        for (uint32_t i = 0; i < 10; ++i) {
-            size = CPU_ALLOC_SIZE(ncores_logical);
-            cpuset = CPU_ALLOC(ncores_logical);
-            if (!cpuset) {
-                fprintf(stderr, "nanothread: core_count(): Could not allocate cpu_set_t.\n");
-                return ncores;
+        std::vector<uint32_t> cpus;
+        if (available_cpus(cpus))
+            ncores = (uint32_t) cpus.size();
+    }
+#endif
+
+    return ncores;
+}
+
+uint32_t core_count() {
+    // assumes atomic word size memory access
+    if (cached_core_count)
+        return cached_core_count;
+
+    uint32_t ncores = available_core_count();
+    cached_core_count = ncores;
+    return ncores;
+}
+
+/// Size of pools in the automatic mode, which also honors the CPU quota
+static uint32_t auto_pool_size() {
+    uint32_t ncores = available_core_count();
+#if defined(__linux__)
+    ncores = cgroup_quota(ncores);
+#endif
+    return ncores;
+}
+
+/// CPUs of the NUMA nodes that are available to the calling thread
+struct NumaTopology {
+    /// Available CPUs of each node (nodes without available CPUs are skipped)
+    std::vector<std::vector<uint32_t>> node_cpus;
+
+    /// Maps CPU indices to indices into 'node_cpus' (NANOTHREAD_AUTO: n/a)
+    std::vector<uint32_t> cpu_nodes;
+};
+
+static NumaTopology numa_topology() {
+    NumaTopology topo;
+    std::vector<uint32_t> cpus;
+    std::vector<std::vector<uint32_t>> node_cpus;
+
+#if defined(__linux__)
+    std::vector<uint32_t> nodes;
+    if (getenv("VALGRIND_OPTS") == nullptr && available_cpus(cpus) &&
+        read_cpu_list("/sys/devices/system/node/online", nodes)) {
+        for (uint32_t node : nodes) {
+            char path[64];
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/node/node%u/cpulist", node);
+            std::vector<uint32_t> list;
+            if (read_cpu_list(path, list))
+                node_cpus.push_back(list);
+        }
+    }
+#elif defined(_WIN32)
+    DWORD_PTR process_mask = 0, system_mask = 0;
+    ULONG highest = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) &&
+        GetNumaHighestNodeNumber(&highest)) {
+        for (uint32_t i = 0; i < 8 * sizeof(DWORD_PTR); ++i) {
+            if (process_mask & ((DWORD_PTR) 1 << i))
+                cpus.push_back(i);
+        }
+        for (ULONG node = 0; node <= highest; ++node) {
+            ULONGLONG mask = 0;
+            std::vector<uint32_t> list;
+            if (GetNumaNodeProcessorMask((UCHAR) node, &mask)) {
+                for (uint32_t i = 0; i < 64; ++i) {
+                    if (mask & (1ull << i))
+                        list.push_back(i);
+                }
+            }
+            node_cpus.push_back(list);
+        }
+    }
+#endif
+
+    // Only keep CPUs that are available, and nodes that have any of them
+    for (const std::vector<uint32_t> &list : node_cpus) {
+        std::vector<uint32_t> avail;
+        for (uint32_t cpu : list) {
+            for (uint32_t cpu2 : cpus) {
+                if (cpu == cpu2) {
+                    avail.push_back(cpu);
+                    break;
+                }
+            }
+        }
+        if (avail.empty())
+            continue;
+
+        for (uint32_t cpu : avail) {
+            if (topo.cpu_nodes.size() <= cpu)
+                topo.cpu_nodes.resize(cpu + 1, NANOTHREAD_AUTO);
+            topo.cpu_nodes[cpu] = (uint32_t) topo.node_cpus.size();
+        }
+        topo.node_cpus.push_back(avail);
+    }
+
+    return topo;
+}
+
+/// Pin the calling thread to a specific CPU
+static void pin_thread(uint32_t cpu) {
+#if defined(__linux__)
+    size_t size = CPU_ALLOC_SIZE(cpu + 1);
+    cpu_set_t *cpuset = CPU_ALLOC(cpu + 1);
+    if (!cpuset)
+        return;
+    CPU_ZERO_S(size, cpuset);
+    CPU_SET_S(cpu, size, cpuset);
+    if (pthread_setaffinity_np(pthread_self(), size, cpuset) != 0)
+        fprintf(stderr, "nanothread: could not pin worker to CPU %u.\n", cpu);
+    CPU_FREE(cpuset);
+#elif defined(_WIN32)
+    if (cpu < 8 * sizeof(DWORD_PTR))
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu);
+#else
+    (void) cpu;
+#endif
+}
+
+
+#if !defined(NANOTHREAD_STATIC)
+uint32_t pool_thread_id() {
+    return nanothread_thread_id_tls;
+}
+#endif
+
+Pool *pool_default() {
+    std::unique_lock<std::mutex> guard(pool_default_lock);
+
+    if (!pool_default_inst)
+        pool_default_inst = pool_create();
+
+    return pool_default_inst;
+}
+
+Pool *pool_create(uint32_t size, int ftz) {
+    Pool *pool = new Pool();
+    pool->ftz = ftz != 0;
+    if (size == (uint32_t) -1)
+        size = core_count();
+    NT_TRACE("pool_create(%p)", pool);
+    pool_set_size(pool, size);
+    return pool;
+}
+
+
+Pool *pool_create_numa(uint32_t size, int ftz) {
+    NumaTopology topo = numa_topology();
+    uint32_t node_count = (uint32_t) topo.node_cpus.size();
+
+    Pool *pool = new Pool(node_count > 0 ? node_count : 1);
+    pool->ftz = ftz != 0;
+    pool->queue.set_cpu_nodes(topo.cpu_nodes);
+
+    // Interleave the CPUs of the different nodes
+    for (size_t i = 0; ; ++i) {
+        bool found = false;
+        for (uint32_t node = 0; node < node_count; ++node) {
+            const std::vector<uint32_t> &list = topo.node_cpus[node];
+            if (i < list.size()) {
+                pool->worker_cpus.push_back(list[i]);
+                pool->worker_nodes.push_back(node);
+                found = true;
+            }
+        }
+        if (!found)
+            break;
+    }
+
+    if (size == (uint32_t) -1)
+        size = pool->worker_cpus.empty() ? core_count()
+                                         : (uint32_t) pool->worker_cpus.size();
+
+    NT_TRACE("pool_create_numa(%p): %u nodes", pool, node_count);
+    pool_set_size(pool, size);
+    return pool;
+}
+
+uint32_t pool_node_count(Pool *pool) {
+    if (!pool) {
+        std::unique_lock<std::mutex> guard(pool_default_lock);
+        pool = pool_default_inst;
+    }
+
+    return pool ? pool->queue.node_count() : 1;
+}
+
+Pool *pool_create_arena(uint32_t max_concurrency, uint32_t weight, int ftz) {
+    Pool *pool = new Pool();
+    pool->ftz = ftz != 0;
+
+    std::unique_lock<std::mutex> guard(arena_lock);
+    if (!arena_group) {
+        ArenaGroup *group = arena_group = new ArenaGroup();
+        uint32_t count = core_count();
+        for (uint32_t i = 0; i < count; ++i)
+            group->threads.emplace_back(arena_worker, group, i + 1);
+    }
+
+    ArenaGroup *group = arena_group;
+    pool->group = group;
+    pool->queue.set_push_hook(arena_notify, group);
+    pool->queue.set_worker_ids(0);
+    pool_set_size(pool, max_concurrency);
+
+    {
+        std::unique_lock<std::mutex> guard2(group->mutex);
+        pool->arena_weight = weight > 0 ? weight : 1;
+        pool->arena_pass = group->vtime;
+        group->arenas.push_back(pool);
+    }
+
+    NT_TRACE("pool_create_arena(%p): max_concurrency=%u, weight=%u", pool,
+             pool->arena_limit.load(), weight);
+    return pool;
+}
+
+void pool_destroy(Pool *pool) {
+    if (pool) {
+        if (pool->group) {
+            arena_remove(pool);
+        } else {
+            pool_set_size(pool, 0);
+            pool_join(pool);
+        }
+        delete pool;
+    } else if (pool_default_inst) {
+        pool_destroy(pool_default_inst);
+        pool_default_inst = nullptr;
+    }
+}
+
+uint32_t pool_size(Pool *pool) {
+    if (!pool) {
+        std::unique_lock<std::mutex> guard(pool_default_lock);
+        pool = pool_default_inst;
+    }
+
+    if (pool && pool->group)
+        return pool->arena_limit.load(std::memory_order_relaxed);
+    else if (pool)
+        return pool->size.load(std::memory_order_relaxed);
+    else
+        return core_count();
+}
+
+void pool_set_size(Pool *pool, uint32_t size) {
+    if (!pool) {
+        std::unique_lock<std::mutex> guard(pool_default_lock);
+        pool = pool_default_inst;
+
+        if (!pool) {
+            pool = pool_default_inst = new Pool();
+            NT_TRACE("pool_create(%p)", pool);
+        }
+    }
+
+    NT_TRACE("pool_set_size(%p, %u)", pool, size);
+
+    if (pool->group) {
+        uint32_t threads = (uint32_t) pool->group->threads.size();
+        if (size > threads)
+            size = threads;
+        pool->arena_limit.store(size, std::memory_order_relaxed);
+        pool->queue.set_worker_count(size);
+
+        // The arena may have work that was waiting for a worker
+        arena_notify(pool->group, size);
+        return;
+    }
+
+    std::unique_lock<std::mutex> guard(pool->resize_mutex);
+    bool auto_size = size == NANOTHREAD_AUTO;
+    if (auto_size)
+        size = auto_pool_size();
+    pool->auto_size = auto_size;
+    pool_resize(pool, size);
+}
+
+// Launch the first worker that hasn't started yet ('workers_mutex' must be held)
+static void pool_spawn(Pool *pool) {
+    for (std::unique_ptr<Worker> &worker : pool->workers) {
+        if (!worker->thread.joinable()) {
+            worker->thread = std::thread(&Worker::run, worker.get());
+            pool->spawning = true;
+            return;
+        }
+    }
+    pool->spawning = false;
+}
+
+/**
+ * Change the number of workers without waiting for threads to start or stop
+ * ('resize_mutex' must be held). Removed workers retire after their current
+ * work unit and are joined by a later resize or pool_join(). New workers
+ * launch each other one at a time, so that the caller only launches the
+ * first one. Retiring workers are reactivated when the pool grows again.
+ */
+static void pool_resize(Pool *pool, uint32_t size) {
+    NT_TRACE("pool_resize(%p, %u)", pool, size);
+
+    // Workers can be targeted by tasks before they have started
+    pool->queue.set_worker_ids(size);
+
+    std::vector<std::unique_ptr<Worker>> revived, exiting;
+    bool shrink;
+    {
+        std::unique_lock<std::mutex> guard(pool->workers_mutex);
+        shrink = pool->workers.size() > size;
+
+        while (pool->workers.size() > size) {
+            pool->workers.back()->state = WorkerRetiring;
+            pool->retired.push_back(std::move(pool->workers.back()));
+            pool->workers.pop_back();
+        }
+
+        std::vector<std::unique_ptr<Worker>> &retired = pool->retired;
+        for (size_t i = 0; i < retired.size(); ) {
+            Worker *w = retired[i].get();
+            uint32_t state = WorkerRetiring;
+            bool keep = false;
+
+            if (!w->thread.joinable()) {
+                // Never launched, discard
+            } else if (w->id <= size &&
+                       w->state.compare_exchange_strong(state, WorkerRunning)) {
+                revived.push_back(std::move(retired[i]));
+            } else if (w->id <= size || w->state.load() == WorkerExited) {
+                // Must be joined before another worker can reuse the ID
+                exiting.push_back(std::move(retired[i]));
+            } else {
+                keep = true;
+            }
+
+            if (keep) {
+                i++;
+            } else {
+                retired[i] = std::move(retired.back());
+                retired.pop_back();
+            }
+        }
+    }
+
+    // Join (typically) finished threads without holding 'workers_mutex'
+    exiting.clear();
+
+    {
+        std::unique_lock<std::mutex> guard(pool->workers_mutex);
+        while (pool->workers.size() < size) {
+            uint32_t id = (uint32_t) pool->workers.size() + 1;
+            std::unique_ptr<Worker> worker;
+            for (std::unique_ptr<Worker> &w : revived) {
+                if (w && w->id == id)
+                    worker = std::move(w);
+            }
+            if (!worker)
+                worker.reset(new Worker(pool, id, pool->ftz));
+            pool->workers.push_back(std::move(worker));
+        }
+
+        if (!pool->spawning)
+            pool_spawn(pool);
+    }
+
+    pool->size.store(size, std::memory_order_relaxed);
+    pool->queue.set_worker_count(size);
+
+    // Let retiring workers notice the request
+    if (shrink)
+        pool->queue.wakeup();
+}
+
+// Wait for all removed workers to exit
+static void pool_join(Pool *pool) {
+    std::unique_lock<std::mutex> guard(pool->resize_mutex);
+    while (true) {
+        std::vector<std::unique_ptr<Worker>> retired;
+        {
+            std::unique_lock<std::mutex> guard2(pool->workers_mutex);
+            if (pool->retired.empty())
+                break;
+            retired.swap(pool->retired);
+        }
+        // (destructors call join())
+    }
+}
+
+// Follow changes of the core count (called by the first worker)
+static void pool_auto_resize(Pool *pool) {
+    // Skip when a resize is in progress, which may be waiting for this worker
+    if (!pool->resize_mutex.try_lock())
+        return;
+
+    if (pool->auto_size) {
+        uint32_t size = auto_pool_size();
+        if (size != pool->size.load(std::memory_order_relaxed))
+            pool_resize(pool, size);
+    }
+
+    pool->resize_mutex.unlock();
+}
+
+void pool_set_work_stealing(Pool *pool, int value) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_set_work_stealing(%p, %i)", pool, value);
+    pool->queue.set_work_stealing(value != 0);
+}
+
+int pool_work_stealing(Pool *pool) {
+    if (!pool) {
+        std::unique_lock<std::mutex> guard(pool_default_lock);
+        pool = pool_default_inst;
+    }
+
+    return pool ? (int) pool->queue.work_stealing_enabled() : 0;
+}
+
+void pool_set_spin_budget(Pool *pool, uint32_t microseconds) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_set_spin_budget(%p, %u)", pool, microseconds);
+    pool->queue.set_spin_budget(microseconds);
+}
+
+uint32_t pool_spin_budget(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+    return pool->queue.spin_budget_us();
+}
+
+void pool_set_latency_mode(Pool *pool, uint32_t hot_workers) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_set_latency_mode(%p, %u)", pool, hot_workers);
+    pool->queue.set_hot_workers(hot_workers);
+
+    // Parked workers that should now be spinning
+    if (hot_workers > 0)
+        pool->queue.wakeup();
+}
+
+uint32_t pool_latency_mode(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+    return pool->queue.hot_worker_count();
+}
+
+void pool_set_critical_path(Pool *pool, int value) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_set_critical_path(%p, %i)", pool, value);
+    pool->queue.set_critical_path(value != 0);
+}
+
+int pool_critical_path(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+    return (int) pool->queue.critical_path_enabled();
+}
+
+void pool_schedule_record(Pool *pool, uint32_t capacity) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_schedule_record(%p, %u)", pool, capacity);
+    pool->queue.set_recording(capacity);
+}
+
+uint32_t pool_schedule_entries(Pool *pool, ScheduleEntry *entries,
+                               uint32_t count) {
+    if (!pool)
+        pool = pool_default();
+    return pool->queue.recorded(entries, count);
+}
+
+void pool_schedule_replay(Pool *pool, const ScheduleEntry *entries,
+                          uint32_t count) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_schedule_replay(%p, %u)", pool, count);
+    pool->queue.set_replay(entries, count);
+}
+
+void pool_stats(Pool *pool, PoolStats *stats) {
+    if (!pool)
+        pool = pool_default();
+    pool->queue.stats(stats);
+}
+
+void pool_set_priority_aging(Pool *pool, uint32_t interval) {
+    if (!pool)
+        pool = pool_default();
+    NT_TRACE("pool_set_priority_aging(%p, %u)", pool, interval);
+    pool->queue.set_aging(interval);
+}
+
+uint32_t pool_priority_aging(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+    return pool->queue.aging_interval();
+}
+
+int profile_tasks = false;
+
+/// Maximum number of parts that a nested submission hands over to idle workers
+#define NANOTHREAD_INLINE_PARTS 32
+
+/// Payload of a task processing part of a nested submission (see below)
+struct InlinePart {
+    void (*func)(uint32_t, void *);
+    void (*func_range)(uint32_t, uint32_t, void *);
+    void *payload;
+    uint32_t offset;
+
+    /// Previously submitted part, which chains the parts for the final wait
+    Task *prev;
+};
+
+static void inline_part_callback(uint32_t begin, uint32_t end, void *ptr) {
+    InlinePart *p = (InlinePart *) ptr;
+    begin += p->offset;
+    end += p->offset;
+
+    if (p->func_range) {
+        p->func_range(begin, end, p->payload);
+    } else {
+        for (uint32_t i = begin; i != end; ++i)
+            p->func(i, p->payload);
+    }
+}
+
+/// Submit a task processing the work units [offset, end) of a nested submission
+static NT_NOINLINE Task *
+task_run_inline_part(Pool *pool, void (*func)(uint32_t, void *),
+                     void (*func_range)(uint32_t, uint32_t, void *),
+                     void *payload, uint32_t offset, uint32_t end, Task *prev) {
+    InlinePart part{ func, func_range, payload, offset, prev };
+
+    // The payload (and hence the link to 'prev') stays valid until release
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.flags = NANOTHREAD_TASK_KEEP_PAYLOAD;
+
+    return task_submit_ex(pool, nullptr, 0, end - offset, nullptr,
+                          inline_part_callback, &part, sizeof(InlinePart),
+                          nullptr, 1, &attr);
+}
+
+/**
+ * Execute the work units of a synchronous submission made by a worker of
+ * 'pool' on the calling thread. The work is processed front to back in
+ * guided chunks. Before each chunk, the function checks whether other threads
+ * are idle, and in that case hands over a proportional share of the remaining
+ * work units to them using a separate task (lazy splitting). These tasks are
+ * chained through their payloads, so that the frame of this function stays
+ * small while the callbacks run. The payload deleter is invoked once all parts
+ * have finished, and exceptions are propagated to the caller afterwards.
+ * 'task_submit_ex()' tail-calls this function (always returns \c nullptr).
+ */
+static NT_NOINLINE Task *
+task_run_inline(Pool *pool, uint32_t size, void (*func)(uint32_t, void *),
+                void (*func_range)(uint32_t, uint32_t, void *), void *payload,
+                void (*payload_deleter)(void *)) {
+    Task *last = nullptr;
+    uint32_t part_count = 0, begin = 0, end = size;
+    std::exception_ptr exception;
+
+    NT_TRACE("task_submit_dep(): nested submission, executing %u work units "
+             "inline", size);
+
+    try {
+        while (begin != end) {
+            uint32_t idle = pool->queue.idle_count();
+
+            if (idle > 0 && end - begin > 1 &&
+                part_count < NANOTHREAD_INLINE_PARTS) {
+                uint32_t keep = (end - begin) / (idle + 1);
+                if (keep == 0)
+                    keep = 1;
+
+                last = task_run_inline_part(pool, func, func_range, payload,
+                                            begin + keep, end, last);
+                part_count++;
+
+                NT_TRACE("task_submit_dep(): handed over work units [%u, %u) "
+                         "to %u idle threads", begin + keep, end, idle);
+
+                end = begin + keep;
+            }
+
+            uint32_t chunk = pool->queue.claim_size(end - begin);
+            bool traced = tracing();
+            uint64_t trace_start = traced ? trace_time() : 0;
+
+            if (func_range) {
+                func_range(begin, begin + chunk, payload);
+            } else {
+                for (uint32_t i = begin; i != begin + chunk; ++i)
+                    func(i, payload);
+            }
+
+            if (traced)
+                trace_record(TraceType::Run, trace_start, trace_time(),
+                             nullptr, begin, begin + chunk);
+
+            pool->queue.count(StatWorkUnits, chunk);
+
+            begin += chunk;
+        }
+    } catch (...) {
+        exception = std::current_exception();
+    }
+
+    // Wait for the other parts, they may still access the payload
+    while (last) {
+        Task *prev = ((InlinePart *) task_payload(last))->prev;
+        try {
+            task_wait_and_release(last);
+        } catch (...) {
+            if (!exception)
+                exception = std::current_exception();
+        }
+        last = prev;
+    }
+
+    if (payload_deleter)
+        payload_deleter(payload);
+
+    if (exception)
+        std::rethrow_exception(exception);
+
+    return nullptr;
+}
+
+int pool_profile() {
+    return (int) profile_tasks;
+}
+
+void pool_set_profile(int value) {
+    profile_tasks = (bool) value;
+}
+
+/// Execute a small task right away while profiling, see 'task_run_now()'
+static NT_NOINLINE Task *
+task_run_profiled(Pool *pool, void (*func)(uint32_t, void *),
+                  void (*func_range)(uint32_t, uint32_t, void *),
+                  void *payload, void (*payload_deleter)(void *)) {
+    if (!pool)
+        pool = pool_default();
+
+    Task *task = pool->queue.alloc(1, pool->queue.current_node());
+
+    task->time_start = timer_ticks();
+
+    if (func)
+        func(0, payload);
+    else if (func_range)
+        func_range(0, 1, payload);
+
+    task->time_end = timer_ticks();
+
+    if (payload_deleter)
+        payload_deleter(payload);
+
+    task->refcount.store(high_bit, std::memory_order_relaxed);
+    task->exception_used.store(false, std::memory_order_relaxed);
+    task->exception = nullptr;
+    task->size = 1;
+    task->func = func;
+    task->func_range = func_range;
+    task->pool = pool;
+    task->payload = nullptr;
+    task->payload_deleter = nullptr;
+
+    return task;
+}
+
+/**
+ * Execute a small task right away. Returns a completed task record holding
+ * the measured time when profiling is enabled, and \c nullptr otherwise.
+ * 'task_submit_ex()' tail-calls this function, so that only its small frame
+ * stays on the stack while the callback runs.
+ */
+static NT_NOINLINE Task *
+task_run_now(Pool *pool, void (*func)(uint32_t, void *),
+             void (*func_range)(uint32_t, uint32_t, void *), void *payload,
+             void (*payload_deleter)(void *)) {
+    if (profile_tasks)
+        return task_run_profiled(pool, func, func_range, payload,
+                                 payload_deleter);
+
+    if (func)
+        func(0, payload);
+    else if (func_range)
+        func_range(0, 1, payload);
+
+    if (payload_deleter)
+        payload_deleter(payload);
+
+    // Don't even return a task..
+    return nullptr;
+}
+
+/// Determine the NUMA node whose queue should receive a new task
+static uint32_t task_node(Pool *pool, const TaskAttr *attr) {
+    uint32_t node_count = pool->queue.node_count();
+    if (node_count == 1)
+        return 0;
+    else if (attr && attr->node != NANOTHREAD_AUTO)
+        return attr->node % node_count;
+    else
+        return pool->queue.current_node();
+}
+
+static void task_set_payload(Task *task, void *payload, uint32_t payload_size,
+                             void (*payload_deleter)(void *),
+                             void (*payload_init)(void *, void *));
+
+/// Populate the fields of a newly allocated task that don't concern the queue
+static void task_init(Task *task, Pool *pool, uint32_t size,
+                      void (*func)(uint32_t, void *),
+                      void (*func_range)(uint32_t, uint32_t, void *),
+                      void *payload, uint32_t payload_size,
+                      void (*payload_deleter)(void *), const TaskAttr *attr) {
+    task->exception_used.store(false, std::memory_order_relaxed);
+    task->exception = nullptr;
+
+    if (attr && attr->priority != NANOTHREAD_PRIORITY_NORMAL)
+        task->priority = (uint8_t) (attr->priority < NANOTHREAD_PRIORITY_HIGH
+                                        ? attr->priority
+                                        : NANOTHREAD_PRIORITY_HIGH);
+
+    if (attr)
+        task->flags = (uint8_t) attr->flags;
+
+    if (attr && attr->thread != NANOTHREAD_AUTO) {
+        task->mailbox = pool->queue.mailbox(attr->thread);
+        if (!task->mailbox) {
+            fprintf(stderr, "nanothread: task_submit(): no thread with ID "
+                            "0x%08x is attached to the pool!\n", attr->thread);
+            abort();
+        }
+        task->flags |= NANOTHREAD_TASK_TARGETED;
+    }
+
+    if (attr && attr->token) {
+        NT_ASSERT(!task->token);
+        attr->token->retain();
+        task->token = attr->token;
+        if (attr->token->cancelled.load(std::memory_order_relaxed))
+            task->cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    task->size = size;
+    task->func = func;
+    task->func_range = func_range;
+    task->pool = pool;
+    task->seq = pool->queue.next_seq();
+    task->cost = (attr && attr->cost > 0.f) ? attr->cost : (float) size;
+
+    task_set_payload(task, payload, payload_size, payload_deleter,
+                     attr ? attr->payload_init : nullptr);
+}
+
+/// Reserve storage for the payload of a task (in its record, if possible)
+static void *task_payload_storage(Task *task, uint32_t payload_size) {
+    if (payload_size <= sizeof(Task::payload_storage))
+        return task->payload_storage;
+
+    /* Payload doesn't fit into temporary storage. Carve it out of
+       the payload arena, which avoids a heap allocation. */
+    return task->pool->queue.alloc_payload(payload_size, &task->payload_chunk);
+}
+
+/// Set the payload of a task, copying it if needed (see task_submit_dep())
+static void task_set_payload(Task *task, void *payload, uint32_t payload_size,
+                             void (*payload_deleter)(void *),
+                             void (*payload_init)(void *, void *)) {
+    if (payload_init) {
+        // Construct the payload in place, the deleter only destroys it
+        task->payload = task_payload_storage(task, payload_size);
+        task->payload_deleter = payload_deleter;
+        payload_init(task->payload, payload);
+    } else if (payload) {
+        if (payload_deleter || payload_size == 0) {
+            task->payload = payload;
+            task->payload_deleter = payload_deleter;
+        } else {
+            task->payload = task_payload_storage(task, payload_size);
+            task->payload_deleter = nullptr;
+            memcpy(task->payload, payload, payload_size);
+        }
+    } else {
+        task->payload = nullptr;
+        task->payload_deleter = nullptr;
+    }
+}
+
+#if defined(NANOTHREAD_STATIC)
+int task_try_inline(Pool *pool) {
+    if (profile_tasks)
+        return 0;
+
+    // (Not counted for the default pool, as in task_submit_ex())
+    if (pool)
+        pool->queue.count(StatInlineTasks);
+
+    return 1;
+}
+#endif
+
+/**
+ * Allocate a task record and push it into the queue once its parents have
+ * completed. This is kept out of line so that the frame of
+ * 'task_submit_ex()', which stays on the stack while the work is executed
+ * right away, remains small.
+ */
+static NT_NOINLINE Task *
+task_submit_queued(Pool *pool, const Task *const *parent, uint32_t parent_count,
+                   bool has_parent, uint32_t size,
+                   void (*func)(uint32_t, void *),
+                   void (*func_range)(uint32_t, uint32_t, void *),
+                   void *payload, uint32_t payload_size,
+                   void (*payload_deleter)(void *), const TaskAttr *attr) {
+    Task *task = pool->queue.alloc(size, task_node(pool, attr));
+    task_init(task, pool, size, func, func_range, payload, payload_size,
+              payload_deleter, attr);
+
+    if (has_parent) {
+        // Prevent early job submission due to completion of parents
+        task->wait_parents.store(1, std::memory_order_release);
+
+        // Register dependencies in queue, will further increase child->wait_parents
+        for (uint32_t i = 0; i < parent_count; ++i)
+            pool->queue.add_dependency((Task *) parent[i], task);
+    }
+
+    bool push = true;
+    if (has_parent) {
+        /* Undo the earlier 'wait' increment. If the value is now zero, all
+           parent tasks have completed and the job can be pushed. Otherwise,
+           it's somebody else's job to carry out this step. */
+        push = task->wait_parents.fetch_sub(1) == 1;
+    }
+
+    if (push)
+        pool->queue.push(task);
+
+    return task;
+}
+
+Task *task_submit_ex(Pool *pool, const Task *const *parent,
+                     uint32_t parent_count, uint32_t size,
+                     void (*func)(uint32_t, void *),
+                     void (*func_range)(uint32_t, uint32_t, void *),
+                     void *payload, uint32_t payload_size,
+                     void (*payload_deleter)(void *), int async,
+                     const TaskAttr *attr) {
+
+    if (size == 0) {
+        // There is no work, so the payload is irrelevant
+        func = nullptr;
+        func_range = nullptr;
+
+        // The queue requires task size >= 1
+        size = 1;
+    }
+
+    // Does the task have parent tasks
+    bool has_parent = false;
+    for (uint32_t i = 0; i < parent_count; ++i)
+        has_parent |= parent[i] != nullptr;
+
+    // Tasks for a specific thread always go through its mailbox
+    bool targeted = attr && attr->thread != NANOTHREAD_AUTO;
+
+    /* Work with a cancellation token is queued as well, so that waiting for it
+       reports a cancellation (also one during its execution), and so that
+       task_is_cancelled() refers to this task within the callback */
+    bool has_token = attr && attr->token;
+
+    /* Payloads that are constructed in place only exist within the task, so
+       such work is queued as well */
+    bool constructed = attr && attr->payload_init;
+
+    // If this is a small work unit, execute it right away
+    if (size == 1 && !has_parent && async == 0 && !targeted && !has_token &&
+        !constructed) {
+        NT_TRACE("task_submit_dep(): task is small, executing right away");
+
+        // (Not counted for the default pool, to avoid locking here)
+        if (pool)
+            pool->queue.count(StatInlineTasks);
+
+        return task_run_now(pool, func, func_range, payload,
+                            payload_deleter);
+    }
+
+    // Size 0 is equivalent to size 1, but without the above optimization
+    if (size == 0)
+        size = 1;
+
+    if (!pool)
+        pool = pool_default();
+
+    /* Nested synchronous submission from a worker: run it on this thread
+       (except when the schedule is recorded, since this depends on timing) */
+    if (size > 1 && !has_parent && async == 0 && !profile_tasks &&
+        !targeted && !has_token && !constructed && (func || func_range) &&
+        pool->queue.is_worker() && !pool->queue.scheduling()) {
+        pool->queue.count(StatInlineNested);
+        return task_run_inline(pool, size, func, func_range, payload,
+                               payload_deleter);
+    }
+
+    return task_submit_queued(pool, parent, parent_count, has_parent, size,
+                              func, func_range, payload, payload_size,
+                              payload_deleter, attr);
+}
+
+Task *task_submit_dep(Pool *pool, const Task *const *parent,
+                      uint32_t parent_count, uint32_t size,
+                      void (*func)(uint32_t, void *), void *payload,
+                      uint32_t payload_size, void (*payload_deleter)(void *),
+                      int async) {
+    return task_submit_ex(pool, parent, parent_count, size, func, nullptr,
+                          payload, payload_size, payload_deleter, async,
+                          nullptr);
+}
+
+Task *task_submit_range_dep(Pool *pool, const Task *const *parent,
+                            uint32_t parent_count, uint32_t size,
+                            void (*func)(uint32_t, uint32_t, void *),
+                            void *payload, uint32_t payload_size,
+                            void (*payload_deleter)(void *), int async) {
+    return task_submit_ex(pool, parent, parent_count, size, nullptr, func,
+                          payload, payload_size, payload_deleter, async,
+                          nullptr);
+}
+
+Task *task_create_event(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+
+    Task *task = pool->queue.alloc(1, pool->queue.current_node());
+    task_init(task, pool, 1, nullptr, nullptr, nullptr, 0, nullptr, nullptr);
+
+    // The task is never pushed, hence there is no reference by the queue
+    task->refcount.store(1 + 2 * high_bit, std::memory_order_relaxed);
+
+    NT_TRACE("task_create_event(): created %p", task);
+    return task;
+}
+
+void task_signal(Task *task) {
+    NT_TRACE("task_signal(%p)", task);
+    task->pool->queue.release(task);
+}
+
+void *task_payload(Task *task) {
+    return task ? task->payload : nullptr;
+}
+
+void task_cancel(Task *task) {
+    if (task) {
+        NT_TRACE("task_cancel(%p)", task);
+        task->cancelled.store(true, std::memory_order_relaxed);
+    }
+}
+
+int task_is_cancelled(const Task *task) {
+    if (!task)
+        task = current_task_tls;
+    return task ? (int) task->cancel_requested() : 0;
+}
+
+CancelToken *cancel_token_create() {
+    return new CancelToken();
+}
+
+void cancel_token_destroy(CancelToken *token) {
+    CancelToken::release(token);
+}
+
+void cancel_token_cancel(CancelToken *token) {
+    NT_TRACE("cancel_token_cancel(%p)", token);
+    token->cancelled.store(true, std::memory_order_relaxed);
+}
+
+int cancel_token_is_cancelled(const CancelToken *token) {
+    return (int) token->cancelled.load(std::memory_order_relaxed);
+}
+
+const char *drjit::task_cancelled::what() const noexcept {
+    return "nanothread: the task was cancelled";
+}
+
+/// Maximum number of task records that a graph fetches at once
+#define NANOTHREAD_GRAPH_BATCH 1024
+
+TaskGraph *task_graph_begin(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+
+    TaskGraph *graph = new TaskGraph();
+    graph->pool = pool;
+    graph->unused.resize(pool->queue.node_count());
+    return graph;
+}
+
+/// Fetch a task record for a graph, and initialize it as if via alloc()
+static Task *task_graph_alloc(TaskGraph *graph, uint32_t size, uint32_t node) {
+    std::vector<Task *> &unused = graph->unused[node];
+
+    if (unused.empty()) {
+        // Fetch more records as the graph grows
+        size_t count = std::max((size_t) NANOTHREAD_SLAB_SIZE, graph->tasks.size());
+        if (count > NANOTHREAD_GRAPH_BATCH)
+            count = NANOTHREAD_GRAPH_BATCH;
+        graph->pool->queue.alloc_batch(node, (uint32_t) count, unused);
+    }
+
+    Task *task = unused.back();
+    unused.pop_back();
+    graph->pool->queue.init(task, size, node);
+
+    /* No reference by user code, the graph owns the handle. This is revisited
+       for the task returned by task_graph_commit(). */
+    task->refcount.store(size + 2 * high_bit, std::memory_order_relaxed);
+    task->graph = graph;
+
+    return task;
+}
+
+Task *task_graph_add(TaskGraph *graph, const Task *const *parent,
+                     uint32_t parent_count, uint32_t size,
+                     void (*func)(uint32_t, void *),
+                     void (*func_range)(uint32_t, uint32_t, void *),
+                     void *payload, uint32_t payload_size,
+                     void (*payload_deleter)(void *), const TaskAttr *attr) {
+    Pool *pool = graph->pool;
+
+    if (graph->sink) {
+        fprintf(stderr, "nanothread: task_graph_add(): the graph was already "
+                        "launched!\n");
+        abort();
+    }
+
+    if (size == 0) {
+        // There is no work, so the payload is irrelevant
+        func = nullptr;
+        func_range = nullptr;
+
+        // The queue requires task size >= 1
+        size = 1;
+    }
+
+    Task *task = task_graph_alloc(graph, size, task_node(pool, attr));
+    task_init(task, pool, size, func, func_range, payload, payload_size,
+              payload_deleter, attr);
+
+    // Parents within the graph are not yet visible to other threads
+    uint32_t wait = 0;
+    bool external = false;
+    for (uint32_t i = 0; i < parent_count; ++i) {
+        Task *p = (Task *) parent[i];
+        if (!p)
+            continue;
+
+        if (p->graph == graph) {
+            pool->queue.add_private_dependency(p, task);
+            wait++;
+        } else {
+            external = true;
+        }
+    }
+
+    if (external) {
+        /* Prevent early job submission due to completion of other parents
+           until the graph is committed */
+        task->wait_parents.store(wait + 1, std::memory_order_release);
+
+        for (uint32_t i = 0; i < parent_count; ++i) {
+            Task *p = (Task *) parent[i];
+            if (p && p->graph != graph)
+                pool->queue.add_dependency(p, task);
+        }
+    } else {
+        task->wait_parents.store(wait, std::memory_order_relaxed);
+    }
+
+    graph->tasks.push_back(task);
+    graph->external.push_back(external ? 1 : 0);
+    graph->wait.push_back(wait);
+
+    return task;
+}
+
+/**
+ * Compute the upward ranks of the tasks of a graph (see \ref Task::rank).
+ * Tasks are added after their parents, hence a traversal in reverse order
+ * visits children first. The sink doesn't count.
+ */
+static void task_graph_rank(TaskGraph *graph, Task *sink) {
+    std::vector<Task *> &tasks = graph->tasks;
+    sink->rank.store(0.f, std::memory_order_relaxed);
+
+    for (size_t i = tasks.size(); i-- > 0; ) {
+        Task *task = tasks[i];
+        float value = 0.f;
+        for (TaskLink *link = task->children.load(std::memory_order_relaxed);
+             link; link = link->next) {
+            if (link->child->graph == graph)
+                value = std::max(
+                    value, link->child->rank.load(std::memory_order_relaxed));
+        }
+        task->rank.store(task->cost + value, std::memory_order_relaxed);
+    }
+}
+
+/// Order ready tasks of a graph so that the most critical ones are popped first
+static void task_graph_sort(std::vector<Task *> &ready) {
+    std::stable_sort(ready.begin(), ready.end(), [](const Task *a, const Task *b) {
+        return a->rank.load(std::memory_order_relaxed) >
+               b->rank.load(std::memory_order_relaxed);
+    });
+}
+
+/// Submit a graph for the first time, optionally keeping its tasks resident
+static Task *task_graph_submit(TaskGraph *graph, bool resident) {
+    Pool *pool = graph->pool;
+    std::vector<Task *> &tasks = graph->tasks, ready;
+
+    /* Create a task that depends on all tasks without children in the graph,
+       which hands out the only reference by user code */
+    Task *sink = task_graph_alloc(graph, 1, pool->queue.current_node());
+    task_init(sink, pool, 1, nullptr, nullptr, nullptr, 0, nullptr, nullptr);
+    sink->refcount.store(1 + 3 * high_bit, std::memory_order_relaxed);
+
+    uint32_t sink_wait = 0;
+    for (Task *task : tasks) {
+        bool leaf = true;
+        for (TaskLink *link = task->children.load(std::memory_order_relaxed);
+             link; link = link->next)
+            leaf &= link->child->graph != graph;
+
+        if (leaf) {
+            pool->queue.add_private_dependency(task, sink);
+            sink_wait++;
+        }
+    }
+    sink->wait_parents.store(sink_wait, std::memory_order_relaxed);
+
+    if (resident) {
+        graph->sink = sink;
+        graph->wait.push_back(sink_wait);
+        graph->lanes.resize(pool->queue.node_count() * NANOTHREAD_PRIORITY_COUNT);
+        graph->active.store((uint32_t) tasks.size() + 1, std::memory_order_relaxed);
+
+        /* Store the successor lists in the order of registration, which
+           release() relies upon for resident tasks */
+        for (size_t i = 0; i <= tasks.size(); ++i) {
+            Task *task = i < tasks.size() ? tasks[i] : sink;
+            TaskLink *link = task->children.load(std::memory_order_relaxed),
+                     *prev = nullptr;
+            while (link) {
+                TaskLink *next = link->next;
+                link->next = prev;
+                prev = link;
+                link = next;
+            }
+            task->children.store(prev, std::memory_order_relaxed);
+            graph->children.push_back(prev);
+            if (task->flags & NANOTHREAD_TASK_TARGETED) {
+                uint32_t id = task->mailbox->id;
+                if (std::find(graph->threads.begin(), graph->threads.end(),
+                              id) == graph->threads.end())
+                    graph->threads.push_back(id);
+            } else {
+                graph->lanes[task->priority * pool->queue.node_count() + task->node] = 1;
             }
-            CPU_ZERO_S(size, cpuset);
-
-            int retval = pthread_getaffinity_np(pthread_self(), size, cpuset);
-            if (retval == 0)
-                break;
-            CPU_FREE(cpuset);
-            ncores_logical *= 2;
         }
+    }
 
-        if (retval) {
-            fprintf(stderr, "nanothread: core_count(): Could not read thread affinity map.\n");
-            return ncores;
-        }
+    bool by_rank = pool->queue.critical_path_enabled();
+    if (by_rank)
+        task_graph_rank(graph, sink);
+
+    if (!resident)
+        sink->graph = nullptr;
+
+    /* Collect tasks that are ready. None of them can run yet, so this step
+       must precede the removal of the guards below. */
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        Task *task = tasks[i];
+        if (!resident)
+            task->graph = nullptr;
+        if (graph->wait[i] == 0)
+            graph->roots.push_back(task);
+        if (!graph->external[i] &&
+            task->wait_parents.load(std::memory_order_relaxed) == 0)
+            ready.push_back(task);
+    }
 
-        uint32_t ncores_avail = 0;
-        for (uint32_t i = 0; i < ncores_logical; ++i)
-            ncores_avail += CPU_ISSET_S(i, size, cpuset) ? 1 : 0;
-        ncores = ncores_avail;
-        CPU_FREE(cpuset);
+    if (tasks.empty()) {
+        ready.push_back(sink);
+        graph->roots.push_back(sink);
     }
-#endif
-    cached_core_count = ncores;
-    return ncores;
-}
 
+    /* Tasks with parents outside of the graph might now be pushed by those,
+       unless they have already finished */
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        if (graph->external[i] && tasks[i]->wait_parents.fetch_sub(1) == 1)
+            ready.push_back(tasks[i]);
+    }
 
-uint32_t pool_thread_id() {
-    return thread_id_tls;
-}
+    NT_TRACE("task_graph_submit(): submitting %zu tasks, %zu are ready",
+             tasks.size() + 1, ready.size());
 
-Pool *pool_default() {
-    std::unique_lock<std::mutex> guard(pool_default_lock);
+    for (std::vector<Task *> &unused : graph->unused) {
+        for (Task *task : unused)
+            pool->queue.recycle_task(task);
+        unused.clear();
+    }
 
-    if (!pool_default_inst)
-        pool_default_inst = pool_create();
+    if (by_rank)
+        task_graph_sort(ready);
 
-    return pool_default_inst;
+    pool->queue.push_batch(ready.data(), (uint32_t) ready.size());
+
+    return sink;
 }
 
-Pool *pool_create(uint32_t size, int ftz) {
-    Pool *pool = new Pool();
-    pool->ftz = ftz != 0;
-    if (size == (uint32_t) -1)
-        size = core_count();
-    NT_TRACE("pool_create(%p)", pool);
-    pool_set_size(pool, size);
-    return pool;
+Task *task_graph_commit(TaskGraph *graph) {
+    if (graph->sink) {
+        fprintf(stderr, "nanothread: task_graph_commit(): the graph was "
+                        "already launched, use task_graph_launch()!\n");
+        abort();
+    }
+
+    Task *sink = task_graph_submit(graph, false);
+    delete graph;
+    return sink;
 }
 
+/**
+ * Wait until no task of a resident graph is referenced anymore. The tasks
+ * that were popped last may still be referenced by the queues, in which case
+ * pushing an empty task to those queues releases them.
+ */
+static void task_graph_sync(TaskGraph *graph) {
+    if (graph->active.load(std::memory_order_acquire) == 0)
+        return;
 
-void pool_destroy(Pool *pool) {
-    if (pool) {
-        pool_set_size(pool, 0);
-        delete pool;
-    } else if (pool_default_inst) {
-        pool_destroy(pool_default_inst);
-        pool_default_inst = nullptr;
+    Pool *pool = graph->pool;
+    uint32_t node_count = pool->queue.node_count();
+    std::vector<Task *> empty;
+
+    for (size_t i = 0; i < graph->lanes.size(); ++i) {
+        if (!graph->lanes[i])
+            continue;
+
+        Task *task = pool->queue.alloc(1, (uint32_t) (i % node_count));
+        TaskAttr attr;
+        task_attr_init(&attr);
+        attr.priority = (uint32_t) (i / node_count);
+        task_init(task, pool, 1, nullptr, nullptr, nullptr, 0, nullptr, &attr);
+
+        // No reference by user code
+        task->refcount.store(1 + 2 * high_bit, std::memory_order_relaxed);
+        empty.push_back(task);
     }
-}
 
-uint32_t pool_size(Pool *pool) {
-    if (!pool) {
-        std::unique_lock<std::mutex> guard(pool_default_lock);
-        pool = pool_default_inst;
+    // Mailboxes are only released once their owner pops the empty task
+    for (uint32_t id : graph->threads) {
+        if (!pool->queue.mailbox(id))
+            continue;
+
+        Task *task = pool->queue.alloc(1, 0);
+        TaskAttr attr;
+        task_attr_init(&attr);
+        attr.thread = id;
+        task_init(task, pool, 1, nullptr, nullptr, nullptr, 0, nullptr, &attr);
+        task->refcount.store(1 + 2 * high_bit, std::memory_order_relaxed);
+        empty.push_back(task);
     }
 
-    if (pool)
-        return (uint32_t) pool->workers.size();
-    else
-        return core_count();
-}
+    pool->queue.push_batch(empty.data(), (uint32_t) empty.size());
 
-void pool_set_size(Pool *pool, uint32_t size) {
-    if (!pool) {
-        std::unique_lock<std::mutex> guard(pool_default_lock);
-        pool = pool_default_inst;
+    auto stopping_criterion = [](void *ptr) -> bool {
+        return ((TaskGraph *) ptr)->active.load(std::memory_order_acquire) == 0;
+    };
 
-        if (!pool) {
-            pool = pool_default_inst = new Pool();
-            NT_TRACE("pool_create(%p)", pool);
-        }
+    pool_work_until(pool, stopping_criterion, graph);
+}
+
+Task *task_graph_launch(TaskGraph *graph) {
+    if (!graph->sink)
+        return task_graph_submit(graph, true);
+
+    task_graph_sync(graph);
+
+    std::vector<Task *> &tasks = graph->tasks;
+    size_t count = tasks.size();
+
+    // Reset the per-launch state of all tasks
+    for (size_t i = 0; i <= count; ++i) {
+        Task *task = i < count ? tasks[i] : graph->sink;
+        uint32_t size = task->size;
+
+        task->next = Task::Ptr();
+        task->refcount.store(size + (i < count ? 2 : 3) * high_bit,
+                             std::memory_order_relaxed);
+        task->wait_parents.store(graph->wait[i], std::memory_order_relaxed);
+        task->wait_count.store(0, std::memory_order_relaxed);
+        task->children.store(graph->children[i], std::memory_order_relaxed);
+        task->exception_used.store(false, std::memory_order_relaxed);
+        task->exception = nullptr;
+        task->cancelled.store(false, std::memory_order_relaxed);
+        task->rank.store(-1.f, std::memory_order_relaxed);
+
+        // The measured time of the previous launch replaces the estimate
+        if (task->time_end > task->time_start && i < count)
+            task->cost = (float) timer_ns(task->time_end - task->time_start);
+
+        task->time_start = task->time_end = 0;
+        task->seq = graph->pool->queue.next_seq();
     }
 
-    NT_TRACE("pool_set_size(%p, %u)", pool, size);
+    graph->active.store((uint32_t) count + 1, std::memory_order_relaxed);
 
-    int diff = (int) size - (int) pool->workers.size();
-    if (diff > 0) {
-        // Launch extra worker threads
-        for (int i = 0; i < diff; ++i)
-            pool->workers.push_back(std::unique_ptr<Worker>(
-                new Worker(pool, (uint32_t) pool->workers.size() + 1, pool->ftz)));
-    } else if (diff < 0) {
-        // Remove worker threads (destructor calls join())
-        for (int i = diff; i != 0; ++i)
-            pool->workers[pool->workers.size() + i]->stop = true;
-        pool->queue.wakeup();
-        for (int i = diff; i != 0; ++i)
-            pool->workers.pop_back();
-    }
-}
+    NT_TRACE("task_graph_launch(): submitting %zu tasks, %zu are ready",
+             count + 1, graph->roots.size());
 
-int profile_tasks = false;
+    Task *sink = graph->sink;
+    if (graph->pool->queue.critical_path_enabled()) {
+        task_graph_rank(graph, sink);
+        std::vector<Task *> roots = graph->roots;
+        task_graph_sort(roots);
+        graph->pool->queue.push_batch(roots.data(), (uint32_t) roots.size());
+    } else {
+        graph->pool->queue.push_batch(graph->roots.data(),
+                                      (uint32_t) graph->roots.size());
+    }
 
-int pool_profile() {
-    return (int) profile_tasks;
+    return sink;
 }
 
-void pool_set_profile(int value) {
-    profile_tasks = (bool) value;
+void task_graph_set_payload(TaskGraph *graph, Task *task, void *payload,
+                            uint32_t payload_size,
+                            void (*payload_deleter)(void *)) {
+    task_graph_sync(graph);
+
+    task->clear_payload();
+    task_set_payload(task, payload, payload_size, payload_deleter, nullptr);
 }
 
-Task *task_submit_dep(Pool *pool, const Task *const *parent,
-                      uint32_t parent_count, uint32_t size,
-                      void (*func)(uint32_t, void *), void *payload,
-                      uint32_t payload_size, void (*payload_deleter)(void *),
-                      int async) {
+void task_graph_makespan(TaskGraph *graph, MakespanReport *report) {
+    task_graph_sync(graph);
+
+    /* Longest chain of dependent tasks starting at each task (in ticks),
+       computed in reverse order as in task_graph_rank() */
+    std::vector<Task *> &tasks = graph->tasks;
+    std::unordered_map<const Task *, uint64_t> chain;
+    uint64_t start = (uint64_t) -1, end = 0, work = 0, critical_path = 0;
+
+    for (size_t i = tasks.size(); i-- > 0; ) {
+        const Task *task = tasks[i];
+        uint64_t duration = 0;
+        if (task->time_end > task->time_start && task->time_start != 0) {
+            duration = task->time_end - task->time_start;
+            start = std::min(start, task->time_start);
+            end = std::max(end, task->time_end);
+        }
 
-    if (size == 0) {
-        // There is no work, so the payload is irrelevant
-        func = nullptr;
+        uint64_t value = 0;
+        for (TaskLink *link = task->children.load(std::memory_order_relaxed);
+             link; link = link->next) {
+            auto it = chain.find(link->child);
+            if (it != chain.end())
+                value = std::max(value, it->second);
+        }
 
-        // The queue requires task size >= 1
-        size = 1;
+        value += duration;
+        chain[task] = value;
+        work += duration;
+        critical_path = std::max(critical_path, value);
     }
 
-    // Does the task have parent tasks
-    bool has_parent = false;
-    for (uint32_t i = 0; i < parent_count; ++i)
-        has_parent |= parent[i] != nullptr;
-
-    // If this is a small work unit, execute it right away
-    if (size == 1 && !has_parent && async == 0) {
-        NT_TRACE("task_submit_dep(): task is small, executing right away");
-
-        if (!profile_tasks) {
-            if (func)
-                func(0, payload);
+    uint64_t threads = (uint64_t) pool_size(graph->pool) + 1;
+    report->achieved_ns = end > start ? timer_ns(end - start) : 0;
+    report->critical_path_ns = timer_ns(critical_path);
+    report->work_ns = timer_ns(work);
+    report->ideal_ns = timer_ns(std::max(critical_path, work / threads));
+}
 
-            if (payload_deleter)
-                payload_deleter(payload);
+void task_graph_destroy(TaskGraph *graph) {
+    if (!graph)
+        return;
 
-            // Don't even return a task..
-            return nullptr;
-        } else {
-            if (!pool)
-                pool = pool_default();
-
-            Task *task = pool->queue.alloc(size);
-
-            #if defined(_WIN32)
-                QueryPerformanceCounter(&task->time_start);
-            #else
-                clock_gettime(CLOCK_MONOTONIC, &task->time_start);
-            #endif
-
-            if (func)
-                func(0, payload);
-
-            #if defined(_WIN32)
-                QueryPerformanceCounter(&task->time_end);
-            #else
-                clock_gettime(CLOCK_MONOTONIC, &task->time_end);
-            #endif
-
-            if (payload_deleter)
-                payload_deleter(payload);
-
-            task->refcount.store(high_bit, std::memory_order_relaxed);
-            task->exception_used.store(false, std::memory_order_relaxed);
-            task->exception = nullptr;
-            task->size = size;
-            task->func = func;
-            task->pool = pool;
-            task->payload = nullptr;
-            task->payload_deleter = nullptr;
+    Pool *pool = graph->pool;
+    task_graph_sync(graph);
 
-            return task;
+    if (!graph->sink) {
+        for (uint8_t external : graph->external) {
+            if (external) {
+                fprintf(stderr, "nanothread: task_graph_destroy(): cannot "
+                                "destroy a graph with external dependencies "
+                                "that was never launched!\n");
+                abort();
+            }
         }
     }
 
-    // Size 0 is equivalent to size 1, but without the above optimization
-    if (size == 0)
-        size = 1;
+    std::vector<Task *> &tasks = graph->tasks;
+    if (graph->sink)
+        tasks.push_back(graph->sink);
 
-    if (!pool)
-        pool = pool_default();
+    for (Task *task : tasks) {
+        task->graph = nullptr;
+        task->clear();
+        pool->queue.recycle_task(task);
+    }
 
-    Task *task = pool->queue.alloc(size);
-    task->exception_used.store(false, std::memory_order_relaxed);
-    task->exception = nullptr;
+    for (std::vector<Task *> &unused : graph->unused) {
+        for (Task *task : unused)
+            pool->queue.recycle_task(task);
+    }
 
-    if (has_parent) {
-        // Prevent early job submission due to completion of parents
-        task->wait_parents.store(1, std::memory_order_release);
+    delete graph;
+}
 
-        // Register dependencies in queue, will further increase child->wait_parents
-        for (uint32_t i = 0; i < parent_count; ++i)
-            pool->queue.add_dependency((Task *) parent[i], task);
-    }
+/// Record the cancellation of a task whose work unit is held by the caller
+static void task_mark_cancelled(Task *task) {
+    task->cancelled.store(true, std::memory_order_relaxed);
 
-    task->size = size;
-    task->func = func;
-    task->pool = pool;
+    bool value = false;
+    if (task->exception_used.compare_exchange_strong(value, true)) {
+        NT_TRACE("task %p was cancelled", task);
+        task->exception = std::make_exception_ptr(drjit::task_cancelled());
+    }
+}
 
-    if (payload) {
-        if (payload_deleter || payload_size == 0) {
-            task->payload = payload;
-            task->payload_deleter = payload_deleter;
-        } else if (payload_size <= sizeof(Task::payload_storage)) {
-            task->payload = task->payload_storage;
-            memcpy(task->payload_storage, payload, payload_size);
-            task->payload_deleter = nullptr;
-        } else {
-            /* Payload doesn't fit into temporary storage, and no
-               custom deleter was provided. Make a temporary copy. */
-            task->payload = malloc(payload_size);
-            task->payload_deleter = free;
-            NT_ASSERT(task->payload != nullptr);
-            memcpy(task->payload, payload, payload_size);
-        }
+/// Store the exception being handled, unless another one was stored already
+static NT_NOINLINE void task_store_exception(Task *task) {
+    bool value = false;
+    if (task->exception_used.compare_exchange_strong(value, true)) {
+        NT_TRACE("exception caught, storing..");
+        task->exception = std::current_exception();
     } else {
-        task->payload = nullptr;
-        task->payload_deleter = nullptr;
+        NT_TRACE("exception caught, ignoring (an exception was already stored)");
     }
+}
 
-    bool push = true;
-    if (has_parent) {
-        /* Undo the earlier 'wait' increment. If the value is now zero, all
-           parent tasks have completed and the job can be pushed. Otherwise,
-           it's somebody else's job to carry out this step. */
-        push = task->wait_parents.fetch_sub(1) == 1;
-    }
+/* Bookkeeping before and after running a work unit. These are kept out of
+   line so that the frame of 'task_wait()' and 'pool_work_until()', which
+   stays on the stack while callbacks wait for other tasks, remains small. */
+static NT_NOINLINE void pool_run_begin(Pool *pool, TaskRange range) {
+    Task *task = range.task;
 
-    if (push)
-        pool->queue.push(task);
+    if (pool->queue.recording())
+        pool->queue.record(range);
 
-    return task;
+    if (!(task->flags & NANOTHREAD_TASK_ALWAYS_RUN) && task->cancel_requested())
+        task_mark_cancelled(task);
+
+    if ((task->func || task->func_range) && task->exception_used.load() &&
+        (task->flags & NANOTHREAD_TASK_ALWAYS_RUN) == 0) {
+        NT_TRACE("not running callback (task=%p, index=[%u, %u)) because "
+                 "another work unit of this task generated an exception "
+                 "or the task was cancelled", task, range.begin, range.end);
+
+        if (task->cancelled.load(std::memory_order_relaxed))
+            pool->queue.count(StatUnitsCancelled, range.size());
+    }
 }
 
-static void pool_execute_task(Pool *pool, bool (*stopping_criterion)(void *),
-                              void *payload, bool may_sleep) {
-    Task *task;
-    uint32_t index;
-    std::tie(task, index) =
-        pool->queue.pop_or_sleep(stopping_criterion, payload, may_sleep);
+static NT_NOINLINE void pool_run_end(Pool *pool, TaskRange range) {
+    pool->queue.count(StatWorkUnits, range.size());
+    pool->queue.release(range.task, false, range.size());
+}
 
-    if (task) {
-        if (task->func) {
-            if (task->exception_used.load()) {
-                NT_TRACE(
-                    "not running callback (task=%p, index=%u) because another "
-                    "work unit of this task generated an exception",
-                    task, index);
+/// Invoke the callback of a work unit (unless it should be skipped)
+static NT_INLINE void pool_run_callback(TaskRange range) {
+    Task *task = range.task;
+
+    if ((task->func || task->func_range) &&
+        ((task->flags & NANOTHREAD_TASK_ALWAYS_RUN) ||
+         !task->exception_used.load())) {
+        Task *prev_task = current_task_tls;
+        current_task_tls = task;
+
+        try {
+            NT_TRACE("running callback (task=%p, index=[%u, %u), "
+                     "payload=%p)", task, range.begin, range.end,
+                     task->payload);
+            if (task->func_range) {
+                task->func_range(range.begin, range.end, task->payload);
             } else {
-                try {
-                    NT_TRACE("running callback (task=%p, index=%u, payload=%p)", task, index, task->payload);
-                    task->func(index, task->payload);
-                } catch (...) {
-                    bool value = false;
-                    if (task->exception_used.compare_exchange_strong(value, true)) {
-                        NT_TRACE("exception caught, storing..");
-                        task->exception = std::current_exception();
-                    } else {
-                        NT_TRACE("exception caught, ignoring (an exception was already stored)");
-                    }
+                for (uint32_t i = range.begin; i != range.end; ++i) {
+                    // Skip the rest if another work unit failed
+                    if (i != range.begin && task->exception_used.load())
+                        break;
+                    task->func(i, task->payload);
                 }
             }
+        } catch (...) {
+            task_store_exception(task);
         }
 
-        pool->queue.release(task);
+        current_task_tls = prev_task;
+
+        // The callback may have returned early due to a cancellation
+        if (!(task->flags & NANOTHREAD_TASK_ALWAYS_RUN) &&
+            task->cancel_requested())
+            task_mark_cancelled(task);
+    }
+}
+
+/// Variant of 'pool_run_range()' that records the execution in the trace
+static NT_NOINLINE void pool_run_traced(Pool *pool, TaskRange range) {
+    uint64_t trace_start = trace_time();
+
+    pool_run_begin(pool, range);
+    pool_run_callback(range);
+
+    trace_record(TraceType::Run, trace_start, trace_time(), range.task,
+                 range.begin, range.end, range.task->seq);
+
+    pool_run_end(pool, range);
+}
+
+/// Run a work unit obtained from the queue of 'pool' and release it
+static NT_INLINE void pool_run_range(Pool *pool, TaskRange range) {
+    if (!range.task)
+        return;
+
+    if (tracing()) {
+        pool_run_traced(pool, range);
+        return;
     }
+
+    pool_run_begin(pool, range);
+    pool_run_callback(range);
+    pool_run_end(pool, range);
+}
+
+static NT_INLINE void pool_execute_task(Pool *pool,
+                                        bool (*stopping_criterion)(void *),
+                                        void *payload, bool may_sleep) {
+    pool_run_range(pool, pool->queue.pop_or_sleep(stopping_criterion, payload,
+                                                  may_sleep));
 }
 
 void pool_work_until(Pool *pool, bool (*stopping_criterion)(void *), void *payload) {
@@ -379,9 +1894,30 @@ void pool_work_until(Pool *pool, bool (*stopping_criterion)(void *), void *paylo
         pool_execute_task(pool, stopping_criterion, payload, false);
 }
 
+uint32_t pool_attach_thread(Pool *pool) {
+    if (!pool)
+        pool = pool_default();
+    return pool->queue.attach_thread();
+}
+
+void pool_detach_thread(Pool *pool) {
+    if (!pool)
+        pool = pool_default_inst;
+    if (!pool || pool->queue.is_worker())
+        return;
+
+    // Run the tasks that are still waiting for this thread
+    auto mailbox_empty = [](void *ptr) -> bool {
+        return ((TaskQueue *) ptr)->mailbox_empty();
+    };
+    pool_work_until(pool, mailbox_empty, &pool->queue);
+
+    pool->queue.detach_thread();
+}
+
 #if defined(__SSE2__)
 struct FTZGuard {
-    FTZGuard(bool enable) : enable(enable) {
+    FTZGuard(bool enable) : enable(enable), csr(0) {
         if (enable) {
             csr = _mm_getcsr();
             _mm_setcsr(csr | (_MM_FLUSH_ZERO_ON | _MM_DENORMALS_ZERO_ON));
@@ -400,6 +1936,11 @@ struct FTZGuard {
 struct FTZGuard { FTZGuard(bool) { } };
 #endif
 
+/// Rethrow the exception of a task (out of line, to keep 'task_wait()' small)
+static NT_NOINLINE void task_rethrow(Task *task) {
+    std::rethrow_exception(task->exception);
+}
+
 void task_wait(Task *task) {
     if (task) {
         Pool *pool = task->pool;
@@ -421,7 +1962,7 @@ void task_wait(Task *task) {
         task->wait_count--;
 
         if (task->exception)
-            std::rethrow_exception(task->exception);
+            task_rethrow(task);
     }
 }
 
@@ -445,41 +1986,25 @@ void task_wait_and_release(Task *task) NANOTHREAD_THROW {
     task_release(task);
 }
 
-#if defined(_WIN32)
-static float timer_frequency_scale = 0.f;
-#endif
-
-NANOTHREAD_EXPORT float task_time(Task *task) NANOTHREAD_THROW {
-    if (!task)
+NANOTHREAD_EXPORT uint64_t task_time_ns(Task *task) NANOTHREAD_THROW {
+    if (!task || task->time_end < task->time_start)
         return 0;
-
-#if !defined(_WIN32)
-    return (task->time_end.tv_sec - task->time_start.tv_sec) * 1e3f +
-           (task->time_end.tv_nsec - task->time_start.tv_nsec) * 1e-6f;
-#else
-    if (timer_frequency_scale == 0.f) {
-        LARGE_INTEGER timer_frequency;
-        QueryPerformanceFrequency(&timer_frequency);
-        timer_frequency_scale = 1e3f / timer_frequency.QuadPart;
-    }
-
-    return timer_frequency_scale *
-           (task->time_end.QuadPart - task->time_start.QuadPart);
-#endif
+    return timer_ns(task->time_end - task->time_start);
 }
 
-Worker::Worker(Pool *pool, uint32_t id, bool ftz)
-    : pool(pool), id(id), stop(false), ftz(ftz) {
-    thread = std::thread(&Worker::run, this);
+NANOTHREAD_EXPORT float task_time(Task *task) NANOTHREAD_THROW {
+    return (float) (task_time_ns(task) * 1e-6);
 }
 
-Worker::~Worker() { thread.join(); }
-
-void Worker::run() {
-    thread_id_tls = id;
+Worker::Worker(Pool *pool, uint32_t id, bool ftz)
+    : pool(pool), id(id), state(WorkerRunning), ftz(ftz) { }
 
-    NT_TRACE("worker started");
+Worker::~Worker() {
+    if (thread.joinable())
+        thread.join();
+}
 
+static void set_thread_name(uint32_t id) {
     #if defined(_WIN32)
         wchar_t buf[24];
         _snwprintf(buf, sizeof(buf) / sizeof(wchar_t), L"nanothread worker %u", id);
@@ -493,15 +2018,225 @@ void Worker::run() {
             pthread_setname_np(pthread_self(), buf);
         #endif
     #endif
+}
+
+void Worker::run() {
+    nanothread_thread_id_tls = id;
+
+    // Launch the next worker, if the pool is still growing
+    {
+        std::unique_lock<std::mutex> guard(pool->workers_mutex);
+        pool_spawn(pool);
+    }
+
+    uint32_t node = 0;
+    if (!pool->worker_cpus.empty()) {
+        size_t slot = (id - 1) % pool->worker_cpus.size();
+        pin_thread(pool->worker_cpus[slot]);
+        node = pool->worker_nodes[slot];
+    }
+
+    pool->queue.attach_worker(id, node);
+
+    // First-touch some task records on this worker's NUMA node
+    if (pool->queue.node_count() > 1)
+        pool->queue.reserve(node, NANOTHREAD_NUMA_RESERVE);
+
+    NT_TRACE("worker started");
+    set_thread_name(id);
 
     FTZGuard ftz_guard(ftz);
-    while (!stop)
-        pool_execute_task(
-            pool, [](void *ptr) -> bool { return *((bool *) ptr); }, &stop,
-            true);
+
+    auto retiring = [](void *ptr) -> bool {
+        return ((std::atomic<uint32_t> *) ptr)->load(std::memory_order_relaxed) !=
+               WorkerRunning;
+    };
+
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point last_check = Clock::now();
+    uint32_t iterations = 0;
+
+    while (true) {
+        while (state.load(std::memory_order_relaxed) == WorkerRunning) {
+            pool_execute_task(pool, retiring, &state, true);
+
+            if (id == 1 && ++iterations % NANOTHREAD_AUTO_SIZE_POLL == 0 &&
+                pool->auto_size.load(std::memory_order_relaxed)) {
+                Clock::time_point now = Clock::now();
+                if (now - last_check >=
+                    std::chrono::milliseconds(NANOTHREAD_AUTO_SIZE_INTERVAL)) {
+                    last_check = now;
+                    pool_auto_resize(pool);
+                }
+            }
+        }
+
+        // Exit unless a resize reactivated the worker in the meantime
+        uint32_t expected = WorkerRetiring;
+        if (state.compare_exchange_strong(expected, WorkerExiting))
+            break;
+    }
+
+    // Finish the work that remains on this worker's deque before exiting
+    auto local_empty = [](void *ptr) -> bool {
+        return ((TaskQueue *) ptr)->local_empty() &&
+               ((TaskQueue *) ptr)->mailbox_empty();
+    };
+
+    while (!local_empty(&pool->queue))
+        pool_execute_task(pool, local_empty, &pool->queue, false);
+
+    pool->queue.detach_worker();
 
     NT_TRACE("worker stopped");
 
-    thread_id_tls = 0;
+    nanothread_thread_id_tls = 0;
+    state = WorkerExited;
+}
+
+// Wake shared workers when work was pushed to one of the arenas
+static void arena_notify(void *payload, uint32_t count) {
+    ArenaGroup *group = (ArenaGroup *) payload;
+    if (group->sleepers.load() == 0)
+        return;
+
+    {
+        std::unique_lock<std::mutex> guard(group->mutex);
+        group->epoch++;
+    }
+
+    if (count == 1)
+        group->work_cv.notify_one();
+    else
+        group->work_cv.notify_all();
+}
+
+// Choose the arena that is furthest behind its share ('group->mutex' must be held)
+static Pool *arena_pick(ArenaGroup *group) {
+    Pool *result = nullptr;
+    for (Pool *pool : group->arenas) {
+        if (pool->arena_active >= pool->arena_limit.load(std::memory_order_relaxed) ||
+            (result && pool->arena_pass >= result->arena_pass) ||
+            !pool->queue.has_work())
+            continue;
+        result = pool;
+    }
+    return result;
+}
+
+// Wait until an arena needs a worker, returns nullptr upon shutdown
+static Pool *arena_acquire(ArenaGroup *group) {
+    std::unique_lock<std::mutex> guard(group->mutex);
+
+    while (true) {
+        if (group->stop)
+            return nullptr;
+
+        Pool *pool = arena_pick(group);
+
+        if (!pool) {
+            /* Announce the intent to sleep before checking again, so that
+               arena_notify() cannot miss work pushed in the meantime */
+            uint64_t epoch = group->epoch;
+            group->sleepers++;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            pool = arena_pick(group);
+            if (!pool) {
+                while (epoch == group->epoch && !group->stop)
+                    group->work_cv.wait(guard);
+            }
+            group->sleepers--;
+        }
+
+        if (pool) {
+            // An arena that was idle doesn't get to catch up on past time
+            if (pool->arena_pass < group->vtime)
+                pool->arena_pass = group->vtime;
+            group->vtime = pool->arena_pass;
+            pool->arena_active++;
+            return pool;
+        }
+    }
+}
+
+// Process the work of an arena for one quantum, returns the number of ranges
+static uint32_t arena_serve(Pool *pool, uint32_t id) {
+    FTZGuard ftz_guard(pool->ftz);
+    TaskQueue &queue = pool->queue;
+    queue.attach_worker(id);
+
+    uint32_t ranges = 0, polls = 0;
+    while (ranges < NANOTHREAD_ARENA_QUANTUM && polls < NANOTHREAD_ARENA_POLLS) {
+        TaskRange range = queue.pop_any();
+        if (!range.task) {
+            polls++;
+            std::this_thread::yield();
+            continue;
+        }
+        pool_run_range(pool, range);
+        ranges++;
+        polls = 0;
+    }
+
+    // The deque must be empty before the worker can leave
+    while (!queue.local_empty()) {
+        pool_run_range(pool, queue.pop_any());
+        ranges++;
+    }
+
+    queue.detach_worker();
+    return ranges;
+}
+
+// Charge the arena for the time that the worker spent on it
+static void arena_release(ArenaGroup *group, Pool *pool, uint32_t ranges) {
+    bool idle;
+    {
+        std::unique_lock<std::mutex> guard(group->mutex);
+        pool->arena_pass +=
+            (uint64_t) (ranges + 1) * NANOTHREAD_ARENA_STRIDE / pool->arena_weight;
+        idle = --pool->arena_active == 0;
+    }
+    if (idle)
+        group->leave_cv.notify_all();
+}
+
+static void arena_worker(ArenaGroup *group, uint32_t id) {
+    nanothread_thread_id_tls = id;
+    set_thread_name(id);
+    NT_TRACE("arena worker started");
+
+    while (Pool *pool = arena_acquire(group)) {
+        uint32_t ranges = arena_serve(pool, id);
+        arena_release(group, pool, ranges);
+    }
+
+    NT_TRACE("arena worker stopped");
+    nanothread_thread_id_tls = 0;
 }
 
+// Detach an arena from the shared workers, and stop them after the last one
+static void arena_remove(Pool *pool) {
+    std::unique_lock<std::mutex> guard(arena_lock);
+    ArenaGroup *group = pool->group;
+
+    {
+        std::unique_lock<std::mutex> guard2(group->mutex);
+        std::vector<Pool *> &arenas = group->arenas;
+        arenas.erase(std::find(arenas.begin(), arenas.end(), pool));
+        while (pool->arena_active > 0)
+            group->leave_cv.wait(guard2);
+
+        if (!arenas.empty())
+            return;
+
+        group->stop = true;
+    }
+
+    group->work_cv.notify_all();
+    for (std::thread &thread : group->threads)
+        thread.join();
+
+    delete group;
+    arena_group = nullptr;
+}
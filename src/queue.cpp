@@ -8,11 +8,22 @@
 */
 
 #include "queue.h"
+#include "trace.h"
+#include "timer.h"
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <ctime>
+#include <chrono>
+#include <new>
 
 #if defined(_WIN32)
 #  include <windows.h>
+#elif defined(__linux__)
+#  include <sched.h>
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#  include <linux/futex.h>
 #endif
 
 #if defined(_MSC_VER)
@@ -21,11 +32,63 @@
 #  include <emmintrin.h>
 #endif
 
-/// Put worker threads to sleep after 500K attempts to get work
-#define NANOTHREAD_MAX_ATTEMPTS 500000
+/// Default upper bound on the spinning time of idle threads (microseconds)
+#if !defined(NANOTHREAD_SPIN_BUDGET)
+#  define NANOTHREAD_SPIN_BUDGET 50000
+#endif
+
+/// Lower bound of the adaptive spinning time before parking (microseconds)
+#if !defined(NANOTHREAD_SPIN_MIN)
+#  define NANOTHREAD_SPIN_MIN 50
+#endif
+
+/// Maximum number of 'pause' instructions between two attempts to get work
+#if !defined(NANOTHREAD_MAX_BACKOFF)
+#  define NANOTHREAD_MAX_BACKOFF 32
+#endif
+
+/// Initial capacity of a worker's work-stealing deque
+#define NANOTHREAD_DEQUE_CAPACITY 64
+
+/// Capacity of the per-worker caches of unused task records
+#define NANOTHREAD_CACHE_SIZE 64
+
+/// Default interval of the priority aging mechanism
+#define NANOTHREAD_AGING_INTERVAL 32
+
+/// TLS variables storing the deque and mailbox of each thread and a seed for stealing
+#if defined(_MSC_VER)
+    static __declspec(thread) TaskDeque *deque_tls = nullptr;
+    static __declspec(thread) Mailbox *mailbox_tls = nullptr;
+    static __declspec(thread) uint32_t steal_seed_tls = 0;
+    static __declspec(thread) uint32_t spin_limit_tls = (uint32_t) -1;
+    static __declspec(thread) uint32_t pop_count_tls = 0;
+    static __declspec(thread) uint32_t handoff_tls = 0;
+#else
+    static __thread TaskDeque *deque_tls = nullptr;
+    static __thread Mailbox *mailbox_tls = nullptr;
+    static __thread uint32_t steal_seed_tls = 0;
+    static __thread uint32_t spin_limit_tls = (uint32_t) -1;
+    static __thread uint32_t pop_count_tls = 0;
+    static __thread uint32_t handoff_tls = 0;
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+/// Return the first (suitably aligned) task record of a slab
+static Task *slab_tasks(uint8_t *slab) {
+    uintptr_t ptr = (uintptr_t) slab;
+    ptr = (ptr + alignof(Task) - 1) / alignof(Task) * alignof(Task);
+    return (Task *) ptr;
+}
+
+static uint64_t elapsed_us(Clock::time_point start) {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+               Clock::now() - start).count();
+}
 
 /// Reduce power usage in busy-wait CAS loops
-static void pause() {
+static void cpu_pause() {
 #if defined(_M_X64) || defined(__SSE2__)
     _mm_pause();
 #endif
@@ -68,9 +131,125 @@ static Task::Ptr ldar(Task::Ptr &source) {
 #endif
 }
 
-TaskQueue::TaskQueue() : tasks_created(0), sleep_state(0) {
-    head = Task::Ptr(alloc(0));
-    tail = head;
+TaskDeque::Array::Array(uint64_t capacity)
+    : mask(capacity - 1), slots(new Slot[capacity]) { }
+
+TaskDeque::Array::~Array() { delete[] slots; }
+
+void TaskDeque::Array::put(int64_t i, const TaskRange &item) {
+    Slot &slot = slots[(uint64_t) i & mask];
+    slot.task.store(item.task, std::memory_order_relaxed);
+    slot.range.store(((uint64_t) item.end << 32) | item.begin,
+                     std::memory_order_relaxed);
+}
+
+TaskRange TaskDeque::Array::get(int64_t i) const {
+    const Slot &slot = slots[(uint64_t) i & mask];
+    uint64_t range = slot.range.load(std::memory_order_relaxed);
+    return TaskRange(slot.task.load(std::memory_order_relaxed),
+                     (uint32_t) range, (uint32_t) (range >> 32));
+}
+
+TaskDeque::TaskDeque(TaskQueue *queue, uint32_t id)
+    : queue(queue), id(id), node(0), top(0), bottom(0),
+      array(new Array(NANOTHREAD_DEQUE_CAPACITY)), cache(nullptr),
+      cache_size(0), payload_chunk(nullptr), mailbox(queue, id + 1) { }
+
+TaskDeque::~TaskDeque() {
+    NT_ASSERT(empty());
+    delete array.load();
+    for (Array *a : retired)
+        delete a;
+}
+
+TaskDeque::Array *TaskDeque::grow(Array *a, int64_t t, int64_t b) {
+    Array *a2 = new Array((a->mask + 1) * 2);
+    for (int64_t i = t; i < b; ++i)
+        a2->put(i, a->get(i));
+    retired.push_back(a);
+    array.store(a2, std::memory_order_release);
+    return a2;
+}
+
+void TaskDeque::push(TaskRange item) {
+    int64_t b = bottom.load(std::memory_order_relaxed),
+            t = top.load(std::memory_order_acquire);
+    Array *a = array.load(std::memory_order_relaxed);
+
+    if (b - t > (int64_t) a->mask)
+        a = grow(a, t, b);
+
+    a->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+bool TaskDeque::pop(TaskRange &item) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    bool success = true;
+    if (t <= b) {
+        item = a->get(b);
+        if (t == b) {
+            // Competing with thieves for the last item
+            success = top.compare_exchange_strong(t, t + 1,
+                                                  std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+    } else {
+        // Deque was empty
+        success = false;
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return success;
+}
+
+bool TaskDeque::steal(TaskRange &item) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return false;
+
+    /* The item may be stale if another thread got to it first. It
+       must not be dereferenced unless the following CAS succeeds. */
+    Array *a = array.load(std::memory_order_acquire);
+    item = a->get(t);
+
+    return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed);
+}
+
+Mailbox::Mailbox(TaskQueue *queue, uint32_t id)
+    : queue(queue), id(id), attached(false) {
+    list.head = Task::Ptr(queue->alloc(0));
+    list.tail = list.head;
+}
+
+TaskQueue::TaskQueue(uint32_t node_count)
+    : nodes(node_count > 0 ? node_count : 1),
+      lists(new TaskList[nodes * NANOTHREAD_PRIORITY_COUNT]),
+      recycle(new TaskStack[nodes]), tasks_created(0), payload_free(nullptr),
+      payload_shared(nullptr), idle(0), sleepers(0),
+      spin_budget(NANOTHREAD_SPIN_BUDGET), hot_workers(0), schedule_seq(0),
+      record_active(false), record_capacity(0), record_count(0),
+      replay(nullptr), critical_path(false), sleep_head(nullptr),
+      work_stealing(false), aging(NANOTHREAD_AGING_INTERVAL),
+      worker_count(0), deque_table(nullptr),
+      deque_count(0), driver_table(nullptr), driver_count(0),
+      push_hook(nullptr), push_hook_payload(nullptr) {
+    for (uint32_t i = 0; i < nodes * NANOTHREAD_PRIORITY_COUNT; ++i) {
+        TaskList &list = lists[i];
+        list.head = Task::Ptr(alloc(0, i % nodes));
+        list.tail = list.head;
+    }
 }
 
 TaskQueue::~TaskQueue() {
@@ -78,9 +257,27 @@ TaskQueue::~TaskQueue() {
              deleted = 0, incomplete = 0,
              incomplete_size = 0;
 
-    // Free jobs that are still in the queue
-    Task::Ptr ptr = head;
-    while (ptr.task) {
+    // Collect jobs that are still in the queues and mailboxes
+    std::vector<TaskList *> all_lists;
+    for (uint32_t i = 0; i < nodes * NANOTHREAD_PRIORITY_COUNT; ++i)
+        all_lists.push_back(&lists[i]);
+    for (std::unique_ptr<TaskDeque> &deque : deques)
+        all_lists.push_back(&deque->mailbox.list);
+    for (std::unique_ptr<Mailbox> &mailbox : drivers)
+        all_lists.push_back(&mailbox->list);
+
+    std::vector<Task::Ptr> pending;
+    for (TaskList *list : all_lists) {
+        Task::Ptr ptr = list->head;
+        while (ptr.task) {
+            pending.push_back(ptr);
+            ptr = ptr.task->next;
+        }
+    }
+
+    // Free them, along with children that would have become ready
+    for (size_t i = 0; i < pending.size(); ++i) {
+        Task::Ptr ptr = pending[i];
         Task *task = ptr.task;
 
         if (ptr.remain() != 0) {
@@ -88,27 +285,40 @@ TaskQueue::~TaskQueue() {
             incomplete++;
         }
 
-        for (Task *child : task->children) {
+        for (TaskLink *link = task->children.load(); link; link = link->next) {
+            Task *child = link->child;
             uint32_t wait = child->wait_parents.fetch_sub(1);
             NT_ASSERT(wait != 0);
             if (wait == 1)
-                push(child);
+                pending.push_back(Task::Ptr(child, child->size));
         }
 
         task->clear();
         deleted++;
-        ptr = task->next;
-        delete task;
     }
 
-    // Free jobs on the free-job stack
-    ptr = recycle;
-    while (ptr.task) {
-        Task *task = ptr.task;
-        NT_ASSERT(task->payload == nullptr && task->children.empty());
-        deleted++;
-        ptr = task->next;
-        delete task;
+    // Free jobs on the free-job stacks
+    for (uint32_t i = 0; i < nodes; ++i) {
+        Task::Ptr ptr = recycle[i].head;
+        while (ptr.task) {
+            Task *task = ptr.task;
+            NT_ASSERT(task->payload == nullptr && task->children.load() == nullptr);
+            deleted++;
+            ptr = task->next;
+        }
+    }
+
+    // .. and in the caches of workers
+    for (std::unique_ptr<TaskDeque> &deque : deques) {
+        for (Task *task = deque->cache; task; task = task->next.task)
+            deleted++;
+    }
+
+    // Destroy all task records, the slabs are freed along with the queue
+    for (std::unique_ptr<uint8_t[]> &slab : slabs) {
+        Task *tasks = slab_tasks(slab.get());
+        for (uint32_t i = 0; i < NANOTHREAD_SLAB_SIZE; ++i)
+            tasks[i].~Task();
     }
 
     if (created != deleted)
@@ -121,78 +331,328 @@ TaskQueue::~TaskQueue() {
                 "completed!\n", incomplete, incomplete_size);
 }
 
-Task *TaskQueue::alloc(uint32_t size) {
-    Task::Ptr node = ldar(recycle);
+Task *TaskQueue::alloc(uint32_t size, uint32_t node_id) {
+    TaskDeque *local = local_deque();
+    Task *task = nullptr;
 
-    while (true) {
-        // Stop if stack is empty
-        if (!node)
-            break;
+    // Fast path: take a record from the worker's cache
+    if (local && local->cache &&
+        local->node.load(std::memory_order_relaxed) == node_id) {
+        task = local->cache;
+        local->cache = task->next.task;
+        local->cache_size--;
+    }
+
+    if (!task) {
+        Task::Ptr &stack = recycle[node_id].head;
+        Task::Ptr node = ldar(stack);
+        uint32_t retries = 0;
+
+        while (true) {
+            // Stop if stack is empty
+            if (!node)
+                break;
+
+            // Load the next node
+            Task::Ptr next = ldar(node.task->next);
 
-        // Load the next node
-        Task::Ptr next = ldar(node.task->next);
+            // Next, try to move it to the stack head
+            if (cas(stack, node, node.update_task(next.task)))
+                break;
 
-        // Next, try to move it to the stack head
-        if (cas(recycle, node, node.update_task(next.task)))
+            retries++;
+            cpu_pause();
+        }
+
+        if (retries)
+            count(StatAllocRetries, retries);
+
+        task = node.task ? node.task : alloc_slab(node_id);
+    }
+
+    init(task, size, node_id);
+    return task;
+}
+
+void TaskQueue::alloc_batch(uint32_t node, uint32_t count,
+                            std::vector<Task *> &out) {
+    Task::Ptr &stack = recycle[node].head;
+    Task::Ptr head = ldar(stack);
+    uint32_t taken = 0, retries = 0;
+
+    /* Detach up to 'count' records from the top of the recycle stack. The
+       records are never freed, so the chain can be traversed before the CAS
+       validates that the stack did not change in the meantime. */
+    while (head) {
+        Task *last = head.task;
+        taken = 1;
+        while (taken < count && last->next.task) {
+            last = last->next.task;
+            taken++;
+        }
+
+        if (cas(stack, head, head.update_task(last->next.task)))
             break;
 
-        pause();
+        taken = 0;
+        retries++;
+        cpu_pause();
     }
 
-    Task *task;
+    if (retries)
+        this->count(StatAllocRetries, retries);
 
-    if (node.task) {
-        task = node.task;
-    } else {
-        task = new Task();
-        tasks_created++;
+    Task *task = head.task;
+    for (uint32_t i = 0; i < taken; ++i) {
+        out.push_back(task);
+        task = task->next.task;
+    }
+
+    // Allocate whole slabs for the remainder
+    for (uint32_t i = taken; i < count; i += NANOTHREAD_SLAB_SIZE) {
+        Task *tasks = alloc_slab(node, false);
+        for (uint32_t j = 0; j < NANOTHREAD_SLAB_SIZE; ++j)
+            out.push_back(tasks + j);
     }
+}
 
+void TaskQueue::init(Task *task, uint32_t size, uint32_t node_id) {
     task->next = Task::Ptr();
+    task->node = (uint16_t) node_id;
+    task->priority = NANOTHREAD_PRIORITY_NORMAL;
+    task->flags = 0;
+    task->graph = nullptr;
+    task->cancelled.store(false, std::memory_order_relaxed);
+    task->mailbox = nullptr;
     task->refcount.store(size + (size == 0 ? high_bit : (3 * high_bit)),
                          std::memory_order_relaxed);
     task->wait_parents.store(0, std::memory_order_relaxed);
     task->wait_count.store(0, std::memory_order_relaxed);
     task->size = size;
-    memset(&task->time_start, 0, sizeof(task->time_start));
-    memset(&task->time_end, 0, sizeof(task->time_end));
+    task->time_start = task->time_end = 0;
+    task->seq = (uint32_t) -1;
+    task->cost = (float) size;
+    task->rank.store(-1.f, std::memory_order_relaxed);
 
     NT_TRACE("created new task %p with size=%u", task, size);
+}
 
-    return task;
+void TaskQueue::reserve(uint32_t node, uint32_t count) {
+    for (uint32_t i = 0; i < count; i += NANOTHREAD_SLAB_SIZE)
+        recycle_task(alloc_slab(node));
 }
 
-void TaskQueue::release(Task *task, bool high) {
-    uint64_t result = task->refcount.fetch_sub(high ? high_bit : 1);
+Task *TaskQueue::alloc_slab(uint32_t node, bool recycle) {
+    std::unique_ptr<uint8_t[]> slab(
+        new uint8_t[NANOTHREAD_SLAB_SIZE * sizeof(Task) + alignof(Task) - 1]);
+    Task *tasks = slab_tasks(slab.get());
+
+    /* Construct the records on the calling thread, which first-touches
+       their memory. Keep the first one and recycle the rest. */
+    for (uint32_t i = 0; i < NANOTHREAD_SLAB_SIZE; ++i) {
+        Task *task = new (tasks + i) Task();
+        task->node = (uint16_t) node;
+        if (i > 0 && recycle)
+            recycle_task(task);
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(slab_mutex);
+        slabs.push_back(std::move(slab));
+    }
+
+    tasks_created += NANOTHREAD_SLAB_SIZE;
+    NT_TRACE("allocated a slab of %u tasks for node %u", NANOTHREAD_SLAB_SIZE,
+             node);
+
+    return tasks;
+}
+
+void *TaskQueue::alloc_payload(uint32_t size, PayloadChunk **chunk) {
+    size = (size + 15) & ~15u;
+
+    if (size > NANOTHREAD_PAYLOAD_MAX) {
+        // Too large to share a chunk, freed along with the payload
+        uint8_t *ptr = (uint8_t *) malloc(NANOTHREAD_PAYLOAD_HEADER + size);
+        NT_ASSERT(ptr != nullptr);
+        PayloadChunk *c = new (ptr) PayloadChunk();
+        c->refs.store(1, std::memory_order_relaxed);
+        c->offset = NANOTHREAD_PAYLOAD_HEADER + size;
+        c->queue = nullptr;
+        c->next = nullptr;
+        *chunk = c;
+        return ptr + NANOTHREAD_PAYLOAD_HEADER;
+    }
+
+    TaskDeque *local = local_deque();
+    if (local)
+        return bump_payload(local->payload_chunk, size, chunk);
+
+    std::unique_lock<std::mutex> guard(payload_mutex);
+    return bump_payload(payload_shared, size, chunk);
+}
+
+void *TaskQueue::bump_payload(PayloadChunk *&current, uint32_t size,
+                              PayloadChunk **chunk) {
+    PayloadChunk *c = current;
+
+    // Only the reference of the allocating thread is left: rewind the chunk
+    if (c && c->refs.load(std::memory_order_acquire) == 1)
+        c->offset = NANOTHREAD_PAYLOAD_HEADER;
+
+    if (!c || c->offset + size > NANOTHREAD_PAYLOAD_CHUNK) {
+        PayloadChunk::release(c);
+
+        std::unique_lock<std::mutex> guard(slab_mutex);
+        c = payload_free;
+        if (c) {
+            payload_free = c->next;
+        } else {
+            // Chunks are aligned to 64 bytes, like the task records
+            std::unique_ptr<uint8_t[]> mem(
+                new uint8_t[NANOTHREAD_PAYLOAD_CHUNK + 63]);
+            uintptr_t addr = ((uintptr_t) mem.get() + 63) & ~(uintptr_t) 63;
+            c = new ((void *) addr) PayloadChunk();
+            c->queue = this;
+            payload_chunks.push_back(std::move(mem));
+        }
+        guard.unlock();
+
+        c->refs.store(1, std::memory_order_relaxed);
+        c->offset = NANOTHREAD_PAYLOAD_HEADER;
+        c->next = nullptr;
+        current = c;
+    }
+
+    c->refs.fetch_add(1, std::memory_order_relaxed);
+    void *ptr = (uint8_t *) c + c->offset;
+    c->offset += size;
+    *chunk = c;
+    return ptr;
+}
+
+void TaskQueue::recycle_payload(PayloadChunk *chunk) {
+    std::unique_lock<std::mutex> guard(slab_mutex);
+    chunk->next = payload_free;
+    payload_free = chunk;
+}
+
+void PayloadChunk::release(PayloadChunk *chunk) {
+    if (!chunk || chunk->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if (chunk->queue)
+        chunk->queue->recycle_payload(chunk);
+    else
+        free(chunk);
+}
+
+void TaskQueue::recycle_task(Task *task) {
+    TaskDeque *local = local_deque();
+
+    CancelToken::release(task->token);
+    task->token = nullptr;
+
+    // Fast path: keep the record in the worker's cache
+    if (local && local->node.load(std::memory_order_relaxed) == task->node) {
+        if (local->cache_size == NANOTHREAD_CACHE_SIZE)
+            flush_cache(local, NANOTHREAD_CACHE_SIZE / 2);
+
+        task->next = Task::Ptr(local->cache);
+        local->cache = task;
+        local->cache_size++;
+        return;
+    }
+
+    push_stack(task->node, task, task);
+}
+
+void TaskQueue::flush_cache(TaskDeque *deque, uint32_t count) {
+    if (count == 0)
+        return;
+
+    // Detach a chain of 'count' records from the cache
+    Task *first = deque->cache, *last = first;
+    for (uint32_t i = 1; i < count; ++i)
+        last = last->next.task;
+    deque->cache = last->next.task;
+    deque->cache_size -= count;
+
+    // .. and push it onto the shared stack using a single CAS
+    push_stack(deque->node.load(std::memory_order_relaxed), first, last);
+
+    NT_TRACE("flushed %u task records from the cache of worker %u", count,
+             deque->id + 1);
+}
+
+void TaskQueue::push_stack(uint32_t node_id, Task *first, Task *last) {
+    Task::Ptr &stack = recycle[node_id].head;
+    Task::Ptr node = ldar(stack);
+
+    while (true) {
+        last->next = node;
+
+        if (cas(stack, node, node.update_task(first)))
+            break;
+
+        cpu_pause();
+    }
+}
+
+void TaskQueue::release(Task *task, bool high, uint32_t count) {
+    uint64_t result =
+        task->refcount.fetch_sub(high ? shift(count) : (uint64_t) count);
     uint32_t ref_lo = (uint32_t) result,
              ref_hi = (uint32_t) (result >> 32);
 
-    NT_ASSERT((!high || ref_hi > 0) && (high || ref_lo > 0));
-    ref_hi -= (uint32_t) high;
-    ref_lo -= (uint32_t) !high;
+    NT_ASSERT((!high || ref_hi >= count) && (high || ref_lo >= count));
+    ref_hi -= high ? count : 0;
+    ref_lo -= high ? 0 : count;
 
-    NT_TRACE("dec_ref(%p, (%i, %i)) -> ref = (%u, %u)", task, (int) high,
-             (int) !high, ref_hi, ref_lo);
+    NT_TRACE("dec_ref(%p, (%u, %u)) -> ref = (%u, %u)", task,
+             high ? count : 0, high ? 0 : count, ref_hi, ref_lo);
 
     // If all work has completed: schedule children and free payload
     if (!high && ref_lo == 0) {
         NT_TRACE("all work associated with task %p has completed.", task);
+        this->count(StatTasksCompleted);
 
         if (profile_tasks) {
-            #if defined(_WIN32)
-                QueryPerformanceCounter(&task->time_end);
-            #else
-                clock_gettime(CLOCK_MONOTONIC, &task->time_end);
-            #endif
+            task->time_end = timer_ticks();
         }
 
-        for (Task *child : task->children) {
-            uint32_t wait = child->wait_parents.fetch_sub(1);
+        /* Detach the successor list. Dependencies can no longer be added
+           at this point, and the list is reversed to notify children in
+           the order in which they were registered. The list of a resident
+           task of a graph is already in this order (apart from children
+           outside of the graph) and must be preserved for later launches. */
+        TaskGraph *graph = task->graph;
+        TaskLink *link = task->children.exchange(nullptr, std::memory_order_acquire),
+                 *prev = nullptr;
+        if (graph) {
+            prev = link;
+        } else {
+            while (link) {
+                TaskLink *next = link->next;
+                link->next = prev;
+                prev = link;
+                link = next;
+            }
+        }
 
-            NT_TRACE("notifying child %p of task %p: wait=%u", child, task,
-                     wait - 1);
+        // In critical path mode, ready children are pushed after ranking them
+        bool by_rank = critical_path_enabled();
+        std::vector<Task *> ready;
 
-            NT_ASSERT(wait > 0);
+        for (link = prev; link; ) {
+            /* The link is stored in the child's record, which may be reused
+               as soon as the child has been notified. */
+            Task *child = link->child;
+            link = link->next;
+
+            // Cancellations propagate along with the associated exception
+            if (task->cancelled.load() && task->exception_used.load())
+                child->cancelled.store(true, std::memory_order_relaxed);
 
             if (task->exception_used.load()) {
                 bool expected = false;
@@ -206,35 +666,112 @@ void TaskQueue::release(Task *task, bool high) {
                 }
             }
 
+            uint32_t wait = child->wait_parents.fetch_sub(1);
+
+            NT_TRACE("notifying child %p of task %p: wait=%u", child, task,
+                     wait - 1);
+
+            NT_ASSERT(wait > 0);
+
             if (wait == 1) {
                 NT_TRACE("Child %p of task %p is ready for execution.", child,
                          task);
-                push(child);
+                if (by_rank)
+                    ready.push_back(child);
+                else
+                    push(child);
             }
         }
 
-        task->clear();
+        if (ready.size() > 1) {
+            /* Workers pop their deque from the end, where the most critical
+               child must go. The shared queues are processed from the front. */
+            bool lifo = work_stealing_enabled() && local_deque();
+            for (Task *child : ready)
+                rank(child);
+            std::sort(ready.begin(), ready.end(),
+                      [lifo](const Task *a, const Task *b) {
+                          float ra = a->rank.load(std::memory_order_relaxed),
+                                rb = b->rank.load(std::memory_order_relaxed);
+                          return lifo ? ra < rb : ra > rb;
+                      });
+        }
+
+        for (Task *child : ready)
+            push(child);
+
+        /* The payload of tasks flagged with NANOTHREAD_TASK_KEEP_PAYLOAD
+           remains accessible until the record is recycled. */
+        if (!graph && !(task->flags & NANOTHREAD_TASK_KEEP_PAYLOAD))
+            task->clear();
 
         // Possible that waiting threads were put to sleep
         if (task->wait_count.load() > 0)
-            wakeup();
+            wakeup_waiting(task);
 
         release(task, true);
     } else if (high && ref_hi == 0) {
         // Nobody holds any references at this point, recycle task
 
         NT_ASSERT(ref_lo == 0);
+
+        if (task->graph) {
+            // Resident tasks of graphs are kept for the next launch
+            NT_TRACE("all usage of resident task %p is done.", task);
+            task->graph->active.fetch_sub(1, std::memory_order_release);
+            return;
+        }
+
         NT_TRACE("all usage of task %p is done, recycling.", task);
+        this->count(StatTasksRecycled);
 
-        Task::Ptr node = ldar(recycle);
-        while (true) {
-            task->next = node;
+        if (task->flags & NANOTHREAD_TASK_KEEP_PAYLOAD)
+            task->clear();
 
-            if (cas(recycle, node, node.update_task(task)))
-                break;
+        recycle_task(task);
+    }
+}
+
+float TaskQueue::rank(Task *task) {
+    float value = task->rank.load(std::memory_order_relaxed);
+    if (value >= 0.f)
+        return value;
+
+    /* Iterative traversal, since dependency chains can be very long. A task
+       is ranked once all of its children are. */
+    struct Frame {
+        Task *task;
+        TaskLink *link;
+        float max;
+    };
+
+    std::vector<Frame> stack;
+    stack.push_back(
+        Frame{ task, task->children.load(std::memory_order_acquire), 0.f });
 
-            pause();
+    while (true) {
+        Frame &frame = stack.back();
+
+        if (frame.link) {
+            Task *child = frame.link->child;
+            frame.link = frame.link->next;
+
+            float r = child->rank.load(std::memory_order_relaxed);
+            if (r >= 0.f)
+                frame.max = std::max(frame.max, r);
+            else
+                stack.push_back(Frame{
+                    child, child->children.load(std::memory_order_acquire), 0.f });
+            continue;
         }
+
+        value = frame.task->cost + frame.max;
+        frame.task->rank.store(value, std::memory_order_relaxed);
+        stack.pop_back();
+
+        if (stack.empty())
+            return value;
+        stack.back().max = std::max(stack.back().max, value);
     }
 }
 
@@ -269,12 +806,21 @@ void TaskQueue::add_dependency(Task *parent, Task *child) {
                                                    std::memory_order_relaxed))
             break;
 
-        pause();
+        cpu_pause();
     }
 
-    // Otherwise, register the child task with the parent
-    parent->children.push_back(child);
+    /* Otherwise, register the child task with the parent. Other threads may
+       concurrently do the same, hence the successor list is updated via CAS.
+       Elements are never removed while the parent is alive, which rules out
+       the ABA problem. */
     uint32_t wait = ++child->wait_parents;
+    TaskLink *link = child->parents.alloc();
+    link->child = child;
+    link->next = parent->children.load(std::memory_order_relaxed);
+    while (!parent->children.compare_exchange_weak(link->next, link,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed))
+        cpu_pause();
     (void) wait;
 
     NT_TRACE("registering dependency: parent=%p, child=%p, child->wait=%u",
@@ -286,15 +832,546 @@ void TaskQueue::add_dependency(Task *parent, Task *child) {
     release(parent);
 }
 
+void TaskQueue::add_private_dependency(Task *parent, Task *child) {
+    TaskLink *link = child->parents.alloc();
+    link->child = child;
+    link->next = parent->children.load(std::memory_order_relaxed);
+    parent->children.store(link, std::memory_order_relaxed);
+
+    NT_TRACE("registering private dependency: parent=%p, child=%p", parent,
+             child);
+}
+
 void TaskQueue::retain(Task *task) {
     NT_TRACE("retain(task=%p)", task);
     task->refcount.fetch_add(high_bit);
 }
 
+TaskDeque *TaskQueue::local_deque() const {
+    TaskDeque *deque = deque_tls;
+    return (deque && deque->queue == this) ? deque : nullptr;
+}
+
+uint32_t TaskQueue::current_node() const {
+    if (nodes == 1)
+        return 0;
+
+    TaskDeque *local = local_deque();
+    if (local)
+        return local->node.load(std::memory_order_relaxed);
+
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+#elif defined(_WIN32)
+    int cpu = (int) GetCurrentProcessorNumber();
+#else
+    int cpu = -1;
+#endif
+
+    if (cpu >= 0 && (size_t) cpu < cpu_nodes.size() && cpu_nodes[cpu] < nodes)
+        return cpu_nodes[cpu];
+
+    return 0;
+}
+
+bool TaskQueue::local_empty() const {
+    TaskDeque *deque = local_deque();
+    return !deque || deque->empty();
+}
+
+void TaskQueue::stats(PoolStats *out) {
+    uint64_t total[StatCount];
+    for (uint32_t i = 0; i < StatCount; ++i)
+        total[i] = external_stats.value[i].load(std::memory_order_relaxed);
+
+    {
+        std::unique_lock<std::mutex> guard(deque_mutex);
+        for (std::unique_ptr<TaskDeque> &deque : deques) {
+            for (uint32_t i = 0; i < StatCount; ++i)
+                total[i] += deque->stats.value[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    out->work_units = total[StatWorkUnits];
+    out->tasks_pushed = total[StatTasksPushed];
+    out->tasks_completed = total[StatTasksCompleted];
+    out->pops = total[StatPops];
+    out->steals = total[StatSteals];
+    out->push_retries = total[StatPushRetries];
+    out->pop_retries = total[StatPopRetries];
+    out->alloc_retries = total[StatAllocRetries];
+    out->idle_spins = total[StatIdleSpins];
+    out->sleeps = total[StatSleeps];
+    out->wakeups = total[StatWakeups];
+    out->tasks_created = tasks_created.load(std::memory_order_relaxed);
+    out->tasks_recycled = total[StatTasksRecycled];
+    out->inline_tasks = total[StatInlineTasks];
+    out->inline_nested = total[StatInlineNested];
+    out->units_cancelled = total[StatUnitsCancelled];
+    out->handoffs = total[StatHandoffs];
+
+    std::unique_lock<std::mutex> guard(slab_mutex);
+    out->payload_chunks = (uint64_t) payload_chunks.size();
+}
+
+TaskDeque *TaskQueue::worker_deque(uint32_t id) {
+    uint32_t index = id - 1;
+
+    if (index >= deques.size()) {
+        while (deques.size() <= index)
+            deques.emplace_back(new TaskDeque(this, (uint32_t) deques.size()));
+
+        /* Publish a new snapshot of the deque list. Thieves may still be
+           reading the previous one, hence it is kept around */
+        size_t count = deques.size();
+        std::unique_ptr<TaskDeque *[]> table(new TaskDeque *[count]);
+        for (size_t i = 0; i < count; ++i)
+            table[i] = deques[i].get();
+
+        deque_table.store(table.get(), std::memory_order_release);
+        deque_count.store((uint32_t) count, std::memory_order_release);
+        deque_tables.push_back(std::move(table));
+    }
+
+    return deques[index].get();
+}
+
+void TaskQueue::set_worker_ids(uint32_t count) {
+    std::unique_lock<std::mutex> guard(deque_mutex);
+    if (count > 0)
+        worker_deque(count);
+    for (size_t i = 0; i < deques.size(); ++i)
+        deques[i]->mailbox.attached.store(i < count, std::memory_order_release);
+}
+
+void TaskQueue::attach_worker(uint32_t id, uint32_t node) {
+    NT_ASSERT(id > 0);
+    std::unique_lock<std::mutex> guard(deque_mutex);
+
+    TaskDeque *deque = worker_deque(id);
+    deque->node.store(node < nodes ? node : 0, std::memory_order_relaxed);
+    deque_tls = deque;
+    mailbox_tls = &deque->mailbox;
+    steal_seed_tls = (id * 0x9E3779B9u) | 1u;
+
+    NT_TRACE("attach_worker(%u, node=%u)", id, node);
+}
+
+void TaskQueue::detach_worker() {
+    TaskDeque *deque = local_deque();
+    NT_ASSERT(deque && deque->empty());
+    flush_cache(deque, deque->cache_size);
+    deque_tls = nullptr;
+    mailbox_tls = nullptr;
+
+    NT_TRACE("detach_worker(%u)", deque->id + 1);
+}
+
+uint32_t TaskQueue::attach_thread() {
+    Mailbox *mailbox = local_mailbox();
+    if (mailbox)
+        return mailbox->id;
+
+    if (mailbox_tls) {
+        fprintf(stderr, "nanothread: pool_attach_thread(): the thread is "
+                        "already attached to another pool!\n");
+        abort();
+    }
+
+    std::unique_lock<std::mutex> guard(deque_mutex);
+    for (std::unique_ptr<Mailbox> &m : drivers) {
+        if (!m->attached.load(std::memory_order_relaxed)) {
+            mailbox = m.get();
+            break;
+        }
+    }
+
+    if (!mailbox) {
+        drivers.emplace_back(
+            new Mailbox(this, NANOTHREAD_DRIVER_ID | (uint32_t) drivers.size()));
+        mailbox = drivers.back().get();
+
+        // Publish a new snapshot, as in attach_worker()
+        size_t count = drivers.size();
+        std::unique_ptr<Mailbox *[]> table(new Mailbox *[count]);
+        for (size_t i = 0; i < count; ++i)
+            table[i] = drivers[i].get();
+
+        driver_table.store(table.get(), std::memory_order_release);
+        driver_count.store((uint32_t) count, std::memory_order_release);
+        driver_tables.push_back(std::move(table));
+    }
+
+    mailbox->attached.store(true, std::memory_order_release);
+    mailbox_tls = mailbox;
+
+    NT_TRACE("attach_thread(): id=%08x", mailbox->id);
+    return mailbox->id;
+}
+
+void TaskQueue::detach_thread() {
+    Mailbox *mailbox = local_mailbox();
+    if (!mailbox || local_deque())
+        return;
+
+    std::unique_lock<std::mutex> guard(deque_mutex);
+    mailbox->attached.store(false, std::memory_order_release);
+    mailbox_tls = nullptr;
+
+    NT_TRACE("detach_thread(): id=%08x", mailbox->id);
+}
+
+Mailbox *TaskQueue::mailbox(uint32_t id) const {
+    Mailbox *mailbox = nullptr;
+
+    if (id & NANOTHREAD_DRIVER_ID) {
+        uint32_t index = id & ~NANOTHREAD_DRIVER_ID;
+        if (index < driver_count.load(std::memory_order_acquire))
+            mailbox = driver_table.load(std::memory_order_acquire)[index];
+    } else if (id > 0 && id <= deque_count.load(std::memory_order_acquire)) {
+        mailbox = &deque_table.load(std::memory_order_acquire)[id - 1]->mailbox;
+    }
+
+    if (mailbox && !mailbox->attached.load(std::memory_order_acquire))
+        mailbox = nullptr;
+
+    return mailbox;
+}
+
+Mailbox *TaskQueue::local_mailbox() const {
+    Mailbox *mailbox = mailbox_tls;
+    return (mailbox && mailbox->queue == this) ? mailbox : nullptr;
+}
+
+bool TaskQueue::mailbox_empty() const {
+    Mailbox *mailbox = local_mailbox();
+    return !mailbox || list_empty(mailbox->list);
+}
+
+bool TaskQueue::steal(TaskDeque *local, TaskRange &item, bool same_node) {
+    uint32_t count = deque_count.load(std::memory_order_acquire);
+    if (count < 2)
+        return false;
+    TaskDeque **table = deque_table.load(std::memory_order_acquire);
+
+    // Visit the other deques starting from a random position (xorshift32)
+    uint32_t seed = steal_seed_tls;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    steal_seed_tls = seed;
+
+    uint32_t index = seed % count,
+             node = local->node.load(std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        TaskDeque *victim = table[index];
+
+        if (++index == count)
+            index = 0;
+
+        if (victim == local || victim->empty() ||
+            (victim->node.load(std::memory_order_relaxed) == node) != same_node)
+            continue;
+
+        if (victim->steal(item)) {
+            NT_TRACE("stole range [%u, %u) of task %p from worker %u",
+                     item.begin, item.end, item.task, victim->id + 1);
+            this->count(StatSteals);
+            if (tracing()) {
+                uint64_t now = trace_time();
+                trace_record(TraceType::Steal, now, now, item.task,
+                             item.begin, item.end, victim->id + 1);
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TaskRange TaskQueue::acquire(TaskDeque *local, TaskRange item) {
+    Task *task = item.task;
+    uint32_t count = task->retire() ? item.size() : claim_size(item.size()),
+             begin = item.begin + count,
+             end = item.end;
+
+    /* Keep the first 'count' work units, and recursively split off the upper
+       half of the remaining range so that other workers can steal large
+       pieces. Every piece contains at least 'count' work units. */
+    if (begin != end) {
+        while (end - begin > count) {
+            uint32_t mid = begin + (end - begin) / 2;
+            local->push(TaskRange(task, mid, end));
+            end = mid;
+        }
+        local->push(TaskRange(task, begin, end));
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeup_if_sleeping((end - item.begin) / count);
+    }
+
+    item.end = item.begin + count;
+    NT_TRACE("pop(task=%p, index=[%u, %u)) from deque", task, item.begin,
+             item.end);
+
+    if (item.begin == 0 && profile_tasks) {
+        task->time_start = timer_ticks();
+    }
+
+    return item;
+}
+
+TaskRange TaskQueue::pop_any() {
+    TaskDeque *local = local_deque();
+    uint32_t node = current_node(), interval = aging_interval();
+    TaskRange item;
+
+    // The replayed schedule determines the next range of this thread
+    Replay *r = replay.load(std::memory_order_acquire);
+    if (r) {
+        item = pop_replay(r);
+        if (item.task)
+            return item;
+    }
+
+    // Tasks that only this thread may execute come first
+    Mailbox *mailbox = local_mailbox();
+    if (mailbox && !list_empty(mailbox->list)) {
+        item = pop_list(mailbox->list);
+        if (item.task)
+            return item;
+    }
+
+    /* Visit the priority levels from highest to lowest, and periodically in
+       the reverse order so that low priority work cannot starve */
+    bool reverse = interval > 0 && ++pop_count_tls % interval == 0;
+
+    for (uint32_t i = 0; i < NANOTHREAD_PRIORITY_COUNT; ++i) {
+        uint32_t priority = reverse ? i : (NANOTHREAD_PRIORITY_COUNT - 1 - i);
+        bool normal = priority == NANOTHREAD_PRIORITY_NORMAL;
+
+        // Deques only store work of normal priority
+        if (normal && local) {
+            if (!local->empty() && local->pop(item))
+                return acquire(local, item);
+
+            if (work_stealing_enabled() && steal(local, item, true))
+                return acquire(local, item);
+        }
+
+        // Start with the queue of the current NUMA node
+        uint32_t n = node;
+        for (uint32_t j = 0; j < nodes; ++j) {
+            TaskList &l = list(n, priority);
+            if (!list_empty(l)) {
+                item = pop_list(l);
+                if (item.task)
+                    return item;
+            }
+            if (++n == nodes)
+                n = 0;
+        }
+
+        // Only steal from workers on other nodes once everything else ran dry
+        if (normal && local && nodes > 1 && work_stealing_enabled() &&
+            steal(local, item, false))
+            return acquire(local, item);
+    }
+
+    return TaskRange();
+}
+
+bool TaskQueue::list_empty(const TaskList &list) const {
+    Task::Ptr head = ldar(const_cast<Task::Ptr &>(list.head));
+    return !ldar(head.task->next).task;
+}
+
+void TaskQueue::wakeup_if_sleeping(uint32_t count) {
+    if (push_hook)
+        push_hook(push_hook_payload, count);
+
+    if (sleepers.load(std::memory_order_acquire) > 0)
+        wakeup(count, nullptr, Sleeper::Work);
+}
+
+bool TaskQueue::has_work() const {
+    for (uint32_t i = 0; i < nodes * NANOTHREAD_PRIORITY_COUNT; ++i) {
+        if (!list_empty(lists[i]))
+            return true;
+    }
+
+    uint32_t count = deque_count.load(std::memory_order_acquire);
+    TaskDeque **table = deque_table.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!table[i]->empty())
+            return true;
+    }
+
+    return false;
+}
+
+void TaskQueue::push_mailbox(Task *task) {
+    // The task may run as soon as it has been appended, read fields first
+    Mailbox *mailbox = task->mailbox;
+    NT_TRACE("push(task=%p, size=%u) to mailbox %08x", task, task->size,
+             mailbox->id);
+
+    push_list(mailbox->list, task, task);
+
+    // Only the owner can process the task, wake it if it is parked
+    if (sleepers.load(std::memory_order_acquire) > 0)
+        wakeup(1, nullptr, Sleeper::Work, mailbox);
+}
+
+bool TaskQueue::handoff(Task *task) {
+    uint32_t hot = hot_workers.load(std::memory_order_relaxed),
+             count = deque_count.load(std::memory_order_acquire);
+    TaskDeque **table = deque_table.load(std::memory_order_acquire);
+    if (hot > count)
+        hot = count;
+
+    uint32_t start = handoff_tls++;
+    for (uint32_t i = 0; i < hot; ++i) {
+        Handoff &slot = table[(start + i) % hot]->handoff;
+        uint32_t state = Handoff::Open;
+
+        if (slot.state.load(std::memory_order_relaxed) != Handoff::Open ||
+            !slot.state.compare_exchange_strong(state, Handoff::Claimed,
+                                                std::memory_order_acquire))
+            continue;
+
+        NT_TRACE("push(task=%p) to the hand-off slot of worker %u", task,
+                 table[(start + i) % hot]->id + 1);
+
+        // As with deque items, the slot doesn't hold a reference
+        release(task, true);
+        slot.range = TaskRange(task, 0, task->size);
+        slot.state.store(Handoff::Full, std::memory_order_release);
+        this->count(StatHandoffs);
+        return true;
+    }
+
+    return false;
+}
+
+TaskRange TaskQueue::close_handoff(Handoff &slot) {
+    uint32_t state = Handoff::Open;
+    if (slot.state.compare_exchange_strong(state, Handoff::Closed,
+                                           std::memory_order_acq_rel))
+        return TaskRange();
+
+    // A submitting thread claimed the slot, wait until it stored the task
+    while (slot.state.load(std::memory_order_acquire) != Handoff::Full)
+        cpu_pause();
+
+    TaskRange range = slot.range;
+    slot.state.store(Handoff::Closed, std::memory_order_relaxed);
+
+    if (profile_tasks)
+        range.task->time_start = timer_ticks();
+
+    return range;
+}
+
 void TaskQueue::push(Task *task) {
     uint32_t size = task->size;
+    count(StatTasksPushed);
+
+    Replay *r = replay.load(std::memory_order_acquire);
+    if (r && push_replay(r, task))
+        return;
+
+    if (task->flags & NANOTHREAD_TASK_TARGETED) {
+        push_mailbox(task);
+        return;
+    }
+
+    // Latency mode: pass small submissions of other threads to a hot worker
+    if (size == 1 && hot_workers.load(std::memory_order_relaxed) > 0 &&
+        !local_deque() && handoff(task))
+        return;
+
+    TaskDeque *local = work_stealing_enabled() ? local_deque() : nullptr;
+    if (local && local->node.load(std::memory_order_relaxed) == task->node &&
+        task->priority == NANOTHREAD_PRIORITY_NORMAL) {
+        NT_TRACE("push(task=%p, size=%u) to deque", task, size);
+
+        // Deque items don't hold a reference, drop the one owned by the queue
+        release(task, true);
+        local->push(TaskRange(task, 0, size));
+
+        /* Order the above push before checking 'sleepers' (the CAS in the
+           shared queue code path below implies this on x86) */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wakeup_if_sleeping(size);
+        return;
+    }
+
+    NT_TRACE("push(task=%p, size=%u, node=%u, priority=%u)", task, size,
+             task->node, task->priority);
+    push_list(list(task->node, task->priority), task, task);
+
+    // Wake as many sleeping threads as can process the new work, if any
+    wakeup_if_sleeping(size);
+}
+
+void TaskQueue::push_batch(Task *const *tasks, uint32_t count) {
+    if (count == 0)
+        return;
+
+    // Tasks of a replayed schedule are stored individually
+    if (replay.load(std::memory_order_acquire)) {
+        for (uint32_t i = 0; i < count; ++i)
+            push(tasks[i]);
+        return;
+    }
+
+    uint32_t lanes = nodes * NANOTHREAD_PRIORITY_COUNT;
+    std::unique_ptr<Task *[]> first(new Task *[2 * lanes]());
+    Task **last = first.get() + lanes;
+    std::vector<Task *> targeted;
+    uint64_t size = 0;
+
+    // Link up the tasks of each queue, in order
+    for (uint32_t i = 0; i < count; ++i) {
+        Task *task = tasks[i];
+        if (task->flags & NANOTHREAD_TASK_TARGETED) {
+            targeted.push_back(task);
+            continue;
+        }
 
-    NT_TRACE("push(task=%p, size=%u)", task, size);
+        uint32_t lane = task->priority * nodes + task->node;
+
+        task->next = Task::Ptr();
+        if (last[lane])
+            last[lane]->next = Task::Ptr(task, task->size);
+        else
+            first[lane] = task;
+        last[lane] = task;
+        size += task->size;
+    }
+
+    NT_TRACE("push_batch(count=%u, size=%llu)", count,
+             (unsigned long long) size);
+    this->count(StatTasksPushed, count);
+
+    /* Tasks may already be running (and even be recycled) once they are
+       appended to a list, hence all fields were read above */
+    for (uint32_t i = 0; i < lanes; ++i) {
+        if (first[i])
+            push_list(lists[i], first[i], last[i]);
+    }
+
+    for (Task *task : targeted)
+        push_mailbox(task);
+
+    wakeup_if_sleeping(size < 0xFFFFFFFFull ? (uint32_t) size : 0xFFFFFFFFu);
+}
+
+void TaskQueue::push_list(TaskList &list, Task *first, Task *last) {
+    Task::Ptr &tail = list.tail;
+    uint32_t retries = 0;
 
     while (true) {
         // Lead tail and tail->next, and double-check, in this order
@@ -307,9 +1384,9 @@ void TaskQueue::push(Task *task) {
         if (tail_c == tail_c_2) {
             if (!next_c.task) {
                 // Tail was pointing to last node, try to insert here
-                if (cas(next, next_c, Task::Ptr(task, size))) {
+                if (cas(next, next_c, Task::Ptr(first, first->size))) {
                     // Best-effort attempt to redirect tail to the added element
-                    cas(tail, tail_c, tail_c.update_task(task));
+                    cas(tail, tail_c, tail_c.update_task(last));
                     break;
                 }
             } else {
@@ -318,16 +1395,170 @@ void TaskQueue::push(Task *task) {
             }
         }
 
-        pause();
+        retries++;
+        cpu_pause();
+    }
+
+    if (retries)
+        count(StatPushRetries, retries);
+}
+
+void TaskQueue::set_recording(uint32_t capacity) {
+    if (capacity == 0) {
+        record_active.store(false, std::memory_order_relaxed);
+        return;
+    }
+
+    record_entries.reset(new ScheduleEntry[capacity]);
+    record_capacity = capacity;
+    record_count.store(0, std::memory_order_relaxed);
+    schedule_seq.store(0, std::memory_order_relaxed);
+    record_active.store(true, std::memory_order_release);
+}
+
+uint32_t TaskQueue::recorded(ScheduleEntry *entries, uint32_t count) const {
+    uint32_t total = record_count.load(std::memory_order_acquire),
+             stored = total < record_capacity ? total : record_capacity;
+
+    if (entries && count > 0)
+        memcpy(entries, record_entries.get(),
+               sizeof(ScheduleEntry) * (count < stored ? count : stored));
+
+    return total;
+}
+
+void TaskQueue::record(const TaskRange &range) {
+    uint32_t index = record_count.fetch_add(1, std::memory_order_relaxed);
+    if (index >= record_capacity)
+        return;
+
+    TaskDeque *local = local_deque();
+    ScheduleEntry &entry = record_entries[index];
+    entry.task = range.task->seq;
+    entry.thread = local ? local->id + 1 : 0;
+    entry.begin = range.begin;
+    entry.end = range.end;
+}
+
+void TaskQueue::set_replay(const ScheduleEntry *entries, uint32_t count) {
+    Replay *r = nullptr;
+
+    if (count > 0) {
+        std::unique_ptr<Replay> replay_new(new Replay());
+        r = replay_new.get();
+
+        // Distribute the ranges over the lanes of the threads
+        uint32_t tasks = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            const ScheduleEntry &e = entries[i];
+            uint32_t lane = e.thread < NANOTHREAD_DRIVER_ID ? e.thread : 0;
+            if (e.task == (uint32_t) -1 || e.begin >= e.end)
+                continue;
+            if (r->lanes.size() <= lane)
+                r->lanes.resize(lane + 1);
+            if (r->units.size() <= e.task)
+                r->units.resize(e.task + 1, 0);
+            r->lanes[lane].push_back(e);
+            r->units[e.task] += e.end - e.begin;
+            tasks = (uint32_t) r->units.size();
+        }
+
+        r->next.reset(new std::atomic<uint32_t>[r->lanes.size()]);
+        for (size_t i = 0; i < r->lanes.size(); ++i)
+            r->next[i].store(0, std::memory_order_relaxed);
+
+        r->tasks.reset(new std::atomic<Task *>[tasks]);
+        for (uint32_t i = 0; i < tasks; ++i)
+            r->tasks[i].store(nullptr, std::memory_order_relaxed);
+
+        replays.push_back(std::move(replay_new));
+    }
+
+    schedule_seq.store(0, std::memory_order_relaxed);
+    replay.store(r, std::memory_order_release);
+
+    // Threads may be waiting for ranges of the previous schedule
+    if (sleepers.load(std::memory_order_acquire) > 0)
+        wakeup((uint32_t) -1, nullptr, Sleeper::Work);
+}
+
+bool TaskQueue::push_replay(Replay *r, Task *task) {
+    uint32_t seq = task->seq;
+    if (seq >= r->units.size())
+        return false;
+
+    if (r->units[seq] != task->size ||
+        (task->flags & NANOTHREAD_TASK_TARGETED)) {
+        // Mailboxes or a mismatch with the recording: schedule as usual
+        r->tasks[seq].store(Replay::bypassed(), std::memory_order_release);
+        return false;
+    }
+
+    NT_TRACE("push(task=%p, size=%u) to the replayed schedule (seq=%u)", task,
+             task->size, seq);
+
+    // As with deque items, the schedule doesn't hold a reference
+    release(task, true);
+    r->tasks[seq].store(task, std::memory_order_release);
+
+    /* The recorded threads may be parked. Order the above store before
+       checking 'sleepers', see pop_or_sleep() */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (push_hook)
+        push_hook(push_hook_payload, task->size);
+    if (sleepers.load(std::memory_order_acquire) > 0)
+        wakeup((uint32_t) -1, nullptr, Sleeper::Work);
+
+    return true;
+}
+
+TaskRange TaskQueue::pop_replay(Replay *r) {
+    TaskDeque *local = local_deque();
+    uint32_t lane = local ? local->id + 1 : 0;
+    if (lane >= r->lanes.size())
+        return TaskRange();
+
+    const std::vector<ScheduleEntry> &entries = r->lanes[lane];
+    std::atomic<uint32_t> &next = r->next[lane];
+    uint32_t index = next.load(std::memory_order_acquire);
+
+    // Threads that aren't workers share lane 0, hence the CAS
+    while (index < entries.size()) {
+        const ScheduleEntry &e = entries[index];
+        Task *task = r->tasks[e.task].load(std::memory_order_acquire);
+
+        // Wait until the task of the next range has been pushed
+        if (!task)
+            break;
+
+        if (!next.compare_exchange_weak(index, index + 1,
+                                        std::memory_order_acq_rel))
+            continue;
+
+        if (task == Replay::bypassed()) {
+            index++;
+            continue;
+        }
+
+        NT_TRACE("pop(task=%p, index=[%u, %u)) from the replayed schedule",
+                 task, e.begin, e.end);
+
+        if (e.begin == 0 && profile_tasks)
+            task->time_start = timer_ticks();
+
+        return TaskRange(task, e.begin, e.end);
     }
 
-    // Wake sleeping threads, if any
-    if (sleep_state.load(std::memory_order_acquire) & low_mask)
-        wakeup();
+    return TaskRange();
 }
 
-std::pair<Task *, uint32_t> TaskQueue::pop() {
-    uint32_t index;
+TaskRange TaskQueue::pop(uint32_t node, uint32_t priority) {
+    return pop_list(list(node, priority));
+}
+
+TaskRange TaskQueue::pop_list(TaskList &list) {
+    Task::Ptr &head = list.head, &tail = list.tail;
+    uint32_t index, count, retries = 0;
     Task *task;
 
     while (true) {
@@ -342,20 +1573,23 @@ std::pair<Task *, uint32_t> TaskQueue::pop() {
         if (head_c == head_c_2) {
             if (head_c.task != tail_c.task) {
                 uint32_t remain = next_c.remain();
+                NT_ASSERT(remain > 0);
+
+                // Retire all work units of cancelled tasks at once
+                count = next_c.task->retire() ? remain : claim_size(remain);
 
-                if (remain > 1) {
-                    // More than 1 remaining work units, update work counter
-                    if (cas(next, next_c, next_c.update_remain(remain - 1))) {
+                if (count < remain) {
+                    // Work units will remain afterwards, update work counter
+                    if (cas(next, next_c, next_c.update_remain(remain - count))) {
                         task = next_c.task;
                         index = task->size - remain;
                         break;
                     }
                 } else {
-                    NT_ASSERT(remain == 1);
                     // Head node is removed from the queue, reduce refcount
                     if (cas(head, head_c, head_c.update_task(next_c.task))) {
                         task = next_c.task;
-                        index = task->size - 1;
+                        index = task->size - remain;
                         release(head_c.task, true);
                         break;
                     }
@@ -364,8 +1598,8 @@ std::pair<Task *, uint32_t> TaskQueue::pop() {
                 // Task queue was empty
                 if (!next_c.task) {
                     task = nullptr;
-                    index = 0;
-                    pause();
+                    index = count = 0;
+                    cpu_pause();
                     break;
                 } else {
                     // Advance the tail, it's falling behind
@@ -374,116 +1608,317 @@ std::pair<Task *, uint32_t> TaskQueue::pop() {
             }
         }
 
-        pause();
+        retries++;
+        cpu_pause();
     }
 
+    if (retries)
+        this->count(StatPopRetries, retries);
+
     if (task) {
-        NT_TRACE("pop(task=%p, index=%u)", task, index);
+        NT_TRACE("pop(task=%p, index=[%u, %u))", task, index, index + count);
 
         if (index == 0 && profile_tasks) {
-            #if defined(_WIN32)
-                QueryPerformanceCounter(&task->time_start);
-            #else
-                clock_gettime(CLOCK_MONOTONIC, &task->time_start);
-            #endif
+            task->time_start = timer_ticks();
         }
     }
 
-    return { task, index };
+    return TaskRange(task, index, index + count);
 }
 
-void TaskQueue::wakeup() {
-    std::unique_lock<std::mutex> guard(sleep_mutex);
-    uint64_t value = sleep_state.load();
-    NT_TRACE("wakeup(): sleep_state := (%u, 0)", (uint32_t) (sleep_state >> 32) + 1);
-    sleep_state = (value + high_bit) & high_mask;
-    sleep_cv.notify_all();
-}
-
-#if defined(NT_DEBUG)
-double time_milliseconds() {
-    #if defined(_WIN32)
-        LARGE_INTEGER ticks, ticks_per_sec;
-        QueryPerformanceCounter(&ticks);
-        QueryPerformanceFrequency(&ticks_per_sec);
-        return (double) (ticks.QuadPart * 1000) / (double) ticks_per_sec.QuadPart;
-    #else
-        struct timespec ts;
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000.0;
-    #endif
+#if defined(__linux__)
+void Sleeper::wait() {
+    while (notified.load(std::memory_order_acquire) == Waiting)
+        syscall(SYS_futex, (uint32_t *) &notified, FUTEX_WAIT_PRIVATE,
+                (uint32_t) Waiting, nullptr, nullptr, 0);
+}
+
+void Sleeper::notify(Reason reason) {
+    notified.store(reason, std::memory_order_release);
+    syscall(SYS_futex, (uint32_t *) &notified, FUTEX_WAKE_PRIVATE, 1, nullptr,
+            nullptr, 0);
+}
+#elif defined(_WIN32)
+void Sleeper::wait() {
+    uint32_t expected = Waiting;
+    while (notified.load(std::memory_order_acquire) == Waiting)
+        WaitOnAddress((volatile VOID *) &notified, &expected, sizeof(uint32_t),
+                      INFINITE);
+}
+
+void Sleeper::notify(Reason reason) {
+    notified.store(reason, std::memory_order_release);
+    WakeByAddressSingle((PVOID) &notified);
+}
+#else
+void Sleeper::wait() {
+    std::unique_lock<std::mutex> guard(mutex);
+    while (notified.load(std::memory_order_acquire) == Waiting)
+        cv.wait(guard);
+}
+
+void Sleeper::notify(Reason reason) {
+    std::unique_lock<std::mutex> guard(mutex);
+    notified.store(reason, std::memory_order_release);
+    cv.notify_one();
 }
 #endif
 
-std::pair<Task *, uint32_t>
+void TaskQueue::add_sleeper(Sleeper *sleeper) {
+    std::unique_lock<std::mutex> guard(sleep_mutex);
+    sleeper->prev = nullptr;
+    sleeper->next = sleep_head;
+    if (sleep_head)
+        sleep_head->prev = sleeper;
+    sleep_head = sleeper;
+    sleeper->linked = true;
+    sleepers++;
+}
+
+bool TaskQueue::remove_sleeper(Sleeper *sleeper) {
+    std::unique_lock<std::mutex> guard(sleep_mutex);
+    if (!sleeper->linked)
+        return false;
+
+    if (sleeper->prev)
+        sleeper->prev->next = sleeper->next;
+    else
+        sleep_head = sleeper->next;
+    if (sleeper->next)
+        sleeper->next->prev = sleeper->prev;
+
+    sleeper->linked = false;
+    sleepers--;
+    return true;
+}
+
+void TaskQueue::wakeup(uint32_t count, void *payload, Sleeper::Reason reason,
+                       const Mailbox *mailbox) {
+    Sleeper *list = nullptr;
+
+    {
+        std::unique_lock<std::mutex> guard(sleep_mutex);
+        Sleeper *sleeper = sleep_head;
+
+        while (sleeper && count > 0) {
+            Sleeper *next = sleeper->next;
+
+            bool match = mailbox ? sleeper->mailbox == mailbox
+                                 : (!payload || sleeper->payload == payload);
+
+            if (match) {
+                // Unlink, and move to the list of threads to be notified
+                if (sleeper->prev)
+                    sleeper->prev->next = next;
+                else
+                    sleep_head = next;
+                if (next)
+                    next->prev = sleeper->prev;
+
+                sleeper->linked = false;
+                sleeper->next = list;
+                list = sleeper;
+                sleepers--;
+                count--;
+            }
+
+            sleeper = next;
+        }
+    }
+
+    // Notify outside of the critical section
+    uint32_t woken = 0;
+    while (list) {
+        Sleeper *next = list->next;
+        list->notify(reason);
+        list = next;
+        woken++;
+    }
+
+    if (woken > 0)
+        this->count(StatWakeups, woken);
+
+    NT_TRACE("wakeup(): woke %u threads", woken);
+
+    if (woken > 0 && tracing()) {
+        uint64_t now = trace_time();
+        trace_record(TraceType::Wake, now, now, nullptr, 0, 0, woken);
+    }
+}
+
+void TaskQueue::wakeup(uint32_t count) {
+    wakeup(count, nullptr, Sleeper::Work);
+}
+
+void TaskQueue::wakeup_waiting(void *payload) {
+    wakeup((uint32_t) -1, payload, Sleeper::Other);
+}
+
+TaskRange
 TaskQueue::pop_or_sleep(bool (*stopping_criterion)(void *), void *payload,
                         bool may_sleep) {
-        std::pair<Task *, uint32_t> result(nullptr, 0);
-        uint32_t attempts = 0;
+    TaskRange result;
+    uint32_t backoff = 1, reason = Sleeper::Waiting, spins = 0;
+    bool spinning = false, is_idle = false;
+    Clock::time_point spin_start;
 
-#if defined(NT_DEBUG)
-    double start = time_milliseconds();
-#endif
+    // Hot workers spin with an open hand-off slot instead of parking
+    TaskDeque *local = may_sleep ? local_deque() : nullptr;
+    Handoff *slot = nullptr;
 
     while (true) {
-        result = pop();
+        result = pop_any();
+        bool stop = !result.task && stopping_criterion(payload);
+
+        if (slot && (result.task || stop ||
+                     slot->state.load(std::memory_order_relaxed) != Handoff::Open)) {
+            TaskRange handed = close_handoff(*slot);
+            slot = nullptr;
+
+            /* Handed tasks are never targeted, so place it on the deque if
+               work (perhaps from the mailbox) was found at the same time */
+            if (handed.task) {
+                if (result.task)
+                    local->push(handed);
+                else
+                    result = handed;
+                break;
+            }
+        }
 
-        if (result.first || stopping_criterion(payload))
+        if (result.task || stop)
             break;
 
-        attempts++;
+        if (!is_idle) {
+            idle++;
+            is_idle = true;
+        }
 
-        if (may_sleep && attempts >= NANOTHREAD_MAX_ATTEMPTS) {
-            std::unique_lock<std::mutex> guard(sleep_mutex);
+        spins++;
 
-            uint64_t value = ++sleep_state, phase = value & high_mask;
-            NT_TRACE("pop_or_sleep(): falling asleep after %.2f milliseconds, "
-                     "sleep_state := (%u, %u)!",
-                     time_milliseconds() - start, (uint32_t)(value >> 32),
-                     (uint32_t) value);
+        // Exponential backoff reduces contention and power usage
+        for (uint32_t i = 0; i < backoff; ++i) {
+            if (slot && slot->state.load(std::memory_order_relaxed) != Handoff::Open)
+                break;
+            cpu_pause();
+        }
+        if (backoff < NANOTHREAD_MAX_BACKOFF)
+            backoff *= 2;
 
-            // Try once more to fetch a job
-            result = pop();
+        if (!may_sleep)
+            continue;
 
-            /* If the following is true, somebody added work, or the stopping
-               became active while this thread was about to go to sleep. */
-            if (result.first || stopping_criterion(payload)) {
-                // Reduce sleep_state if we're still in the same phase.
-                NT_TRACE("sleep aborted.");
-                while (true) {
-                    if (sleep_state.compare_exchange_strong(value, value - 1))
-                        break;
-                    if ((value & high_mask) != phase)
-                        break;
-                    pause();
-                }
+        if (local && local->id < hot_workers.load(std::memory_order_relaxed)) {
+            if (!slot) {
+                slot = &local->handoff;
+                slot->state.store(Handoff::Open, std::memory_order_release);
+            }
+            continue;
+        } else if (slot) {
+            // Latency mode was disabled in the meantime
+            TaskRange handed = close_handoff(*slot);
+            slot = nullptr;
+            if (handed.task) {
+                result = handed;
                 break;
             }
+        }
+
+        if (!spinning) {
+            spin_start = Clock::now();
+            spinning = true;
+            continue;
+        }
+
+        uint32_t budget = spin_budget_us(), limit = spin_limit_tls;
+        if (limit > budget)
+            limit = budget;
+
+        uint64_t spin_time = elapsed_us(spin_start);
+        if (spin_time < limit)
+            continue;
 
-            /* The push() code above has the structure
+        NT_TRACE("pop_or_sleep(): falling asleep after %u microseconds",
+                 (uint32_t) spin_time);
 
-                - A1. Enqueue work
-                - A2. Check sleep_state, and wake threads if nonzero
+        Sleeper sleeper(payload, local_mailbox());
+        add_sleeper(&sleeper);
+        count(StatSleeps);
+        count(StatIdleSpins, spins);
+        spins = 0;
 
-               While the code here has the structure
+        /* The push() code above has the structure
 
-                - B1. Increase sleep_state
-                - B2. Try to dequeue work
-                - B3. Wait for wakeup signal
+            - A1. Enqueue work
+            - A2. Check 'sleepers', and wake threads if nonzero
 
-               This ordering excludes the possibility that the thread sleeps
-               erroneously while work is available or added later on.
-            */
+           While the code here has the structure
 
-            while ((sleep_state & high_mask) == phase)
-                sleep_cv.wait(guard);
+            - B1. Register as a sleeper
+            - B2. Try to dequeue work
+            - B3. Wait for wakeup signal
 
-            value = sleep_state.load();
-            NT_TRACE("pop_or_sleep(): woke up -- sleep_state=(%u, %u)",
-                     (uint32_t)(value >> 32), (uint32_t) value);
+           This ordering excludes the possibility that the thread sleeps
+           erroneously while work is available or added later on.
+        */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // Try once more to fetch a job
+        result = pop_any();
+
+        /* If the following is true, somebody added work, or the stopping
+           became active while this thread was about to go to sleep. */
+        if (result.task || stopping_criterion(payload)) {
+            NT_TRACE("sleep aborted.");
+
+            // Wait for a concurrent notification to finish if needed
+            if (!remove_sleeper(&sleeper))
+                sleeper.wait();
+
+            reason = sleeper.notified.load(std::memory_order_relaxed);
+            break;
+        }
+
+        Clock::time_point sleep_start = Clock::now();
+        bool traced = tracing();
+        uint64_t trace_start = traced ? trace_time() : 0;
+        sleeper.wait();
+        uint64_t sleep_time = elapsed_us(sleep_start);
+        if (traced)
+            trace_record(TraceType::Sleep, trace_start, trace_time());
+        reason = sleeper.notified.load(std::memory_order_relaxed);
+
+        /* Adapt the spinning time: spin for longer if the thread was woken up
+           soon after parking, and park sooner if it slept for a long time */
+        if (sleep_time < limit) {
+            limit = limit * 2 > NANOTHREAD_SPIN_MIN ? limit * 2 : NANOTHREAD_SPIN_MIN;
+            if (limit > budget)
+                limit = budget;
+        } else {
+            limit = limit / 2 > NANOTHREAD_SPIN_MIN ? limit / 2 : NANOTHREAD_SPIN_MIN;
         }
+        spin_limit_tls = limit;
+
+        NT_TRACE("pop_or_sleep(): woke up after %u microseconds (reason=%u), "
+                 "spin limit := %u microseconds", (uint32_t) sleep_time,
+                 reason, limit);
+
+        backoff = 1;
+        spinning = false;
     }
 
+    /* Pass on the wakeup if this thread was woken to process new work, but
+       it stopped due to the stopping criterion instead */
+    if (!result.task && reason == Sleeper::Work)
+        wakeup_if_sleeping(1);
+
+    if (result.task)
+        count(StatPops);
+    if (spins)
+        count(StatIdleSpins, spins);
+
+    if (is_idle)
+        idle--;
+
     return result;
 }
-
@@ -9,17 +9,61 @@
 
 #pragma once
 
+#include <nanothread/nanothread.h>
 #include <atomic>
 #include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <cstring>
+#include <memory>
 
 #if defined(_WIN32)
 #  include <windows.h>
 #endif
 
 struct Pool;
+struct TaskQueue;
+struct Task;
+struct Mailbox;
+
+/**
+ * Guided scheduling: when popping work, claim up to 'remain / (factor *
+ * threads)' work units at once, where 'remain' is the number of work units
+ * left and 'threads' is the number of threads processing the queue.
+ */
+#define NANOTHREAD_CLAIM_FACTOR 2
+
+/// Number of dependency links that are stored without a heap allocation
+#define NANOTHREAD_INLINE_PARENTS 4
+
+/// Number of dependency links in each heap-allocated block
+#define NANOTHREAD_LINK_BLOCK 32
+
+/// Number of task records that are allocated at once
+#define NANOTHREAD_SLAB_SIZE 32
+
+/// Internal task flag: the task goes to the mailbox \ref Task::mailbox
+#define NANOTHREAD_TASK_TARGETED 0x80
+
+/// Thread IDs (see \ref TaskAttr::thread) with this bit refer to driver threads
+#define NANOTHREAD_DRIVER_ID 0x80000000u
+
+/// Size of the chunks of the payload arena (see \ref PayloadChunk)
+#define NANOTHREAD_PAYLOAD_CHUNK 65536
+
+/// Largest payload that is carved out of a shared chunk of the payload arena
+#define NANOTHREAD_PAYLOAD_MAX (NANOTHREAD_PAYLOAD_CHUNK / 4)
+
+/// Offset of the first payload within a chunk (a multiple of its alignment)
+#define NANOTHREAD_PAYLOAD_HEADER 64
+
+/// Size of the payload storage within each task record (a multiple of 16)
+#if !defined(NANOTHREAD_PAYLOAD_STORAGE)
+#  define NANOTHREAD_PAYLOAD_STORAGE 256
+#endif
+
+static_assert(NANOTHREAD_PAYLOAD_STORAGE % 16 == 0,
+              "NANOTHREAD_PAYLOAD_STORAGE must be a multiple of 16!");
 
 constexpr uint64_t high_bit  = (uint64_t) 0x0000000100000000ull;
 constexpr uint64_t high_mask = (uint64_t) 0xFFFFFFFF00000000ull;
@@ -27,7 +71,124 @@ constexpr uint64_t low_mask  = (uint64_t) 0x00000000FFFFFFFFull;
 
 inline uint64_t shift(uint32_t value) { return ((uint64_t) value) << 32; }
 
-struct Task {
+/// Shared cancellation flag of a set of tasks, see \ref cancel_token_create()
+struct CancelToken {
+    std::atomic<bool> cancelled{false};
+
+    /// References by the user and by tasks that were submitted with the token
+    std::atomic<uint32_t> refcount{1};
+
+    void retain() { refcount.fetch_add(1, std::memory_order_relaxed); }
+
+    static void release(CancelToken *token) {
+        if (token && token->refcount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete token;
+    }
+};
+
+/**
+ * \brief Chunk of the payload arena of a \ref TaskQueue
+ *
+ * Payloads that don't fit into \ref Task::payload_storage are carved out of
+ * chunks using a bump pointer (see \ref TaskQueue::alloc_payload()). Each
+ * payload holds a reference to its chunk, and so does the thread that is
+ * currently allocating from it. When the latter is the only one left, all
+ * payloads are gone and the thread rewinds the chunk as a whole. Unused chunks
+ * are returned to the queue, which frees them when it is destroyed. Larger
+ * payloads than \ref NANOTHREAD_PAYLOAD_MAX get a chunk of their own.
+ */
+struct PayloadChunk {
+    std::atomic<uint32_t> refs;
+
+    /// Offset of the next payload, only accessed by the allocating thread
+    uint32_t offset;
+
+    /// Queue that owns the chunk (\c nullptr for a chunk holding one payload)
+    TaskQueue *queue;
+
+    /// Next unused chunk of the queue
+    PayloadChunk *next;
+
+    /// Release a reference, recycling or freeing the chunk if it was the last
+    static void release(PayloadChunk *chunk);
+};
+
+/// Edge from a parent task to a child task, stored in the child's record
+struct TaskLink {
+    Task *child;
+    TaskLink *next;
+};
+
+/**
+ * \brief Storage for the edges that connect a task to its parents
+ *
+ * Each registered dependency consumes one \ref TaskLink, which is then
+ * inserted into the lock-free successor list of the parent. The first \ref
+ * NANOTHREAD_INLINE_PARENTS links are stored inline, and further ones come
+ * from blocks of \ref NANOTHREAD_LINK_BLOCK entries that are allocated on
+ * demand. Links never move once handed out (parents reference them), and
+ * blocks are kept when the storage is cleared, so that recycled tasks can
+ * reuse them.
+ *
+ * Only the thread that submits a task allocates links from its storage.
+ */
+struct TaskLinks {
+    TaskLinks() : count(0), head(nullptr), current(nullptr) { }
+    ~TaskLinks() {
+        while (head) {
+            Block *next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    TaskLinks(const TaskLinks &) = delete;
+    TaskLinks &operator=(const TaskLinks &) = delete;
+
+    TaskLink *alloc() {
+        if (count < NANOTHREAD_INLINE_PARENTS)
+            return storage + count++;
+
+        uint32_t index = (count++ - NANOTHREAD_INLINE_PARENTS) % NANOTHREAD_LINK_BLOCK;
+        if (index == 0) {
+            Block *next = current ? current->next : head;
+            if (!next) {
+                next = new Block();
+                next->next = nullptr;
+                if (current)
+                    current->next = next;
+                else
+                    head = next;
+            }
+            current = next;
+        }
+
+        return current->links + index;
+    }
+
+    void clear() { count = 0; current = nullptr; }
+    uint32_t size() const { return count; }
+
+private:
+    struct Block {
+        TaskLink links[NANOTHREAD_LINK_BLOCK];
+        Block *next;
+    };
+
+    uint32_t count;
+    Block *head, *current;
+    TaskLink storage[NANOTHREAD_INLINE_PARENTS];
+};
+
+/**
+ * \brief Task record
+ *
+ * The fields accessed whenever work units are claimed and completed occupy
+ * the first cache line, and infrequently used fields start on the next one.
+ * Records are allocated in slabs by \ref TaskQueue and never freed before
+ * the queue is destroyed.
+ */
+struct alignas(64) Task {
     /**
      * \brief Wide 16 byte pointer to a task in the worker pool. In addition to the
      * pointer itself, it encapsulates two more pieces of information:
@@ -96,20 +257,46 @@ struct Task {
     /// Total number of work units in this task
     uint32_t size;
 
+    /// NUMA node of the task record, also selects the queue it is pushed to
+    uint16_t node;
+
+    /// Priority level, selects the queue of the node that the task is pushed to
+    uint8_t priority;
+
+    /// Task flags (\c NANOTHREAD_TASK_*), see \ref TaskAttr
+    uint8_t flags;
+
     /// Callback of the work unit
     void (*func)(uint32_t, void *);
 
-    /// Pool that this tasks belongs to
-    Pool *pool;
+    /// Alternative callback processing a range of work units at once
+    void (*func_range)(uint32_t, uint32_t, void *);
 
     /// Payload to be delivered to 'func'
     void *payload;
 
+    // ------------ End of the first cache line, cold fields below ------------
+
+    /// Pool that this tasks belongs to
+    alignas(64) Pool *pool;
+
     /// Custom deleter used to free 'payload'
     void (*payload_deleter)(void *);
 
-    /// Successor tasks that depend on this task
-    std::vector<Task *> children;
+    /// Task graph that this task is part of (while it is being built, or if
+    /// it is resident)
+    TaskGraph *graph;
+
+    /**
+     * \brief Lock-free list of successor tasks that depend on this task
+     *
+     * Dependencies are only ever added (via CAS) until all work units have
+     * completed, at which point \ref TaskQueue::release() detaches the list.
+     */
+    std::atomic<TaskLink *> children;
+
+    /// Links connecting this task to the successor lists of its parents
+    TaskLinks parents;
 
     /// Atomic flag stating whether the 'exception' field is already used
     std::atomic<bool> exception_used;
@@ -117,27 +304,406 @@ struct Task {
     /// Pointer to an exception in case the task failed
     std::exception_ptr exception;
 
-#if !defined(_WIN32)
-    timespec time_start, time_end;
-#else
-    LARGE_INTEGER time_start, time_end;
-#endif
+    /**
+     * \brief Set when the task was cancelled (see \ref task_cancel()), or
+     * when a cancelled parent task propagated its cancellation
+     *
+     * This flag (unlike \c token) may be checked before a work unit has been
+     * claimed, since task records are never freed.
+     */
+    std::atomic<bool> cancelled;
+
+    /// Cancellation token that the task was submitted with (optional)
+    CancelToken *token = nullptr;
+
+    /// Mailbox of the thread that must run the task (\c NANOTHREAD_TASK_TARGETED)
+    Mailbox *mailbox = nullptr;
+
+    /// Chunk of the payload arena storing 'payload' (if any)
+    PayloadChunk *payload_chunk = nullptr;
+
+    /// Sequence number while a schedule is recorded or replayed (otherwise -1)
+    uint32_t seq;
+
+    /// Estimated execution time in nanoseconds, see \ref TaskAttr::cost
+    float cost;
+
+    /**
+     * \brief Upward rank in critical path mode: estimated time until the
+     * task and all of its descendants have completed (negative if unknown)
+     *
+     * See \ref TaskQueue::rank(). Resident tasks of graphs are ranked once
+     * per launch.
+     */
+    std::atomic<float> rank;
+
+    /// Start and end time in timer ticks (when profiling is enabled)
+    uint64_t time_start, time_end;
 
     /// Fixed-size payload storage region
-    alignas(8) uint8_t payload_storage[256];
+    alignas(16) uint8_t payload_storage[NANOTHREAD_PAYLOAD_STORAGE];
 
-    void clear() {
+    /**
+     * \brief Should the remaining work units be skipped without claiming them
+     * in pieces?
+     *
+     * Tasks flagged with \c NANOTHREAD_TASK_ALWAYS_RUN are never retired.
+     */
+    bool retire() const {
+        return !(flags & NANOTHREAD_TASK_ALWAYS_RUN) &&
+               cancelled.load(std::memory_order_relaxed);
+    }
+
+    /// Was cancellation requested? Only valid while a reference is held.
+    bool cancel_requested() const {
+        return cancelled.load(std::memory_order_relaxed) ||
+               (token && token->cancelled.load(std::memory_order_relaxed));
+    }
+
+    /// Invoke the payload deleter and release the storage of the payload
+    void clear_payload() {
         if (payload_deleter)
             payload_deleter(payload);
+        PayloadChunk::release(payload_chunk);
         payload_deleter = nullptr;
+        payload_chunk = nullptr;
         payload = nullptr;
-        children.clear();
+    }
+
+    void clear() {
+        clear_payload();
+        children.store(nullptr, std::memory_order_relaxed);
+        parents.clear();
 #if !defined(NDEBUG)
         memset(payload_storage, 0xFF, sizeof(payload_storage));
 #endif
     }
 };
 
+/// Contiguous range <tt>[begin, end)</tt> of the work units of a task
+struct TaskRange {
+    Task *task;
+    uint32_t begin, end;
+
+    TaskRange(Task *task = nullptr, uint32_t begin = 0, uint32_t end = 0)
+        : task(task), begin(begin), end(end) { }
+
+    uint32_t size() const { return end - begin; }
+};
+
+/// Head and tail of a lock-free list data structure (one per NUMA node and
+/// priority level, and one per mailbox)
+struct TaskList {
+    Task::Ptr head, tail;
+    uint8_t padding[64 - 2 * sizeof(Task::Ptr)];
+};
+
+/**
+ * \brief Slot through which a submitting thread hands a task directly to an
+ * idle worker in latency mode (see \ref TaskQueue::set_hot_workers())
+ *
+ * The owner opens the slot while it spins for work. A submitting thread
+ * claims an open slot via CAS, stores the work units, and marks it as full.
+ */
+struct Handoff {
+    enum State : uint32_t { Closed = 0, Open = 1, Claimed = 2, Full = 3 };
+
+    /// Keep the slot apart from data that the owner modifies
+    uint8_t padding_1[64];
+
+    std::atomic<uint32_t> state;
+    TaskRange range;
+
+    uint8_t padding_2[64 - sizeof(std::atomic<uint32_t>) - sizeof(TaskRange)];
+
+    Handoff() : state(Closed) { }
+};
+
+/**
+ * \brief Tasks that must be executed by a specific thread, see \ref
+ * TaskAttr::thread
+ *
+ * Each worker owns a mailbox (stored in its \ref TaskDeque), and driver
+ * threads obtain one via \ref TaskQueue::attach_thread(). Only the owner pops
+ * tasks from the list, and it does so before consulting any other queue.
+ */
+struct Mailbox {
+    /// Create an empty mailbox with the given ID
+    Mailbox(TaskQueue *queue, uint32_t id);
+
+    /// Queue that this mailbox belongs to
+    TaskQueue *queue;
+
+    /// Value of \ref TaskAttr::thread referring to the owner
+    uint32_t id;
+
+    /**
+     * \brief Can tasks target the mailbox? This is the case while a driver
+     * thread is attached to it, or while the pool has a worker with this ID
+     * (which may not have started yet).
+     */
+    std::atomic<bool> attached;
+
+    /// Tasks waiting for the owner, as in the shared queues
+    TaskList list;
+};
+
+/**
+ * \brief Graph of tasks, see \ref task_graph_begin()
+ *
+ * While the graph is being built, its tasks point to it via \ref Task::graph.
+ * Tasks of graphs that are launched via \ref task_graph_launch() keep this
+ * pointer afterwards: such tasks are resident, i.e., their records, payloads,
+ * and successor lists are not released following completion.
+ */
+struct TaskGraph {
+    Pool *pool;
+
+    /// Tasks of the graph, in the order in which they were added
+    std::vector<Task *> tasks;
+
+    /// Does the i-th task depend on tasks outside of the graph?
+    std::vector<uint8_t> external;
+
+    /// Number of parents of the i-th task within the graph
+    std::vector<uint32_t> wait;
+
+    /// Unused task records fetched in bulk (one list per NUMA node)
+    std::vector<std::vector<Task *>> unused;
+
+    // ---------- Fields below are used by resident graphs ----------
+
+    /// Task that depends on all tasks without children in the graph
+    Task *sink = nullptr;
+
+    /// Tasks without parents in the graph
+    std::vector<Task *> roots;
+
+    /// Successor list of the i-th task (and of the sink as the last entry)
+    std::vector<TaskLink *> children;
+
+    /// Which queues (node and priority level) do the tasks go to?
+    std::vector<uint8_t> lanes;
+
+    /// Which mailboxes (\ref TaskAttr::thread) do the tasks go to?
+    std::vector<uint32_t> threads;
+
+    /// Number of tasks that are still referenced following the last launch
+    std::atomic<uint32_t> active { 0 };
+};
+
+/// Scheduler statistics, see \ref PoolStats
+enum Stat : uint32_t {
+    StatWorkUnits,
+    StatTasksPushed,
+    StatTasksCompleted,
+    StatPops,
+    StatSteals,
+    StatPushRetries,
+    StatPopRetries,
+    StatAllocRetries,
+    StatIdleSpins,
+    StatSleeps,
+    StatWakeups,
+    StatTasksRecycled,
+    StatInlineTasks,
+    StatInlineNested,
+    StatUnitsCancelled,
+    StatHandoffs,
+    StatCount
+};
+
+/// Set of statistics counters, padded to a multiple of the cache line size
+struct StatBlock {
+    std::atomic<uint64_t> value[StatCount];
+    uint8_t padding[64 - (StatCount * sizeof(uint64_t)) % 64];
+
+    StatBlock() {
+        for (uint32_t i = 0; i < StatCount; ++i)
+            value[i].store(0, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * \brief Work-stealing deque storing ranges of work units
+ *
+ * Implementation of the dynamically growing circular deque presented in the
+ * paper
+ *
+ * "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * by Nhat Minh Lê, Antoniu Pop, Albert Cohen, and Francesco Zappa Nardelli.
+ *
+ * (which in turn is based on the deque by David Chase and Yossi Lev). Each
+ * worker owns one deque. The owner pushes and pops items at the bottom end
+ * (LIFO order), while other workers steal items from the top end (FIFO
+ * order). Only \ref pop() and \ref steal() race with each other, and they
+ * only need a CAS when competing for the very last item.
+ *
+ * Each item refers to a contiguous range <tt>[begin, end)</tt> of work
+ * units of a task. Items do not hold a reference to their task, the
+ * remaining work units keep it alive.
+ */
+struct TaskDeque {
+    /// Create an empty deque that belongs to the given queue
+    TaskDeque(TaskQueue *queue, uint32_t id);
+
+    /// Release the deque's storage. It must be empty at this point.
+    ~TaskDeque();
+
+    /// Append an item at the bottom end. May only be called by the owner.
+    void push(TaskRange item);
+
+    /// Remove an item from the bottom end. May only be called by the owner.
+    bool pop(TaskRange &item);
+
+    /// Try to remove an item from the top end. May be called by any thread.
+    bool steal(TaskRange &item);
+
+    /// Conservative check whether the deque is empty
+    bool empty() const {
+        return top.load(std::memory_order_acquire) >=
+               bottom.load(std::memory_order_acquire);
+    }
+
+    /// Queue that this deque belongs to
+    TaskQueue *queue;
+
+    /// Index of the deque within the queue (== worker ID - 1)
+    uint32_t id;
+
+    /// NUMA node of the owning worker (set by \ref TaskQueue::attach_worker())
+    std::atomic<uint32_t> node;
+
+private:
+    struct Slot {
+        std::atomic<Task *> task;
+        std::atomic<uint64_t> range;
+    };
+
+    /// Circular buffer, the capacity is a power of two
+    struct Array {
+        uint64_t mask;
+        Slot *slots;
+
+        Array(uint64_t capacity);
+        ~Array();
+        void put(int64_t i, const TaskRange &item);
+        TaskRange get(int64_t i) const;
+    };
+
+    /// Grow the buffer, keeping the old one around for concurrent thieves
+    Array *grow(Array *array, int64_t top, int64_t bottom);
+
+    /* Place 'top' (written by thieves) and 'bottom' (written by the owner)
+       on separate cache lines */
+    std::atomic<int64_t> top;
+    uint8_t padding[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom;
+    std::atomic<Array *> array;
+
+public:
+    /**
+     * \brief Unused task records of the owner's NUMA node, linked via \ref
+     * Task::next and only accessed by the owner.
+     *
+     * Stored next to 'bottom', which is also written only by the owner.
+     */
+    Task *cache;
+
+    /// Number of records in 'cache'
+    uint32_t cache_size;
+
+    /// Chunk of the payload arena that the owner allocates payloads from
+    PayloadChunk *payload_chunk;
+
+    /// Statistics of the owner, only written by the owner
+    StatBlock stats;
+
+    /// Tasks that must be executed by the owner
+    Mailbox mailbox;
+
+    /// Tasks handed over directly to the owner in latency mode
+    Handoff handoff;
+
+private:
+    /// Buffers replaced by \ref grow(), only accessed by the owner
+    std::vector<Array *> retired;
+};
+
+/**
+ * \brief Schedule that is being replayed, see \ref TaskQueue::set_replay()
+ *
+ * When a task with a sequence number of the schedule is pushed, it is stored
+ * in \c tasks instead of the queues. Every thread then takes the ranges of
+ * its lane in order, once their tasks have been stored.
+ */
+struct Replay {
+    /// Ranges of each thread (index 0: threads that aren't workers), in order
+    std::vector<std::vector<ScheduleEntry>> lanes;
+
+    /// Index of the next range of each lane
+    std::unique_ptr<std::atomic<uint32_t>[]> next;
+
+    /// Pushed tasks by sequence number (or \ref Replay::bypassed())
+    std::unique_ptr<std::atomic<Task *>[]> tasks;
+
+    /// Total number of work units of each task in the schedule
+    std::vector<uint32_t> units;
+
+    /// Marks tasks that don't match the schedule and went through the queues
+    static Task *bypassed() { return (Task *) (uintptr_t) 1; }
+};
+
+/**
+ * \brief Record of a thread that is parked within \ref
+ * TaskQueue::pop_or_sleep()
+ *
+ * Instances live on the stack of the parked thread and are linked into a list
+ * of sleepers. The thread blocks on its own futex word (Linux), address
+ * (Windows), or condition variable (other platforms), so that specific
+ * threads can be woken without affecting the others.
+ */
+struct Sleeper {
+    /// Reasons for waking a thread
+    enum Reason : uint32_t { Waiting = 0, Work = 1, Other = 2 };
+
+    /// Reason for the wakeup, or \c Waiting
+    std::atomic<uint32_t> notified;
+
+    /// Payload of stopping criterion, used to wake threads waiting for a task
+    void *payload;
+
+    /// Mailbox of the thread (if any), used to wake it for targeted tasks
+    Mailbox *mailbox;
+
+    /// Doubly linked list of sleepers (protected by \ref TaskQueue::sleep_mutex)
+    Sleeper *prev, *next;
+
+    /// Is the instance part of the list of sleepers?
+    bool linked;
+
+#if !defined(__linux__) && !defined(_WIN32)
+    std::mutex mutex;
+    std::condition_variable cv;
+#endif
+
+    Sleeper(void *payload, Mailbox *mailbox)
+        : notified(Waiting), payload(payload), mailbox(mailbox), prev(nullptr),
+          next(nullptr), linked(false) { }
+
+    /// Block until \ref notify() has been called
+    void wait();
+
+    /**
+     * \brief Wake the thread
+     *
+     * Must be called once after the sleeper was removed from the list. The
+     * sleeping thread may destroy the instance while this function runs, it
+     * only touches the futex word/address afterwards (which is harmless).
+     */
+    void notify(Reason reason);
+};
+
 /**
  * Modified implementation of the lock-free queue presented in the paper
  *
@@ -148,19 +714,37 @@ struct Task {
  * item also has a *size* \c N that effectively creates \c N adjacent copies of
  * the item (but using a counter, which is more efficient than naive
  * replication). The \ref pop() operation returns the a pointer to the item and
- * a number in the range <tt>[0, N-1]</tt> indicating the item's index.
+ * a range of indices within <tt>[0, N-1]</tt>. To reduce contention, multiple
+ * adjacent indices are claimed at once while many of them remain ("guided"
+ * scheduling), where the claim size shrinks as the item is consumed.
  *
  * Tasks can also have children. Following termination of a task, the queue
  * will push any children that don't depend on other unfinished work.
  *
+ * On NUMA systems, the queue can consist of several Michael-Scott queues and
+ * task record pools (one per NUMA node). Tasks are then pushed to the queue of
+ * their node, and threads prefer to fetch work from the queue of their own
+ * node before turning to other nodes.
+ *
+ * When work stealing is enabled (see \ref set_work_stealing()), tasks pushed
+ * by a worker thread of this queue (e.g. nested tasks or children that
+ * became ready within the worker) are placed on that worker's \ref
+ * TaskDeque instead. Idle workers then first consult their own deque, then
+ * try to steal from other workers, and finally fall back to the shared queue.
+ *
  * The implementation here is designed to work on standard weakly ordered
  * memory architecture (e.g. AArch64), but likely would not not work an
  * completely weakly ordered architecture like the DEC Alpha.
  */
 struct TaskQueue {
 public:
-    /// Create an empty task queue
-    TaskQueue();
+    /**
+     * \brief Create an empty task queue
+     *
+     * \param node_count
+     *     Number of NUMA nodes. A separate queue is created for each one.
+     */
+    TaskQueue(uint32_t node_count = 1);
 
     /// Free the queue and delete any remaining tasks
     ~TaskQueue();
@@ -178,71 +762,604 @@ public:
      * units. The number '2' indicates two special references by user code and
      * by the queue itself, which don't correspond to outstanding work.
      *
-     * Initializes the Tasks' \c wait \c size, \c refcount, and \c next fields.
+     * The task record is taken from the pool of NUMA node \c node, which is
+     * also the queue that \ref push() will append the task to.
+     *
+     * Initializes the Tasks' \c wait \c size, \c refcount, \c node, \c
+     * priority (to \c NANOTHREAD_PRIORITY_NORMAL), and \c next fields.
+     */
+    Task *alloc(uint32_t size, uint32_t node = 0);
+
+    /**
+     * \brief Fetch at least \c count unused task records of NUMA node \c
+     * node and append them to \c out
+     *
+     * In contrast to repeated calls to \ref alloc(), this detaches the
+     * records from the node's recycle stack using a single atomic operation
+     * and allocates any missing ones in whole slabs. The records must be
+     * initialized via \ref init() before use, and ones that end up unused
+     * can be returned using \ref recycle_task().
+     */
+    void alloc_batch(uint32_t node, uint32_t count, std::vector<Task *> &out);
+
+    /// Initialize an unused task record, see \ref alloc()
+    void init(Task *task, uint32_t size, uint32_t node);
+
+    /**
+     * \brief Create at least \c count task records and add them to the pool
+     * of unused tasks of NUMA node \c node.
+     *
+     * This is called by workers on startup so that task records are
+     * first touched (and hence physically allocated) on their home node.
      */
-    Task *alloc(uint32_t size);
+    void reserve(uint32_t node, uint32_t count);
+
+    /**
+     * \brief Allocate \c size bytes of storage (aligned to 16 bytes) for the
+     * payload of a task
+     *
+     * Workers allocate from a chunk of their own, and other threads share a
+     * chunk protected by a mutex. The chunk containing the storage is written
+     * to \c chunk, whose reference must eventually be released via \ref
+     * PayloadChunk::release().
+     */
+    void *alloc_payload(uint32_t size, PayloadChunk **chunk);
+
+    /// Return a chunk of the payload arena that is no longer referenced
+    void recycle_payload(PayloadChunk *chunk);
 
     /**
      * \brief Decrease the reference count of a task.
      *
      * The implementation moves the task into a pool of completed tasks once
-     * the task is no longer referenced by any thread or data structure.
+     * the task is no longer referenced by any thread or data structure. The
+     * \c count parameter specifies by how much the reference count should be
+     * reduced (e.g. the number of completed work units).
      */
-    void release(Task *task, bool high = false);
+    void release(Task *task, bool high = false, uint32_t count = 1);
 
     /// Increase the reference count of a task.
     void retain(Task *task);
 
-    /// Append a task at the end of the queue
+    /**
+     * \brief Move an unused task record into the cache of the calling
+     * worker, or onto the shared stack of its NUMA node.
+     */
+    void recycle_task(Task *task);
+
+    /**
+     * \brief Append a task at the end of the queue
+     *
+     * If work stealing is enabled and the caller is a worker of this queue,
+     * the task is instead pushed onto the worker's local deque.
+     */
     void push(Task *task);
 
+    /**
+     * \brief Append a set of tasks to the queue
+     *
+     * Tasks going to the same NUMA node and priority level are first linked
+     * up and then appended to the associated queue using a single atomic
+     * operation. Sleeping threads are only notified once. The tasks must not
+     * be accessed by the caller afterwards, unless it holds a reference.
+     */
+    void push_batch(Task *const *tasks, uint32_t count);
+
     /// Register an inter-task dependency
     void add_dependency(Task *task, Task *child);
 
     /**
-     * \brief Pop a task from the queue
+     * \brief Register an inter-task dependency between two tasks that are
+     * not yet visible to other threads
+     *
+     * This is a cheaper variant of \ref add_dependency() that doesn't need
+     * atomic operations. It is the caller's responsibility to later account
+     * for the increase of <tt>child->wait_parents</tt>, which is not done
+     * here.
+     */
+    void add_private_dependency(Task *task, Task *child);
+
+    /**
+     * \brief Pop a range of work units from the queue of NUMA node \c node
+     * and priority level \c priority
      *
      * When the queue is nonempty, this function returns a task instance and a
-     * number in the range <tt>[0, size - 1]</tt>, where \c size is the number
-     * of work units in the task. Otherwise, it returns \c nullptr and 0.
+     * nonempty range of work unit indices within <tt>[0, size - 1]</tt>, where
+     * \c size is the number of work units in the task. The caller is
+     * responsible for executing all of them. Otherwise, it returns an empty
+     * range with <tt>task == nullptr</tt>.
+     */
+    TaskRange pop(uint32_t node = 0,
+                  uint32_t priority = NANOTHREAD_PRIORITY_NORMAL);
+
+    /**
+     * \brief Fetch work from the queues of all priority levels
+     *
+     * Levels are visited from highest to lowest priority, and periodically
+     * in the reverse order (see \ref set_aging()). Within a level, the
+     * shared queues are visited starting with the current node. Normal
+     * priority work is additionally taken from the local deque, the deques
+     * of other workers on the same NUMA node (before the shared queues), and
+     * the deques of workers on other NUMA nodes (afterwards).
+     *
+     * Has the same interface as \ref pop().
+     */
+    TaskRange pop_any();
+
+    /**
+     * \brief Fetch a task from the queue, or sleep
+     *
+     * This function repeatedly tries to fetch work from the queue using an
+     * exponential backoff strategy. If no work is available for an extended
+     * amount of time and the \c may_sleep parameter is set to \c true, the
+     * thread parks until it is woken by \ref push() or \ref wakeup().
+     *
+     * The spinning phase adapts to the observed idle periods: when a parked
+     * thread is woken shortly after it went to sleep, it spins for longer the
+     * next time, and when it sleeps for a long time, it parks sooner. The
+     * spinning time never exceeds the spin budget (\ref set_spin_budget()).
+     *
+     * The function stops trying to acquire work and returns an empty range
+     * (with <tt>task == nullptr</tt>) when the supplied function
+     * <tt>stopping_criterion(payload)</tt> evaluates to true.
+     */
+    TaskRange pop_or_sleep(bool (*stopping_criterion)(void *), void *payload,
+                           bool may_sleep);
+
+    /**
+     * \brief Wake sleeping threads
+     *
+     * \param count
+     *     Maximum number of threads to wake. By default, all of them are woken.
+     */
+    void wakeup(uint32_t count = (uint32_t) -1);
+
+    /// Wake threads whose stopping criterion in pop_or_sleep() uses \c payload
+    void wakeup_waiting(void *payload);
+
+    /**
+     * \brief Set the maximum amount of time (in microseconds) that idle
+     * threads spin before they park
      */
-    std::pair<Task *, uint32_t> pop();
+    void set_spin_budget(uint32_t value) {
+        spin_budget.store(value, std::memory_order_relaxed);
+    }
+
+    /// Return the spin budget in microseconds
+    uint32_t spin_budget_us() const {
+        return spin_budget.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Set the number of hot workers (latency mode)
+     *
+     * The first \c value workers never park. While they spin, they accept
+     * small tasks submitted by other threads through their \ref Handoff
+     * slot, which bypasses the queues and the wakeup mechanism.
+     */
+    void set_hot_workers(uint32_t value) {
+        hot_workers.store(value, std::memory_order_relaxed);
+    }
+
+    /// Return the number of hot workers
+    uint32_t hot_worker_count() const {
+        return hot_workers.load(std::memory_order_relaxed);
+    }
+
+    /// Enable/disable ordering ready tasks by their upward rank
+    void set_critical_path(bool value) {
+        critical_path.store(value, std::memory_order_relaxed);
+    }
+
+    /// Are ready tasks ordered by their upward rank?
+    bool critical_path_enabled() const {
+        return critical_path.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Return the upward rank of a task that hasn't started yet (see
+     * \ref Task::rank)
+     *
+     * Unknown ranks are computed via a depth-first traversal of the
+     * descendants, which cannot have started either. The result is cached in
+     * the records of all visited tasks.
+     */
+    float rank(Task *task);
+
+    /**
+     * \brief Record the ranges of work units that threads execute into a
+     * buffer of \c capacity entries (see \ref pool_schedule_record())
+     *
+     * The value zero stops the recording and keeps the entries.
+     */
+    void set_recording(uint32_t capacity);
+
+    /// Copy up to \c count recorded entries and return the number of ranges
+    uint32_t recorded(ScheduleEntry *entries, uint32_t count) const;
+
+    /// Is a schedule being recorded?
+    bool recording() const {
+        return record_active.load(std::memory_order_relaxed);
+    }
+
+    /// Append an entry for a range of work units that is about to run
+    void record(const TaskRange &range);
+
+    /// Replay a schedule (see \ref pool_schedule_replay()), or stop if \c count == 0
+    void set_replay(const ScheduleEntry *entries, uint32_t count);
+
+    /// Is a schedule being recorded or replayed?
+    bool scheduling() const {
+        return record_active.load(std::memory_order_relaxed) ||
+               replay.load(std::memory_order_relaxed) != nullptr;
+    }
+
+    /// Sequence number of a newly submitted task (see \ref Task::seq)
+    uint32_t next_seq() {
+        return scheduling() ? schedule_seq.fetch_add(1, std::memory_order_relaxed)
+                            : (uint32_t) -1;
+    }
 
     /**
-     * \breif Fetch a task from the queue, or sleep
+     * \brief Associate the calling thread with the deque of worker \c id
+     * running on NUMA node \c node
      *
-     * This function repeatedly tries to fetch work from the queue and sleeps
-     * if no work is available for an extended amount of time (~50 ms) and
-     * the \c may_sleep parameter is set to \c true.
+     * Worker IDs start at 1. Deques are created on demand and reused when a
+     * worker with the same ID is launched again later on.
+     */
+    void attach_worker(uint32_t id, uint32_t node = 0);
+
+    /// Undo \ref attach_worker(). The worker's deque must be empty.
+    void detach_worker();
+
+    /**
+     * \brief Specify that the pool has workers with IDs <tt>1..count</tt>
+     *
+     * Tasks can target the mailboxes of these workers even before they have
+     * started, while the mailboxes of other workers are closed.
+     */
+    void set_worker_ids(uint32_t count);
+
+    /**
+     * \brief Attach a mailbox to the calling thread and return its ID (see
+     * \ref TaskAttr::thread)
      *
-     * The function stops trying to acquire work and returns <tt>(nullptr,
-     * 0)</tt> when the supplied function <tt>stopping_criterion(payload)</tt>
-     * evaluates to true.
+     * Workers already own a mailbox, whose ID is the worker ID. Other
+     * threads become driver threads of the queue, whose mailboxes have IDs
+     * with the bit \c NANOTHREAD_DRIVER_ID. The mailboxes of driver threads
+     * that detached are reused.
      */
-    std::pair<Task *, uint32_t> pop_or_sleep(bool (*stopping_criterion)(void *),
-                                             void *payload, bool may_sleep);
+    uint32_t attach_thread();
 
-    /// Wake sleeping threads
-    void wakeup();
+    /// Undo \ref attach_thread() for a driver thread
+    void detach_thread();
+
+    /// Return the mailbox with the given ID if a thread is attached to it
+    Mailbox *mailbox(uint32_t id) const;
+
+    /// Is the local deque of the calling thread empty?
+    bool local_empty() const;
+
+    /// Is the mailbox of the calling thread empty (or doesn't it have one)?
+    bool mailbox_empty() const;
+
+    /// Enable/disable pushing tasks onto per-worker deques
+    void set_work_stealing(bool value) {
+        work_stealing.store(value, std::memory_order_relaxed);
+    }
+
+    /// Are tasks pushed onto per-worker deques?
+    bool work_stealing_enabled() const {
+        return work_stealing.load(std::memory_order_relaxed);
+    }
+
+    /// Number of NUMA nodes (and separate queues)
+    uint32_t node_count() const { return nodes; }
+
+    /// Set the interval of the priority aging mechanism (0: disabled)
+    void set_aging(uint32_t value) {
+        aging.store(value, std::memory_order_relaxed);
+    }
+
+    /// Return the interval of the priority aging mechanism
+    uint32_t aging_interval() const {
+        return aging.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Specify the NUMA node of each CPU
+     *
+     * This is used to determine the node of threads that aren't workers
+     * of this queue. Must be called before the queue is used.
+     */
+    void set_cpu_nodes(const std::vector<uint32_t> &value) { cpu_nodes = value; }
+
+    /// Return the NUMA node of the calling thread
+    uint32_t current_node() const;
+
+    /// Inform the queue about the number of workers processing its tasks
+    void set_worker_count(uint32_t value) {
+        worker_count.store(value, std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief Return how many of \c remain work units should be claimed at once
+     *
+     * Following the "guided" scheduling strategy, this is a fraction of the
+     * remaining work that is inversely proportional to the number of threads.
+     */
+    uint32_t claim_size(uint32_t remain) const {
+        uint32_t threads = worker_count.load(std::memory_order_relaxed) + 1,
+                 count = remain / (NANOTHREAD_CLAIM_FACTOR * threads);
+        return count > 0 ? count : 1;
+    }
+
+    /**
+     * \brief Increase a statistics counter
+     *
+     * Workers update their own counters without atomic read-modify-write
+     * operations, other threads share a set of atomic counters.
+     */
+    void count(Stat stat, uint64_t amount = 1) {
+        TaskDeque *local = local_deque();
+        if (local) {
+            std::atomic<uint64_t> &value = local->stats.value[stat];
+            value.store(value.load(std::memory_order_relaxed) + amount,
+                        std::memory_order_relaxed);
+        } else {
+            external_stats.value[stat].fetch_add(amount,
+                                                 std::memory_order_relaxed);
+        }
+    }
+
+    /// Sum up the statistics counters of all threads
+    void stats(PoolStats *out);
+
+    /**
+     * \brief Conservative check whether the shared queues or the deques of
+     * workers contain work (mailboxes are not considered)
+     */
+    bool has_work() const;
+
+    /**
+     * \brief Register a function that is called whenever work is pushed
+     *
+     * Arenas use this to wake the shared workers, which don't park within the
+     * queue. The parameters are the payload and an upper bound on the number
+     * of threads that can process the new work. Must be set before the queue
+     * is used.
+     */
+    void set_push_hook(void (*hook)(void *, uint32_t), void *payload) {
+        push_hook = hook;
+        push_hook_payload = payload;
+    }
+
+    /// Return the number of threads that are waiting for work
+    uint32_t idle_count() const {
+        return idle.load(std::memory_order_relaxed);
+    }
+
+    /// Is the calling thread a worker that is attached to this queue?
+    bool is_worker() const { return local_deque() != nullptr; }
 
 private:
-    /// Head and tail of a lock-free list data structure
-    Task::Ptr head, tail;
+    /// Return the calling thread's deque if it belongs to this queue
+    TaskDeque *local_deque() const;
+
+    /// Return the deque of worker \c id, creating it if needed (\c deque_mutex must be held)
+    TaskDeque *worker_deque(uint32_t id);
+
+    /// Return the calling thread's mailbox if it belongs to this queue
+    Mailbox *local_mailbox() const;
+
+    /// Append a task to the mailbox of its thread, and wake it if needed
+    void push_mailbox(Task *task);
+
+    /// Try to pass a task to the hand-off slot of a spinning hot worker
+    bool handoff(Task *task);
+
+    /// Close the hand-off slot, returns the work that was handed over, if any
+    TaskRange close_handoff(Handoff &slot);
+
+    /// Turn a deque item into a work unit, pushing the rest back locally
+    TaskRange acquire(TaskDeque *local, TaskRange item);
+
+    /**
+     * \brief Try to steal work from the deque of another worker
+     *
+     * When \c same_node is \c true, only workers running on the same NUMA
+     * node as the caller are considered. Otherwise, only workers on other
+     * nodes are considered.
+     */
+    bool steal(TaskDeque *local, TaskRange &item, bool same_node);
+
+    /**
+     * \brief Wake up to \c count sleeping threads if there are any, and if
+     * the new work can't be taken by threads that are still spinning (used by
+     * push operations).
+     */
+    void wakeup_if_sleeping(uint32_t count);
 
-    /// Head of a lock-free stack storing unused tasks
-    Task::Ptr recycle;
+    /// Add a sleeper to the list of parked threads
+    void add_sleeper(Sleeper *sleeper);
+
+    /// Unlink a sleeper. Returns \c false if somebody else did so already
+    bool remove_sleeper(Sleeper *sleeper);
+
+    /**
+     * \brief Wake up to \c count threads
+     *
+     * When \c mailbox is specified, only its owner is considered. Otherwise,
+     * all threads (if \c payload is \c nullptr) or the ones whose stopping
+     * criterion uses \c payload are considered.
+     */
+    void wakeup(uint32_t count, void *payload, Sleeper::Reason reason,
+                const Mailbox *mailbox = nullptr);
+
+    /**
+     * \brief Allocate a slab of \ref NANOTHREAD_SLAB_SIZE task records on
+     * behalf of NUMA node \c node.
+     *
+     * The first record is returned. When \c recycle is \c true, the
+     * remaining ones are placed onto the recycle stack of the node, and
+     * otherwise they are left to the caller (they follow the first record in
+     * memory).
+     */
+    Task *alloc_slab(uint32_t node, bool recycle = true);
+
+    /// Move the first \c count records of a worker's cache to the shared stack
+    void flush_cache(TaskDeque *deque, uint32_t count);
+
+    /// Push a linked chain of unused task records onto a node's shared stack
+    void push_stack(uint32_t node, Task *first, Task *last);
+
+    /// Store a task of the replayed schedule, returns \c false if it doesn't match
+    bool push_replay(Replay *r, Task *task);
+
+    /// Take the next range of the calling thread from the replayed schedule
+    TaskRange pop_replay(Replay *r);
+
+    /// Bump-allocate a payload from 'current', replacing the chunk if needed
+    void *bump_payload(PayloadChunk *&current, uint32_t size,
+                       PayloadChunk **chunk);
+
+    /// Head of a lock-free stack storing unused tasks (one per NUMA node)
+    struct TaskStack {
+        Task::Ptr head;
+        uint8_t padding[64 - sizeof(Task::Ptr)];
+    };
+
+    /// Return the list storing tasks of the given NUMA node and priority
+    TaskList &list(uint32_t node, uint32_t priority) const {
+        return lists[priority * nodes + node];
+    }
+
+    /// Conservative check whether a list is empty
+    bool list_empty(const TaskList &list) const;
+
+    /// Pop a range of work units from a specific list
+    TaskRange pop_list(TaskList &list);
+
+    /// Append a linked chain of tasks to a specific list
+    void push_list(TaskList &list, Task *first, Task *last);
+
+    /// Number of NUMA nodes
+    uint32_t nodes;
+
+    /// Queues of tasks that are ready for execution (see \ref list())
+    std::unique_ptr<TaskList[]> lists;
+
+    /// Stacks of unused task records
+    std::unique_ptr<TaskStack[]> recycle;
+
+    /// NUMA node of each CPU
+    std::vector<uint32_t> cpu_nodes;
 
     /// Number of task instances created (for debugging)
     std::atomic<uint32_t> tasks_created;
 
-    /// Upper 32 bit: sleep phase, lower 32 bit: number of sleepers
-    std::atomic<uint64_t> sleep_state;
+    /// Statistics counters of threads that aren't workers of this queue
+    StatBlock external_stats;
 
     /// Mutex protecting the fields below
+    std::mutex slab_mutex;
+
+    /// Memory regions holding the task records
+    std::vector<std::unique_ptr<uint8_t[]>> slabs;
+
+    /// Memory regions holding the chunks of the payload arena
+    std::vector<std::unique_ptr<uint8_t[]>> payload_chunks;
+
+    /// Unused chunks of the payload arena, linked via \ref PayloadChunk::next
+    PayloadChunk *payload_free;
+
+    /// Mutex protecting 'payload_shared'
+    std::mutex payload_mutex;
+
+    /// Chunk that threads other than the workers allocate payloads from
+    PayloadChunk *payload_shared;
+
+    /// Number of threads in pop_or_sleep() that did not find work (incl. parked ones)
+    std::atomic<uint32_t> idle;
+
+    /// Number of threads that are currently parked
+    std::atomic<uint32_t> sleepers;
+
+    /// Maximum spinning time in microseconds before parking
+    std::atomic<uint32_t> spin_budget;
+
+    /// Number of workers that spin instead of parking (latency mode)
+    std::atomic<uint32_t> hot_workers;
+
+    /// Sequence number of the next submitted task (see \ref next_seq())
+    std::atomic<uint32_t> schedule_seq;
+
+    /// Is a schedule being recorded?
+    std::atomic<bool> record_active;
+
+    /// Buffer of recorded entries, see \ref set_recording()
+    std::unique_ptr<ScheduleEntry[]> record_entries;
+    uint32_t record_capacity;
+
+    /// Number of ranges executed since the recording began
+    std::atomic<uint32_t> record_count;
+
+    /// Schedule that is being replayed (if any)
+    std::atomic<Replay *> replay;
+
+    /// Replaced schedules, kept around for threads that may still read them
+    std::vector<std::unique_ptr<Replay>> replays;
+
+    /// Are ready tasks ordered by their upward rank?
+    std::atomic<bool> critical_path;
+
+    /// Mutex protecting the field below
     std::mutex sleep_mutex;
 
-    /// Condition variable used to manage workers that are asleep
-    std::condition_variable sleep_cv;
+    /// Head of a doubly linked list of parked threads
+    Sleeper *sleep_head;
+
+    /// Should workers push tasks onto their local deques?
+    std::atomic<bool> work_stealing;
+
+    /// Interval of the priority aging mechanism
+    std::atomic<uint32_t> aging;
+
+    /// Number of workers, used to determine claim sizes
+    std::atomic<uint32_t> worker_count;
+
+    /// Lock-free snapshot of the deque list, read by thieves
+    std::atomic<TaskDeque **> deque_table;
+
+    /// Number of valid entries in 'deque_table'
+    std::atomic<uint32_t> deque_count;
+
+    /// Mutex protecting the fields below
+    std::mutex deque_mutex;
+
+    /// Storage of all deques created so far
+    std::vector<std::unique_ptr<TaskDeque>> deques;
+
+    /// All versions of 'deque_table' (old ones may still be accessed)
+    std::vector<std::unique_ptr<TaskDeque *[]>> deque_tables;
+
+    /// Lock-free snapshot of the mailboxes of driver threads
+    std::atomic<Mailbox **> driver_table;
+
+    /// Number of valid entries in 'driver_table'
+    std::atomic<uint32_t> driver_count;
+
+    /// Mailboxes of driver threads (protected by 'deque_mutex')
+    std::vector<std::unique_ptr<Mailbox>> drivers;
+
+    /// All versions of 'driver_table' (old ones may still be accessed)
+    std::vector<std::unique_ptr<Mailbox *[]>> driver_tables;
+
+    /// Function called when work is pushed (see \ref set_push_hook())
+    void (*push_hook)(void *, uint32_t);
+
+    /// Payload of 'push_hook'
+    void *push_hook_payload;
 };
 
 
@@ -253,6 +1370,14 @@ extern int profile_tasks;
 #define NT_STR_2(x) #x
 #define NT_STR(x)   NT_STR_2(x)
 
+#if defined(_MSC_VER)
+#  define NT_NOINLINE __declspec(noinline)
+#  define NT_INLINE __forceinline
+#else
+#  define NT_NOINLINE __attribute__((noinline))
+#  define NT_INLINE inline __attribute__((always_inline))
+#endif
+
 // #define NT_DEBUG
 #if defined(NT_DEBUG)
 #  define NT_TRACE(fmt, ...)                                                  \
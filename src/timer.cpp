@@ -0,0 +1,90 @@
+/*
+    src/timer.cpp -- Low-overhead timestamps used for profiling and tracing
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#include "timer.h"
+#include <atomic>
+#include <thread>
+
+#if defined(NANOTHREAD_TIMER_TSC) && !defined(_MSC_VER)
+#  include <cpuid.h>
+#endif
+
+/// Minimum duration of the calibration of the time stamp counter
+#define NANOTHREAD_TIMER_CALIBRATION_NS 10000000
+
+static bool timer_tsc_invariant() {
+#if defined(NANOTHREAD_TIMER_TSC)
+    // CPUID leaf 0x80000007, EDX bit 8: invariant TSC
+    unsigned int regs[4] = { 0, 0, 0, 0 };
+    #if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0x80000000);
+        if ((unsigned int) info[0] < 0x80000007u)
+            return false;
+        __cpuid(info, 0x80000007);
+        regs[3] = (unsigned int) info[3];
+    #else
+        if (__get_cpuid_max(0x80000000u, nullptr) < 0x80000007u)
+            return false;
+        __get_cpuid(0x80000007u, &regs[0], &regs[1], &regs[2], &regs[3]);
+    #endif
+    return (regs[3] & (1u << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+// (The initializers below run in the order of definition)
+bool timer_tsc = timer_tsc_invariant();
+
+/// Reference point of the calibration
+static const uint64_t timer_start_ticks = timer_ticks();
+static const std::chrono::steady_clock::time_point timer_start_time =
+    std::chrono::steady_clock::now();
+
+/// Cached result of timer_tick_ns() (0: not calibrated yet)
+static std::atomic<double> timer_scale(0.0);
+
+uint64_t timer_epoch() { return timer_start_ticks; }
+
+double timer_tick_ns() {
+    double scale = timer_scale.load(std::memory_order_relaxed);
+    if (scale != 0.0)
+        return scale;
+
+#if defined(NANOTHREAD_TIMER_CNTVCT)
+    // The counter frequency is provided by the system
+    uint64_t freq;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(freq));
+    scale = freq ? 1e9 / (double) freq : 1.0;
+#elif defined(NANOTHREAD_TIMER_TSC)
+    if (timer_tsc) {
+        while (true) {
+            uint64_t ticks = timer_ticks();
+            int64_t ns = (int64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - timer_start_time).count();
+
+            if (ns >= NANOTHREAD_TIMER_CALIBRATION_NS && ticks > timer_start_ticks) {
+                scale = (double) ns / (double) (ticks - timer_start_ticks);
+                break;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } else {
+        scale = 1.0;
+    }
+#else
+    scale = 1.0;
+#endif
+
+    // Concurrent calibrations yield nearly identical values, keep any of them
+    timer_scale.store(scale, std::memory_order_relaxed);
+    return scale;
+}
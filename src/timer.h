@@ -0,0 +1,62 @@
+/*
+    src/timer.h -- Low-overhead timestamps used for profiling and tracing
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#  include <intrin.h>
+#  define NANOTHREAD_TIMER_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define NANOTHREAD_TIMER_TSC 1
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+#  define NANOTHREAD_TIMER_CNTVCT 1
+#endif
+
+/**
+ * \brief Does timer_ticks() read the time stamp counter?
+ *
+ * This requires an invariant TSC, whose rate doesn't depend on the power state
+ * of the core (determined once at startup). Otherwise, timer_ticks() falls
+ * back to a steady clock with nanosecond ticks.
+ */
+extern bool timer_tsc;
+
+/// Return the current time in ticks of an unspecified (constant) rate
+inline uint64_t timer_ticks() {
+#if defined(NANOTHREAD_TIMER_TSC)
+    if (timer_tsc)
+        return (uint64_t) __rdtsc();
+#elif defined(NANOTHREAD_TIMER_CNTVCT)
+    uint64_t value;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#endif
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * \brief Return the duration of a tick in nanoseconds
+ *
+ * The time stamp counter is calibrated against the steady clock the first
+ * time that this function is called, which may take a few milliseconds.
+ */
+extern double timer_tick_ns();
+
+/// Tick count at startup, used as the origin of traces
+extern uint64_t timer_epoch();
+
+/// Convert a number of ticks into nanoseconds
+inline uint64_t timer_ns(uint64_t ticks) {
+    return (uint64_t) ((double) ticks * timer_tick_ns() + 0.5);
+}
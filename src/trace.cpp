@@ -0,0 +1,173 @@
+/*
+    src/trace.cpp -- Per-thread event tracing used by nanothread
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#include <nanothread/nanothread.h>
+#include "trace.h"
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * \brief Ring buffer storing the events of one thread
+ *
+ * Only the owning thread writes to the buffer. It publishes each event by
+ * incrementing 'count' with release semantics, so that \ref pool_trace_dump()
+ * can read the buffer without locking.
+ */
+struct TraceBuffer {
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<uint64_t> count;
+
+    /// Value of pool_thread_id() when the buffer was created
+    uint32_t thread_id;
+
+    TraceBuffer(uint32_t thread_id)
+        : events(new TraceEvent[NANOTHREAD_TRACE_CAPACITY]), count(0),
+          thread_id(thread_id) { }
+};
+
+std::atomic<bool> trace_enabled(false);
+
+/// Mutex protecting 'trace_buffers'
+static std::mutex trace_lock;
+
+/// Ring buffers of all threads that have recorded events so far
+static std::vector<std::unique_ptr<TraceBuffer>> trace_buffers;
+
+#if defined(_MSC_VER)
+    static __declspec(thread) TraceBuffer *trace_buffer_tls = nullptr;
+#else
+    static __thread TraceBuffer *trace_buffer_tls = nullptr;
+#endif
+
+void trace_record(TraceType type, uint64_t start, uint64_t end,
+                  const void *task, uint32_t begin, uint32_t end_index,
+                  uint32_t arg) {
+    TraceBuffer *buffer = trace_buffer_tls;
+
+    if (!buffer) {
+        std::unique_lock<std::mutex> guard(trace_lock);
+        trace_buffers.emplace_back(new TraceBuffer(pool_thread_id()));
+        buffer = trace_buffer_tls = trace_buffers.back().get();
+    }
+
+    uint64_t index = buffer->count.load(std::memory_order_relaxed);
+    TraceEvent &event = buffer->events[index % NANOTHREAD_TRACE_CAPACITY];
+    event.start = start;
+    event.end = end;
+    event.task = task;
+    event.begin = begin;
+    event.end_index = end_index;
+    event.type = type;
+    event.arg = arg;
+    buffer->count.store(index + 1, std::memory_order_release);
+}
+
+void pool_set_trace(int value) {
+    trace_enabled.store(value != 0, std::memory_order_relaxed);
+}
+
+int pool_trace() {
+    return (int) trace_enabled.load(std::memory_order_relaxed);
+}
+
+void pool_trace_clear() {
+    std::unique_lock<std::mutex> guard(trace_lock);
+    for (std::unique_ptr<TraceBuffer> &buffer : trace_buffers)
+        buffer->count.store(0, std::memory_order_relaxed);
+}
+
+int pool_trace_dump(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        fprintf(stderr, "pool_trace_dump(): could not open \"%s\"!\n", filename);
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> guard(trace_lock);
+    bool first = true;
+
+    // Timestamps are written in microseconds since startup
+    uint64_t epoch = timer_epoch();
+    double scale = timer_tick_ns() * 1e-3;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for (size_t tid = 0; tid < trace_buffers.size(); ++tid) {
+        TraceBuffer *buffer = trace_buffers[tid].get();
+
+        // Thread name
+        if (buffer->thread_id)
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                    "\"tid\":%zu,\"args\":{\"name\":\"nanothread worker %u\"}}",
+                    first ? "" : ",", tid, buffer->thread_id);
+        else
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                    "\"tid\":%zu,\"args\":{\"name\":\"thread\"}}",
+                    first ? "" : ",", tid);
+        first = false;
+
+        uint64_t count = buffer->count.load(std::memory_order_acquire),
+                 begin = count > NANOTHREAD_TRACE_CAPACITY
+                             ? count - NANOTHREAD_TRACE_CAPACITY : 0;
+
+        for (uint64_t i = begin; i < count; ++i) {
+            const TraceEvent &e = buffer->events[i % NANOTHREAD_TRACE_CAPACITY];
+            double ts = (double) (int64_t) (e.start - epoch) * scale,
+                   dur = (double) (e.end - e.start) * scale;
+
+            switch (e.type) {
+                case TraceType::Run:
+                    // Nested work that was executed inline has no task
+                    if (e.task)
+                        fprintf(f, ",\n{\"name\":\"task %p\",", e.task);
+                    else
+                        fprintf(f, ",\n{\"name\":\"inline\",");
+                    fprintf(f, "\"cat\":\"run\",\"ph\":\"X\",\"ts\":%.3f,"
+                            "\"dur\":%.3f,\"pid\":0,\"tid\":%zu,\"args\":{"
+                            "\"task\":\"%p\",\"begin\":%u,\"end\":%u", ts,
+                            dur, tid, e.task, e.begin, e.end_index);
+                    // Sequence number while a schedule is recorded/replayed
+                    if (e.task && e.arg != (uint32_t) -1)
+                        fprintf(f, ",\"seq\":%u", e.arg);
+                    fprintf(f, "}}");
+                    break;
+
+                case TraceType::Steal:
+                    fprintf(f, ",\n{\"name\":\"steal\",\"cat\":\"steal\","
+                            "\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,"
+                            "\"tid\":%zu,\"args\":{\"task\":\"%p\","
+                            "\"begin\":%u,\"end\":%u,\"victim\":%u}}", ts, tid,
+                            e.task, e.begin, e.end_index, e.arg);
+                    break;
+
+                case TraceType::Sleep:
+                    fprintf(f, ",\n{\"name\":\"sleep\",\"cat\":\"sleep\","
+                            "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,"
+                            "\"tid\":%zu}", ts, dur, tid);
+                    break;
+
+                case TraceType::Wake:
+                    fprintf(f, ",\n{\"name\":\"wake\",\"cat\":\"wake\","
+                            "\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":0,"
+                            "\"tid\":%zu,\"args\":{\"threads\":%u}}", ts, tid,
+                            e.arg);
+                    break;
+            }
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+    bool success = ferror(f) == 0;
+    if (fclose(f) != 0)
+        success = false;
+
+    return (int) success;
+}
@@ -0,0 +1,71 @@
+/*
+    src/trace.h -- Per-thread event tracing used by nanothread
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#pragma once
+
+#include "timer.h"
+#include <atomic>
+#include <cstdint>
+
+/// Number of events that each thread's ring buffer can hold
+#define NANOTHREAD_TRACE_CAPACITY 65536
+
+/// Kinds of events recorded by the tracing mechanism
+enum class TraceType : uint32_t {
+    /// Execution of a range of work units of a task ('arg': sequence number)
+    Run,
+
+    /// Range of work units stolen from another worker's deque ('arg': victim)
+    Steal,
+
+    /// Time spent parked in TaskQueue::pop_or_sleep()
+    Sleep,
+
+    /// Wakeup of parked threads ('arg': number of threads)
+    Wake
+};
+
+/// A single entry of a thread's trace
+struct TraceEvent {
+    /// Start and end time in timer ticks (identical for instantaneous events)
+    uint64_t start, end;
+
+    /// Associated task, if any
+    const void *task;
+
+    /// Associated range of work units, if any
+    uint32_t begin, end_index;
+
+    /// Event kind
+    TraceType type;
+
+    /// Additional event-specific information
+    uint32_t arg;
+};
+
+/// Is tracing enabled? (global setting, see pool_set_trace())
+extern std::atomic<bool> trace_enabled;
+
+/// Return the current time in timer ticks (converted by pool_trace_dump())
+inline uint64_t trace_time() { return timer_ticks(); }
+
+/**
+ * \brief Append an event to the calling thread's ring buffer
+ *
+ * The buffer is created the first time that a thread records an event. Once
+ * the buffer is full, the oldest events are overwritten.
+ */
+extern void trace_record(TraceType type, uint64_t start, uint64_t end,
+                         const void *task = nullptr, uint32_t begin = 0,
+                         uint32_t end_index = 0, uint32_t arg = 0);
+
+/// Is tracing enabled?
+inline bool tracing() {
+    return trace_enabled.load(std::memory_order_relaxed);
+}
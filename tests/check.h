@@ -0,0 +1,22 @@
+/*
+    tests/check.h -- Assertion macro shared by the test programs
+
+    Copyright (c) 2021 Wenzel Jakob <wenzel.jakob@epfl.ch>
+
+    All rights reserved. Use of this source code is governed by a BSD-style
+    license that can be found in the LICENSE file.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Abort with a message naming the condition if it does not hold
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "Check failed: %s\n", #cond);                     \
+            abort();                                                          \
+        }                                                                     \
+    } while (0)
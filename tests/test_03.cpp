@@ -1,6 +1,10 @@
 #include <nanothread/nanothread.h>
 #include <stdlib.h>
 
+#if !defined(_WIN32)
+#  include <pthread.h>
+#endif
+
 Task *tetranacci(Pool *pool, uint32_t i, uint32_t *out) {
     if (i < 4) {
         *out = (i == 3) ? 1 : 0;
@@ -53,7 +57,47 @@ Task * tetranacci_2(Pool *pool, uint32_t i, uint32_t *out) {
     );
 }
 
+#if !defined(_WIN32)
+/* Without workers, the blocking variant nests a task_wait() per level on the
+   waiting thread. Run it on a thread with a small stack, so that growth of
+   the frames that stay live across callbacks doesn't go unnoticed. */
+#if defined(__OPTIMIZE__) && !defined(__SANITIZE_ADDRESS__)
+#  define TEST_STACK_SIZE (512 * 1024)
+#else
+#  define TEST_STACK_SIZE (1024 * 1024) // Unoptimized frames are larger
+#endif
+
+void *nested_waits(void *ptr) {
+    uint32_t out = 0;
+    Task *task = tetranacci_2((Pool *) ptr, 16, &out);
+    task_wait_and_release(task);
+    if (out != 2872)
+        abort();
+    return nullptr;
+}
+
+void test_stack_size() {
+    Pool *pool = pool_create(0);
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, TEST_STACK_SIZE);
+    if (pthread_create(&thread, &attr, nested_waits, pool) != 0)
+        abort();
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+
+    pool_destroy(pool);
+}
+#endif
+
 int main(int, char**) {
+#if !defined(_WIN32)
+    printf("Testing with a %i KiB stack..\n", TEST_STACK_SIZE / 1024);
+    test_stack_size();
+#endif
+
     // Create a worker per CPU thread
     for (int i = 0; i< 100; ++i) {
         printf("Testing with %i threads..\n", i);
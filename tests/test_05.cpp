@@ -0,0 +1,86 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+namespace dr = drjit;
+
+// Nested parallel loops that are submitted from within pool workers
+uint64_t nested_sum(Pool *pool, uint32_t n) {
+    std::atomic<uint64_t> sum(0);
+
+    dr::parallel_for(
+        dr::blocked_range<uint32_t>(0, n, 1),
+        [&](dr::blocked_range<uint32_t> outer) {
+            for (uint32_t i = outer.begin(); i != outer.end(); ++i) {
+                dr::parallel_for(
+                    dr::blocked_range<uint32_t>(0, n, 3),
+                    [&, i](dr::blocked_range<uint32_t> inner) {
+                        uint64_t partial = 0;
+                        for (uint32_t j = inner.begin(); j != inner.end(); ++j)
+                            partial += (uint64_t) i * n + j;
+                        sum += partial;
+                    },
+                    pool);
+            }
+        },
+        pool);
+
+    return sum.load();
+}
+
+// Fine-grained dependency graph, children become ready on the workers
+Task *tetranacci(Pool *pool, uint32_t i, uint32_t *out) {
+    if (i < 4) {
+        *out = (i == 3) ? 1 : 0;
+        return nullptr;
+    }
+
+    return dr::do_async(
+        [pool, i, out]() {
+            uint32_t tmp[4];
+            Task *task[4];
+
+            for (int k = 0; k < 4; ++k)
+                task[k] = tetranacci(pool, i - k - 1, tmp + k);
+
+            Task *sum = dr::do_async(
+                [&tmp, out]() { *out = tmp[0] + tmp[1] + tmp[2] + tmp[3]; },
+                { task[0], task[1], task[2], task[3] }, pool);
+
+            for (int k = 0; k < 4; ++k)
+                task_release(task[k]);
+
+            task_wait_and_release(sum);
+        }, {}, pool
+    );
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 16; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+        pool_set_work_stealing(pool, 1);
+        if (!pool_work_stealing(pool))
+            abort();
+
+        uint32_t n = 200;
+        uint64_t expected = (uint64_t) n * n * ((uint64_t) n * n - 1) / 2;
+        if (nested_sum(pool, n) != expected)
+            abort();
+
+        uint32_t out = 0;
+        task_wait_and_release(tetranacci(pool, 16, &out));
+        if (out != 2872)
+            abort();
+
+        // Shrink the pool while workers have local work
+        Task *task = tetranacci(pool, 18, &out);
+        pool_set_size(pool, i / 2);
+        task_wait_and_release(task);
+        if (out != 10671)
+            abort();
+
+        pool_destroy(pool);
+    }
+}
@@ -0,0 +1,79 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+
+struct Counters {
+    std::unique_ptr<std::atomic<uint32_t>[]> visits;
+    std::atomic<uint32_t> calls;
+};
+
+void check(Counters &c, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++i) {
+        if (c.visits[i].load() != 1) {
+            fprintf(stderr, "Work unit %u was visited %u times!\n", i,
+                    c.visits[i].load());
+            abort();
+        }
+        c.visits[i].store(0);
+    }
+}
+
+int main(int, char**) {
+    const uint32_t size = 1000000;
+
+    Counters c;
+    c.visits.reset(new std::atomic<uint32_t>[size]);
+    for (uint32_t i = 0; i < size; ++i)
+        c.visits[i].store(0);
+
+    for (uint32_t threads = 0; threads <= 8; ++threads) {
+        Pool *pool = pool_create(threads);
+
+        // Range-based callback: chunks must be disjoint and cover [0, size)
+        c.calls = 0;
+        task_submit_range_and_wait(
+            pool, size,
+            [](uint32_t begin, uint32_t end, void *payload) {
+                Counters *c = (Counters *) payload;
+                if (begin >= end || end > size)
+                    abort();
+                for (uint32_t i = begin; i != end; ++i)
+                    c->visits[i]++;
+                c->calls++;
+            },
+            &c);
+        check(c, size);
+        printf("%u threads: %u range callbacks for %u work units\n", threads,
+               c.calls.load(), size);
+        if (c.calls.load() >= size / 100)
+            abort();
+
+        // Per-index callback, work units are still claimed in batches
+        task_submit_and_wait(
+            pool, size,
+            [](uint32_t index, void *payload) {
+                ((Counters *) payload)->visits[index]++;
+            },
+            &c);
+        check(c, size);
+
+        // Ranges that are split further on the workers' deques
+        pool_set_work_stealing(pool, 1);
+        Task *task = drjit::do_async(
+            [pool, &c]() {
+                drjit::parallel_for(
+                    drjit::blocked_range<uint32_t>(0, size, 7),
+                    [&c](drjit::blocked_range<uint32_t> range) {
+                        for (uint32_t i : range)
+                            c.visits[i]++;
+                    },
+                    pool);
+            }, {}, pool);
+        task_wait_and_release(task);
+        check(c, size);
+
+        pool_destroy(pool);
+    }
+}
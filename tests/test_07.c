@@ -0,0 +1,52 @@
+#include <nanothread/nanothread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIZE 10000
+
+void my_task(uint32_t index, void *payload) {
+    ((uint32_t *) payload)[index] += index;
+}
+
+void my_range_task(uint32_t begin, uint32_t end, void *payload) {
+    for (uint32_t i = begin; i != end; ++i)
+        ((uint32_t *) payload)[i] += i;
+}
+
+int main(int argc, char** argv) {
+    (void) argc; (void) argv; // Command line arguments unused
+
+    static uint32_t temp[SIZE];
+    memset(temp, 0, sizeof(temp));
+
+    // Create a NUMA-aware pool with a worker per CPU thread
+    Pool *pool = pool_create_numa(NANOTHREAD_AUTO, 1);
+    uint32_t nodes = pool_node_count(pool);
+    printf("Pool has %u threads on %u NUMA nodes\n", pool_size(pool), nodes);
+
+    // Submit a pair of dependent tasks to each node
+    for (uint32_t node = 0; node <= nodes; ++node) {
+        TaskAttr attr;
+        task_attr_init(&attr);
+        if (node < nodes)
+            attr.node = node; // otherwise, use the node of this thread
+
+        Task *task_1 = task_submit_ex(pool, NULL, 0, SIZE, my_task, NULL,
+                                      temp, 0, NULL, 1, &attr);
+        Task *task_2 = task_submit_ex(pool, (const Task * const *) &task_1, 1,
+                                      SIZE, NULL, my_range_task, temp, 0,
+                                      NULL, 1, &attr);
+        task_release(task_1);
+        task_wait_and_release(task_2);
+    }
+
+    for (uint32_t i = 0; i < SIZE; ++i) {
+        if (temp[i] != 2 * (nodes + 1) * i) {
+            fprintf(stderr, "Test failed!\n");
+            abort();
+        }
+    }
+
+    pool_destroy(pool);
+}
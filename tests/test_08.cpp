@@ -0,0 +1,59 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace dr = drjit;
+
+// Bursts of work separated by idle periods, so that workers park in between
+void bursts(Pool *pool, uint32_t count, uint32_t idle_us) {
+    for (uint32_t k = 0; k < count; ++k) {
+        std::atomic<uint32_t> sum(0);
+
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, 1000, 10),
+            [&](dr::blocked_range<uint32_t> range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    sum += i;
+            },
+            pool);
+
+        if (sum.load() != 499500)
+            abort();
+
+        std::this_thread::sleep_for(std::chrono::microseconds(idle_us));
+    }
+}
+
+// Long-running task, so that the submitting thread parks in task_wait()
+void slow_task(Pool *pool) {
+    std::atomic<bool> done(false);
+    Task *task = dr::do_async(
+        [&done]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            done = true;
+        }, {}, pool);
+    task_wait_and_release(task);
+    if (!done.load())
+        abort();
+}
+
+int main(int, char**) {
+    uint32_t budgets[] = { 0, 100, 50000 };
+
+    for (uint32_t i = 0; i < 8; ++i) {
+        for (uint32_t budget : budgets) {
+            printf("Testing with %u threads, spin budget %u us..\n", i, budget);
+            Pool *pool = pool_create(i);
+            pool_set_spin_budget(pool, budget);
+            if (pool_spin_budget(pool) != budget)
+                abort();
+
+            bursts(pool, 20, 500);
+            slow_task(pool);
+            pool_destroy(pool);
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace dr = drjit;
+
+// Few outer iterations, so that most workers are idle during the inner loops
+void nested_coverage(Pool *pool, uint32_t outer, uint32_t inner) {
+    std::vector<std::atomic<uint32_t>> hits(outer * inner);
+    for (auto &h : hits)
+        h.store(0);
+
+    dr::parallel_for(
+        dr::blocked_range<uint32_t>(0, outer, 1),
+        [&](dr::blocked_range<uint32_t> range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                dr::parallel_for(
+                    dr::blocked_range<uint32_t>(0, inner, 7),
+                    [&, i](dr::blocked_range<uint32_t> r) {
+                        for (uint32_t j = r.begin(); j != r.end(); ++j)
+                            hits[i * inner + j]++;
+                    },
+                    pool);
+            }
+        },
+        pool);
+
+    for (auto &h : hits) {
+        if (h.load() != 1)
+            abort();
+    }
+}
+
+// Exceptions raised by nested loops propagate to the submitting worker
+void nested_exception(Pool *pool) {
+    std::atomic<uint32_t> caught(0);
+
+    dr::parallel_for(
+        dr::blocked_range<uint32_t>(0, 4, 1),
+        [&](dr::blocked_range<uint32_t>) {
+            try {
+                dr::parallel_for(
+                    dr::blocked_range<uint32_t>(0, 1000, 1),
+                    [&](dr::blocked_range<uint32_t> r) {
+                        for (uint32_t j = r.begin(); j != r.end(); ++j) {
+                            if (j == 777)
+                                throw std::runtime_error("failure");
+                        }
+                    },
+                    pool);
+            } catch (const std::runtime_error &) {
+                caught++;
+            }
+        },
+        pool);
+
+    if (caught.load() != 4)
+        abort();
+}
+
+// Run a function on a worker (the main thread would otherwise help out)
+template <typename Func> void run_on_worker(Pool *pool, Func func) {
+    std::atomic<bool> done(false);
+    Task *task = dr::do_async([&]() { func(); done = true; }, {}, pool);
+    while (!done.load())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    task_wait_and_release(task);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 8; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (int k = 0; k < 2; ++k) {
+            nested_coverage(pool, 2, 10000);
+            nested_coverage(pool, 50, 300);
+            nested_exception(pool);
+
+            if (i > 0) {
+                run_on_worker(pool, [pool]() {
+                    nested_coverage(pool, 2, 10000);
+                    nested_exception(pool);
+                });
+            }
+
+            pool_set_work_stealing(pool, 1);
+        }
+
+        pool_destroy(pool);
+    }
+}
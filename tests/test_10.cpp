@@ -0,0 +1,102 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace dr = drjit;
+
+#define COUNT 20
+
+struct State {
+    std::atomic<uint32_t> counter;
+    uint32_t order[2 * COUNT];
+};
+
+struct Payload {
+    State *state;
+    uint32_t priority;
+};
+
+void record(uint32_t /* unused */, void *ptr) {
+    Payload *payload = (Payload *) ptr;
+    uint32_t index = payload->state->counter++;
+    payload->state->order[index] = payload->priority;
+}
+
+// Submit low priority tasks followed by high priority ones while the only
+// worker is busy, then return the number of low priority tasks that ran
+// before the last high priority task
+uint32_t run(Pool *pool) {
+    State state;
+    state.counter = 0;
+
+    std::atomic<bool> started(false), release(false);
+    Task *gate = dr::do_async(
+        [&]() {
+            started = true;
+            while (!release.load())
+                std::this_thread::yield();
+        }, {}, pool);
+
+    while (!started.load())
+        std::this_thread::yield();
+
+    Task *tasks[2 * COUNT];
+    for (uint32_t i = 0; i < 2 * COUNT; ++i) {
+        Payload payload;
+        payload.state = &state;
+        payload.priority = i < COUNT ? NANOTHREAD_PRIORITY_LOW
+                                     : NANOTHREAD_PRIORITY_HIGH;
+
+        TaskAttr attr;
+        task_attr_init(&attr);
+        attr.priority = payload.priority;
+
+        tasks[i] = task_submit_ex(pool, nullptr, 0, 1, record, nullptr,
+                                  &payload, sizeof(payload), nullptr, 1, &attr);
+    }
+
+    // Let the worker process everything, the main thread doesn't help
+    release = true;
+    while (state.counter.load() != 2 * COUNT)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    task_wait_and_release(gate);
+    for (uint32_t i = 0; i < 2 * COUNT; ++i)
+        task_wait_and_release(tasks[i]);
+
+    uint32_t last_high = 0, low_before = 0;
+    for (uint32_t i = 0; i < 2 * COUNT; ++i) {
+        if (state.order[i] == NANOTHREAD_PRIORITY_HIGH)
+            last_high = i;
+    }
+    for (uint32_t i = 0; i < last_high; ++i) {
+        if (state.order[i] == NANOTHREAD_PRIORITY_LOW)
+            low_before++;
+    }
+
+    return low_before;
+}
+
+int main(int, char**) {
+    Pool *pool = pool_create(1);
+
+    // Strict priorities
+    pool_set_priority_aging(pool, 0);
+    if (pool_priority_aging(pool) != 0)
+        abort();
+    if (run(pool) != 0)
+        abort();
+
+    // Aging: low priority work also makes progress
+    pool_set_priority_aging(pool, 4);
+    uint32_t low_before = run(pool);
+    printf("%u low priority tasks ran before the last high priority one\n",
+           low_before);
+    if (low_before == 0)
+        abort();
+
+    pool_destroy(pool);
+}
@@ -0,0 +1,84 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+namespace dr = drjit;
+
+static size_t count(const std::string &str, const char *pattern) {
+    size_t result = 0, pos = 0;
+    while ((pos = str.find(pattern, pos)) != std::string::npos) {
+        result++;
+        pos += strlen(pattern);
+    }
+    return result;
+}
+
+int main(int, char**) {
+    const char *filename = "nanothread_trace.json";
+    Pool *pool = pool_create(4);
+    pool_set_work_stealing(pool, 1);
+
+    pool_set_trace(1);
+    if (!pool_trace())
+        abort();
+
+    std::atomic<uint32_t> sum(0);
+    for (int k = 0; k < 10; ++k) {
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, 1000, 1),
+            [&](dr::blocked_range<uint32_t> range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    sum += i;
+            },
+            pool);
+
+        // Give the workers an opportunity to fall asleep
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    pool_set_trace(0);
+    if (sum.load() != 4995000)
+        abort();
+
+    if (!pool_trace_dump(filename))
+        abort();
+
+    FILE *f = fopen(filename, "r");
+    if (!f)
+        abort();
+    std::string contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        contents.append(buf, n);
+    fclose(f);
+    remove(filename);
+
+    size_t runs = count(contents, "\"cat\":\"run\""),
+           threads = count(contents, "\"thread_name\"");
+    printf("Trace has %zu run events on %zu threads\n", runs, threads);
+
+    if (contents.find("{\"displayTimeUnit") != 0 ||
+        contents.find("]}") == std::string::npos || runs < 10 || threads < 1)
+        abort();
+
+    // Cleared traces contain no events
+    pool_trace_clear();
+    if (!pool_trace_dump(filename))
+        abort();
+    f = fopen(filename, "r");
+    contents.clear();
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        contents.append(buf, n);
+    fclose(f);
+    remove(filename);
+    if (count(contents, "\"cat\":") != 0)
+        abort();
+
+    pool_destroy(pool);
+}
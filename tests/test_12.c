@@ -0,0 +1,65 @@
+#include <nanothread/nanothread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "check.h"
+
+void my_task(uint32_t index, void *payload) {
+    (void) index; (void) payload;
+}
+
+int main(int argc, char** argv) {
+    (void) argc; (void) argv; // Command line arguments unused
+
+    for (uint32_t threads = 0; threads < 4; ++threads) {
+        Pool *pool = pool_create(threads, 1);
+        PoolStats stats;
+
+        pool_stats(pool, &stats);
+        CHECK(stats.work_units == 0 && stats.tasks_pushed == 0);
+
+        // 100 small tasks that are executed right away
+        for (int i = 0; i < 100; ++i)
+            task_submit(pool, 1, my_task, NULL, 0, NULL, 0);
+
+        // A chain of 10 tasks with 1000 work units each
+        Task *prev = NULL;
+        for (int i = 0; i < 10; ++i) {
+            Task *task = task_submit_dep(pool, (const Task * const *) &prev,
+                                         1, 1000, my_task, NULL, 0, NULL, 1);
+            task_release(prev);
+            prev = task;
+        }
+        task_wait_and_release(prev);
+
+        pool_stats(pool, &stats);
+        printf("%u threads: work_units=%llu, pushed=%llu, completed=%llu, "
+               "pops=%llu, push_retries=%llu, pop_retries=%llu, "
+               "alloc_retries=%llu, idle_spins=%llu, sleeps=%llu, "
+               "wakeups=%llu, created=%llu, recycled=%llu, inline=%llu\n",
+               threads, (unsigned long long) stats.work_units,
+               (unsigned long long) stats.tasks_pushed,
+               (unsigned long long) stats.tasks_completed,
+               (unsigned long long) stats.pops,
+               (unsigned long long) stats.push_retries,
+               (unsigned long long) stats.pop_retries,
+               (unsigned long long) stats.alloc_retries,
+               (unsigned long long) stats.idle_spins,
+               (unsigned long long) stats.sleeps,
+               (unsigned long long) stats.wakeups,
+               (unsigned long long) stats.tasks_created,
+               (unsigned long long) stats.tasks_recycled,
+               (unsigned long long) stats.inline_tasks);
+
+        CHECK(stats.work_units == 10000);
+        CHECK(stats.tasks_pushed == 10);
+        CHECK(stats.tasks_completed == 10);
+        CHECK(stats.pops >= 10 && stats.pops <= 10000);
+        CHECK(stats.inline_tasks == 100);
+        CHECK(stats.tasks_created > 0 && stats.tasks_recycled >= 9);
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+std::atomic<bool> go(false);
+std::atomic<uint32_t> counter(0);
+
+void gate(uint32_t, void *) {
+    while (!go.load())
+        std::this_thread::yield();
+}
+
+void increment(uint32_t, void *) { counter++; }
+
+// Several threads register dependencies on the same parent concurrently
+int main(int, char**) {
+    const uint32_t n_threads = 8, n_children = 500;
+
+    for (uint32_t i = 1; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (int it = 0; it < 10; ++it) {
+            go = false;
+            counter = 0;
+
+            Task *parent = task_submit_dep(pool, nullptr, 0, 1, gate, nullptr,
+                                           0, nullptr, 1);
+
+            std::vector<std::thread> threads;
+            std::vector<Task *> joins(n_threads);
+
+            for (uint32_t t = 0; t < n_threads; ++t) {
+                threads.emplace_back([&, t]() {
+                    std::vector<Task *> children(n_children);
+                    for (uint32_t j = 0; j < n_children; ++j)
+                        children[j] = task_submit_dep(pool, &parent, 1, 1,
+                                                      increment, nullptr, 0,
+                                                      nullptr, 1);
+
+                    // Wide fan-in, uses more than the inline dependency links
+                    joins[t] = task_submit_dep(pool, children.data(),
+                                               n_children, 1, increment,
+                                               nullptr, 0, nullptr, 1);
+
+                    for (Task *child : children)
+                        task_release(child);
+                });
+            }
+
+            for (std::thread &t : threads)
+                t.join();
+
+            if (counter.load() != 0)
+                abort();
+
+            go = true;
+            task_release(parent);
+
+            for (Task *join : joins)
+                task_wait_and_release(join);
+
+            if (counter.load() != n_threads * (n_children + 1))
+                abort();
+        }
+
+        pool_destroy(pool);
+    }
+}
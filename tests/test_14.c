@@ -0,0 +1,107 @@
+#include <nanothread/nanothread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDTH 100
+#define DEPTH 100
+
+uint64_t value[DEPTH][WIDTH];
+uint64_t external_value = 0;
+
+typedef struct Node {
+    uint32_t layer, index;
+} Node;
+
+// Each node sums up the values of its two parents in the previous layer
+void node_task(uint32_t unused, void *payload) {
+    (void) unused;
+    Node *node = (Node *) payload;
+    uint32_t l = node->layer, i = node->index;
+
+    if (l == 0)
+        value[l][i] = i + external_value;
+    else
+        value[l][i] = value[l - 1][i] + value[l - 1][(i + 1) % WIDTH];
+}
+
+void external_task(uint32_t unused, void *payload) {
+    (void) unused; (void) payload;
+    external_value = 1;
+}
+
+void range_task(uint32_t begin, uint32_t end, void *payload) {
+    uint64_t *out = (uint64_t *) payload;
+    for (uint32_t i = begin; i < end; ++i)
+        out[i] = 2 * value[DEPTH - 1][i];
+}
+
+int main(int argc, char** argv) {
+    (void) argc; (void) argv; // Command line arguments unused
+
+    // Reference solution
+    uint64_t ref[DEPTH][WIDTH];
+    for (uint32_t l = 0; l < DEPTH; ++l) {
+        for (uint32_t i = 0; i < WIDTH; ++i)
+            ref[l][i] = l == 0 ? i + 1 : ref[l - 1][i] + ref[l - 1][(i + 1) % WIDTH];
+    }
+
+    for (uint32_t threads = 0; threads < 4; ++threads) {
+        printf("Testing with %u threads..\n", threads);
+        Pool *pool = pool_create(threads, 1);
+
+        for (int it = 0; it < 5; ++it) {
+            memset(value, 0, sizeof(value));
+            external_value = 0;
+
+            // The first layer depends on a task outside of the graph
+            Task *external = task_submit_dep(pool, NULL, 0, 1, external_task,
+                                             NULL, 0, NULL, 1);
+
+            TaskGraph *graph = task_graph_begin(pool);
+            Task *prev[WIDTH], *cur[WIDTH];
+
+            for (uint32_t l = 0; l < DEPTH; ++l) {
+                for (uint32_t i = 0; i < WIDTH; ++i) {
+                    Node node = { l, i };
+                    const Task *parents[2] = { prev[i], prev[(i + 1) % WIDTH] };
+                    cur[i] = task_graph_add(graph, l == 0 ? (const Task **) &external : parents,
+                                            l == 0 ? 1 : 2, 1, node_task, NULL,
+                                            &node, sizeof(Node), NULL, NULL);
+                }
+                memcpy(prev, cur, sizeof(cur));
+            }
+
+            // A range-based task at the end, whose handle is kept
+            uint64_t doubled[WIDTH];
+            Task *last = task_graph_add(graph, (const Task **) prev, WIDTH,
+                                        WIDTH, NULL, range_task, doubled, 0,
+                                        NULL, NULL);
+            task_retain(last);
+
+            // An empty graph completes right away
+            if (it == 0)
+                task_wait_and_release(task_graph_commit(task_graph_begin(pool)));
+
+            task_release(external);
+            task_wait_and_release(task_graph_commit(graph));
+
+            if (memcmp(value, ref, sizeof(ref)) != 0) {
+                fprintf(stderr, "Incorrect result!\n");
+                abort();
+            }
+
+            task_wait_and_release(last);
+            for (uint32_t i = 0; i < WIDTH; ++i) {
+                if (doubled[i] != 2 * ref[DEPTH - 1][i]) {
+                    fprintf(stderr, "Incorrect range result!\n");
+                    abort();
+                }
+            }
+        }
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include <nanothread/nanothread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "check.h"
+
+const uint32_t n = 1000;
+
+struct Buffers {
+    uint32_t *in, *out;
+};
+
+// A pair of dependent parallel loops, which are replayed with new buffers
+void scale(uint32_t begin, uint32_t end, void *payload) {
+    Buffers *b = (Buffers *) payload;
+    for (uint32_t i = begin; i < end; ++i)
+        b->out[i] = b->in[i] * 2;
+}
+
+void offset(uint32_t begin, uint32_t end, void *payload) {
+    uint32_t *data = (uint32_t *) payload;
+    for (uint32_t i = begin; i < end; ++i) {
+        if (data[i] == 0xDEAD * 2)
+            throw std::runtime_error("bad value");
+        data[i] += 1;
+    }
+}
+
+int main(int, char**) {
+    for (uint32_t threads = 0; threads < 4; ++threads) {
+        printf("Testing with %u threads..\n", threads);
+        Pool *pool = pool_create(threads);
+
+        std::vector<uint32_t> in[2], out[2];
+        for (int k = 0; k < 2; ++k) {
+            in[k].resize(n);
+            out[k].resize(n);
+        }
+
+        TaskGraph *graph = task_graph_begin(pool);
+        Buffers buffers { in[0].data(), out[0].data() };
+        Task *a = task_graph_add(graph, nullptr, 0, n, nullptr, scale,
+                                 &buffers, sizeof(Buffers), nullptr, nullptr);
+        Task *b = task_graph_add(graph, &a, 1, n, nullptr, offset,
+                                 out[0].data(), 0, nullptr, nullptr);
+        PoolStats stats_before, stats_after;
+
+        for (uint32_t it = 0; it < 100; ++it) {
+            int k = it % 2;
+            for (uint32_t i = 0; i < n; ++i)
+                in[k][i] = i + it;
+
+            if (it > 0) {
+                buffers = Buffers{ in[k].data(), out[k].data() };
+                task_graph_set_payload(graph, a, &buffers, sizeof(Buffers));
+                task_graph_set_payload(graph, b, out[k].data());
+            }
+
+            if (it == 1)
+                pool_stats(pool, &stats_before);
+
+            task_wait_and_release(task_graph_launch(graph));
+
+            for (uint32_t i = 0; i < n; ++i)
+                CHECK(out[k][i] == (i + it) * 2 + 1);
+        }
+
+        // Replays don't create new task records
+        pool_stats(pool, &stats_after);
+        CHECK(stats_after.tasks_created == stats_before.tasks_created);
+
+        // An exception during one launch doesn't affect the next one
+        in[0][n / 2] = 0xDEAD;
+        buffers = Buffers{ in[0].data(), out[0].data() };
+        task_graph_set_payload(graph, a, &buffers, sizeof(Buffers));
+        task_graph_set_payload(graph, b, out[0].data());
+
+        bool caught = false;
+        try {
+            task_wait_and_release(task_graph_launch(graph));
+        } catch (const std::exception &) {
+            caught = true;
+        }
+        CHECK(caught);
+
+        in[0][n / 2] = 0;
+        task_wait_and_release(task_graph_launch(graph));
+        CHECK(out[0][n / 2] == 1);
+
+        task_graph_destroy(graph);
+        pool_destroy(pool);
+    }
+}
@@ -0,0 +1,102 @@
+#include <nanothread/coro.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+// Awaits a parallel loop, whose handle is consumed by co_await
+dr::coro_task<uint64_t> sum(Pool *pool, uint32_t n) {
+    std::vector<uint32_t> data(n);
+
+    co_await dr::parallel_for_async(
+        dr::blocked_range<uint32_t>(0, n, 64),
+        [&](dr::blocked_range<uint32_t> range) {
+            for (uint32_t i : range)
+                data[i] = i;
+        },
+        {}, pool);
+
+    uint64_t result = 0;
+    for (uint32_t value : data)
+        result += value;
+    co_return result;
+}
+
+// Awaits other coroutines
+dr::coro_task<uint64_t> sum_of_sums(Pool *pool, uint32_t count) {
+    std::vector<dr::coro_task<uint64_t>> tasks;
+    for (uint32_t i = 0; i < count; ++i)
+        tasks.push_back(sum(pool, 1000 + i));
+
+    uint64_t result = 0;
+    for (dr::coro_task<uint64_t> &task : tasks)
+        result += co_await task;
+    co_return result;
+}
+
+// Futures produce the result of the asynchronous function
+dr::coro_task<uint32_t> square(Pool *pool, uint32_t value) {
+    uint32_t result = co_await dr::do_async_future([value]() { return value * value; },
+                                            {}, pool);
+    co_return result;
+}
+
+// Exceptions of awaited tasks are rethrown within the coroutine
+dr::coro_task<> failing(Pool *pool, std::atomic<int> *caught) {
+    Task *task = dr::do_async([]() { throw std::runtime_error("failure"); },
+                              {}, pool);
+    try {
+        co_await task;
+    } catch (const std::runtime_error &) {
+        (*caught)++;
+    }
+
+    co_await dr::awaitable(dr::do_async([]() { }, {}, pool), pool);
+    throw std::logic_error("propagated");
+}
+
+int main(int, char**) {
+    for (uint32_t threads = 0; threads < 4; ++threads) {
+        printf("Testing with %u threads..\n", threads);
+        Pool *pool = pool_create(threads);
+
+        uint32_t count = 100;
+        uint64_t expected = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint64_t n = 1000 + i;
+            expected += n * (n - 1) / 2;
+        }
+        CHECK(sum_of_sums(pool, count).get() == expected);
+        CHECK(square(pool, 12).get() == 144);
+
+        // Many coroutines in flight, used as parents of ordinary tasks
+        std::vector<dr::coro_task<uint64_t>> tasks;
+        std::vector<const Task *> handles;
+        for (uint32_t i = 0; i < count; ++i) {
+            tasks.push_back(sum(pool, 1000 + i));
+            handles.push_back(tasks.back().task());
+        }
+        std::atomic<bool> joined(false);
+        task_wait_and_release(
+            dr::do_async([&]() { joined = true; }, handles.data(),
+                         handles.size(), pool));
+        CHECK(joined.load());
+
+        std::atomic<int> caught(0);
+        bool propagated = false;
+        try {
+            failing(pool, &caught).get();
+        } catch (const std::logic_error &) {
+            propagated = true;
+        }
+        CHECK(caught.load() == 1 && propagated);
+
+        tasks.clear();
+        pool_destroy(pool);
+    }
+}
@@ -0,0 +1,192 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+std::atomic<int> alive(0);
+
+// Result type with a destructor, counts the number of live instances
+struct Tracked {
+    uint32_t value;
+    Tracked(uint32_t value) : value(value) { alive++; }
+    Tracked(Tracked &&t) : value(t.value) { alive++; }
+    Tracked(const Tracked &) = delete;
+    ~Tracked() { alive--; }
+};
+
+void test_values(Pool *pool) {
+    std::vector<dr::future<uint64_t>> futures;
+    for (uint32_t i = 0; i < 1000; ++i)
+        futures.push_back(
+            dr::do_async_future([i]() { return (uint64_t) i * i; }, {}, pool));
+
+    uint64_t sum = 0;
+    for (auto &f : futures)
+        sum += f.get();
+    CHECK(sum == 332833500);
+
+    for (auto &f : futures)
+        CHECK(!f.valid());
+}
+
+void test_move_only(Pool *pool) {
+    dr::future<std::unique_ptr<uint32_t>> f = dr::do_async_future(
+        []() { return std::unique_ptr<uint32_t>(new uint32_t(123)); }, {},
+        pool);
+    std::unique_ptr<uint32_t> value = f.get();
+    CHECK(value && *value == 123);
+
+    /* Results that are never retrieved are destroyed along with the task
+       (checked once the pool is gone, as records are recycled lazily) */
+    std::vector<Task *> tasks;
+    for (uint32_t i = 0; i < 100; ++i) {
+        dr::future<Tracked> f2 =
+            dr::do_async_future([i]() { return Tracked(i); }, {}, pool);
+        if (i % 2 == 0)
+            CHECK(f2.get().value == i);
+        else
+            tasks.push_back(std::move(f2));
+    }
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+
+    // Discarding a future doesn't wait for its task
+    std::atomic<bool> called(false);
+    Task *event = task_create_event(pool), *task;
+    {
+        dr::future<Tracked> f4 = dr::do_async_future(
+            [&]() { called = true; return Tracked(1); }, { event }, pool);
+        task = f4.task();
+        task_retain(task);
+    }
+    CHECK(!called.load());
+    task_signal(event);
+    task_release(event);
+    task_wait_and_release(task);
+    CHECK(called.load());
+
+    // A capture that isn't trivially copyable
+    std::string prefix = "nano";
+    dr::future<std::string> f3 =
+        dr::do_async_future([prefix]() { return prefix + "thread"; }, {}, pool);
+    CHECK(f3.get() == "nanothread");
+}
+
+void test_then(Pool *pool) {
+    std::string result =
+        dr::do_async_future([]() { return 20; }, {}, pool)
+            .then([](int value) { return value * 2 + 2; }, pool)
+            .then([](int value) { return std::to_string(value); }, pool)
+            .get();
+    CHECK(result == "42");
+
+    std::atomic<uint32_t> counter(0);
+    dr::future<void> f =
+        dr::do_async_future([&]() { counter++; }, {}, pool)
+            .then([&]() { counter += 10; }, pool)
+            .then([&]() { return Tracked(counter.load()); }, pool)
+            .then([&](Tracked t) { counter += t.value; }, pool);
+    f.get();
+    CHECK(counter.load() == 22);
+
+    // Move-only results are passed along without copies
+    std::unique_ptr<uint32_t> value =
+        dr::do_async_future([]() { return std::unique_ptr<uint32_t>(new uint32_t(1)); },
+                     {}, pool)
+            .then([](std::unique_ptr<uint32_t> p) { *p += 1; return p; }, pool)
+            .get();
+    CHECK(*value == 2);
+
+    // Continuations that are never retrieved
+    std::vector<Task *> tasks;
+    for (uint32_t i = 0; i < 100; ++i)
+        tasks.push_back(
+            dr::do_async_future([i]() { return Tracked(i); }, {}, pool)
+                .then([](Tracked t) { return Tracked(t.value + 1); }, pool));
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+}
+
+void test_exceptions(Pool *pool) {
+    dr::future<int> f =
+        dr::do_async_future([]() -> int { throw std::runtime_error("failure"); }, {},
+                     pool);
+    bool caught = false;
+    try {
+        f.get();
+    } catch (const std::runtime_error &e) {
+        caught = std::string(e.what()) == "failure";
+    }
+    CHECK(caught && !f.valid());
+
+    // The continuation is skipped, and the exception reaches its future
+    std::atomic<bool> called(false);
+    dr::future<Tracked> f2 =
+        dr::do_async_future([]() -> Tracked { throw std::runtime_error("parent"); },
+                     {}, pool)
+            .then([&](Tracked t) { called = true; return t; }, pool);
+    caught = false;
+    try {
+        f2.get();
+    } catch (const std::runtime_error &e) {
+        caught = std::string(e.what()) == "parent";
+    }
+    CHECK(caught && !called.load());
+}
+
+void test_handles(Pool *pool) {
+    // Futures can be used like ordinary task handles
+    std::atomic<uint32_t> counter(0);
+    Task *parent = dr::do_async([&]() { counter++; }, {}, pool);
+    dr::future<uint32_t> f =
+        dr::do_async_future([&]() { return counter.load(); }, { parent }, pool);
+    task_release(parent);
+    CHECK(f.get() == 1);
+
+    dr::future<uint32_t> f2 = dr::do_async_future([]() { return 5u; }, {}, pool);
+    f2.wait();
+    Task *task = std::move(f2);
+    CHECK(!f2.valid());
+    task_wait_and_release(task);
+
+    // .. also when the result has a destructor
+    task = dr::do_async_future([]() { return Tracked(3); }, {}, pool);
+    task_wait_and_release(task);
+
+    // Plain task handles of functions with a destructor and result
+    std::string suffix("!");
+    task = dr::do_async([&counter, suffix]() {
+        counter++;
+        return suffix;
+    }, {}, pool);
+    task_wait_and_release(task);
+    CHECK(counter.load() == 2);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (int it = 0; it < 10; ++it) {
+            test_values(pool);
+            test_move_only(pool);
+            test_then(pool);
+            test_exceptions(pool);
+            test_handles(pool);
+        }
+
+        pool_destroy(pool);
+        CHECK(alive.load() == 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <nanothread/algorithm.h>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+void test_reduce(Pool *pool, double &det_sum) {
+    const uint64_t n = 1000000;
+
+    for (int deterministic = 0; deterministic < 2; ++deterministic) {
+        uint64_t sum = dr::parallel_reduce(
+            dr::blocked_range<uint64_t>(0, n, 1000), (uint64_t) 0,
+            [](dr::blocked_range<uint64_t> range) {
+                uint64_t value = 0;
+                for (uint64_t i : range)
+                    value += i;
+                return value;
+            },
+            std::plus<uint64_t>(), deterministic != 0, pool);
+        CHECK(sum == n * (n - 1) / 2);
+
+        uint64_t max = dr::parallel_transform_reduce(
+            dr::blocked_range<uint64_t>(0, n, 777), (uint64_t) 0,
+            [](uint64_t i) { return (i * 7919) % 100003; },
+            [](uint64_t a, uint64_t b) { return a > b ? a : b; },
+            deterministic != 0, pool);
+        CHECK(max == 100002);
+    }
+
+    // Floating point results don't depend on the number of threads
+    double value = dr::parallel_transform_reduce(
+        dr::blocked_range<uint32_t>(0, 100000, 100), 0.0,
+        [](uint32_t i) { return 1.0 / (1.0 + i); }, std::plus<double>(),
+        true, pool);
+    if (det_sum == 0)
+        det_sum = value;
+    CHECK(value == det_sum);
+
+    // Empty range
+    CHECK(dr::parallel_reduce(
+              dr::blocked_range<uint32_t>(0, 0), 5,
+              [](dr::blocked_range<uint32_t>) { return 1; },
+              std::plus<int>(), false, pool) == 5);
+}
+
+void test_scan(Pool *pool) {
+    for (uint32_t n : { 0u, 1u, 100u, 4095u, 100000u }) {
+        std::vector<uint32_t> in(n), out(n);
+        for (uint32_t i = 0; i < n; ++i)
+            in[i] = i % 7;
+
+        uint32_t total = dr::parallel_scan(
+            dr::blocked_range<uint32_t>(0, n, 1024), 0u,
+            [&](dr::blocked_range<uint32_t> block, uint32_t sum, bool final) {
+                for (uint32_t i : block) {
+                    sum += in[i];
+                    if (final)
+                        out[i] = sum;
+                }
+                return sum;
+            },
+            std::plus<uint32_t>(), pool);
+
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            sum += in[i];
+            CHECK(out[i] == sum);
+        }
+        CHECK(total == sum);
+    }
+}
+
+void test_sort(Pool *pool) {
+    std::mt19937 rng(1234);
+
+    for (size_t n : { 0u, 1u, 1000u, 16385u, 100000u, 1000000u }) {
+        std::vector<uint32_t> data(n);
+        for (uint32_t &v : data)
+            v = rng() % 1000;
+
+        std::vector<uint32_t> ref = data;
+        std::sort(ref.begin(), ref.end());
+
+        std::vector<uint32_t> data2 = data;
+        dr::parallel_sort(data.begin(), data.end(), pool);
+        CHECK(data == ref);
+
+        // Small grain size and a custom comparator
+        dr::parallel_sort(data2.begin(), data2.end(),
+                          std::greater<uint32_t>(), pool, 1000);
+        std::reverse(ref.begin(), ref.end());
+        CHECK(data2 == ref);
+    }
+
+    // Elements with a nontrivial move constructor
+    std::vector<std::string> strings(50000);
+    for (size_t i = 0; i < strings.size(); ++i)
+        strings[i] = std::to_string(rng());
+    std::vector<std::string> ref = strings;
+    std::sort(ref.begin(), ref.end());
+    dr::parallel_sort(strings.begin(), strings.end(), pool, 4096);
+    CHECK(strings == ref);
+}
+
+int main(int, char**) {
+    double det_sum = 0;
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        test_reduce(pool, det_sum);
+        test_scan(pool);
+        test_sort(pool);
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include <nanothread/algorithm.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+// Every element of automatically sized ranges is visited exactly once
+void test_coverage(Pool *pool) {
+    for (uint32_t n : { 0u, 1u, 7u, 1000u, 123457u, 10000000u }) {
+        std::vector<uint8_t> visited(n, 0);
+        std::atomic<uint32_t> blocks(0);
+
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, n, dr::auto_block_size),
+            [&](dr::blocked_range<uint32_t> range) {
+                for (uint32_t i : range)
+                    visited[i]++;
+                blocks++;
+            },
+            pool);
+
+        for (uint32_t i = 0; i < n; ++i)
+            CHECK(visited[i] == 1);
+
+        uint32_t expected =
+            dr::blocked_range<uint32_t>(0, n, dr::auto_block_size)
+                .resolve(pool)
+                .blocks();
+        CHECK(blocks.load() == expected);
+
+        // Bounded number of blocks per thread
+        uint32_t threads = pool_size(pool);
+        CHECK(expected <= (threads ? (threads + 1) * NANOTHREAD_AUTO_BLOCKS : 1));
+        if (n >= 1000 && threads > 0)
+            CHECK(expected > threads);
+    }
+
+    // Asynchronous variant
+    std::atomic<uint64_t> sum(0);
+    Task *task = dr::parallel_for_async(
+        dr::blocked_range<uint64_t>(0, 100000, dr::auto_block_size),
+        [&](dr::blocked_range<uint64_t> range) {
+            uint64_t value = 0;
+            for (uint64_t i : range)
+                value += i;
+            sum += value;
+        },
+        {}, pool);
+    task_wait_and_release(task);
+    CHECK(sum.load() == 100000ull * 99999ull / 2);
+
+    uint64_t sum2 = dr::parallel_transform_reduce(
+        dr::blocked_range<uint64_t>(0, 100000, dr::auto_block_size),
+        (uint64_t) 0, [](uint64_t i) { return i; }, std::plus<uint64_t>(),
+        false, pool);
+    CHECK(sum2 == sum.load());
+}
+
+void test_feedback(Pool *pool) {
+    if (pool_size(pool) == 0)
+        return;
+
+    // Very cheap loops end up in a single block (which runs inline)
+    dr::auto_partitioner cheap;
+    std::atomic<uint32_t> blocks(0);
+    for (int it = 0; it < 5; ++it) {
+        blocks = 0;
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, 1000, dr::auto_block_size),
+            [&](dr::blocked_range<uint32_t> range) {
+                volatile uint32_t value = 0;
+                for (uint32_t i : range)
+                    value = value + i;
+                blocks++;
+            },
+            cheap, pool);
+    }
+    CHECK(cheap.cost() > 0);
+    CHECK(blocks.load() == 1);
+
+    // Expensive elements are still distributed among the threads
+    dr::auto_partitioner expensive;
+    for (int it = 0; it < 3; ++it) {
+        blocks = 0;
+        dr::parallel_for(
+            dr::blocked_range<uint32_t>(0, 64, dr::auto_block_size),
+            [&](dr::blocked_range<uint32_t> range) {
+                for (uint32_t i : range) {
+                    (void) i;
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+                blocks++;
+            },
+            expensive, pool);
+    }
+    CHECK(expensive.cost() >= 100000);
+    CHECK(blocks.load() ==
+          dr::blocked_range<uint32_t>(0, 64, dr::auto_block_size)
+              .resolve(pool)
+              .blocks());
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        test_coverage(pool);
+        test_feedback(pool);
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,231 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+std::atomic<bool> go(false);
+std::atomic<uint32_t> counter(0);
+
+void gate(uint32_t, void *) {
+    while (!go.load())
+        std::this_thread::yield();
+}
+
+void increment(uint32_t, void *) { counter++; }
+
+// Runs until the task is cancelled
+void poll(uint32_t, void *) {
+    counter++;
+    while (!task_is_cancelled())
+        std::this_thread::yield();
+}
+
+CancelToken *own_token = nullptr;
+std::atomic<bool> observed(false);
+
+// Cancels the token of its own task from the first work unit
+void cancel_first(uint32_t index, void *) {
+    counter++;
+    if (index == 0) {
+        cancel_token_cancel(own_token);
+        observed = task_is_cancelled() != 0;
+    }
+}
+
+bool is_cancelled(Task *task) {
+    try {
+        task_wait_and_release(task);
+    } catch (const dr::task_cancelled &) {
+        return true;
+    }
+    return false;
+}
+
+struct Nested {
+    Pool *pool;
+    const TaskAttr *attr;
+    void (*func)(uint32_t, void *);
+    uint32_t size;
+    bool cancelled;
+};
+
+// Synchronously submits work from within a task
+void submit_nested(uint32_t, void *payload) {
+    Nested *nested = (Nested *) payload;
+    nested->cancelled =
+        is_cancelled(task_submit_ex(nested->pool, nullptr, 0, nested->size,
+                                    nested->func, nullptr, nullptr, 0, nullptr,
+                                    0, nested->attr));
+}
+
+// Cancel a large task and its descendants before they start
+void test_cancel(Pool *pool) {
+    go = pool_size(pool) == 0;
+    counter = 0;
+
+    PoolStats before;
+    pool_stats(pool, &before);
+
+    Task *parent = task_submit_dep(pool, nullptr, 0, 1, gate, nullptr, 0,
+                                   nullptr, 1);
+    Task *task = task_submit_dep(pool, &parent, 1, 1000000, increment,
+                                 nullptr, 0, nullptr, 1);
+    Task *child = task_submit_dep(pool, &task, 1, 1000, increment, nullptr,
+                                  0, nullptr, 1);
+    Task *grandchild = task_submit_dep(pool, &child, 1, 1000, increment,
+                                       nullptr, 0, nullptr, 1);
+
+    task_cancel(task);
+    CHECK(task_is_cancelled(task));
+    CHECK(!task_is_cancelled(parent));
+    go = true;
+
+    task_wait_and_release(parent);
+    CHECK(is_cancelled(task));
+    CHECK(is_cancelled(child));
+    CHECK(is_cancelled(grandchild));
+    CHECK(counter.load() == 0);
+
+    PoolStats after;
+    pool_stats(pool, &after);
+    CHECK(after.units_cancelled - before.units_cancelled == 1002000);
+
+    // The remaining work units were retired by a few pops
+    CHECK(after.pops - before.pops < 100);
+
+    // Cancelling a completed task has no effect
+    Task *done = task_submit_dep(pool, nullptr, 0, 10, increment, nullptr, 0,
+                                 nullptr, 1);
+    task_wait(done);
+    task_cancel(done);
+    task_wait_and_release(done);
+    CHECK(counter.load() == 10);
+}
+
+// Running callbacks poll the cancellation flag of a token
+void test_token(Pool *pool) {
+    if (pool_size(pool) == 0)
+        return;
+
+    dr::cancel_token token;
+    counter = 0;
+
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.token = token.get();
+
+    Task *running = task_submit_ex(pool, nullptr, 0, 1, poll, nullptr, nullptr,
+                                   0, nullptr, 1, &attr);
+    Task *pending = task_submit_ex(pool, &running, 1, 100, increment, nullptr,
+                                   nullptr, 0, nullptr, 1, &attr);
+
+    while (counter.load() == 0)
+        std::this_thread::yield();
+
+    CHECK(!token.cancelled());
+    token.cancel();
+    CHECK(token.cancelled());
+
+    CHECK(is_cancelled(running));
+    CHECK(is_cancelled(pending));
+    CHECK(counter.load() == 1);
+
+    // Tasks submitted after cancellation don't run
+    Task *late = task_submit_ex(pool, nullptr, 0, 100, increment, nullptr,
+                                nullptr, 0, nullptr, 1, &attr);
+    CHECK(is_cancelled(late));
+    CHECK(counter.load() == 1);
+
+    // .. even when they are small or submitted synchronously
+    Task *small = task_submit_ex(pool, nullptr, 0, 1, increment, nullptr,
+                                 nullptr, 0, nullptr, 0, &attr);
+    CHECK(small && is_cancelled(small));
+
+    Nested nested{ pool, &attr, increment, 100, false };
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1, submit_nested,
+                                          &nested, 0, nullptr, 1));
+    CHECK(nested.cancelled);
+    CHECK(counter.load() == 1);
+
+    // Synchronous work that a worker submits with a token and that cancels it
+    dr::cancel_token token2;
+    attr.token = own_token = token2.get();
+    counter = 0;
+    observed = false;
+
+    Nested nested2{ pool, &attr, cancel_first, 2000, false };
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1, submit_nested,
+                                          &nested2, 0, nullptr, 1));
+    CHECK(nested2.cancelled && observed.load());
+    CHECK(counter.load() < 2000);
+}
+
+// Cancelled graphs, and tasks that always run
+void test_graph(Pool *pool) {
+    CancelToken *token = cancel_token_create();
+    counter = 0;
+
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.token = token;
+
+    TaskGraph *graph = task_graph_begin(pool);
+    Task *a = task_graph_add(graph, nullptr, 0, 100, increment, nullptr,
+                             nullptr, 0, nullptr, &attr);
+    Task *b = task_graph_add(graph, &a, 1, 100, increment, nullptr, nullptr,
+                             0, nullptr, &attr);
+    (void) b;
+
+    // The token is kept alive by the tasks
+    cancel_token_destroy(token);
+
+    task_wait_and_release(task_graph_launch(graph));
+    CHECK(counter.load() == 200);
+
+    // Replaying cancelled tasks
+    cancel_token_cancel(token);
+    CHECK(is_cancelled(task_graph_launch(graph)));
+    CHECK(counter.load() == 200);
+    task_graph_destroy(graph);
+
+    // Continuations of cancelled futures observe the cancellation
+    go = pool_size(pool) == 0;
+    Task *parent = task_submit_dep(pool, nullptr, 0, 1, gate, nullptr, 0,
+                                   nullptr, 1);
+    dr::future<int> f = dr::do_async_future([]() { return 1; }, { parent }, pool);
+    task_cancel(f.task());
+    dr::future<int> f2 = f.then([](int value) { return value + 1; }, pool);
+    go = true;
+    task_release(parent);
+
+    bool caught = false;
+    try {
+        f2.get();
+    } catch (const dr::task_cancelled &) {
+        caught = true;
+    }
+    CHECK(caught);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (int it = 0; it < 10; ++it) {
+            test_cancel(pool);
+            test_token(pool);
+            test_graph(pool);
+        }
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <nanothread/pipeline.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+std::atomic<int> alive(0);
+
+struct Item {
+    uint32_t index = 0;
+    uint64_t value = 0;
+    std::vector<uint32_t> data;
+
+    Item() { alive++; }
+    ~Item() { alive--; }
+};
+
+// Items traverse all stages, serial stages see one item at a time
+void test_stages(Pool *pool, uint32_t max_tokens) {
+    const uint32_t n = 10000;
+    uint32_t next = 0, in_order = 0, out_of_order = 0;
+    std::atomic<uint32_t> in_flight(0), max_in_flight(0), parallel(0);
+    std::atomic<bool> serial_busy(false);
+    uint64_t sum = 0;
+
+    dr::pipeline<Item> p(max_tokens, pool);
+    p.input([&](Item &item) {
+         if (next == n)
+             return false;
+         item.index = next++;
+         uint32_t count = ++in_flight;
+         uint32_t expected = max_in_flight.load();
+         while (count > expected &&
+                !max_in_flight.compare_exchange_weak(expected, count))
+             ;
+         return true;
+     })
+     .stage(dr::stage_mode::parallel,
+            [&](Item &item) {
+                item.data.assign(item.index % 100, item.index);
+                item.value = 0;
+                for (uint32_t v : item.data)
+                    item.value += v;
+                parallel++;
+            })
+     .stage(dr::stage_mode::serial_out_of_order,
+            [&](Item &) {
+                CHECK(!serial_busy.exchange(true));
+                out_of_order++;
+                serial_busy = false;
+            })
+     .stage(dr::stage_mode::serial_in_order,
+            [&](Item &item) {
+                CHECK(item.index == in_order);
+                in_order++;
+                sum += item.value;
+                in_flight--;
+            });
+
+    for (int it = 0; it < 2; ++it) {
+        next = in_order = out_of_order = 0;
+        parallel = 0;
+        sum = 0;
+        p.run();
+
+        CHECK(in_order == n && out_of_order == n && parallel.load() == n);
+        CHECK(in_flight.load() == 0);
+        CHECK(max_in_flight.load() <= max_tokens);
+
+        uint64_t ref = 0;
+        for (uint32_t i = 0; i < n; ++i)
+            ref += (uint64_t) i * (i % 100);
+        CHECK(sum == ref);
+    }
+
+    // Token storage is allocated once and reused
+    CHECK(alive.load() == (int) max_tokens);
+}
+
+// The stream ends right away, or there are no stages besides the input
+void test_empty(Pool *pool) {
+    uint32_t count = 0;
+    dr::pipeline<Item> p(4, pool);
+    p.input([&](Item &) { return count++ < 100; });
+    p.run();
+    CHECK(count == 101);
+
+    bool called = false;
+    dr::pipeline<Item> p2(4, pool);
+    p2.input([](Item &) { return false; })
+      .stage(dr::stage_mode::serial_in_order,
+             [&](Item &) { called = true; });
+    p2.run();
+    CHECK(!called);
+}
+
+// Exceptions stop the input, and are rethrown by run()
+void test_exceptions(Pool *pool) {
+    uint32_t next = 0, in_order = 0;
+    dr::pipeline<Item> p(8, pool);
+    p.input([&](Item &item) {
+         item.index = next++;
+         return true; // Infinite stream
+     })
+     .stage(dr::stage_mode::parallel,
+            [](Item &item) {
+                if (item.index == 1000)
+                    throw std::runtime_error("failure");
+            })
+     .stage(dr::stage_mode::serial_in_order,
+            [&](Item &item) {
+                CHECK(item.index == in_order);
+                in_order++;
+            });
+
+    bool caught = false;
+    try {
+        p.run();
+    } catch (const std::runtime_error &e) {
+        caught = std::string(e.what()) == "failure";
+    }
+    CHECK(caught);
+    CHECK(in_order <= 1000);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (int it = 0; it < 5; ++it) {
+            for (uint32_t tokens : { 1u, 2u, 7u, 32u }) {
+                test_stages(pool, tokens);
+                CHECK(alive.load() == 0);
+            }
+            test_empty(pool);
+            test_exceptions(pool);
+            CHECK(alive.load() == 0);
+        }
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
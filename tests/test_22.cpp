@@ -0,0 +1,189 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+struct Target {
+    std::thread::id thread;
+    uint32_t worker;
+    std::atomic<uint32_t> runs, misses;
+};
+
+// Counts work units that ran on the wrong thread
+void check_thread(uint32_t, void *payload) {
+    Target *t = *(Target **) payload;
+    if (std::this_thread::get_id() != t->thread ||
+        pool_thread_id() != t->worker)
+        t->misses++;
+    t->runs++;
+}
+
+Task *submit(Pool *pool, Target *t, uint32_t thread, uint32_t size,
+             const Task *const *parents = nullptr, uint32_t parent_count = 0) {
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.thread = thread;
+    return task_submit_ex(pool, parents, parent_count, size, check_thread,
+                          nullptr, &t, sizeof(Target *), nullptr, 1, &attr);
+}
+
+// Tasks targeting the individual workers
+void test_workers(Pool *pool) {
+    uint32_t size = pool_size(pool);
+    if (size == 0)
+        return;
+
+    // Determine the thread object of each worker
+    std::vector<Target> targets(size + 1);
+    for (uint32_t i = 1; i <= size; ++i) {
+        targets[i].worker = i;
+        targets[i].runs = targets[i].misses = 0;
+    }
+
+    std::atomic<uint32_t> found(0);
+    TaskAttr attr;
+    task_attr_init(&attr);
+    for (uint32_t i = 1; i <= size; ++i) {
+        struct Payload {
+            Pool *pool;
+            std::vector<Target> *targets;
+            std::atomic<uint32_t> *found;
+        };
+        Payload payload{ pool, &targets, &found };
+        attr.thread = i;
+        task_wait_and_release(task_submit_ex(
+            pool, nullptr, 0, 1,
+            [](uint32_t, void *ptr) {
+                Payload *p = (Payload *) ptr;
+                // The ID of a worker is its worker ID
+                CHECK(pool_attach_thread(p->pool) == pool_thread_id());
+                (*p->targets)[pool_thread_id()].thread =
+                    std::this_thread::get_id();
+                (*p->found)++;
+            },
+            nullptr, &payload, sizeof(Payload), nullptr, 1, &attr));
+    }
+    CHECK(found.load() == size);
+
+    // Chains of tasks, each bound to one of the workers
+    std::vector<Task *> tasks;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        uint32_t worker = 1 + i % size;
+        Task *parent = i >= size ? tasks[i - size] : nullptr;
+        tasks.push_back(submit(pool, &targets[worker], worker, 1 + i % 5,
+                               &parent, 1));
+    }
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+
+    uint32_t runs = 0;
+    for (uint32_t i = 1; i <= size; ++i) {
+        CHECK(targets[i].misses.load() == 0);
+        runs += targets[i].runs.load();
+    }
+    CHECK(runs == 3000);
+}
+
+// Continuations that must run on the driver thread (e.g. a GUI thread)
+void test_driver(Pool *pool) {
+    uint32_t id = pool_attach_thread(pool);
+    CHECK(id == pool_attach_thread(pool));
+
+    Target target;
+    target.thread = std::this_thread::get_id();
+    target.worker = 0;
+    target.runs = target.misses = 0;
+
+    // Small targeted tasks are not executed right away on other threads
+    std::vector<Task *> tasks;
+    for (uint32_t i = 0; i < 100; ++i) {
+        Task *parent = dr::do_async([]() { }, {}, pool);
+        tasks.push_back(submit(pool, &target, id, 1, &parent, 1));
+        task_release(parent);
+    }
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+    CHECK(target.runs.load() == 100 && target.misses.load() == 0);
+
+    // Future continuations
+    std::thread::id main_thread = std::this_thread::get_id();
+    uint32_t value = dr::do_async_future([]() { return 20u; }, {}, pool)
+                         .then([&](uint32_t v) {
+                             CHECK(std::this_thread::get_id() == main_thread);
+                             return v * 2 + 2;
+                         }, pool, id)
+                         .get();
+    CHECK(value == 42);
+
+    // Resident graphs with targeted tasks
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.thread = id;
+    Target *target_ptr = &target;
+    TaskGraph *graph = task_graph_begin(pool);
+    Task *a = task_graph_add(graph, nullptr, 0, 10, check_thread, nullptr,
+                             &target_ptr, sizeof(Target *), nullptr, nullptr);
+    task_graph_add(graph, &a, 1, 10, check_thread, nullptr, &target_ptr,
+                   sizeof(Target *), nullptr, &attr);
+    target.runs = 0;
+    for (int i = 0; i < 10; ++i)
+        task_wait_and_release(task_graph_launch(graph));
+    task_graph_destroy(graph);
+    CHECK(target.runs.load() == 200);
+
+    pool_detach_thread(pool);
+}
+
+// A separate driver thread that processes its mailbox until it is stopped
+void test_thread(Pool *pool) {
+    std::atomic<uint32_t> id(0);
+    std::atomic<bool> stop(false);
+    Target target;
+    target.worker = 0;
+    target.runs = target.misses = 0;
+
+    std::thread driver([&]() {
+        target.thread = std::this_thread::get_id();
+        id = pool_attach_thread(pool);
+        pool_work_until(
+            pool, [](void *ptr) -> bool { return ((std::atomic<bool> *) ptr)->load(); },
+            &stop);
+        pool_detach_thread(pool);
+    });
+
+    while (id.load() == 0)
+        std::this_thread::yield();
+
+    std::vector<Task *> tasks;
+    for (uint32_t i = 0; i < 100; ++i)
+        tasks.push_back(submit(pool, &target, id.load(), 10));
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+
+    stop = true;
+    driver.join();
+    CHECK(target.runs.load() == 1000 && target.misses.load() == 0);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (int it = 0; it < 5; ++it) {
+            test_workers(pool);
+            test_driver(pool);
+            test_thread(pool);
+        }
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
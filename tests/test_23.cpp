@@ -0,0 +1,124 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+struct Counter {
+    std::atomic<uint32_t> running, max_running, runs;
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+};
+
+Counter counters[2];
+std::mutex threads_mutex;
+std::set<std::thread::id> all_threads;
+
+void work(uint32_t, void *payload) {
+    Counter *c = *(Counter **) payload;
+    uint32_t value = ++c->running, expected = c->max_running.load();
+    while (value > expected &&
+           !c->max_running.compare_exchange_weak(expected, value))
+        ;
+
+    {
+        std::lock_guard<std::mutex> guard(c->mutex);
+        c->threads.insert(std::this_thread::get_id());
+    }
+    {
+        std::lock_guard<std::mutex> guard(threads_mutex);
+        all_threads.insert(std::this_thread::get_id());
+    }
+
+    for (volatile int i = 0; i < 1000; ++i)
+        ;
+
+    c->runs++;
+    c->running--;
+}
+
+void reset(Counter &c) {
+    c.running = c.max_running = c.runs = 0;
+    c.threads.clear();
+}
+
+// Arenas process their own tasks on the shared workers, within their limits
+void test_isolation(uint32_t limit) {
+    Pool *a = pool_create_arena(limit);
+    Pool *b = pool_create_arena(NANOTHREAD_AUTO, 2);
+    CHECK(pool_size(a) == (limit < core_count() ? limit : core_count()));
+    CHECK(pool_size(b) == core_count());
+
+    for (Counter &c : counters)
+        reset(c);
+    all_threads.clear();
+
+    Counter *ca = &counters[0], *cb = &counters[1];
+    std::vector<Task *> tasks;
+    for (int i = 0; i < 20; ++i) {
+        tasks.push_back(task_submit_dep(a, nullptr, 0, 1000, work, &ca,
+                                        sizeof(Counter *), nullptr, 1));
+        tasks.push_back(task_submit_dep(b, nullptr, 0, 1000, work, &cb,
+                                        sizeof(Counter *), nullptr, 1));
+    }
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+
+    CHECK(ca->runs.load() == 20000 && cb->runs.load() == 20000);
+
+    // The waiting thread helps, which adds one to the concurrency
+    CHECK(ca->max_running.load() <= pool_size(a) + 1);
+
+    // No more threads than cores, plus the main thread
+    CHECK(all_threads.size() <= core_count() + 1);
+
+    // Waiting on a task of one arena from within the other
+    int value = dr::do_async_future(
+                    [b]() { return dr::do_async_future([]() { return 1; }, {}, b).get() + 1; },
+                    {}, a)
+                    .get();
+    CHECK(value == 2);
+
+    pool_destroy(a);
+    pool_destroy(b);
+}
+
+// Resizing arenas, and arenas that don't get any shared workers
+void test_resize() {
+    Pool *pool = pool_create_arena(0);
+    CHECK(pool_size(pool) == 0);
+
+    Counter *c = &counters[0];
+    reset(*c);
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 100, work, &c,
+                                          sizeof(Counter *), nullptr, 1));
+    CHECK(c->runs.load() == 100 && c->threads.size() == 1);
+
+    pool_set_size(pool, 1);
+    CHECK(pool_size(pool) == 1);
+    pool_set_size(pool, NANOTHREAD_AUTO);
+    CHECK(pool_size(pool) >= 1 && pool_size(pool) <= core_count());
+
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1000, work, &c,
+                                          sizeof(Counter *), nullptr, 1));
+    CHECK(c->runs.load() == 1100);
+    pool_destroy(pool);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with a limit of %u threads..\n", i);
+        for (int it = 0; it < 5; ++it)
+            test_isolation(i);
+    }
+    test_resize();
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+std::atomic<bool> go(false);
+std::atomic<uint32_t> started(0), counter(0);
+
+void gate(uint32_t, void *) {
+    started++;
+    while (!go.load())
+        std::this_thread::yield();
+}
+
+void increment(uint32_t, void *) { counter++; }
+
+// Shrinking doesn't wait for busy workers
+void test_shrink(uint32_t size) {
+    Pool *pool = pool_create(size);
+    go = false;
+    started = 0;
+
+    Task *task = task_submit_dep(pool, nullptr, 0, size, gate, nullptr, 0,
+                                 nullptr, 1);
+    while (started.load() < size)
+        std::this_thread::yield();
+
+    // All workers are blocked, so this would hang if it joined them
+    pool_set_size(pool, 0);
+    CHECK(pool_size(pool) == 0);
+    go = true;
+    task_wait_and_release(task);
+
+    // Growing again reactivates workers that haven't exited yet
+    pool_set_size(pool, size);
+    CHECK(pool_size(pool) == size);
+
+    counter = 0;
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1000, increment,
+                                          nullptr, 0, nullptr, 1));
+    CHECK(counter.load() == 1000);
+
+    pool_destroy(pool);
+}
+
+// Resizing while other threads submit work
+void test_concurrent() {
+    Pool *pool = pool_create(2);
+    std::atomic<bool> stop(false);
+    counter = 0;
+
+    std::vector<std::thread> submitters;
+    for (int i = 0; i < 2; ++i) {
+        submitters.emplace_back([&]() {
+            while (!stop.load()) {
+                uint32_t size = pool_size(pool);
+                CHECK(size <= 4);
+                task_wait_and_release(task_submit_dep(
+                    pool, nullptr, 0, 100, increment, nullptr, 0, nullptr, 1));
+            }
+        });
+    }
+
+    for (uint32_t i = 0; i < 2000; ++i)
+        pool_set_size(pool, (i * 7) % 5);
+
+    stop = true;
+    for (std::thread &t : submitters)
+        t.join();
+
+    CHECK(counter.load() % 100 == 0);
+    pool_destroy(pool);
+}
+
+// Automatic mode follows the core count, clamped to the CPU quota
+void test_auto() {
+    Pool *pool = pool_create(1);
+    pool_set_size(pool, NANOTHREAD_AUTO);
+    CHECK(pool_size(pool) >= 1 && pool_size(pool) <= core_count());
+
+    counter = 0;
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 10000, increment,
+                                          nullptr, 0, nullptr, 1));
+    CHECK(counter.load() == 10000);
+
+    // An explicit size ends the automatic mode
+    pool_set_size(pool, 3);
+    CHECK(pool_size(pool) == 3);
+    pool_destroy(pool);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 1; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        for (int it = 0; it < 10; ++it)
+            test_shrink(i);
+    }
+
+    test_concurrent();
+    test_auto();
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <nanothread/nanothread.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include "check.h"
+
+void sleep_20ms(uint32_t, void *) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+}
+
+void check_time(Task *task) {
+    task_wait(task);
+    uint64_t ns = task_time_ns(task);
+    CHECK(ns >= 19000000 && ns < 2000000000);
+
+    // Both functions measure the same interval
+    CHECK(std::fabs(task_time(task) - ns * 1e-6f) < 1e-3f);
+    task_release(task);
+}
+
+int main(int, char**) {
+    pool_set_profile(1);
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        // Asynchronous tasks, which are timed by the queue
+        for (int it = 0; it < 3; ++it)
+            check_time(task_submit_dep(pool, nullptr, 0, 2, sleep_20ms,
+                                       nullptr, 0, nullptr, 1));
+
+        // Small tasks that run right away
+        check_time(task_submit_dep(pool, nullptr, 0, 1, sleep_20ms, nullptr, 0,
+                                   nullptr, 0));
+
+        pool_destroy(pool);
+    }
+
+    // Without profiling, no time is recorded
+    pool_set_profile(0);
+    Task *task = task_submit_dep(nullptr, nullptr, 0, 2, sleep_20ms, nullptr,
+                                 0, nullptr, 1);
+    task_wait(task);
+    CHECK(task_time_ns(task) == 0 && task_time(task) == 0.f);
+    task_release(task);
+    pool_destroy(nullptr);
+
+    return 0;
+}
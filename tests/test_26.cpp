@@ -0,0 +1,89 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+std::atomic<uint32_t> counter(0);
+
+void increment(uint32_t, void *) { counter++; }
+
+// Small submissions of other threads are handed to spinning workers
+void test_handoff(Pool *pool) {
+    PoolStats before, after;
+    pool_stats(pool, &before);
+
+    counter = 0;
+    uint32_t submitted = 0;
+    do {
+        // Give the hot worker time to open its slot
+        for (int i = 0; i < 100; ++i)
+            std::this_thread::yield();
+        task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1, increment,
+                                              nullptr, 0, nullptr, 1));
+        submitted++;
+        pool_stats(pool, &after);
+    } while (after.handoffs == before.handoffs);
+
+    CHECK(counter.load() == submitted);
+
+    // Futures, and submissions from several threads at once
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 3; ++i) {
+        threads.emplace_back([pool]() {
+            for (int j = 0; j < 200; ++j) {
+                int value = dr::do_async_future([j]() { return j + 1; }, {}, pool).get();
+                CHECK(value == j + 1);
+                task_release(task_submit_dep(pool, nullptr, 0, 1, increment,
+                                             nullptr, 0, nullptr, 1));
+            }
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    // Larger tasks still go through the queue
+    task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1000, increment,
+                                          nullptr, 0, nullptr, 1));
+    while (counter.load() != submitted + 1600)
+        std::this_thread::yield();
+}
+
+int main(int, char**) {
+    for (uint32_t i = 1; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        for (uint32_t hot = 1; hot <= i; ++hot) {
+            pool_set_latency_mode(pool, hot);
+            CHECK(pool_latency_mode(pool) == hot);
+            test_handoff(pool);
+        }
+
+        // Without the latency mode, idle workers park again
+        pool_set_latency_mode(pool, 0);
+        CHECK(pool_latency_mode(pool) == 0);
+        PoolStats before, after;
+        pool_stats(pool, &before);
+        pool_set_spin_budget(pool, 0);
+        task_wait_and_release(task_submit_dep(pool, nullptr, 0, 1, increment,
+                                              nullptr, 0, nullptr, 1));
+        do {
+            std::this_thread::yield();
+            pool_stats(pool, &after);
+        } while (after.sleeps == before.sleeps);
+
+        // Resizing and destroying pools with spinning workers
+        pool_set_latency_mode(pool, i);
+        pool_set_size(pool, 1);
+        test_handoff(pool);
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,240 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+std::atomic<uint32_t> counter(0), failures(0);
+
+// Payload that doesn't fit into the task record
+template <size_t Size> struct Large {
+    uint32_t seed;
+    uint8_t data[Size];
+
+    void fill(uint32_t value) {
+        seed = value;
+        for (size_t i = 0; i < Size; ++i)
+            data[i] = (uint8_t) (value + i);
+    }
+
+    bool valid() const {
+        for (size_t i = 0; i < Size; ++i) {
+            if (data[i] != (uint8_t) (seed + i))
+                return false;
+        }
+        return true;
+    }
+};
+
+template <size_t Size> void check_large(uint32_t, void *payload) {
+    if (!((Large<Size> *) payload)->valid() ||
+        ((uintptr_t) payload) % 16 != 0)
+        failures++;
+    counter++;
+}
+
+template <size_t Size>
+Task *submit_large(Pool *pool, uint32_t value, const Task *parent = nullptr) {
+    Large<Size> payload;
+    payload.fill(value);
+    Task *task = task_submit_dep(pool, &parent, parent ? 1 : 0, 4,
+                                 check_large<Size>, &payload, sizeof(payload),
+                                 nullptr, 1);
+
+    // The task has its own copy
+    memset(&payload, 0, sizeof(payload));
+    return task;
+}
+
+// Payload constructed from a smaller source object
+struct Source { int32_t value; };
+struct Target { int32_t magic, value; };
+
+void check_target(uint32_t, void *payload) {
+    Target *target = (Target *) payload;
+    if (target->magic != 1234 || target->value != 7)
+        failures++;
+    counter++;
+}
+
+// Copies of large payloads, held back until an event is signaled
+template <size_t Size> void test_large(Pool *pool, uint32_t count) {
+    counter = 0;
+    Task *event = task_create_event(pool);
+    std::vector<Task *> tasks;
+    for (uint32_t i = 0; i < count; ++i)
+        tasks.push_back(submit_large<Size>(pool, i, event));
+    task_signal(event);
+    task_release(event);
+    for (Task *task : tasks)
+        task_wait_and_release(task);
+    CHECK(counter.load() == count * 4 && failures.load() == 0);
+}
+
+// Counts copies and moves of a functor
+struct Counter {
+    std::atomic<uint32_t> copies{0}, moves{0}, calls{0};
+};
+
+struct Functor {
+    Counter *c;
+    uint8_t data[1024];
+
+    Functor(Counter *c) : c(c) { memset(data, 0, sizeof(data)); }
+    Functor(const Functor &f) : c(f.c) {
+        memcpy(data, f.data, sizeof(data));
+        c->copies++;
+    }
+    Functor(Functor &&f) : c(f.c) {
+        memcpy(data, f.data, sizeof(data));
+        c->moves++;
+    }
+
+    int operator()() const { c->calls++; return 123; }
+    void operator()(dr::blocked_range<uint32_t> range) const {
+        c->calls += range.end() - range.begin();
+    }
+};
+
+void test_in_place(Pool *pool) {
+    {
+        // do_async_future() moves the function once into the task
+        Counter c;
+        Functor f(&c);
+        CHECK(dr::do_async_future(std::move(f), {}, pool).get() == 123);
+        CHECK(c.copies.load() == 0 && c.moves.load() == 1 && c.calls.load() == 1);
+
+        // .. and copies lvalues once
+        CHECK(dr::do_async_future(f, {}, pool).get() == 123);
+        CHECK(c.copies.load() == 1 && c.moves.load() == 1 && c.calls.load() == 2);
+    }
+
+    {
+        Counter c;
+        Functor f(&c);
+        Task *task = dr::parallel_for_async(
+            dr::blocked_range<uint32_t>(0, 1000, 7), std::move(f), {}, pool);
+        task_wait_and_release(task);
+        CHECK(c.copies.load() == 0 && c.moves.load() == 1 &&
+              c.calls.load() == 1000);
+    }
+
+    // C interface: construction and destruction happen exactly once
+    static std::atomic<uint32_t> inits, destroys;
+    inits = destroys = 0;
+    counter = 0;
+
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.payload_init = [](void *storage, void *payload) {
+        memcpy(storage, payload, sizeof(Large<512>));
+        inits++;
+    };
+    auto destroy = [](void *payload) {
+        if (!((Large<512> *) payload)->valid())
+            failures++;
+        destroys++;
+    };
+
+    Large<512> payload;
+    payload.fill(42);
+    Task *task = task_submit_ex(pool, nullptr, 0, 10, check_large<512>, nullptr,
+                                &payload, sizeof(payload), destroy, 1, &attr);
+    task_wait_and_release(task);
+    CHECK(inits.load() == 1 && destroys.load() == 1 && counter.load() == 10);
+
+    // Synchronous submissions construct the payload as well
+    inits = destroys = 0;
+    counter = 0;
+    attr.payload_init = [](void *storage, void *payload) {
+        Target *target = (Target *) storage;
+        target->magic = 1234;
+        target->value = ((Source *) payload)->value;
+        inits++;
+    };
+    auto destroy_target = [](void *payload) {
+        if (((Target *) payload)->magic != 1234)
+            failures++;
+        destroys++;
+    };
+
+    Source source{ 7 };
+    task = task_submit_ex(pool, nullptr, 0, 1, check_target, nullptr, &source,
+                          sizeof(Target), destroy_target, 0, &attr);
+    task_wait_and_release(task);
+    CHECK(inits.load() == 1 && destroys.load() == 1 && counter.load() == 1);
+
+    // .. also when they are nested into work running on the pool
+    TaskAttr *attr_p = &attr;
+    dr::parallel_for(dr::blocked_range<uint32_t>(0, 8, 1),
+                     [pool, attr_p, destroy_target](dr::blocked_range<uint32_t>) {
+                         Source source{ 7 };
+                         task_wait_and_release(task_submit_ex(
+                             pool, nullptr, 0, 10, check_target, nullptr,
+                             &source, sizeof(Target), destroy_target, 0,
+                             attr_p));
+                     }, pool);
+    CHECK(inits.load() == 9 && destroys.load() == 9 && counter.load() == 81);
+    CHECK(failures.load() == 0);
+}
+
+// Large payloads of resident graphs, changed between launches
+void test_graph(Pool *pool) {
+    TaskGraph *graph = task_graph_begin(pool);
+    Large<2048> payload;
+    payload.fill(7);
+    Task *a = task_graph_add(graph, nullptr, 0, 3, check_large<2048>, nullptr,
+                             &payload, sizeof(payload), nullptr, nullptr);
+    task_graph_add(graph, &a, 1, 5, check_large<2048>, nullptr, &payload,
+                   sizeof(payload), nullptr, nullptr);
+
+    counter = 0;
+    for (uint32_t i = 0; i < 3; ++i) {
+        task_wait_and_release(task_graph_launch(graph));
+        payload.fill(i);
+        task_graph_set_payload(graph, a, &payload, sizeof(payload));
+    }
+    task_graph_destroy(graph);
+    CHECK(counter.load() == 24 && failures.load() == 0);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        test_large<300>(pool, 100);
+        test_large<4000>(pool, 1000);
+        test_large<40000>(pool, 10);
+
+        /* Chunks of the arena are reused once their payloads are gone. A
+           worker releases the payload shortly after the waiting thread sees
+           that the task has completed, which may keep a chunk per worker
+           busy for a little longer. */
+        PoolStats before, after;
+        pool_stats(pool, &before);
+        CHECK(before.payload_chunks > 0);
+        for (int it = 0; it < 3; ++it)
+            test_large<4000>(pool, 1000);
+        pool_stats(pool, &after);
+        CHECK(after.payload_chunks <= before.payload_chunks + pool_size(pool));
+
+        // Tasks submitted by workers use chunks of their own
+        dr::parallel_for(dr::blocked_range<uint32_t>(0, 64, 1),
+                         [pool](dr::blocked_range<uint32_t> range) {
+                             for (uint32_t j : range)
+                                 task_wait_and_release(submit_large<1000>(pool, j));
+                         }, pool);
+
+        test_in_place(pool);
+        test_graph(pool);
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
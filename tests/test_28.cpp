@@ -0,0 +1,71 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+// Repeated passes over an array, checking that every block runs exactly once
+void test_passes(Pool *pool, uint32_t size, uint32_t block_size,
+                 dr::affinity_partitioner &partitioner, bool exact = true) {
+    dr::blocked_range<uint32_t> range =
+        dr::blocked_range<uint32_t>(0, size, block_size).resolve(pool);
+    uint32_t blocks = range.blocks();
+
+    std::vector<uint32_t> values(size, 0);
+    std::vector<uint32_t> prev(blocks, (uint32_t) -1), cur(blocks);
+
+    for (uint32_t it = 0; it < 10; ++it) {
+        dr::parallel_for(
+            range,
+            [&](dr::blocked_range<uint32_t> r) {
+                for (uint32_t i : r)
+                    values[i]++;
+                cur[r.begin() / range.block_size()] = pool_thread_id();
+            },
+            partitioner, pool);
+
+        // The partitioner counts blocks that stayed on their thread
+        uint32_t hits = 0;
+        for (uint32_t i = 0; i < blocks; ++i)
+            hits += cur[i] == prev[i];
+        if (it > 0 && exact)
+            CHECK(partitioner.hits() == hits);
+        prev = cur;
+    }
+
+    for (uint32_t i = 0; i < size; ++i)
+        CHECK(values[i] == 10);
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+        dr::affinity_partitioner partitioner;
+
+        test_passes(pool, 100000, 1000, partitioner);
+
+        // Only the calling thread: every block stays where it was
+        if (i == 0)
+            CHECK(partitioner.hits() == 100);
+
+        // A different number of blocks starts over
+        test_passes(pool, 1001, 10, partitioner);
+        test_passes(pool, 10000, dr::auto_block_size, partitioner);
+        test_passes(pool, 0, 1, partitioner);
+
+        // The pool changes size between runs (retiring workers may still help)
+        pool_set_size(pool, i + 2);
+        test_passes(pool, 10000, 7, partitioner, false);
+        pool_set_size(pool, 1);
+        test_passes(pool, 10000, 7, partitioner, false);
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
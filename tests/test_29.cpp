@@ -0,0 +1,139 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "check.h"
+
+namespace dr = drjit;
+
+std::atomic<uint32_t> counter(0);
+
+void work(uint32_t, void *) {
+    volatile uint32_t value = 0;
+    for (uint32_t i = 0; i < 1000; ++i)
+        value = value + i;
+    counter++;
+}
+
+// Layers of tasks that depend on all tasks of the previous layer
+void run_dag(Pool *pool) {
+    std::vector<Task *> prev, cur;
+    counter = 0;
+    for (uint32_t layer = 0; layer < 10; ++layer) {
+        for (uint32_t i = 0; i < 4; ++i)
+            cur.push_back(task_submit_dep(pool, prev.data(),
+                                          (uint32_t) prev.size(), 8 + i, work,
+                                          nullptr, 0, nullptr, 1));
+        for (Task *task : prev)
+            task_release(task);
+        prev.swap(cur);
+        cur.clear();
+    }
+
+    // Nested loops are recorded as well (workers don't run them inline)
+    dr::parallel_for(dr::blocked_range<uint32_t>(0, 8),
+                     [pool](dr::blocked_range<uint32_t>) {
+                         task_submit_and_wait(pool, 4, work, nullptr);
+                     }, pool);
+
+    for (Task *task : prev)
+        task_wait_and_release(task);
+    CHECK(counter.load() == 10 * (8 + 9 + 10 + 11) + 32);
+}
+
+std::vector<ScheduleEntry> fetch(Pool *pool) {
+    uint32_t count = pool_schedule_entries(pool, nullptr, 0);
+    std::vector<ScheduleEntry> entries(count);
+    CHECK(pool_schedule_entries(pool, entries.data(), count) == count);
+    return entries;
+}
+
+// Do both schedules assign the same ranges to each thread, in the same order?
+bool same_placement(const std::vector<ScheduleEntry> &a,
+                    const std::vector<ScheduleEntry> &b, uint32_t threads) {
+    if (a.size() != b.size())
+        return false;
+
+    for (uint32_t t = 0; t <= threads; ++t) {
+        std::vector<ScheduleEntry> la, lb;
+        for (const ScheduleEntry &e : a)
+            if (e.thread == t)
+                la.push_back(e);
+        for (const ScheduleEntry &e : b)
+            if (e.thread == t)
+                lb.push_back(e);
+
+        if (la.size() != lb.size())
+            return false;
+        for (size_t i = 0; i < la.size(); ++i) {
+            if (la[i].task != lb[i].task || la[i].begin != lb[i].begin ||
+                la[i].end != lb[i].end)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int, char**) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        // Record the schedule of a run
+        pool_schedule_record(pool, 100000);
+        run_dag(pool);
+        pool_schedule_record(pool, 0);
+        std::vector<ScheduleEntry> recorded = fetch(pool);
+
+        uint32_t units = 0;
+        for (const ScheduleEntry &e : recorded) {
+            CHECK(e.thread <= i && e.begin < e.end);
+            units += e.end - e.begin;
+        }
+        CHECK(units == 10 * (8 + 9 + 10 + 11) + 8 + 32);
+
+        // Replaying it (while recording again) reproduces the placement
+        for (int it = 0; it < 3; ++it) {
+            pool_schedule_replay(pool, recorded.data(), (uint32_t) recorded.size());
+            pool_schedule_record(pool, 100000);
+            run_dag(pool);
+            pool_schedule_replay(pool, nullptr, 0);
+            pool_schedule_record(pool, 0);
+            CHECK(same_placement(recorded, fetch(pool), i));
+        }
+
+        // Seeded schedule: move the ranges to random threads, keeping the order
+        std::mt19937 rng(1234 + i);
+        std::vector<ScheduleEntry> seeded = recorded;
+        for (ScheduleEntry &e : seeded)
+            e.thread = rng() % (i + 1);
+        pool_schedule_replay(pool, seeded.data(), (uint32_t) seeded.size());
+        pool_schedule_record(pool, 100000);
+        run_dag(pool);
+        pool_schedule_record(pool, 0);
+        CHECK(same_placement(seeded, fetch(pool), i));
+
+        // Tasks that don't match the schedule are executed as usual
+        pool_schedule_replay(pool, seeded.data(), (uint32_t) seeded.size());
+        counter = 0;
+        task_submit_and_wait(pool, 1000, work, nullptr);
+        for (uint32_t j = 0; j < 100; ++j)
+            task_submit_and_wait(pool, 3, work, nullptr);
+        CHECK(counter.load() == 1300);
+        pool_schedule_replay(pool, nullptr, 0);
+
+        // A small recording drops entries, but still counts them
+        pool_schedule_record(pool, 10);
+        run_dag(pool);
+        pool_schedule_record(pool, 0);
+        CHECK(pool_schedule_entries(pool, nullptr, 0) > 10);
+
+        pool_destroy(pool);
+    }
+
+    return 0;
+}
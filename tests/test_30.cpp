@@ -0,0 +1,206 @@
+#include <nanothread/nanothread.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#include "check.h"
+
+std::mutex order_mutex;
+std::vector<uint32_t> order;
+
+// Append the payload (an ID) to the execution order
+void note(uint32_t, void *payload) {
+    std::lock_guard<std::mutex> guard(order_mutex);
+    order.push_back(*(uint32_t *) payload);
+}
+
+// .. after spinning for roughly two milliseconds
+void note_slow(uint32_t index, void *payload) {
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+    while (std::chrono::steady_clock::now() < end)
+        ;
+    note(index, payload);
+}
+
+Task *submit(Pool *pool, Task *parent, uint32_t id, float cost) {
+    TaskAttr attr;
+    task_attr_init(&attr);
+    attr.cost = cost;
+    return task_submit_ex(pool, &parent, 1, 1, note, nullptr, &id, sizeof(id),
+                          nullptr, 1, &attr);
+}
+
+// Siblings that become ready at once, run by the calling thread alone
+void test_siblings(bool critical_path) {
+    Pool *pool = pool_create(0);
+    pool_set_critical_path(pool, critical_path);
+    CHECK(pool_critical_path(pool) == (int) critical_path);
+
+    /* Child 2 is cheap, but leads to an expensive task. Children without a
+       cost hint count one per work unit. */
+    order.clear();
+    Task *event = task_create_event(pool);
+    Task *t1 = submit(pool, event, 1, 10.f),
+         *t2 = submit(pool, event, 2, 1.f),
+         *t3 = submit(pool, event, 3, 100.f),
+         *t4 = submit(pool, event, 4, 0.f),
+         *t5 = submit(pool, t2, 5, 1000.f);
+    task_signal(event);
+    task_release(event);
+
+    for (Task *task : { t1, t2, t3, t4, t5 })
+        task_wait_and_release(task);
+
+    if (critical_path) {
+        CHECK((order == std::vector<uint32_t>{ 2, 3, 1, 4, 5 }));
+    } else {
+        CHECK((order == std::vector<uint32_t>{ 1, 2, 3, 4, 5 }));
+    }
+
+    pool_destroy(pool);
+}
+
+// Roots of a resident graph, ranked by measured durations after one launch
+void test_graph_roots() {
+    Pool *pool = pool_create(0);
+    pool_set_critical_path(pool, 1);
+    pool_set_profile(1);
+
+    uint32_t ids[] = { 1, 2, 3 };
+    TaskAttr attr;
+    task_attr_init(&attr);
+    TaskGraph *graph = task_graph_begin(pool);
+
+    // The estimates claim that the slow task is cheap
+    attr.cost = 1.f;
+    task_graph_add(graph, nullptr, 0, 1, note_slow, nullptr, &ids[0],
+                   sizeof(uint32_t), nullptr, &attr);
+    attr.cost = 1000.f;
+    Task *t2 = task_graph_add(graph, nullptr, 0, 1, note, nullptr, &ids[1],
+                              sizeof(uint32_t), nullptr, &attr);
+    attr.cost = 1.f;
+    task_graph_add(graph, &t2, 1, 1, note, nullptr, &ids[2], sizeof(uint32_t),
+                   nullptr, &attr);
+
+    order.clear();
+    task_wait_and_release(task_graph_launch(graph));
+    CHECK((order == std::vector<uint32_t>{ 2, 1, 3 }));
+
+    for (int i = 0; i < 3; ++i) {
+        order.clear();
+        task_wait_and_release(task_graph_launch(graph));
+        CHECK((order == std::vector<uint32_t>{ 1, 2, 3 }));
+    }
+
+    /* A single thread runs everything back to back (the calibration of the
+       time stamp counter is slightly imprecise) */
+    MakespanReport report;
+    task_graph_makespan(graph, &report);
+    CHECK(report.critical_path_ns >= 1900000);
+    CHECK(report.work_ns >= report.critical_path_ns);
+    CHECK(report.ideal_ns == report.work_ns);
+    CHECK(report.achieved_ns >= report.ideal_ns);
+
+    task_graph_destroy(graph);
+
+    // Without profiling, nothing is measured
+    pool_set_profile(0);
+    graph = task_graph_begin(pool);
+    task_graph_add(graph, nullptr, 0, 1, note, nullptr, &ids[0],
+                   sizeof(uint32_t), nullptr, nullptr);
+    task_wait_and_release(task_graph_launch(graph));
+    task_graph_makespan(graph, &report);
+    CHECK(report.achieved_ns == 0 && report.ideal_ns == 0 &&
+          report.critical_path_ns == 0 && report.work_ns == 0);
+    task_graph_destroy(graph);
+
+    pool_destroy(pool);
+}
+
+std::atomic<uint32_t> counter(0);
+
+void work(uint32_t, void *) { counter++; }
+
+// Layers of tasks that depend on two tasks of the previous layer
+void test_layers(Pool *pool, TaskGraph *graph) {
+    std::vector<Task *> prev, cur;
+    TaskAttr attr;
+    task_attr_init(&attr);
+
+    for (uint32_t layer = 0; layer < 20; ++layer) {
+        for (uint32_t i = 0; i < 8; ++i) {
+            Task *parents[2] = { nullptr, nullptr };
+            if (!prev.empty()) {
+                parents[0] = prev[i];
+                parents[1] = prev[(i * 3 + 1) % 8];
+            }
+            attr.cost = (float) ((layer * 7 + i * 13) % 10);
+            if (graph)
+                cur.push_back(task_graph_add(graph, parents, 2, 1 + i % 3, work,
+                                             nullptr, nullptr, 0, nullptr, &attr));
+            else
+                cur.push_back(task_submit_ex(pool, parents, 2, 1 + i % 3, work,
+                                             nullptr, nullptr, 0, nullptr, 1,
+                                             &attr));
+        }
+        if (!graph) {
+            for (Task *task : prev)
+                task_release(task);
+        }
+        prev.swap(cur);
+        cur.clear();
+    }
+
+    if (!graph) {
+        for (Task *task : prev)
+            task_wait_and_release(task);
+    }
+}
+
+int main(int, char**) {
+    test_siblings(false);
+    test_siblings(true);
+    test_graph_roots();
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        printf("Testing with %u threads..\n", i);
+        Pool *pool = pool_create(i);
+
+        // Both orders of ready children (shared queue and worker deques)
+        pool_set_work_stealing(pool, i % 2);
+        pool_set_critical_path(pool, 1);
+        CHECK(pool_work_stealing(pool) == (int) (i % 2));
+
+        for (int it = 0; it < 10; ++it) {
+            counter = 0;
+            test_layers(pool, nullptr);
+            CHECK(counter.load() == 20 * (1 + 2 + 3 + 1 + 2 + 3 + 1 + 2));
+        }
+
+        // Resident graph, ranked by measured durations from the second launch
+        pool_set_profile(1);
+        TaskGraph *graph = task_graph_begin(pool);
+        test_layers(pool, graph);
+        counter = 0;
+        for (int it = 0; it < 10; ++it)
+            task_wait_and_release(task_graph_launch(graph));
+        CHECK(counter.load() == 10 * 20 * 15);
+
+        MakespanReport report;
+        task_graph_makespan(graph, &report);
+        CHECK(report.achieved_ns > 0 && report.achieved_ns >= report.ideal_ns);
+        CHECK(report.ideal_ns >= report.critical_path_ns &&
+              report.work_ns >= report.critical_path_ns);
+        task_graph_destroy(graph);
+        pool_set_profile(0);
+
+        pool_set_critical_path(pool, 0);
+        CHECK(pool_work_stealing(pool) == (int) (i % 2));
+        pool_destroy(pool);
+    }
+
+    return 0;
+}